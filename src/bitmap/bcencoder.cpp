@@ -0,0 +1,1201 @@
+//==================================================================================================
+//
+// Block compression of RGBA8888 images
+//
+// Errors are measured on four pixels at a time. Color blocks are compared in a metric space where
+// the squared distance is the error of the metric: scaled RGB for the linear and sRGB metrics and
+// unit vectors for normals, whose distance grows with the angle between them.
+//
+//==================================================================================================
+
+#include <math.h>
+
+#include "bitmap/bcencoder.h"
+#include "mathlib/ssemath.h"
+#include "vstdlib/jobthread.h"
+#include "tier1/strtools.h"
+#include "tier1/utlvector.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// Endpoints the exhaustive search tries on either side of the best fit
+#define BC_COLOR_SEARCH_PASSES		16
+#define BC_CHANNEL_SEARCH_RADIUS	4
+
+// Share of luminance of red, green and blue. The sRGB metric scales each channel by the square root
+// so that squared distances are weighted by it
+static const float s_flSRGBScale[3] = { 0.4611f, 0.8457f, 0.2687f };
+
+//-----------------------------------------------------------------------------
+// A 4x4 block, four pixels per SIMD register
+//-----------------------------------------------------------------------------
+struct BCBlock_t
+{
+	fltx4	m_Metric[3][4];			// RGB in metric space
+	fltx4	m_Weight[4];			// 0 for pixels left out of the color fit
+	fltx4	m_Channel[4][4];		// RGBA, 0-255
+	float	m_Pixel[16][4];			// Same, per pixel
+	bool	m_bTransparent[16];		// For IMAGE_FORMAT_DXT1_ONEBITALPHA
+	int		m_nTransparent;
+};
+
+//-----------------------------------------------------------------------------
+// Best endpoints to get a single 8 bit value out of 5 and 6 bit color channels at 2/3 of the
+// way from the first to the second endpoint
+//-----------------------------------------------------------------------------
+class CBCSingleColorTables
+{
+public:
+	CBCSingleColorTables()
+	{
+		Build( 5, m_Match5 );
+		Build( 6, m_Match6 );
+	}
+
+	uint8 m_Match5[256][2];
+	uint8 m_Match6[256][2];
+
+private:
+	static void Build( int nBits, uint8 pMatch[256][2] )
+	{
+		int nSize = 1 << nBits;
+		for ( int v = 0; v < 256; ++v )
+		{
+			int nBestError = INT_MAX;
+			for ( int a = 0; a < nSize; ++a )
+			{
+				int nA = ( a << ( 8 - nBits ) ) | ( a >> ( 2 * nBits - 8 ) );
+				for ( int b = 0; b < nSize; ++b )
+				{
+					int nB = ( b << ( 8 - nBits ) ) | ( b >> ( 2 * nBits - 8 ) );
+
+					// Prefer close endpoints, hardware interpolates them with less precision
+					int nError = abs( ( 2 * nA + nB ) / 3 - v ) * 100 + abs( nA - nB );
+					if ( nError < nBestError )
+					{
+						nBestError = nError;
+						pMatch[v][0] = a;
+						pMatch[v][1] = b;
+					}
+				}
+			}
+		}
+	}
+};
+
+static CBCSingleColorTables s_SingleColor;
+
+//-----------------------------------------------------------------------------
+// Helpers
+//-----------------------------------------------------------------------------
+static inline float HorizontalSum( const fltx4 &v )
+{
+	return SubFloat( v, 0 ) + SubFloat( v, 1 ) + SubFloat( v, 2 ) + SubFloat( v, 3 );
+}
+
+static inline void Unpack565( uint16 nColor, float *pRGB )
+{
+	int r = ( nColor >> 11 ) & 31;
+	int g = ( nColor >> 5 ) & 63;
+	int b = nColor & 31;
+	pRGB[0] = (float)( ( r << 3 ) | ( r >> 2 ) );
+	pRGB[1] = (float)( ( g << 2 ) | ( g >> 4 ) );
+	pRGB[2] = (float)( ( b << 3 ) | ( b >> 2 ) );
+}
+
+static inline uint16 Pack565( const float *pRGB )
+{
+	int r = clamp( (int)( pRGB[0] * ( 31.0f / 255.0f ) + 0.5f ), 0, 31 );
+	int g = clamp( (int)( pRGB[1] * ( 63.0f / 255.0f ) + 0.5f ), 0, 63 );
+	int b = clamp( (int)( pRGB[2] * ( 31.0f / 255.0f ) + 0.5f ), 0, 31 );
+	return (uint16)( ( r << 11 ) | ( g << 5 ) | b );
+}
+
+static void ToMetricSpace( BCErrorMetric_t metric, const float *pRGB, float *pOut )
+{
+	switch ( metric )
+	{
+	case BC_METRIC_SRGB:
+		for ( int i = 0; i < 3; ++i )
+		{
+			pOut[i] = pRGB[i] * ( s_flSRGBScale[i] / 255.0f );
+		}
+		break;
+
+	case BC_METRIC_NORMAL:
+		{
+			float x = pRGB[0] * ( 2.0f / 255.0f ) - 1.0f;
+			float y = pRGB[1] * ( 2.0f / 255.0f ) - 1.0f;
+			float z = pRGB[2] * ( 2.0f / 255.0f ) - 1.0f;
+			float flLengthSqr = x * x + y * y + z * z;
+			if ( flLengthSqr < 1e-8f )
+			{
+				pOut[0] = 0.0f;
+				pOut[1] = 0.0f;
+				pOut[2] = 1.0f;
+				break;
+			}
+			float flInvLength = 1.0f / sqrtf( flLengthSqr );
+			pOut[0] = x * flInvLength;
+			pOut[1] = y * flInvLength;
+			pOut[2] = z * flInvLength;
+		}
+		break;
+
+	default:
+		for ( int i = 0; i < 3; ++i )
+		{
+			pOut[i] = pRGB[i] * ( 1.0f / 255.0f );
+		}
+		break;
+	}
+}
+
+static void LoadBlock( const uint8 *pSrc, int nWidth, int nHeight, int nSrcStride, int x, int y,
+	const BCEncodeParams_t &params, bool bOneBitAlpha, BCBlock_t *pBlock )
+{
+	pBlock->m_nTransparent = 0;
+	for ( int i = 0; i < 16; ++i )
+	{
+		int nX = MIN( x + ( i & 3 ), nWidth - 1 );
+		int nY = MIN( y + ( i >> 2 ), nHeight - 1 );
+		const uint8 *pPixel = pSrc + nY * nSrcStride + nX * 4;
+		float *pOut = pBlock->m_Pixel[i];
+		for ( int c = 0; c < 4; ++c )
+		{
+			pOut[c] = pPixel[c];
+			SubFloat( pBlock->m_Channel[c][i >> 2], i & 3 ) = pPixel[c];
+		}
+
+		float flMetric[3];
+		ToMetricSpace( params.m_Metric, pOut, flMetric );
+		for ( int c = 0; c < 3; ++c )
+		{
+			SubFloat( pBlock->m_Metric[c][i >> 2], i & 3 ) = flMetric[c];
+		}
+
+		pBlock->m_bTransparent[i] = bOneBitAlpha && pPixel[3] < params.m_nAlphaThreshold;
+		pBlock->m_nTransparent += pBlock->m_bTransparent[i];
+		SubFloat( pBlock->m_Weight[i >> 2], i & 3 ) = pBlock->m_bTransparent[i] ? 0.0f : 1.0f;
+	}
+}
+
+static void StoreIndices( const fltx4 &indices, uint8 *pIndices )
+{
+	for ( int i = 0; i < 4; ++i )
+	{
+		pIndices[i] = (uint8)SubFloat( indices, i );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Color blocks
+//-----------------------------------------------------------------------------
+
+// Picks the nearest palette color of every pixel, returns the error of the block
+static float ChooseColorIndices( const BCBlock_t &block, const float pPalette[4][3], int nColors, uint8 *pIndices )
+{
+	fltx4 paletteR[4], paletteG[4], paletteB[4], paletteIndex[4];
+	for ( int k = 0; k < nColors; ++k )
+	{
+		paletteR[k] = ReplicateX4( pPalette[k][0] );
+		paletteG[k] = ReplicateX4( pPalette[k][1] );
+		paletteB[k] = ReplicateX4( pPalette[k][2] );
+		paletteIndex[k] = ReplicateX4( (float)k );
+	}
+
+	fltx4 error = Four_Zeros;
+	for ( int i = 0; i < 4; ++i )
+	{
+		fltx4 best = Four_FLT_MAX;
+		fltx4 bestIndex = Four_Zeros;
+		for ( int k = 0; k < nColors; ++k )
+		{
+			fltx4 dr = SubSIMD( block.m_Metric[0][i], paletteR[k] );
+			fltx4 dg = SubSIMD( block.m_Metric[1][i], paletteG[k] );
+			fltx4 db = SubSIMD( block.m_Metric[2][i], paletteB[k] );
+			fltx4 d = MaddSIMD( dr, dr, MaddSIMD( dg, dg, MulSIMD( db, db ) ) );
+			bestIndex = MaskedAssign( CmpLtSIMD( d, best ), paletteIndex[k], bestIndex );
+			best = MinSIMD( d, best );
+		}
+		error = MaddSIMD( best, block.m_Weight[i], error );
+		if ( pIndices )
+		{
+			StoreIndices( bestIndex, pIndices + i * 4 );
+		}
+	}
+	return HorizontalSum( error );
+}
+
+// Error of a pair of 565 endpoints. Four color blocks need nColor0 > nColor1, three color
+// blocks the opposite; the endpoints are swapped as needed
+static float EvaluateColorEndpoints( const BCBlock_t &block, BCErrorMetric_t metric, bool bThreeColor,
+	uint16 *pColor0, uint16 *pColor1, uint8 *pIndices )
+{
+	if ( bThreeColor ? ( *pColor0 > *pColor1 ) : ( *pColor0 < *pColor1 ) )
+	{
+		V_swap( *pColor0, *pColor1 );
+	}
+
+	float flColor[4][3];
+	Unpack565( *pColor0, flColor[0] );
+	Unpack565( *pColor1, flColor[1] );
+	int nColors;
+	if ( bThreeColor || *pColor0 == *pColor1 )
+	{
+		for ( int c = 0; c < 3; ++c )
+		{
+			flColor[2][c] = ( flColor[0][c] + flColor[1][c] ) * 0.5f;
+		}
+		nColors = 3;
+	}
+	else
+	{
+		for ( int c = 0; c < 3; ++c )
+		{
+			flColor[2][c] = ( 2.0f * flColor[0][c] + flColor[1][c] ) * ( 1.0f / 3.0f );
+			flColor[3][c] = ( flColor[0][c] + 2.0f * flColor[1][c] ) * ( 1.0f / 3.0f );
+		}
+		nColors = 4;
+	}
+
+	float flPalette[4][3];
+	for ( int k = 0; k < nColors; ++k )
+	{
+		ToMetricSpace( metric, flColor[k], flPalette[k] );
+	}
+	return ChooseColorIndices( block, flPalette, nColors, pIndices );
+}
+
+static void FitColorBoundingBox( const BCBlock_t &block, float *pMax, float *pMin )
+{
+	for ( int c = 0; c < 3; ++c )
+	{
+		pMax[c] = 0.0f;
+		pMin[c] = 255.0f;
+	}
+	for ( int i = 0; i < 16; ++i )
+	{
+		if ( block.m_bTransparent[i] )
+			continue;
+		for ( int c = 0; c < 3; ++c )
+		{
+			pMax[c] = MAX( pMax[c], block.m_Pixel[i][c] );
+			pMin[c] = MIN( pMin[c], block.m_Pixel[i][c] );
+		}
+	}
+
+	// The extremes are rarely used, pull them in by half a palette step
+	for ( int c = 0; c < 3; ++c )
+	{
+		float flInset = ( pMax[c] - pMin[c] ) * ( 1.0f / 16.0f );
+		pMax[c] -= flInset;
+		pMin[c] += flInset;
+	}
+}
+
+static void FitColorPrincipalAxis( const BCBlock_t &block, BCErrorMetric_t metric, float *pMax, float *pMin )
+{
+	const float flUnitScale[3] = { 1.0f, 1.0f, 1.0f };
+	const float *pScale = ( metric == BC_METRIC_SRGB ) ? s_flSRGBScale : flUnitScale;
+
+	float flMean[3] = { 0.0f, 0.0f, 0.0f };
+	int nCount = 0;
+	for ( int i = 0; i < 16; ++i )
+	{
+		if ( block.m_bTransparent[i] )
+			continue;
+		for ( int c = 0; c < 3; ++c )
+		{
+			flMean[c] += block.m_Pixel[i][c] * pScale[c];
+		}
+		++nCount;
+	}
+	for ( int c = 0; c < 3; ++c )
+	{
+		flMean[c] /= nCount;
+	}
+
+	float flCovariance[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+	for ( int i = 0; i < 16; ++i )
+	{
+		if ( block.m_bTransparent[i] )
+			continue;
+		float r = block.m_Pixel[i][0] * pScale[0] - flMean[0];
+		float g = block.m_Pixel[i][1] * pScale[1] - flMean[1];
+		float b = block.m_Pixel[i][2] * pScale[2] - flMean[2];
+		flCovariance[0] += r * r;
+		flCovariance[1] += r * g;
+		flCovariance[2] += r * b;
+		flCovariance[3] += g * g;
+		flCovariance[4] += g * b;
+		flCovariance[5] += b * b;
+	}
+
+	// Power iteration, starting from the channel with the most variance
+	float flAxis[3] = { 0.0f, 0.0f, 0.0f };
+	if ( flCovariance[0] >= flCovariance[3] && flCovariance[0] >= flCovariance[5] )
+	{
+		flAxis[0] = 1.0f;
+	}
+	else
+	{
+		flAxis[ flCovariance[3] >= flCovariance[5] ? 1 : 2 ] = 1.0f;
+	}
+	for ( int nIteration = 0; nIteration < 8; ++nIteration )
+	{
+		float x = flAxis[0] * flCovariance[0] + flAxis[1] * flCovariance[1] + flAxis[2] * flCovariance[2];
+		float y = flAxis[0] * flCovariance[1] + flAxis[1] * flCovariance[3] + flAxis[2] * flCovariance[4];
+		float z = flAxis[0] * flCovariance[2] + flAxis[1] * flCovariance[4] + flAxis[2] * flCovariance[5];
+		float flLength = MAX( fabsf( x ), MAX( fabsf( y ), fabsf( z ) ) );
+		if ( flLength < 1e-6f )
+			break;
+		flAxis[0] = x / flLength;
+		flAxis[1] = y / flLength;
+		flAxis[2] = z / flLength;
+	}
+	float flLengthSqr = flAxis[0] * flAxis[0] + flAxis[1] * flAxis[1] + flAxis[2] * flAxis[2];
+
+	float flMinT = 0.0f;
+	float flMaxT = 0.0f;
+	for ( int i = 0; i < 16; ++i )
+	{
+		if ( block.m_bTransparent[i] )
+			continue;
+		float t = 0.0f;
+		for ( int c = 0; c < 3; ++c )
+		{
+			t += ( block.m_Pixel[i][c] * pScale[c] - flMean[c] ) * flAxis[c];
+		}
+		t /= flLengthSqr;
+		flMinT = MIN( flMinT, t );
+		flMaxT = MAX( flMaxT, t );
+	}
+
+	for ( int c = 0; c < 3; ++c )
+	{
+		pMax[c] = clamp( ( flMean[c] + flAxis[c] * flMaxT ) / pScale[c], 0.0f, 255.0f );
+		pMin[c] = clamp( ( flMean[c] + flAxis[c] * flMinT ) / pScale[c], 0.0f, 255.0f );
+	}
+}
+
+// Endpoints that best reproduce the pixels with the given indices, by least squares
+static bool RefineColorEndpoints( const BCBlock_t &block, const uint8 *pIndices, bool bThreeColor, float *pColor0, float *pColor1 )
+{
+	static const float s_flFourColorWeights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+	static const float s_flThreeColorWeights[4] = { 1.0f, 0.0f, 0.5f, 0.0f };
+	const float *pWeights = bThreeColor ? s_flThreeColorWeights : s_flFourColorWeights;
+
+	float aa = 0.0f, bb = 0.0f, ab = 0.0f;
+	float ax[3] = { 0.0f, 0.0f, 0.0f };
+	float bx[3] = { 0.0f, 0.0f, 0.0f };
+	for ( int i = 0; i < 16; ++i )
+	{
+		if ( block.m_bTransparent[i] || ( bThreeColor && pIndices[i] == 3 ) )
+			continue;
+		float a = pWeights[pIndices[i]];
+		float b = 1.0f - a;
+		aa += a * a;
+		bb += b * b;
+		ab += a * b;
+		for ( int c = 0; c < 3; ++c )
+		{
+			ax[c] += a * block.m_Pixel[i][c];
+			bx[c] += b * block.m_Pixel[i][c];
+		}
+	}
+
+	float flDet = aa * bb - ab * ab;
+	if ( fabsf( flDet ) < 1e-6f )
+		return false;
+
+	float flInvDet = 1.0f / flDet;
+	for ( int c = 0; c < 3; ++c )
+	{
+		pColor0[c] = clamp( ( ax[c] * bb - bx[c] * ab ) * flInvDet, 0.0f, 255.0f );
+		pColor1[c] = clamp( ( bx[c] * aa - ax[c] * ab ) * flInvDet, 0.0f, 255.0f );
+	}
+	return true;
+}
+
+// Tries every endpoint one step away in each channel until none is better
+static float SearchColorEndpoints( const BCBlock_t &block, BCErrorMetric_t metric, bool bThreeColor,
+	uint16 *pColor0, uint16 *pColor1, float flError )
+{
+	static const int s_nShift[3] = { 11, 5, 0 };
+	static const int s_nMax[3] = { 31, 63, 31 };
+
+	for ( int nPass = 0; nPass < BC_COLOR_SEARCH_PASSES; ++nPass )
+	{
+		bool bImproved = false;
+		for ( int nEndpoint = 0; nEndpoint < 2; ++nEndpoint )
+		{
+			for ( int c = 0; c < 3; ++c )
+			{
+				for ( int nDelta = -1; nDelta <= 1; nDelta += 2 )
+				{
+					uint16 nColor[2] = { *pColor0, *pColor1 };
+					int nValue = ( ( nColor[nEndpoint] >> s_nShift[c] ) & s_nMax[c] ) + nDelta;
+					if ( nValue < 0 || nValue > s_nMax[c] )
+						continue;
+					nColor[nEndpoint] = (uint16)( ( nColor[nEndpoint] & ~( s_nMax[c] << s_nShift[c] ) ) | ( nValue << s_nShift[c] ) );
+
+					float flTryError = EvaluateColorEndpoints( block, metric, bThreeColor, &nColor[0], &nColor[1], NULL );
+					if ( flTryError < flError )
+					{
+						flError = flTryError;
+						*pColor0 = nColor[0];
+						*pColor1 = nColor[1];
+						bImproved = true;
+					}
+				}
+			}
+		}
+		if ( !bImproved )
+			break;
+	}
+	return flError;
+}
+
+static void WriteColorBlock( uint16 nColor0, uint16 nColor1, const uint8 *pIndices, uint8 *pOut )
+{
+	pOut[0] = nColor0 & 0xff;
+	pOut[1] = nColor0 >> 8;
+	pOut[2] = nColor1 & 0xff;
+	pOut[3] = nColor1 >> 8;
+	for ( int i = 0; i < 4; ++i )
+	{
+		pOut[4 + i] = pIndices[i * 4] | ( pIndices[i * 4 + 1] << 2 ) | ( pIndices[i * 4 + 2] << 4 ) | ( pIndices[i * 4 + 3] << 6 );
+	}
+}
+
+static void EncodeColorBlock( const BCBlock_t &block, const BCEncodeParams_t &params, uint8 *pOut )
+{
+	uint8 nIndices[16];
+	bool bThreeColor = block.m_nTransparent > 0;
+	if ( block.m_nTransparent == 16 )
+	{
+		V_memset( nIndices, 3, sizeof( nIndices ) );
+		WriteColorBlock( 0, 0, nIndices, pOut );
+		return;
+	}
+
+	// Solid colors use the endpoints that interpolate to them exactly
+	bool bSolid = true;
+	int nFirst = -1;
+	for ( int i = 0; i < 16 && bSolid; ++i )
+	{
+		if ( block.m_bTransparent[i] )
+			continue;
+		if ( nFirst < 0 )
+		{
+			nFirst = i;
+		}
+		bSolid = !V_memcmp( block.m_Pixel[i], block.m_Pixel[nFirst], 3 * sizeof( float ) );
+	}
+
+	uint16 nColor0, nColor1;
+	float flError;
+	if ( bSolid && !bThreeColor )
+	{
+		int r = (int)block.m_Pixel[nFirst][0];
+		int g = (int)block.m_Pixel[nFirst][1];
+		int b = (int)block.m_Pixel[nFirst][2];
+		nColor0 = (uint16)( ( s_SingleColor.m_Match5[r][0] << 11 ) | ( s_SingleColor.m_Match6[g][0] << 5 ) | s_SingleColor.m_Match5[b][0] );
+		nColor1 = (uint16)( ( s_SingleColor.m_Match5[r][1] << 11 ) | ( s_SingleColor.m_Match6[g][1] << 5 ) | s_SingleColor.m_Match5[b][1] );
+		flError = EvaluateColorEndpoints( block, params.m_Metric, false, &nColor0, &nColor1, nIndices );
+		WriteColorBlock( nColor0, nColor1, nIndices, pOut );
+		return;
+	}
+
+	float flMax[3], flMin[3];
+	FitColorBoundingBox( block, flMax, flMin );
+	nColor0 = Pack565( flMax );
+	nColor1 = Pack565( flMin );
+	flError = EvaluateColorEndpoints( block, params.m_Metric, bThreeColor, &nColor0, &nColor1, nIndices );
+
+	if ( params.m_Quality >= BC_QUALITY_NORMAL )
+	{
+		FitColorPrincipalAxis( block, params.m_Metric, flMax, flMin );
+		uint16 nTryColor0 = Pack565( flMax );
+		uint16 nTryColor1 = Pack565( flMin );
+		uint8 nTryIndices[16];
+		float flTryError = EvaluateColorEndpoints( block, params.m_Metric, bThreeColor, &nTryColor0, &nTryColor1, nTryIndices );
+
+		for ( int nIteration = 0; ; ++nIteration )
+		{
+			if ( flTryError < flError )
+			{
+				flError = flTryError;
+				nColor0 = nTryColor0;
+				nColor1 = nTryColor1;
+				V_memcpy( nIndices, nTryIndices, sizeof( nIndices ) );
+			}
+			if ( nIteration == 2 || !RefineColorEndpoints( block, nIndices, bThreeColor, flMax, flMin ) )
+				break;
+			nTryColor0 = Pack565( flMax );
+			nTryColor1 = Pack565( flMin );
+			flTryError = EvaluateColorEndpoints( block, params.m_Metric, bThreeColor, &nTryColor0, &nTryColor1, nTryIndices );
+		}
+	}
+
+	if ( params.m_Quality >= BC_QUALITY_EXHAUSTIVE )
+	{
+		flError = SearchColorEndpoints( block, params.m_Metric, bThreeColor, &nColor0, &nColor1, flError );
+		EvaluateColorEndpoints( block, params.m_Metric, bThreeColor, &nColor0, &nColor1, nIndices );
+	}
+
+	if ( bThreeColor )
+	{
+		for ( int i = 0; i < 16; ++i )
+		{
+			if ( block.m_bTransparent[i] )
+			{
+				nIndices[i] = 3;
+			}
+		}
+	}
+	WriteColorBlock( nColor0, nColor1, nIndices, pOut );
+}
+
+//-----------------------------------------------------------------------------
+// Single channel blocks: DXT5 alpha, ATI1N and both halves of ATI2N
+//-----------------------------------------------------------------------------
+static void ChannelPalette( int nValue0, int nValue1, float *pPalette )
+{
+	pPalette[0] = (float)nValue0;
+	pPalette[1] = (float)nValue1;
+	if ( nValue0 > nValue1 )
+	{
+		for ( int i = 1; i < 7; ++i )
+		{
+			pPalette[i + 1] = ( ( 7 - i ) * nValue0 + i * nValue1 ) * ( 1.0f / 7.0f );
+		}
+	}
+	else
+	{
+		for ( int i = 1; i < 5; ++i )
+		{
+			pPalette[i + 1] = ( ( 5 - i ) * nValue0 + i * nValue1 ) * ( 1.0f / 5.0f );
+		}
+		pPalette[6] = 0.0f;
+		pPalette[7] = 255.0f;
+	}
+}
+
+// Picks the nearest palette value of every pixel, returns the squared error of the block
+static float EvaluateChannelEndpoints( const fltx4 *pValues, int nValue0, int nValue1, uint8 *pIndices )
+{
+	float flPalette[8];
+	ChannelPalette( nValue0, nValue1, flPalette );
+
+	fltx4 error = Four_Zeros;
+	for ( int i = 0; i < 4; ++i )
+	{
+		fltx4 best = Four_FLT_MAX;
+		fltx4 bestIndex = Four_Zeros;
+		for ( int k = 0; k < 8; ++k )
+		{
+			fltx4 d = SubSIMD( pValues[i], ReplicateX4( flPalette[k] ) );
+			d = MulSIMD( d, d );
+			bestIndex = MaskedAssign( CmpLtSIMD( d, best ), ReplicateX4( (float)k ), bestIndex );
+			best = MinSIMD( d, best );
+		}
+		error = AddSIMD( error, best );
+		if ( pIndices )
+		{
+			StoreIndices( bestIndex, pIndices + i * 4 );
+		}
+	}
+	return HorizontalSum( error );
+}
+
+// Angular error of ATI2N pixels, with one channel taken from the palette and the other one fixed
+static float EvaluateNormalChannelEndpoints( const BCBlock_t &block, int nChannel, const fltx4 *pOther,
+	int nValue0, int nValue1, uint8 *pIndices )
+{
+	float flPalette[8];
+	ChannelPalette( nValue0, nValue1, flPalette );
+
+	fltx4 scale = ReplicateX4( 2.0f / 255.0f );
+	fltx4 error = Four_Zeros;
+	for ( int i = 0; i < 4; ++i )
+	{
+		fltx4 other = SubSIMD( MulSIMD( pOther[i], scale ), Four_Ones );
+		fltx4 otherSqr = MulSIMD( other, other );
+		fltx4 best = Four_FLT_MAX;
+		fltx4 bestIndex = Four_Zeros;
+		for ( int k = 0; k < 8; ++k )
+		{
+			fltx4 value = ReplicateX4( flPalette[k] * ( 2.0f / 255.0f ) - 1.0f );
+			fltx4 lengthSqr = MaddSIMD( value, value, otherSqr );
+			fltx4 z = SqrtSIMD( MaxSIMD( SubSIMD( Four_Ones, lengthSqr ), Four_Zeros ) );
+
+			// Outside the unit circle z is 0 and the normal needs normalizing
+			fltx4 invLength = ReciprocalSqrtSIMD( MaxSIMD( lengthSqr, Four_Ones ) );
+			fltx4 x = MulSIMD( nChannel == 0 ? value : other, invLength );
+			fltx4 y = MulSIMD( nChannel == 0 ? other : value, invLength );
+
+			fltx4 dx = SubSIMD( x, block.m_Metric[0][i] );
+			fltx4 dy = SubSIMD( y, block.m_Metric[1][i] );
+			fltx4 dz = SubSIMD( z, block.m_Metric[2][i] );
+			fltx4 d = MaddSIMD( dx, dx, MaddSIMD( dy, dy, MulSIMD( dz, dz ) ) );
+			bestIndex = MaskedAssign( CmpLtSIMD( d, best ), ReplicateX4( (float)k ), bestIndex );
+			best = MinSIMD( d, best );
+		}
+		error = AddSIMD( error, best );
+		if ( pIndices )
+		{
+			StoreIndices( bestIndex, pIndices + i * 4 );
+		}
+	}
+	return HorizontalSum( error );
+}
+
+// Values 0 and 1 that best reproduce the pixels with the given indices of an eight value block
+static bool RefineChannelEndpoints( const fltx4 *pValues, const uint8 *pIndices, int *pValue0, int *pValue1 )
+{
+	float aa = 0.0f, bb = 0.0f, ab = 0.0f, ax = 0.0f, bx = 0.0f;
+	for ( int i = 0; i < 16; ++i )
+	{
+		int nIndex = pIndices[i];
+		float a = ( nIndex == 0 ) ? 1.0f : ( nIndex == 1 ) ? 0.0f : ( 8 - nIndex ) * ( 1.0f / 7.0f );
+		float b = 1.0f - a;
+		float x = SubFloat( pValues[i >> 2], i & 3 );
+		aa += a * a;
+		bb += b * b;
+		ab += a * b;
+		ax += a * x;
+		bx += b * x;
+	}
+
+	float flDet = aa * bb - ab * ab;
+	if ( fabsf( flDet ) < 1e-6f )
+		return false;
+
+	float flInvDet = 1.0f / flDet;
+	*pValue0 = clamp( (int)( ( ax * bb - bx * ab ) * flInvDet + 0.5f ), 0, 255 );
+	*pValue1 = clamp( (int)( ( bx * aa - ax * ab ) * flInvDet + 0.5f ), 0, 255 );
+	if ( *pValue0 < *pValue1 )
+	{
+		V_swap( *pValue0, *pValue1 );
+	}
+	return *pValue0 != *pValue1;
+}
+
+struct ChannelFit_t
+{
+	int		m_nValue0;
+	int		m_nValue1;
+	float	m_flError;
+	uint8	m_nIndices[16];
+
+	void Try( const fltx4 *pValues, int nValue0, int nValue1 )
+	{
+		uint8 nIndices[16];
+		float flError = EvaluateChannelEndpoints( pValues, nValue0, nValue1, nIndices );
+		if ( flError < m_flError )
+		{
+			m_flError = flError;
+			m_nValue0 = nValue0;
+			m_nValue1 = nValue1;
+			V_memcpy( m_nIndices, nIndices, sizeof( m_nIndices ) );
+		}
+	}
+};
+
+static void FitChannelBlock( const fltx4 *pValues, BCQuality_t quality, ChannelFit_t *pFit )
+{
+	int nMin = 255, nMax = 0;
+	int nInnerMin = 255, nInnerMax = 0;
+	for ( int i = 0; i < 16; ++i )
+	{
+		int nValue = (int)SubFloat( pValues[i >> 2], i & 3 );
+		nMin = MIN( nMin, nValue );
+		nMax = MAX( nMax, nValue );
+		if ( nValue != 0 && nValue != 255 )
+		{
+			nInnerMin = MIN( nInnerMin, nValue );
+			nInnerMax = MAX( nInnerMax, nValue );
+		}
+	}
+
+	pFit->m_flError = FLT_MAX;
+	pFit->Try( pValues, nMax, nMin );
+	if ( quality < BC_QUALITY_NORMAL || pFit->m_flError == 0.0f )
+		return;
+
+	for ( int nIteration = 0; nIteration < 2; ++nIteration )
+	{
+		int nValue0, nValue1;
+		if ( !RefineChannelEndpoints( pValues, pFit->m_nIndices, &nValue0, &nValue1 ) )
+			break;
+		pFit->Try( pValues, nValue0, nValue1 );
+	}
+
+	// Six value blocks have exact 0 and 255 for the pixels at the extremes
+	if ( nInnerMin <= nInnerMax && ( nMin == 0 || nMax == 255 ) )
+	{
+		pFit->Try( pValues, nInnerMin, nInnerMax );
+	}
+
+	if ( quality < BC_QUALITY_EXHAUSTIVE )
+		return;
+
+	int nCenter0 = pFit->m_nValue0;
+	int nCenter1 = pFit->m_nValue1;
+	for ( int nValue0 = nCenter0 - BC_CHANNEL_SEARCH_RADIUS; nValue0 <= nCenter0 + BC_CHANNEL_SEARCH_RADIUS; ++nValue0 )
+	{
+		for ( int nValue1 = nCenter1 - BC_CHANNEL_SEARCH_RADIUS; nValue1 <= nCenter1 + BC_CHANNEL_SEARCH_RADIUS; ++nValue1 )
+		{
+			if ( nValue0 >= 0 && nValue0 <= 255 && nValue1 >= 0 && nValue1 <= 255 )
+			{
+				pFit->Try( pValues, nValue0, nValue1 );
+			}
+		}
+	}
+}
+
+static void WriteChannelBlock( int nValue0, int nValue1, const uint8 *pIndices, uint8 *pOut )
+{
+	pOut[0] = (uint8)nValue0;
+	pOut[1] = (uint8)nValue1;
+	uint64 nBits = 0;
+	for ( int i = 0; i < 16; ++i )
+	{
+		nBits |= (uint64)pIndices[i] << ( i * 3 );
+	}
+	for ( int i = 0; i < 6; ++i )
+	{
+		pOut[2 + i] = (uint8)( nBits >> ( i * 8 ) );
+	}
+}
+
+static void EncodeChannelBlock( const fltx4 *pValues, BCQuality_t quality, uint8 *pOut )
+{
+	ChannelFit_t fit;
+	FitChannelBlock( pValues, quality, &fit );
+	WriteChannelBlock( fit.m_nValue0, fit.m_nValue1, fit.m_nIndices, pOut );
+}
+
+static void DecodeChannelValues( const ChannelFit_t &fit, fltx4 *pDecoded )
+{
+	float flPalette[8];
+	ChannelPalette( fit.m_nValue0, fit.m_nValue1, flPalette );
+	for ( int i = 0; i < 16; ++i )
+	{
+		SubFloat( pDecoded[i >> 2], i & 3 ) = flPalette[fit.m_nIndices[i]];
+	}
+}
+
+// Refits each channel of an ATI2N block for the least angular error, with the other one decoded
+static void RefineNormalChannels( const BCBlock_t &block, ChannelFit_t *pFits )
+{
+	for ( int nChannel = 0; nChannel < 2; ++nChannel )
+	{
+		ChannelFit_t &fit = pFits[nChannel];
+		fltx4 other[4];
+		DecodeChannelValues( pFits[nChannel ^ 1], other );
+
+		int nCenter0 = fit.m_nValue0;
+		int nCenter1 = fit.m_nValue1;
+		float flBestError = EvaluateNormalChannelEndpoints( block, nChannel, other, nCenter0, nCenter1, fit.m_nIndices );
+		for ( int nValue0 = nCenter0 - BC_CHANNEL_SEARCH_RADIUS; nValue0 <= nCenter0 + BC_CHANNEL_SEARCH_RADIUS; ++nValue0 )
+		{
+			for ( int nValue1 = nCenter1 - BC_CHANNEL_SEARCH_RADIUS; nValue1 <= nCenter1 + BC_CHANNEL_SEARCH_RADIUS; ++nValue1 )
+			{
+				if ( nValue0 < 0 || nValue0 > 255 || nValue1 < 0 || nValue1 > 255 )
+					continue;
+
+				uint8 nIndices[16];
+				float flError = EvaluateNormalChannelEndpoints( block, nChannel, other, nValue0, nValue1, nIndices );
+				if ( flError < flBestError )
+				{
+					flBestError = flError;
+					fit.m_nValue0 = nValue0;
+					fit.m_nValue1 = nValue1;
+					V_memcpy( fit.m_nIndices, nIndices, sizeof( fit.m_nIndices ) );
+				}
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Encodes one row of blocks at a time, from any thread
+//-----------------------------------------------------------------------------
+class CBCImageEncoder
+{
+public:
+	CBCImageEncoder( const uint8 *pSrc, int nWidth, int nHeight, int nSrcStride, ImageFormat dstFormat,
+		uint8 *pDst, const BCEncodeParams_t &params ) : m_Params( params )
+	{
+		m_pSrc = pSrc;
+		m_nWidth = nWidth;
+		m_nHeight = nHeight;
+		m_nSrcStride = nSrcStride;
+		m_Format = dstFormat;
+		m_pDst = pDst;
+		m_nBlockSize = ( dstFormat == IMAGE_FORMAT_DXT5 || dstFormat == IMAGE_FORMAT_ATI2N ) ? 16 : 8;
+		m_nBlocksWide = ( nWidth + 3 ) >> 2;
+	}
+
+	void EncodeRow( int &nBlockRow );
+
+private:
+	const uint8				*m_pSrc;
+	int						m_nWidth;
+	int						m_nHeight;
+	int						m_nSrcStride;
+	ImageFormat				m_Format;
+	uint8					*m_pDst;
+	const BCEncodeParams_t	&m_Params;
+	int						m_nBlockSize;
+	int						m_nBlocksWide;
+};
+
+void CBCImageEncoder::EncodeRow( int &nBlockRow )
+{
+	bool bOneBitAlpha = ( m_Format == IMAGE_FORMAT_DXT1_ONEBITALPHA );
+	uint8 *pOut = m_pDst + nBlockRow * m_nBlocksWide * m_nBlockSize;
+
+	BCBlock_t block;
+	for ( int nBlock = 0; nBlock < m_nBlocksWide; ++nBlock, pOut += m_nBlockSize )
+	{
+		LoadBlock( m_pSrc, m_nWidth, m_nHeight, m_nSrcStride, nBlock * 4, nBlockRow * 4, m_Params, bOneBitAlpha, &block );
+		switch ( m_Format )
+		{
+		case IMAGE_FORMAT_DXT1:
+		case IMAGE_FORMAT_DXT1_ONEBITALPHA:
+			EncodeColorBlock( block, m_Params, pOut );
+			break;
+
+		case IMAGE_FORMAT_DXT5:
+			EncodeChannelBlock( block.m_Channel[3], m_Params.m_Quality, pOut );
+			EncodeColorBlock( block, m_Params, pOut + 8 );
+			break;
+
+		case IMAGE_FORMAT_ATI1N:
+			EncodeChannelBlock( block.m_Channel[0], m_Params.m_Quality, pOut );
+			break;
+
+		case IMAGE_FORMAT_ATI2N:
+			{
+				ChannelFit_t fits[2];
+				FitChannelBlock( block.m_Channel[0], m_Params.m_Quality, &fits[0] );
+				FitChannelBlock( block.m_Channel[1], m_Params.m_Quality, &fits[1] );
+				if ( m_Params.m_Metric == BC_METRIC_NORMAL && m_Params.m_Quality >= BC_QUALITY_EXHAUSTIVE )
+				{
+					RefineNormalChannels( block, fits );
+				}
+				WriteChannelBlock( fits[0].m_nValue0, fits[0].m_nValue1, fits[0].m_nIndices, pOut );
+				WriteChannelBlock( fits[1].m_nValue0, fits[1].m_nValue1, fits[1].m_nIndices, pOut + 8 );
+			}
+			break;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Encoding
+//-----------------------------------------------------------------------------
+bool BCCanEncode( ImageFormat fmt )
+{
+	switch ( fmt )
+	{
+	case IMAGE_FORMAT_DXT1:
+	case IMAGE_FORMAT_DXT1_ONEBITALPHA:
+	case IMAGE_FORMAT_DXT5:
+	case IMAGE_FORMAT_ATI1N:
+	case IMAGE_FORMAT_ATI2N:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+bool BCEncodeImage( const uint8 *pSrc, int nWidth, int nHeight, int nSrcStride, ImageFormat dstFormat,
+	uint8 *pDst, const BCEncodeParams_t &params )
+{
+	if ( !BCCanEncode( dstFormat ) || nWidth <= 0 || nHeight <= 0 )
+		return false;
+
+	CBCImageEncoder encoder( pSrc, nWidth, nHeight, nSrcStride, dstFormat, pDst, params );
+	int nBlockRows = ( nHeight + 3 ) >> 2;
+	if ( !params.m_pThreadPool || nBlockRows == 1 )
+	{
+		for ( int i = 0; i < nBlockRows; ++i )
+		{
+			encoder.EncodeRow( i );
+		}
+		return true;
+	}
+
+	CUtlVector< int > blockRows;
+	blockRows.SetCount( nBlockRows );
+	for ( int i = 0; i < nBlockRows; ++i )
+	{
+		blockRows[i] = i;
+	}
+	ParallelProcess( params.m_pThreadPool, blockRows.Base(), nBlockRows, &encoder, &CBCImageEncoder::EncodeRow );
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Decoding
+//-----------------------------------------------------------------------------
+static void DecodeColorBlock( const uint8 *pBlock, bool bFourColorOnly, uint8 pOut[16][4] )
+{
+	uint16 nColor0 = pBlock[0] | ( pBlock[1] << 8 );
+	uint16 nColor1 = pBlock[2] | ( pBlock[3] << 8 );
+
+	float flColor0[3], flColor1[3];
+	Unpack565( nColor0, flColor0 );
+	Unpack565( nColor1, flColor1 );
+
+	uint8 nPalette[4][4];
+	for ( int c = 0; c < 3; ++c )
+	{
+		int a = (int)flColor0[c];
+		int b = (int)flColor1[c];
+		nPalette[0][c] = a;
+		nPalette[1][c] = b;
+		if ( nColor0 > nColor1 || bFourColorOnly )
+		{
+			nPalette[2][c] = ( 2 * a + b ) / 3;
+			nPalette[3][c] = ( a + 2 * b ) / 3;
+		}
+		else
+		{
+			nPalette[2][c] = ( a + b ) / 2;
+			nPalette[3][c] = 0;
+		}
+	}
+	nPalette[0][3] = nPalette[1][3] = nPalette[2][3] = 255;
+	nPalette[3][3] = ( nColor0 > nColor1 || bFourColorOnly ) ? 255 : 0;
+
+	for ( int i = 0; i < 16; ++i )
+	{
+		int nIndex = ( pBlock[4 + ( i >> 2 )] >> ( ( i & 3 ) * 2 ) ) & 3;
+		V_memcpy( pOut[i], nPalette[nIndex], 4 );
+	}
+}
+
+static void DecodeChannelBlock( const uint8 *pBlock, uint8 pOut[16][4], int nChannel )
+{
+	int nValue0 = pBlock[0];
+	int nValue1 = pBlock[1];
+	uint8 nPalette[8];
+	nPalette[0] = nValue0;
+	nPalette[1] = nValue1;
+	if ( nValue0 > nValue1 )
+	{
+		for ( int i = 1; i < 7; ++i )
+		{
+			nPalette[i + 1] = ( ( 7 - i ) * nValue0 + i * nValue1 + 3 ) / 7;
+		}
+	}
+	else
+	{
+		for ( int i = 1; i < 5; ++i )
+		{
+			nPalette[i + 1] = ( ( 5 - i ) * nValue0 + i * nValue1 + 2 ) / 5;
+		}
+		nPalette[6] = 0;
+		nPalette[7] = 255;
+	}
+
+	uint64 nBits = 0;
+	for ( int i = 0; i < 6; ++i )
+	{
+		nBits |= (uint64)pBlock[2 + i] << ( i * 8 );
+	}
+	for ( int i = 0; i < 16; ++i )
+	{
+		pOut[i][nChannel] = nPalette[( nBits >> ( i * 3 ) ) & 7];
+	}
+}
+
+bool BCDecodeImage( const uint8 *pSrc, ImageFormat srcFormat, int nWidth, int nHeight, uint8 *pDst, int nDstStride )
+{
+	int nBlockSize;
+	switch ( srcFormat )
+	{
+	case IMAGE_FORMAT_DXT1:
+	case IMAGE_FORMAT_DXT1_ONEBITALPHA:
+	case IMAGE_FORMAT_ATI1N:
+		nBlockSize = 8;
+		break;
+
+	case IMAGE_FORMAT_DXT3:
+	case IMAGE_FORMAT_DXT5:
+	case IMAGE_FORMAT_ATI2N:
+		nBlockSize = 16;
+		break;
+
+	default:
+		return false;
+	}
+
+	int nBlocksWide = ( nWidth + 3 ) >> 2;
+	int nBlocksHigh = ( nHeight + 3 ) >> 2;
+	for ( int nBlockY = 0; nBlockY < nBlocksHigh; ++nBlockY )
+	{
+		for ( int nBlockX = 0; nBlockX < nBlocksWide; ++nBlockX, pSrc += nBlockSize )
+		{
+			uint8 pixels[16][4];
+			switch ( srcFormat )
+			{
+			case IMAGE_FORMAT_DXT1:
+			case IMAGE_FORMAT_DXT1_ONEBITALPHA:
+				DecodeColorBlock( pSrc, false, pixels );
+				break;
+
+			case IMAGE_FORMAT_DXT3:
+				DecodeColorBlock( pSrc + 8, true, pixels );
+				for ( int i = 0; i < 16; ++i )
+				{
+					pixels[i][3] = ( ( pSrc[i >> 1] >> ( ( i & 1 ) * 4 ) ) & 15 ) * 17;
+				}
+				break;
+
+			case IMAGE_FORMAT_DXT5:
+				DecodeColorBlock( pSrc + 8, true, pixels );
+				DecodeChannelBlock( pSrc, pixels, 3 );
+				break;
+
+			case IMAGE_FORMAT_ATI1N:
+				V_memset( pixels, 0, sizeof( pixels ) );
+				DecodeChannelBlock( pSrc, pixels, 0 );
+				for ( int i = 0; i < 16; ++i )
+				{
+					pixels[i][3] = 255;
+				}
+				break;
+
+			case IMAGE_FORMAT_ATI2N:
+				DecodeChannelBlock( pSrc, pixels, 0 );
+				DecodeChannelBlock( pSrc + 8, pixels, 1 );
+				for ( int i = 0; i < 16; ++i )
+				{
+					float x = pixels[i][0] * ( 2.0f / 255.0f ) - 1.0f;
+					float y = pixels[i][1] * ( 2.0f / 255.0f ) - 1.0f;
+					float z = sqrtf( MAX( 1.0f - x * x - y * y, 0.0f ) );
+					pixels[i][2] = (uint8)( z * 127.5f + 127.5f );
+					pixels[i][3] = 255;
+				}
+				break;
+			}
+
+			int nX = nBlockX * 4;
+			int nY = nBlockY * 4;
+			for ( int i = 0; i < 16; ++i )
+			{
+				if ( nX + ( i & 3 ) < nWidth && nY + ( i >> 2 ) < nHeight )
+				{
+					V_memcpy( pDst + ( nY + ( i >> 2 ) ) * nDstStride + ( nX + ( i & 3 ) ) * 4, pixels[i], 4 );
+				}
+			}
+		}
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Decoding of every format above and the uncompressed 8 bit ones
+//-----------------------------------------------------------------------------
+bool CanDecodeToRGBA8888( ImageFormat fmt )
+{
+	switch ( fmt )
+	{
+	case IMAGE_FORMAT_RGBA8888:
+	case IMAGE_FORMAT_ABGR8888:
+	case IMAGE_FORMAT_ARGB8888:
+	case IMAGE_FORMAT_BGRA8888:
+	case IMAGE_FORMAT_BGRX8888:
+	case IMAGE_FORMAT_RGBX8888:
+	case IMAGE_FORMAT_RGB888:
+	case IMAGE_FORMAT_BGR888:
+	case IMAGE_FORMAT_I8:
+	case IMAGE_FORMAT_IA88:
+	case IMAGE_FORMAT_A8:
+		return true;
+
+	case IMAGE_FORMAT_DXT1:
+	case IMAGE_FORMAT_DXT1_ONEBITALPHA:
+	case IMAGE_FORMAT_DXT3:
+	case IMAGE_FORMAT_DXT5:
+	case IMAGE_FORMAT_ATI1N:
+	case IMAGE_FORMAT_ATI2N:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+bool DecodeToRGBA8888( const uint8 *pSrc, ImageFormat fmt, int nWidth, int nHeight, uint8 *pDst )
+{
+	if ( BCDecodeImage( pSrc, fmt, nWidth, nHeight, pDst, nWidth * 4 ) )
+		return true;
+	if ( !CanDecodeToRGBA8888( fmt ) )
+		return false;
+
+	int nPixels = nWidth * nHeight;
+	for ( int i = 0; i < nPixels; ++i, pDst += 4 )
+	{
+		switch ( fmt )
+		{
+		case IMAGE_FORMAT_RGBA8888:
+			pDst[0] = pSrc[0]; pDst[1] = pSrc[1]; pDst[2] = pSrc[2]; pDst[3] = pSrc[3];
+			pSrc += 4;
+			break;
+		case IMAGE_FORMAT_ABGR8888:
+			pDst[0] = pSrc[3]; pDst[1] = pSrc[2]; pDst[2] = pSrc[1]; pDst[3] = pSrc[0];
+			pSrc += 4;
+			break;
+		case IMAGE_FORMAT_ARGB8888:
+			pDst[0] = pSrc[1]; pDst[1] = pSrc[2]; pDst[2] = pSrc[3]; pDst[3] = pSrc[0];
+			pSrc += 4;
+			break;
+		case IMAGE_FORMAT_BGRA8888:
+			pDst[0] = pSrc[2]; pDst[1] = pSrc[1]; pDst[2] = pSrc[0]; pDst[3] = pSrc[3];
+			pSrc += 4;
+			break;
+		case IMAGE_FORMAT_BGRX8888:
+			pDst[0] = pSrc[2]; pDst[1] = pSrc[1]; pDst[2] = pSrc[0]; pDst[3] = 255;
+			pSrc += 4;
+			break;
+		case IMAGE_FORMAT_RGBX8888:
+			pDst[0] = pSrc[0]; pDst[1] = pSrc[1]; pDst[2] = pSrc[2]; pDst[3] = 255;
+			pSrc += 4;
+			break;
+		case IMAGE_FORMAT_RGB888:
+			pDst[0] = pSrc[0]; pDst[1] = pSrc[1]; pDst[2] = pSrc[2]; pDst[3] = 255;
+			pSrc += 3;
+			break;
+		case IMAGE_FORMAT_BGR888:
+			pDst[0] = pSrc[2]; pDst[1] = pSrc[1]; pDst[2] = pSrc[0]; pDst[3] = 255;
+			pSrc += 3;
+			break;
+		case IMAGE_FORMAT_I8:
+			pDst[0] = pDst[1] = pDst[2] = pSrc[0]; pDst[3] = 255;
+			pSrc += 1;
+			break;
+		case IMAGE_FORMAT_IA88:
+			pDst[0] = pDst[1] = pDst[2] = pSrc[0]; pDst[3] = pSrc[1];
+			pSrc += 2;
+			break;
+		case IMAGE_FORMAT_A8:
+			pDst[0] = pDst[1] = pDst[2] = 0; pDst[3] = pSrc[0];
+			pSrc += 1;
+			break;
+		default:
+			Assert( 0 );
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,434 @@
+//==================================================================================================
+//
+// Bilateral grid for FloatBitMap_t::TileableBilateralGridFilter
+//
+// Every pixel of a channel is splatted into a coarse 3D grid, two dimensions for its position and
+// one for its value, with the weight it was splatted with next to it. Blurring the grid averages
+// pixels that are both near each other and close in value, and reading it back at each pixel's
+// own position and value, divided by the weight, gives the filtered value. The cost depends on the
+// size of the grid rather than on the radius, which the brute force filter pays for squared.
+//
+// Grid rows are stored like the image, x across, one row per (y, value) cell, so the blur runs
+// four cells at a time. The spatial axes wrap around so the result tiles.
+//
+//==================================================================================================
+
+#include <float.h>
+#include <math.h>
+
+#include "bitmap/floatbitmap.h"
+#include "mathlib/ssemath.h"
+#include "vstdlib/jobthread.h"
+#include "tier1/utlvector.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// Below this the grid is hardly smaller than the image, the brute force filter is used instead
+#define BILATERAL_GRID_MIN_RADIUS		4
+
+// Cells along the value axis, the value cells widen when the channel spans more than this many
+#define BILATERAL_GRID_MAX_VALUE_CELLS	32
+
+// Grid rows or image rows handed to a thread at a time
+#define BILATERAL_GRID_ROWS_PER_JOB		4
+
+typedef CUtlVector< float, CUtlMemoryAligned< float, 16 > > BilateralFloats_t;
+
+enum BilateralGridPass_t
+{
+	BILATERAL_PASS_SPLAT = 0,		// Per grid row, the image rows that reach it
+	BILATERAL_PASS_BLUR_X,
+	BILATERAL_PASS_BLUR_Y,
+	BILATERAL_PASS_BLUR_Z,
+	BILATERAL_PASS_SLICE,			// Per image row
+};
+
+//-----------------------------------------------------------------------------
+// Where a pixel row or column lands in the grid: between two cells, the second weighted by m_flFrac
+//-----------------------------------------------------------------------------
+struct BilateralGridCoord_t
+{
+	int		m_nCell[2];
+	float	m_flFrac;
+};
+
+class CBilateralGrid
+{
+public:
+	CBilateralGrid( FloatBitMap_t &bitmap, IThreadPool *pThreadPool );
+
+	void Filter( int nChannel, int nSlice, float flCellSize, float flValueCellSize );
+
+	void ProcessRows( BilateralGridPass_t *pPass, int nFirstRow, int nRowCount );
+
+private:
+	void InitCoords( int nPixels, int nCells, CUtlVector< BilateralGridCoord_t > &coords );
+	void RunPass( BilateralGridPass_t pass );
+
+	float *Row( BilateralFloats_t &grid, int gy, int gz )
+	{
+		return grid.Base() + ( gy * m_nDepth + gz ) * m_nStride + 4;
+	}
+
+	void SplatRow( int gy );
+	void BlurRowsX( int gy );
+	void BlurRowsY( int gy );
+	void BlurRowsZ( int gy );
+	void SliceRow( int y );
+
+	FloatBitMap_t		&m_Bitmap;
+	IThreadPool			*m_pThreadPool;
+	int					m_nChannel;
+	int					m_nSlice;
+
+	int					m_nWidth;			// Grid size
+	int					m_nHeight;
+	int					m_nDepth;
+	int					m_nStride;
+	float				m_flMinValue;
+	float				m_flInvValueCellSize;
+
+	CUtlVector< BilateralGridCoord_t >	m_X;
+	CUtlVector< BilateralGridCoord_t >	m_Y;
+
+	// Sums of the splatted values and weights. Blur passes read from one of each pair and write to
+	// the other
+	BilateralFloats_t	m_Value[2];
+	BilateralFloats_t	m_Weight[2];
+	int					m_nCurrent;
+	BilateralFloats_t	m_Zero;				// A row of 0 for cells past the ends of the value axis
+};
+
+CBilateralGrid::CBilateralGrid( FloatBitMap_t &bitmap, IThreadPool *pThreadPool ) : m_Bitmap( bitmap )
+{
+	m_pThreadPool = pThreadPool;
+	m_nChannel = 0;
+	m_nSlice = 0;
+	m_nWidth = m_nHeight = m_nDepth = m_nStride = 0;
+	m_flMinValue = 0.0f;
+	m_flInvValueCellSize = 1.0f;
+	m_nCurrent = 0;
+}
+
+// Cell centers sit flCellSize apart starting half a cell in, the size is stretched so that a whole
+// number of cells covers the image and wrapping stays exact
+void CBilateralGrid::InitCoords( int nPixels, int nCells, CUtlVector< BilateralGridCoord_t > &coords )
+{
+	float flCellsPerPixel = nCells / (float)nPixels;
+	coords.SetCount( nPixels );
+	for ( int i = 0; i < nPixels; ++i )
+	{
+		float flCell = ( i + 0.5f ) * flCellsPerPixel - 0.5f;
+		int nCell = (int)floorf( flCell );
+		coords[i].m_flFrac = flCell - nCell;
+		coords[i].m_nCell[0] = ( nCell < 0 ) ? nCell + nCells : nCell;
+		coords[i].m_nCell[1] = ( nCell + 1 >= nCells ) ? nCell + 1 - nCells : nCell + 1;
+	}
+}
+
+void CBilateralGrid::Filter( int nChannel, int nSlice, float flCellSize, float flValueCellSize )
+{
+	m_nChannel = nChannel;
+	m_nSlice = nSlice;
+
+	int nCols = m_Bitmap.NumCols();
+	int nRows = m_Bitmap.NumRows();
+
+	float flMin = FLT_MAX;
+	float flMax = -FLT_MAX;
+	for ( int y = 0; y < nRows; ++y )
+	{
+		const float *pRow = m_Bitmap.RowPtr<float>( nChannel, y, nSlice );
+		for ( int x = 0; x < nCols; ++x )
+		{
+			flMin = MIN( flMin, pRow[x] );
+			flMax = MAX( flMax, pRow[x] );
+		}
+	}
+
+	int nValueCells = (int)ceilf( ( flMax - flMin ) / flValueCellSize );
+	if ( nValueCells > BILATERAL_GRID_MAX_VALUE_CELLS )
+	{
+		nValueCells = BILATERAL_GRID_MAX_VALUE_CELLS;
+		flValueCellSize = ( flMax - flMin ) / nValueCells;
+	}
+
+	// Values map to cells 1 to nValueCells + 1, with an empty cell on either side for the blur to
+	// spread into
+	m_nWidth = MAX( 1, (int)( nCols / flCellSize + 0.5f ) );
+	m_nHeight = MAX( 1, (int)( nRows / flCellSize + 0.5f ) );
+	m_nDepth = nValueCells + 3;
+	m_nStride = 8 + ( ( m_nWidth + 3 ) & ~3 );
+	m_flMinValue = flMin;
+	m_flInvValueCellSize = 1.0f / flValueCellSize;
+
+	InitCoords( nCols, m_nWidth, m_X );
+	InitCoords( nRows, m_nHeight, m_Y );
+
+	int nSize = m_nStride * m_nHeight * m_nDepth;
+	for ( int i = 0; i < 2; ++i )
+	{
+		m_Value[i].SetCount( nSize );
+		m_Weight[i].SetCount( nSize );
+	}
+	m_Zero.SetCount( m_nStride );
+	memset( m_Zero.Base(), 0, m_nStride * sizeof( float ) );
+	m_nCurrent = 0;
+
+	RunPass( BILATERAL_PASS_SPLAT );
+	RunPass( BILATERAL_PASS_BLUR_X );
+	RunPass( BILATERAL_PASS_BLUR_Y );
+	RunPass( BILATERAL_PASS_BLUR_Z );
+	RunPass( BILATERAL_PASS_SLICE );
+}
+
+void CBilateralGrid::RunPass( BilateralGridPass_t pass )
+{
+	int nRows = ( pass == BILATERAL_PASS_SLICE ) ? m_Bitmap.NumRows() : m_nHeight;
+	int nJobs = ( nRows + BILATERAL_GRID_ROWS_PER_JOB - 1 ) / BILATERAL_GRID_ROWS_PER_JOB;
+	if ( !m_pThreadPool || nJobs <= 1 )
+	{
+		ProcessRows( &pass, 0, nRows );
+	}
+	else
+	{
+		ParallelLoopProcessChunks( m_pThreadPool, &pass, 0, nRows, nJobs, this, &CBilateralGrid::ProcessRows );
+	}
+
+	if ( pass >= BILATERAL_PASS_BLUR_X && pass <= BILATERAL_PASS_BLUR_Z )
+	{
+		m_nCurrent ^= 1;
+	}
+}
+
+void CBilateralGrid::ProcessRows( BilateralGridPass_t *pPass, int nFirstRow, int nRowCount )
+{
+	for ( int y = nFirstRow; y < nFirstRow + nRowCount; ++y )
+	{
+		switch ( *pPass )
+		{
+		case BILATERAL_PASS_SPLAT:
+			SplatRow( y );
+			break;
+		case BILATERAL_PASS_BLUR_X:
+			BlurRowsX( y );
+			break;
+		case BILATERAL_PASS_BLUR_Y:
+			BlurRowsY( y );
+			break;
+		case BILATERAL_PASS_BLUR_Z:
+			BlurRowsZ( y );
+			break;
+		case BILATERAL_PASS_SLICE:
+			SliceRow( y );
+			break;
+		}
+	}
+}
+
+// Each job owns whole grid rows, so it gathers the image rows that reach them rather than
+// scattering image rows into grid rows other jobs are writing
+void CBilateralGrid::SplatRow( int gy )
+{
+	BilateralFloats_t &value = m_Value[ m_nCurrent ];
+	BilateralFloats_t &weight = m_Weight[ m_nCurrent ];
+	memset( Row( value, gy, 0 ) - 4, 0, m_nDepth * m_nStride * sizeof( float ) );
+	memset( Row( weight, gy, 0 ) - 4, 0, m_nDepth * m_nStride * sizeof( float ) );
+
+	int nCols = m_Bitmap.NumCols();
+	int nRows = m_Bitmap.NumRows();
+	for ( int y = 0; y < nRows; ++y )
+	{
+		// A grid only one row high gets both weights of every image row
+		const BilateralGridCoord_t &coordY = m_Y[y];
+		float flWeightY = 0.0f;
+		if ( coordY.m_nCell[0] == gy )
+		{
+			flWeightY += 1.0f - coordY.m_flFrac;
+		}
+		if ( coordY.m_nCell[1] == gy )
+		{
+			flWeightY += coordY.m_flFrac;
+		}
+		if ( flWeightY == 0.0f )
+			continue;
+
+		const float *pRow = m_Bitmap.RowPtr<float>( m_nChannel, y, m_nSlice );
+		for ( int x = 0; x < nCols; ++x )
+		{
+			float flValue = pRow[x];
+			float flZ = ( flValue - m_flMinValue ) * m_flInvValueCellSize;
+			int gz = (int)flZ;
+			float flFracZ = flZ - gz;
+			gz += 1;
+
+			const BilateralGridCoord_t &coordX = m_X[x];
+			float flWeightX[2] = { 1.0f - coordX.m_flFrac, coordX.m_flFrac };
+			float flWeightZ[2] = { flWeightY * ( 1.0f - flFracZ ), flWeightY * flFracZ };
+			for ( int k = 0; k < 2; ++k )
+			{
+				float *pValue = Row( value, gy, gz + k );
+				float *pWeight = Row( weight, gy, gz + k );
+				for ( int i = 0; i < 2; ++i )
+				{
+					float flWeight = flWeightZ[k] * flWeightX[i];
+					pValue[ coordX.m_nCell[i] ] += flWeight * flValue;
+					pWeight[ coordX.m_nCell[i] ] += flWeight;
+				}
+			}
+		}
+	}
+}
+
+// The blur is [1 2 1] / 4 along each axis in turn
+void CBilateralGrid::BlurRowsX( int gy )
+{
+	fltx4 quarter = ReplicateX4( 0.25f );
+	fltx4 half = ReplicateX4( 0.5f );
+	for ( int i = 0; i < 2; ++i )
+	{
+		BilateralFloats_t &src = i ? m_Weight[ m_nCurrent ] : m_Value[ m_nCurrent ];
+		BilateralFloats_t &dst = i ? m_Weight[ m_nCurrent ^ 1 ] : m_Value[ m_nCurrent ^ 1 ];
+		for ( int gz = 0; gz < m_nDepth; ++gz )
+		{
+			float *pIn = Row( src, gy, gz );
+			float *pOut = Row( dst, gy, gz );
+
+			// Ghost cells across the wrap, the right one may share a group of four with the last
+			// cell and is written before it is read
+			pIn[-1] = pIn[ m_nWidth - 1 ];
+			pIn[ m_nWidth ] = pIn[0];
+			for ( int x = 0; x < m_nWidth; x += 4 )
+			{
+				fltx4 sides = AddSIMD( LoadUnalignedSIMD( pIn + x - 1 ), LoadUnalignedSIMD( pIn + x + 1 ) );
+				fltx4 result = MaddSIMD( half, LoadAlignedSIMD( pIn + x ), MulSIMD( quarter, sides ) );
+				StoreAlignedSIMD( pOut + x, result );
+			}
+		}
+	}
+}
+
+void CBilateralGrid::BlurRowsY( int gy )
+{
+	int gyUp = ( gy > 0 ) ? gy - 1 : m_nHeight - 1;
+	int gyDown = ( gy + 1 < m_nHeight ) ? gy + 1 : 0;
+
+	fltx4 quarter = ReplicateX4( 0.25f );
+	fltx4 half = ReplicateX4( 0.5f );
+	for ( int i = 0; i < 2; ++i )
+	{
+		BilateralFloats_t &src = i ? m_Weight[ m_nCurrent ] : m_Value[ m_nCurrent ];
+		BilateralFloats_t &dst = i ? m_Weight[ m_nCurrent ^ 1 ] : m_Value[ m_nCurrent ^ 1 ];
+		for ( int gz = 0; gz < m_nDepth; ++gz )
+		{
+			const float *pUp = Row( src, gyUp, gz );
+			const float *pIn = Row( src, gy, gz );
+			const float *pDown = Row( src, gyDown, gz );
+			float *pOut = Row( dst, gy, gz );
+			for ( int x = 0; x < m_nWidth; x += 4 )
+			{
+				fltx4 sides = AddSIMD( LoadAlignedSIMD( pUp + x ), LoadAlignedSIMD( pDown + x ) );
+				fltx4 result = MaddSIMD( half, LoadAlignedSIMD( pIn + x ), MulSIMD( quarter, sides ) );
+				StoreAlignedSIMD( pOut + x, result );
+			}
+		}
+	}
+}
+
+void CBilateralGrid::BlurRowsZ( int gy )
+{
+	fltx4 quarter = ReplicateX4( 0.25f );
+	fltx4 half = ReplicateX4( 0.5f );
+	const float *pZero = m_Zero.Base() + 4;
+	for ( int i = 0; i < 2; ++i )
+	{
+		BilateralFloats_t &src = i ? m_Weight[ m_nCurrent ] : m_Value[ m_nCurrent ];
+		BilateralFloats_t &dst = i ? m_Weight[ m_nCurrent ^ 1 ] : m_Value[ m_nCurrent ^ 1 ];
+		for ( int gz = 0; gz < m_nDepth; ++gz )
+		{
+			const float *pBelow = ( gz > 0 ) ? Row( src, gy, gz - 1 ) : pZero;
+			const float *pIn = Row( src, gy, gz );
+			const float *pAbove = ( gz + 1 < m_nDepth ) ? Row( src, gy, gz + 1 ) : pZero;
+			float *pOut = Row( dst, gy, gz );
+			for ( int x = 0; x < m_nWidth; x += 4 )
+			{
+				fltx4 sides = AddSIMD( LoadAlignedSIMD( pBelow + x ), LoadAlignedSIMD( pAbove + x ) );
+				fltx4 result = MaddSIMD( half, LoadAlignedSIMD( pIn + x ), MulSIMD( quarter, sides ) );
+				StoreAlignedSIMD( pOut + x, result );
+			}
+		}
+	}
+}
+
+void CBilateralGrid::SliceRow( int y )
+{
+	BilateralFloats_t &value = m_Value[ m_nCurrent ];
+	BilateralFloats_t &weight = m_Weight[ m_nCurrent ];
+
+	const BilateralGridCoord_t &coordY = m_Y[y];
+	float flWeightY[2] = { 1.0f - coordY.m_flFrac, coordY.m_flFrac };
+
+	float *pRow = m_Bitmap.RowPtr<float>( m_nChannel, y, m_nSlice );
+	int nCols = m_Bitmap.NumCols();
+	for ( int x = 0; x < nCols; ++x )
+	{
+		float flZ = ( pRow[x] - m_flMinValue ) * m_flInvValueCellSize;
+		int gz = (int)flZ;
+		float flFracZ = flZ - gz;
+		gz += 1;
+
+		const BilateralGridCoord_t &coordX = m_X[x];
+		float flWeightX[2] = { 1.0f - coordX.m_flFrac, coordX.m_flFrac };
+		float flWeightZ[2] = { 1.0f - flFracZ, flFracZ };
+
+		float flValueSum = 0.0f;
+		float flWeightSum = 0.0f;
+		for ( int j = 0; j < 2; ++j )
+		{
+			for ( int k = 0; k < 2; ++k )
+			{
+				const float *pValue = Row( value, coordY.m_nCell[j], gz + k );
+				const float *pWeight = Row( weight, coordY.m_nCell[j], gz + k );
+				for ( int i = 0; i < 2; ++i )
+				{
+					float flWeight = flWeightY[j] * flWeightZ[k] * flWeightX[i];
+					flValueSum += flWeight * pValue[ coordX.m_nCell[i] ];
+					flWeightSum += flWeight * pWeight[ coordX.m_nCell[i] ];
+				}
+			}
+		}
+
+		// Every pixel splats into the cells it reads back from, so the weight is only 0 when they
+		// lost all of it to float precision
+		if ( flWeightSum > 0.0f )
+		{
+			pRow[x] = flValueSum / flWeightSum;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Approximates TileableBilateralFilter with a bilateral grid whose cells are half the radius
+// across and half the edge threshold deep, which the blur widens to about the same footprint
+//-----------------------------------------------------------------------------
+void FloatBitMap_t::TileableBilateralGridFilter( int radius_in_pixels, float edge_threshold_value )
+{
+	if ( radius_in_pixels < BILATERAL_GRID_MIN_RADIUS || edge_threshold_value <= 0.0f )
+	{
+		TileableBilateralFilter( radius_in_pixels, edge_threshold_value );
+		return;
+	}
+
+	CBilateralGrid grid( *this, sm_pFBMThreadPool );
+	for ( int c = 0; c < FBM_ATTR_COUNT; ++c )
+	{
+		if ( !HasAllocatedMemory( c ) )
+			continue;
+
+		for ( int z = 0; z < NumSlices(); ++z )
+		{
+			grid.Filter( c, z, 0.5f * radius_in_pixels, 0.5f * edge_threshold_value );
+		}
+	}
+}
@@ -0,0 +1,707 @@
+//==================================================================================================
+//
+// Multigrid solver for FloatBitMap_t::PoissonMultigrid
+//
+// Each V-cycle smooths the error with red-black Gauss-Seidel, hands the residual to a grid of half
+// the size and adds the correction that comes back. Smoothing only removes error a few pixels
+// across, the coarser grids take care of the rest.
+//
+// Locked pixels cut the links between their neighbors, so the equation of a coarse pixel is built
+// from the fine pixels it covers rather than assumed to be the plain 5 point stencil. A coarse
+// pixel is locked only when every pixel it covers is.
+//
+// Rows carry one ghost pixel on each side holding the value across the wrap, which lets the
+// smoother read left and right neighbors four at a time.
+//
+//==================================================================================================
+
+#include "bitmap/floatbitmap.h"
+#include "mathlib/ssemath.h"
+#include "vstdlib/jobthread.h"
+#include "tier1/utlvector.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// Grids are halved while both sides are at least this large
+#define POISSON_MIN_GRID_SIZE		8
+
+// Scale of the coarse equations built from the fine ones, see BuildCoarseGrid
+#define POISSON_COARSE_SCALE		( 2.0f / 3.0f )
+
+#define POISSON_PRE_SMOOTH			2
+#define POISSON_POST_SMOOTH			2
+#define POISSON_COARSEST_SWEEPS		64
+
+// V-cycles MakeTileableMultigrid runs
+#define POISSON_TILEABLE_VCYCLES	12
+
+// Rows of a grid handed to a thread at a time
+#define POISSON_ROWS_PER_JOB		16
+
+// Order of the deltas: (x,y)-(x,y-1), (x,y)-(x-1,y), (x,y)-(x+1,y), (x,y)-(x,y+1)
+static const int s_nDeltaX[4] = { 0, -1, 1, 0 };
+static const int s_nDeltaY[4] = { -1, 0, 0, 1 };
+
+typedef CUtlVector< float, CUtlMemoryAligned< float, 16 > > PoissonFloats_t;
+typedef CUtlVector< uint32, CUtlMemoryAligned< uint32, 16 > > PoissonMask_t;
+
+//-----------------------------------------------------------------------------
+// One grid of the hierarchy
+//-----------------------------------------------------------------------------
+struct PoissonGrid_t
+{
+	void Init( int nWidth, int nHeight, bool bCoefficients )
+	{
+		m_nWidth = nWidth;
+		m_nHeight = nHeight;
+
+		// Four floats ahead of each row keep x = 0 aligned and hold the left ghost. The right one
+		// follows the row, in the four floats after it that the last unaligned load reaches into
+		m_nStride = 8 + ( ( nWidth + 3 ) & ~3 );
+		int nSize = m_nStride * nHeight;
+		m_Solution.SetCount( nSize );
+		m_RHS.SetCount( nSize );
+		m_Residual.SetCount( nSize );
+		m_Free.SetCount( nSize );
+		memset( m_Solution.Base(), 0, nSize * sizeof( float ) );
+		memset( m_RHS.Base(), 0, nSize * sizeof( float ) );
+		memset( m_Residual.Base(), 0, nSize * sizeof( float ) );
+		memset( m_Free.Base(), 0, nSize * sizeof( uint32 ) );
+
+		m_bCoefficients = bCoefficients;
+		if ( bCoefficients )
+		{
+			m_Diagonal.SetCount( nSize );
+			m_InvDiagonal.SetCount( nSize );
+			memset( m_Diagonal.Base(), 0, nSize * sizeof( float ) );
+			memset( m_InvDiagonal.Base(), 0, nSize * sizeof( float ) );
+			for ( int i = 0; i < 4; ++i )
+			{
+				m_Link[i].SetCount( nSize );
+				memset( m_Link[i].Base(), 0, nSize * sizeof( float ) );
+			}
+		}
+	}
+
+	int WrapY( int y ) const
+	{
+		return ( y < 0 ) ? y + m_nHeight : ( ( y >= m_nHeight ) ? y - m_nHeight : y );
+	}
+
+	int WrapX( int x ) const
+	{
+		return ( x < 0 ) ? x + m_nWidth : ( ( x >= m_nWidth ) ? x - m_nWidth : x );
+	}
+
+	float *Solution( int y )	{ return m_Solution.Base() + y * m_nStride + 4; }
+	float *RHS( int y )			{ return m_RHS.Base() + y * m_nStride + 4; }
+	float *Residual( int y )	{ return m_Residual.Base() + y * m_nStride + 4; }
+	uint32 *Free( int y )		{ return m_Free.Base() + y * m_nStride + 4; }
+	float *Diagonal( int y )	{ return m_Diagonal.Base() + y * m_nStride + 4; }
+	float *InvDiagonal( int y )	{ return m_InvDiagonal.Base() + y * m_nStride + 4; }
+	float *Link( int i, int y )	{ return m_Link[i].Base() + y * m_nStride + 4; }
+
+	void UpdateGhosts( int y )
+	{
+		float *pRow = Solution( y );
+		pRow[-1] = pRow[ m_nWidth - 1 ];
+		pRow[ m_nWidth ] = pRow[0];
+	}
+
+	int				m_nWidth;
+	int				m_nHeight;
+	int				m_nStride;
+	PoissonFloats_t	m_Solution;
+	PoissonFloats_t	m_RHS;
+	PoissonFloats_t	m_Residual;
+	PoissonMask_t	m_Free;			// All bits set for pixels that aren't locked
+
+	// Equation of each pixel of the coarse grids: diagonal * e - sum of link * neighbor = rhs, links
+	// in the order of the deltas. The finest grid is 4 * u - sum of the neighbors = rhs
+	bool			m_bCoefficients;
+	PoissonFloats_t	m_Diagonal;
+	PoissonFloats_t	m_InvDiagonal;
+	PoissonFloats_t	m_Link[4];
+};
+
+//-----------------------------------------------------------------------------
+// Solves one channel at a time
+//-----------------------------------------------------------------------------
+enum PoissonPass_t
+{
+	POISSON_PASS_SMOOTH_RED = 0,	// Pixels where x + y is even
+	POISSON_PASS_SMOOTH_BLACK,
+	POISSON_PASS_RESIDUAL,
+	POISSON_PASS_RESTRICT,			// Residual of the grid to the right hand side of the next one
+	POISSON_PASS_PROLONG,			// Solution of the next grid added to this one
+};
+
+class CPoissonMultigrid
+{
+public:
+	CPoissonMultigrid( IThreadPool *pThreadPool );
+	~CPoissonMultigrid();
+
+	// Builds the grids for an image, pFree is false for its locked pixels
+	void Init( int nWidth, int nHeight, const bool *pFree );
+
+	PoissonGrid_t &Finest() { return *m_Grids[0]; }
+	void VCycle( int nGrid );
+
+	void ProcessRows( PoissonPass_t *pPass, int nFirstRow, int nRowCount );
+
+private:
+	void RunPass( PoissonPass_t pass, int nGrid );
+	void Smooth( int nGrid );
+
+	// Equation of a pixel on any grid
+	static float Diagonal( PoissonGrid_t &grid, int x, int y );
+	static float Link( PoissonGrid_t &grid, int x, int y, int i );
+	void BuildCoarseGrid( PoissonGrid_t &grid, PoissonGrid_t &coarse );
+
+	void SmoothRow( PoissonGrid_t &grid, int y, int nColor );
+	void SmoothCoarseRow( PoissonGrid_t &grid, int y, int nColor );
+	void ResidualRow( PoissonGrid_t &grid, int y );
+	void CoarseResidualRow( PoissonGrid_t &grid, int y );
+	void RestrictRow( PoissonGrid_t &grid, PoissonGrid_t &coarse, int y );
+	void ProlongRow( PoissonGrid_t &grid, PoissonGrid_t &coarse, int y );
+
+	IThreadPool						*m_pThreadPool;
+	CUtlVector< PoissonGrid_t * >	m_Grids;
+	int								m_nPassGrid;
+	fltx4							m_ColorMask[2];		// Lanes with even and odd x
+};
+
+CPoissonMultigrid::CPoissonMultigrid( IThreadPool *pThreadPool )
+{
+	m_pThreadPool = pThreadPool;
+	m_nPassGrid = 0;
+
+	static const ALIGN16 uint32 s_EvenLanes[4] ALIGN16_POST = { ~0u, 0, ~0u, 0 };
+	static const ALIGN16 uint32 s_OddLanes[4] ALIGN16_POST = { 0, ~0u, 0, ~0u };
+	m_ColorMask[0] = LoadAlignedSIMD( s_EvenLanes );
+	m_ColorMask[1] = LoadAlignedSIMD( s_OddLanes );
+}
+
+CPoissonMultigrid::~CPoissonMultigrid()
+{
+	m_Grids.PurgeAndDeleteElements();
+}
+
+void CPoissonMultigrid::Init( int nWidth, int nHeight, const bool *pFree )
+{
+	m_Grids.PurgeAndDeleteElements();
+
+	PoissonGrid_t *pGrid = new PoissonGrid_t;
+	pGrid->Init( nWidth, nHeight, false );
+	for ( int y = 0; y < nHeight; ++y )
+	{
+		uint32 *pRowFree = pGrid->Free( y );
+		for ( int x = 0; x < nWidth; ++x )
+		{
+			pRowFree[x] = pFree[ y * nWidth + x ] ? ~0u : 0;
+		}
+	}
+	m_Grids.AddToTail( pGrid );
+
+	while ( pGrid->m_nWidth >= POISSON_MIN_GRID_SIZE && pGrid->m_nHeight >= POISSON_MIN_GRID_SIZE )
+	{
+		PoissonGrid_t *pCoarse = new PoissonGrid_t;
+		pCoarse->Init( ( pGrid->m_nWidth + 1 ) >> 1, ( pGrid->m_nHeight + 1 ) >> 1, true );
+		BuildCoarseGrid( *pGrid, *pCoarse );
+		m_Grids.AddToTail( pCoarse );
+		pGrid = pCoarse;
+	}
+}
+
+float CPoissonMultigrid::Diagonal( PoissonGrid_t &grid, int x, int y )
+{
+	if ( grid.m_bCoefficients )
+		return grid.Diagonal( y )[x];
+	return grid.Free( y )[x] ? 4.0f : 0.0f;
+}
+
+// Links to locked pixels are left out, the error is 0 there
+float CPoissonMultigrid::Link( PoissonGrid_t &grid, int x, int y, int i )
+{
+	if ( grid.m_bCoefficients )
+		return grid.Link( i, y )[x];
+
+	int nx = grid.WrapX( x + s_nDeltaX[i] );
+	int ny = grid.WrapY( y + s_nDeltaY[i] );
+	return ( grid.Free( y )[x] && grid.Free( ny )[nx] ) ? 1.0f : 0.0f;
+}
+
+// The error of a coarse pixel is spread evenly over the pixels it covers, which turns their
+// equations into one: diagonals add up, links within the coarse pixel cancel out of the diagonal
+// and links to the pixels of a neighbor add up to the link to it. The sum is twice the 5 point
+// stencil where nothing is locked but less than that next to locked pixels, whose error really is
+// 0 instead of spread out. Halving it overshoots there and a cycle can grow the error, two thirds
+// converges everywhere at little cost away from the locks
+void CPoissonMultigrid::BuildCoarseGrid( PoissonGrid_t &grid, PoissonGrid_t &coarse )
+{
+	for ( int cy = 0; cy < coarse.m_nHeight; ++cy )
+	{
+		float *pDiagonal = coarse.Diagonal( cy );
+		float *pInvDiagonal = coarse.InvDiagonal( cy );
+		uint32 *pFree = coarse.Free( cy );
+		for ( int cx = 0; cx < coarse.m_nWidth; ++cx )
+		{
+			float flDiagonal = 0.0f;
+			float flLink[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+			for ( int y = 2 * cy; y < MIN( 2 * cy + 2, grid.m_nHeight ); ++y )
+			{
+				for ( int x = 2 * cx; x < MIN( 2 * cx + 2, grid.m_nWidth ); ++x )
+				{
+					flDiagonal += Diagonal( grid, x, y );
+					for ( int i = 0; i < 4; ++i )
+					{
+						float flWeight = Link( grid, x, y, i );
+						int nx = grid.WrapX( x + s_nDeltaX[i] );
+						int ny = grid.WrapY( y + s_nDeltaY[i] );
+						if ( ( nx >> 1 ) == cx && ( ny >> 1 ) == cy )
+						{
+							flDiagonal -= flWeight;
+						}
+						else
+						{
+							flLink[i] += flWeight;
+						}
+					}
+				}
+			}
+
+			pDiagonal[cx] = POISSON_COARSE_SCALE * flDiagonal;
+			pInvDiagonal[cx] = ( flDiagonal > 0.0f ) ? 1.0f / ( POISSON_COARSE_SCALE * flDiagonal ) : 0.0f;
+			pFree[cx] = ( flDiagonal > 0.0f ) ? ~0u : 0;
+			for ( int i = 0; i < 4; ++i )
+			{
+				coarse.Link( i, cy )[cx] = POISSON_COARSE_SCALE * flLink[i];
+			}
+		}
+	}
+}
+
+void CPoissonMultigrid::RunPass( PoissonPass_t pass, int nGrid )
+{
+	m_nPassGrid = nGrid;
+	PoissonGrid_t &grid = *m_Grids[nGrid];
+
+	// Smoothing odd heights, the first and last rows wrap onto each other with the same color and
+	// can't be updated at the same time. The last row goes after the others
+	int nRows = grid.m_nHeight;
+	bool bSmooth = ( pass == POISSON_PASS_SMOOTH_RED || pass == POISSON_PASS_SMOOTH_BLACK );
+	if ( bSmooth && ( nRows & 1 ) )
+	{
+		--nRows;
+	}
+
+	int nJobs = ( nRows + POISSON_ROWS_PER_JOB - 1 ) / POISSON_ROWS_PER_JOB;
+	if ( !m_pThreadPool || nJobs <= 1 )
+	{
+		ProcessRows( &pass, 0, nRows );
+	}
+	else
+	{
+		ParallelLoopProcessChunks( m_pThreadPool, &pass, 0, nRows, nJobs, this, &CPoissonMultigrid::ProcessRows );
+	}
+
+	if ( nRows < grid.m_nHeight )
+	{
+		ProcessRows( &pass, nRows, 1 );
+	}
+}
+
+void CPoissonMultigrid::ProcessRows( PoissonPass_t *pPass, int nFirstRow, int nRowCount )
+{
+	PoissonGrid_t &grid = *m_Grids[ m_nPassGrid ];
+	for ( int y = nFirstRow; y < nFirstRow + nRowCount; ++y )
+	{
+		switch ( *pPass )
+		{
+		case POISSON_PASS_SMOOTH_RED:
+		case POISSON_PASS_SMOOTH_BLACK:
+			if ( grid.m_bCoefficients )
+			{
+				SmoothCoarseRow( grid, y, *pPass - POISSON_PASS_SMOOTH_RED );
+			}
+			else
+			{
+				SmoothRow( grid, y, *pPass - POISSON_PASS_SMOOTH_RED );
+			}
+			break;
+		case POISSON_PASS_RESIDUAL:
+			if ( grid.m_bCoefficients )
+			{
+				CoarseResidualRow( grid, y );
+			}
+			else
+			{
+				ResidualRow( grid, y );
+			}
+			break;
+		case POISSON_PASS_RESTRICT:
+			RestrictRow( *m_Grids[ m_nPassGrid - 1 ], grid, y );
+			break;
+		case POISSON_PASS_PROLONG:
+			ProlongRow( grid, *m_Grids[ m_nPassGrid + 1 ], y );
+			break;
+		}
+	}
+}
+
+void CPoissonMultigrid::SmoothRow( PoissonGrid_t &grid, int y, int nColor )
+{
+	float *pRow = grid.Solution( y );
+	const float *pUp = grid.Solution( grid.WrapY( y - 1 ) );
+	const float *pDown = grid.Solution( grid.WrapY( y + 1 ) );
+	const float *pRHS = grid.RHS( y );
+	const uint32 *pFree = grid.Free( y );
+
+	// Pixel x has the color being updated when x + y has the parity of nColor
+	fltx4 colorMask = m_ColorMask[ ( nColor + y ) & 1 ];
+	fltx4 quarter = ReplicateX4( 0.25f );
+	for ( int x = 0; x < grid.m_nWidth; x += 4 )
+	{
+		fltx4 sum = AddSIMD( LoadUnalignedSIMD( pRow + x - 1 ), LoadUnalignedSIMD( pRow + x + 1 ) );
+		sum = AddSIMD( sum, AddSIMD( LoadAlignedSIMD( pUp + x ), LoadAlignedSIMD( pDown + x ) ) );
+		fltx4 value = MulSIMD( AddSIMD( sum, LoadAlignedSIMD( pRHS + x ) ), quarter );
+		fltx4 update = AndSIMD( LoadAlignedSIMD( pFree + x ), colorMask );
+		StoreAlignedSIMD( pRow + x, MaskedAssign( update, value, LoadAlignedSIMD( pRow + x ) ) );
+	}
+	grid.UpdateGhosts( y );
+}
+
+void CPoissonMultigrid::SmoothCoarseRow( PoissonGrid_t &grid, int y, int nColor )
+{
+	float *pRow = grid.Solution( y );
+	const float *pUp = grid.Solution( grid.WrapY( y - 1 ) );
+	const float *pDown = grid.Solution( grid.WrapY( y + 1 ) );
+	const float *pRHS = grid.RHS( y );
+	const float *pInvDiagonal = grid.InvDiagonal( y );
+	const float *pLinkUp = grid.Link( 0, y );
+	const float *pLinkLeft = grid.Link( 1, y );
+	const float *pLinkRight = grid.Link( 2, y );
+	const float *pLinkDown = grid.Link( 3, y );
+	const uint32 *pFree = grid.Free( y );
+
+	fltx4 colorMask = m_ColorMask[ ( nColor + y ) & 1 ];
+	for ( int x = 0; x < grid.m_nWidth; x += 4 )
+	{
+		fltx4 sum = MaddSIMD( LoadAlignedSIMD( pLinkUp + x ), LoadAlignedSIMD( pUp + x ), LoadAlignedSIMD( pRHS + x ) );
+		sum = MaddSIMD( LoadAlignedSIMD( pLinkLeft + x ), LoadUnalignedSIMD( pRow + x - 1 ), sum );
+		sum = MaddSIMD( LoadAlignedSIMD( pLinkRight + x ), LoadUnalignedSIMD( pRow + x + 1 ), sum );
+		sum = MaddSIMD( LoadAlignedSIMD( pLinkDown + x ), LoadAlignedSIMD( pDown + x ), sum );
+		fltx4 value = MulSIMD( sum, LoadAlignedSIMD( pInvDiagonal + x ) );
+		fltx4 update = AndSIMD( LoadAlignedSIMD( pFree + x ), colorMask );
+		StoreAlignedSIMD( pRow + x, MaskedAssign( update, value, LoadAlignedSIMD( pRow + x ) ) );
+	}
+	grid.UpdateGhosts( y );
+}
+
+void CPoissonMultigrid::ResidualRow( PoissonGrid_t &grid, int y )
+{
+	const float *pRow = grid.Solution( y );
+	const float *pUp = grid.Solution( grid.WrapY( y - 1 ) );
+	const float *pDown = grid.Solution( grid.WrapY( y + 1 ) );
+	const float *pRHS = grid.RHS( y );
+	const uint32 *pFree = grid.Free( y );
+	float *pResidual = grid.Residual( y );
+
+	fltx4 four = ReplicateX4( 4.0f );
+	for ( int x = 0; x < grid.m_nWidth; x += 4 )
+	{
+		fltx4 sum = AddSIMD( LoadUnalignedSIMD( pRow + x - 1 ), LoadUnalignedSIMD( pRow + x + 1 ) );
+		sum = AddSIMD( sum, AddSIMD( LoadAlignedSIMD( pUp + x ), LoadAlignedSIMD( pDown + x ) ) );
+
+		// f - ( 4u - sum )
+		fltx4 residual = AddSIMD( LoadAlignedSIMD( pRHS + x ), MsubSIMD( four, LoadAlignedSIMD( pRow + x ), sum ) );
+		StoreAlignedSIMD( pResidual + x, AndSIMD( LoadAlignedSIMD( pFree + x ), residual ) );
+	}
+}
+
+void CPoissonMultigrid::CoarseResidualRow( PoissonGrid_t &grid, int y )
+{
+	const float *pRow = grid.Solution( y );
+	const float *pUp = grid.Solution( grid.WrapY( y - 1 ) );
+	const float *pDown = grid.Solution( grid.WrapY( y + 1 ) );
+	const float *pRHS = grid.RHS( y );
+	const float *pDiagonal = grid.Diagonal( y );
+	const float *pLinkUp = grid.Link( 0, y );
+	const float *pLinkLeft = grid.Link( 1, y );
+	const float *pLinkRight = grid.Link( 2, y );
+	const float *pLinkDown = grid.Link( 3, y );
+	const uint32 *pFree = grid.Free( y );
+	float *pResidual = grid.Residual( y );
+
+	for ( int x = 0; x < grid.m_nWidth; x += 4 )
+	{
+		fltx4 sum = MaddSIMD( LoadAlignedSIMD( pLinkUp + x ), LoadAlignedSIMD( pUp + x ), LoadAlignedSIMD( pRHS + x ) );
+		sum = MaddSIMD( LoadAlignedSIMD( pLinkLeft + x ), LoadUnalignedSIMD( pRow + x - 1 ), sum );
+		sum = MaddSIMD( LoadAlignedSIMD( pLinkRight + x ), LoadUnalignedSIMD( pRow + x + 1 ), sum );
+		sum = MaddSIMD( LoadAlignedSIMD( pLinkDown + x ), LoadAlignedSIMD( pDown + x ), sum );
+
+		// rhs + sum of links - diagonal * e
+		fltx4 residual = MsubSIMD( LoadAlignedSIMD( pDiagonal + x ), LoadAlignedSIMD( pRow + x ), sum );
+		StoreAlignedSIMD( pResidual + x, AndSIMD( LoadAlignedSIMD( pFree + x ), residual ) );
+	}
+}
+
+// The equations of the pixels a coarse pixel covers add up to its own, so do their residuals
+void CPoissonMultigrid::RestrictRow( PoissonGrid_t &grid, PoissonGrid_t &coarse, int y )
+{
+	const float *pFine0 = grid.Residual( 2 * y );
+	const float *pFine1 = ( 2 * y + 1 < grid.m_nHeight ) ? grid.Residual( 2 * y + 1 ) : NULL;
+	float *pRHS = coarse.RHS( y );
+	float *pSolution = coarse.Solution( y );
+	const uint32 *pFree = coarse.Free( y );
+	for ( int x = 0; x < coarse.m_nWidth; ++x )
+	{
+		int x0 = 2 * x;
+		int x1 = 2 * x + 1;
+		float flSum = pFine0[x0];
+		if ( x1 < grid.m_nWidth )
+		{
+			flSum += pFine0[x1];
+		}
+		if ( pFine1 )
+		{
+			flSum += pFine1[x0];
+			if ( x1 < grid.m_nWidth )
+			{
+				flSum += pFine1[x1];
+			}
+		}
+		pRHS[x] = pFree[x] ? flSum : 0.0f;
+		pSolution[x] = 0.0f;
+	}
+	coarse.UpdateGhosts( y );
+}
+
+// Bilinear, a fine pixel is a quarter of a coarse pixel away from the center of the one covering it
+void CPoissonMultigrid::ProlongRow( PoissonGrid_t &grid, PoissonGrid_t &coarse, int y )
+{
+	int cy = y >> 1;
+	int cyNear = coarse.WrapY( MIN( cy, coarse.m_nHeight - 1 ) );
+	int cyFar = coarse.WrapY( ( y & 1 ) ? cyNear + 1 : cyNear - 1 );
+	const float *pNear = coarse.Solution( cyNear );
+	const float *pFar = coarse.Solution( cyFar );
+
+	float *pRow = grid.Solution( y );
+	const uint32 *pFree = grid.Free( y );
+	for ( int x = 0; x < grid.m_nWidth; ++x )
+	{
+		if ( !pFree[x] )
+			continue;
+
+		int cx = MIN( x >> 1, coarse.m_nWidth - 1 );
+		int cxFar = coarse.WrapX( ( x & 1 ) ? cx + 1 : cx - 1 );
+		float flNear = 0.75f * pNear[cx] + 0.25f * pNear[cxFar];
+		float flFar = 0.75f * pFar[cx] + 0.25f * pFar[cxFar];
+		pRow[x] += 0.75f * flNear + 0.25f * flFar;
+	}
+	grid.UpdateGhosts( y );
+}
+
+void CPoissonMultigrid::Smooth( int nGrid )
+{
+	RunPass( POISSON_PASS_SMOOTH_RED, nGrid );
+	RunPass( POISSON_PASS_SMOOTH_BLACK, nGrid );
+}
+
+void CPoissonMultigrid::VCycle( int nGrid )
+{
+	if ( nGrid == m_Grids.Count() - 1 )
+	{
+		for ( int i = 0; i < POISSON_COARSEST_SWEEPS; ++i )
+		{
+			Smooth( nGrid );
+		}
+		return;
+	}
+
+	for ( int i = 0; i < POISSON_PRE_SMOOTH; ++i )
+	{
+		Smooth( nGrid );
+	}
+
+	RunPass( POISSON_PASS_RESIDUAL, nGrid );
+	RunPass( POISSON_PASS_RESTRICT, nGrid + 1 );
+	VCycle( nGrid + 1 );
+	RunPass( POISSON_PASS_PROLONG, nGrid );
+
+	for ( int i = 0; i < POISSON_POST_SMOOTH; ++i )
+	{
+		Smooth( nGrid );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Solves the poisson equation for the rgb of the image
+//-----------------------------------------------------------------------------
+void FloatBitMap_t::PoissonMultigrid( FloatBitMap_t * deltas[4], int nVCycles, uint32 flags )
+{
+	Assert( NumSlices() == 1 );
+	int nWidth = NumCols();
+	int nHeight = NumRows();
+	if ( nWidth <= 0 || nHeight <= 0 )
+		return;
+
+	CUtlVector< bool > free;
+	free.SetCount( nWidth * nHeight );
+	bool bAnyLocked = false;
+	for ( int y = 0; y < nHeight; ++y )
+	{
+		for ( int x = 0; x < nWidth; ++x )
+		{
+			free[ y * nWidth + x ] = ( Alpha( x, y, 0 ) != 0.0f );
+			bAnyLocked |= !free[ y * nWidth + x ];
+		}
+	}
+
+	CPoissonMultigrid solver( sm_pFBMThreadPool );
+	solver.Init( nWidth, nHeight, free.Base() );
+	PoissonGrid_t &grid = solver.Finest();
+
+	for ( int c = 0; c < 3; ++c )
+	{
+		float flMean = 0.0f;
+		for ( int y = 0; y < nHeight; ++y )
+		{
+			float *pSolution = grid.Solution( y );
+			float *pRHS = grid.RHS( y );
+			for ( int x = 0; x < nWidth; ++x )
+			{
+				pSolution[x] = Pixel( x, y, 0, c );
+				flMean += pSolution[x];
+
+				// The pixel minus each neighbor should match its delta, the four summed:
+				// 4 * p - sum of the neighbors = sum of the deltas
+				float flRHS = 0.0f;
+				for ( int i = 0; i < 4; ++i )
+				{
+					float flDelta = deltas[i]->Pixel( x, y, 0, c );
+					if ( flags & SPFLAGS_MAXGRADIENT )
+					{
+						float flGradient = pSolution[x] - PixelWrapped( x + s_nDeltaX[i], y + s_nDeltaY[i], 0, c );
+						if ( fabs( flGradient ) > fabs( flDelta ) )
+						{
+							flDelta = flGradient;
+						}
+					}
+					flRHS += flDelta;
+				}
+				pRHS[x] = free[ y * nWidth + x ] ? flRHS : 0.0f;
+			}
+			grid.UpdateGhosts( y );
+		}
+
+		for ( int i = 0; i < nVCycles; ++i )
+		{
+			solver.VCycle( 0 );
+		}
+
+		// With nothing locked only the differences between pixels are set, keep the average
+		float flShift = 0.0f;
+		if ( !bAnyLocked )
+		{
+			float flNewMean = 0.0f;
+			for ( int y = 0; y < nHeight; ++y )
+			{
+				const float *pSolution = grid.Solution( y );
+				for ( int x = 0; x < nWidth; ++x )
+				{
+					flNewMean += pSolution[x];
+				}
+			}
+			flShift = ( flMean - flNewMean ) / ( nWidth * nHeight );
+		}
+
+		for ( int y = 0; y < nHeight; ++y )
+		{
+			const float *pSolution = grid.Solution( y );
+			for ( int x = 0; x < nWidth; ++x )
+			{
+				Pixel( x, y, 0, c ) = pSolution[x] + flShift;
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Keeps the gradients of the image except across its edges, which are locked to the average of
+// the two sides so that they match when tiled
+//-----------------------------------------------------------------------------
+void FloatBitMap_t::MakeTileableMultigrid( void )
+{
+	int nWidth = NumCols();
+	int nHeight = NumRows();
+
+	FloatBitMap_t gradients[4];
+	FloatBitMap_t *pDeltas[4];
+	for ( int i = 0; i < 4; ++i )
+	{
+		gradients[i].Init( nWidth, nHeight, 1, FBM_ATTR_RGB_MASK );
+		pDeltas[i] = &gradients[i];
+	}
+
+	FloatBitMap_t work;
+	work.Init( nWidth, nHeight );
+	for ( int y = 0; y < nHeight; ++y )
+	{
+		for ( int x = 0; x < nWidth; ++x )
+		{
+			for ( int c = 0; c < 3; ++c )
+			{
+				float flValue = Pixel( x, y, 0, c );
+				work.Pixel( x, y, 0, c ) = flValue;
+				for ( int i = 0; i < 4; ++i )
+				{
+					int nx = x + s_nDeltaX[i];
+					int ny = y + s_nDeltaY[i];
+					bool bInside = ( nx >= 0 ) && ( nx < nWidth ) && ( ny >= 0 ) && ( ny < nHeight );
+					pDeltas[i]->Pixel( x, y, 0, c ) = bInside ? flValue - Pixel( nx, ny, 0, c ) : 0.0f;
+				}
+			}
+			work.Alpha( x, y, 0 ) = 1.0f;
+		}
+	}
+
+	for ( int x = 0; x < nWidth; ++x )
+	{
+		for ( int c = 0; c < 3; ++c )
+		{
+			float flEdge = 0.5f * ( work.Pixel( x, 0, 0, c ) + work.Pixel( x, nHeight - 1, 0, c ) );
+			work.Pixel( x, 0, 0, c ) = flEdge;
+			work.Pixel( x, nHeight - 1, 0, c ) = flEdge;
+		}
+		work.Alpha( x, 0, 0 ) = 0.0f;
+		work.Alpha( x, nHeight - 1, 0 ) = 0.0f;
+	}
+
+	for ( int y = 0; y < nHeight; ++y )
+	{
+		for ( int c = 0; c < 3; ++c )
+		{
+			float flEdge = 0.5f * ( work.Pixel( 0, y, 0, c ) + work.Pixel( nWidth - 1, y, 0, c ) );
+			work.Pixel( 0, y, 0, c ) = flEdge;
+			work.Pixel( nWidth - 1, y, 0, c ) = flEdge;
+		}
+		work.Alpha( 0, y, 0 ) = 0.0f;
+		work.Alpha( nWidth - 1, y, 0 ) = 0.0f;
+	}
+
+	work.PoissonMultigrid( pDeltas, POISSON_TILEABLE_VCYCLES, 0 );
+
+	for ( int y = 0; y < nHeight; ++y )
+	{
+		for ( int x = 0; x < nWidth; ++x )
+		{
+			for ( int c = 0; c < 3; ++c )
+			{
+				Pixel( x, y, 0, c ) = work.Pixel( x, y, 0, c );
+			}
+		}
+	}
+}
@@ -0,0 +1,392 @@
+//==================================================================================================
+//
+// Self shadowed bump maps and ambient occlusion marched through a height field
+//
+// Every texel is a box as tall as its height. A max mip pyramid stores the tallest box under each
+// cell of every level, so a ray that passes over a cell skips all of it and climbs a level, and a
+// ray that doesn't drops a level until it is down to single texels. Rays only go up, so the
+// lowest point of the ray over the rest of a cell is where it enters it.
+//
+// The rays of a texel are marched four at a time, one per lane. Only the height lookups are done
+// lane by lane, the stepping is SIMD.
+//
+//==================================================================================================
+
+#include <float.h>
+#include <math.h>
+
+#include "bitmap/floatbitmap.h"
+#include "mathlib/ssemath.h"
+#include "mathlib/halton.h"
+#include "mathlib/bumpvects.h"
+#include "vstdlib/jobthread.h"
+#include "tier1/utlvector.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// Rays start this far above their texel so they don't hit its own top
+#define SSBUMP_RAY_BIAS				0.01f
+
+// Rays still marching after this many steps are counted as unoccluded
+#define SSBUMP_MAX_STEPS			512
+
+// How far past a cell boundary a ray is moved so that it lands in the next cell
+#define SSBUMP_STEP_BIAS			( 1.0f / 1024.0f )
+
+// Rows handed to a thread at a time
+#define SSBUMP_ROWS_PER_JOB			4
+
+//-----------------------------------------------------------------------------
+// Four rays, one per lane
+//-----------------------------------------------------------------------------
+struct SSBumpRayGroup_t
+{
+	fltx4	m_DirX;					// Unit direction across the height field
+	fltx4	m_DirY;
+	fltx4	m_InvAbsDirX;			// Distance across per unit of x, large for rays along y
+	fltx4	m_InvAbsDirY;
+	fltx4	m_PositiveX;			// Masks of the lanes going towards +x and +y
+	fltx4	m_PositiveY;
+	fltx4	m_Slope;				// Height gained per unit of distance across
+	fltx4	m_Valid;				// Mask of the lanes holding a ray, the last group may be short
+	fltx4	m_BasisWeight[NUM_BUMP_VECTS];	// Light the ray brings along each bump basis vector
+	fltx4	m_AOWeight;				// Cosine to the flat surface normal
+};
+
+typedef CUtlVector< SSBumpRayGroup_t, CUtlMemoryAligned< SSBumpRayGroup_t, 16 > > SSBumpRayGroups_t;
+
+class CHeightFieldMarcher
+{
+public:
+	CHeightFieldMarcher( const FloatBitMap_t &height, float flBumpScale, int nRays, IThreadPool *pThreadPool );
+	~CHeightFieldMarcher();
+
+	// RGB along each bump basis vector, alpha the ambient occlusion, for all texels
+	void Trace( FloatBitMap_t *pResult );
+
+	void ProcessRows( FloatBitMap_t *pResult, int nFirstRow, int nRowCount );
+
+private:
+	void BuildPyramid();
+	void InitRays( int nRays );
+	fltx4 MarchRays( float flX, float flY, float flHeight, const SSBumpRayGroup_t &rays );
+
+	const FloatBitMap_t					&m_Height;
+	float								m_flBumpScale;
+	float								m_flMaxHeight;		// Of the whole height field, scaled
+	float								m_flMaxDistance;	// Rays stop after crossing a whole tile
+	IThreadPool							*m_pThreadPool;
+
+	// Level 0 is the scaled height itself, kept in alpha
+	FloatImagePyramid_t					m_Pyramid;
+	const float							*m_pLevelBase[MAX_IMAGE_PYRAMID_LEVELS];
+	int									m_nLevelStride[MAX_IMAGE_PYRAMID_LEVELS];
+
+	SSBumpRayGroups_t					m_Rays;
+	float								m_flTotalBasisWeight[NUM_BUMP_VECTS];
+	float								m_flTotalAOWeight;
+};
+
+CHeightFieldMarcher::CHeightFieldMarcher( const FloatBitMap_t &height, float flBumpScale, int nRays, IThreadPool *pThreadPool ) :
+	m_Height( height )
+{
+	m_flBumpScale = flBumpScale;
+	m_pThreadPool = pThreadPool;
+	m_flMaxDistance = MAX( height.NumCols(), height.NumRows() );
+	BuildPyramid();
+	InitRays( nRays );
+}
+
+CHeightFieldMarcher::~CHeightFieldMarcher()
+{
+	// The levels are ours, don't leave them for the pyramid to free
+	for ( int i = 0; i < m_Pyramid.m_nLevels; ++i )
+	{
+		delete m_Pyramid.m_pLevels[i];
+		m_Pyramid.m_pLevels[i] = NULL;
+	}
+	m_Pyramid.m_nLevels = 0;
+}
+
+// Cells of level n cover 2^n texels on a side, wrapping around the far edges where the size isn't
+// a multiple of that. Every level is taken straight from the texels so that holds exactly
+void CHeightFieldMarcher::BuildPyramid()
+{
+	int nCols = m_Height.NumCols();
+	int nRows = m_Height.NumRows();
+
+	m_flMaxHeight = -FLT_MAX;
+	for ( int nLevel = 0; nLevel < MAX_IMAGE_PYRAMID_LEVELS; ++nLevel )
+	{
+		int nCellSize = 1 << nLevel;
+		int nLevelCols = ( nCols + nCellSize - 1 ) >> nLevel;
+		int nLevelRows = ( nRows + nCellSize - 1 ) >> nLevel;
+
+		FloatBitMap_t *pLevel = new FloatBitMap_t;
+		pLevel->Init( nLevelCols, nLevelRows, 1, FBM_ATTR_ALPHA_MASK );
+		for ( int cy = 0; cy < nLevelRows; ++cy )
+		{
+			float *pOut = pLevel->RowPtr<float>( FBM_ATTR_ALPHA, cy );
+			for ( int cx = 0; cx < nLevelCols; ++cx )
+			{
+				float flMax = -FLT_MAX;
+				for ( int y = cy * nCellSize; y < ( cy + 1 ) * nCellSize; ++y )
+				{
+					const float *pIn = m_Height.RowPtr<float>( FBM_ATTR_ALPHA, y % nRows );
+					for ( int x = cx * nCellSize; x < ( cx + 1 ) * nCellSize; ++x )
+					{
+						flMax = MAX( flMax, pIn[ x % nCols ] );
+					}
+				}
+				pOut[cx] = m_flBumpScale * flMax;
+			}
+		}
+
+		m_pLevelBase[nLevel] = pLevel->RowPtr<float>( FBM_ATTR_ALPHA, 0 );
+		m_nLevelStride[nLevel] = ( nLevelRows > 1 ) ? pLevel->RowPtr<float>( FBM_ATTR_ALPHA, 1 ) - m_pLevelBase[nLevel] : 0;
+		m_Pyramid.m_pLevels[nLevel] = pLevel;
+		m_Pyramid.m_nLevels = nLevel + 1;
+
+		if ( nLevelCols == 1 && nLevelRows == 1 )
+		{
+			m_flMaxHeight = m_pLevelBase[nLevel][0];
+			break;
+		}
+	}
+}
+
+void CHeightFieldMarcher::InitRays( int nRays )
+{
+	int nGroups = ( nRays + 3 ) / 4;
+	m_Rays.SetCount( nGroups );
+	memset( m_flTotalBasisWeight, 0, sizeof( m_flTotalBasisWeight ) );
+	m_flTotalAOWeight = 0.0f;
+
+	DirectionalSampler_t sampler;
+	for ( int i = 0; i < nGroups * 4; ++i )
+	{
+		SSBumpRayGroup_t &group = m_Rays[ i / 4 ];
+		int nLane = i & 3;
+
+		Vector dir = sampler.NextValue();
+		dir.z = fabs( dir.z );							// upper hemisphere
+		bool bValid = ( i < nRays );
+
+		float flAcross = sqrtf( dir.x * dir.x + dir.y * dir.y );
+		if ( flAcross > 1e-4f )
+		{
+			SubFloat( group.m_DirX, nLane ) = dir.x / flAcross;
+			SubFloat( group.m_DirY, nLane ) = dir.y / flAcross;
+			SubFloat( group.m_Slope, nLane ) = dir.z / flAcross;
+		}
+		else
+		{
+			// Straight up, it leaves the height field before it goes anywhere
+			SubFloat( group.m_DirX, nLane ) = 0.0f;
+			SubFloat( group.m_DirY, nLane ) = 0.0f;
+			SubFloat( group.m_Slope, nLane ) = 1e4f;
+		}
+
+		float flDirX = SubFloat( group.m_DirX, nLane );
+		float flDirY = SubFloat( group.m_DirY, nLane );
+		SubFloat( group.m_InvAbsDirX, nLane ) = ( fabs( flDirX ) > 1e-4f ) ? 1.0f / fabs( flDirX ) : 1e4f;
+		SubFloat( group.m_InvAbsDirY, nLane ) = ( fabs( flDirY ) > 1e-4f ) ? 1.0f / fabs( flDirY ) : 1e4f;
+		SubInt( group.m_PositiveX, nLane ) = ( flDirX > 0.0f ) ? ~0 : 0;
+		SubInt( group.m_PositiveY, nLane ) = ( flDirY > 0.0f ) ? ~0 : 0;
+		SubInt( group.m_Valid, nLane ) = bValid ? ~0 : 0;
+
+		for ( int b = 0; b < NUM_BUMP_VECTS; ++b )
+		{
+			const TableVector &basis = g_localBumpBasis[b];
+			float flWeight = bValid ? MAX( 0.0f, dir.x * basis[0] + dir.y * basis[1] + dir.z * basis[2] ) : 0.0f;
+			SubFloat( group.m_BasisWeight[b], nLane ) = flWeight;
+			m_flTotalBasisWeight[b] += flWeight;
+		}
+		SubFloat( group.m_AOWeight, nLane ) = bValid ? dir.z : 0.0f;
+		m_flTotalAOWeight += bValid ? dir.z : 0.0f;
+	}
+}
+
+// Returns the mask of the lanes whose ray hits the height field
+fltx4 CHeightFieldMarcher::MarchRays( float flX, float flY, float flHeight, const SSBumpRayGroup_t &rays )
+{
+	int nCols = m_Height.NumCols();
+	int nRows = m_Height.NumRows();
+
+	fltx4 originX = ReplicateX4( flX );
+	fltx4 originY = ReplicateX4( flY );
+	fltx4 originHeight = ReplicateX4( flHeight );
+	fltx4 width = ReplicateX4( (float)nCols );
+	fltx4 height = ReplicateX4( (float)nRows );
+	fltx4 invWidth = ReplicateX4( 1.0f / nCols );
+	fltx4 invHeight = ReplicateX4( 1.0f / nRows );
+	fltx4 maxHeight = ReplicateX4( m_flMaxHeight );
+	fltx4 maxDistance = ReplicateX4( m_flMaxDistance );
+	fltx4 topLevel = ReplicateX4( (float)( m_Pyramid.m_nLevels - 1 ) );
+
+	// FloorSIMD only rounds down for positive values, positions are moved by this many tiles
+	// before they are wrapped so that they never go below 0
+	fltx4 tilesX = ReplicateX4( ceilf( m_flMaxDistance / nCols ) + 1.0f );
+	fltx4 tilesY = ReplicateX4( ceilf( m_flMaxDistance / nRows ) + 1.0f );
+	fltx4 stepBias = ReplicateX4( SSBUMP_STEP_BIAS );
+
+	fltx4 distance = Four_Zeros;
+	fltx4 level = Four_Zeros;
+	fltx4 active = rays.m_Valid;
+	fltx4 hit = Four_Zeros;
+
+	for ( int nStep = 0; nStep < SSBUMP_MAX_STEPS && !IsAllZeros( active ); ++nStep )
+	{
+		fltx4 x = MaddSIMD( distance, rays.m_DirX, originX );
+		fltx4 y = MaddSIMD( distance, rays.m_DirY, originY );
+		x = SubSIMD( x, MulSIMD( width, SubSIMD( FloorSIMD( MaddSIMD( x, invWidth, tilesX ) ), tilesX ) ) );
+		y = SubSIMD( y, MulSIMD( height, SubSIMD( FloorSIMD( MaddSIMD( y, invHeight, tilesY ) ), tilesY ) ) );
+		x = MaxSIMD( x, Four_Zeros );
+		y = MaxSIMD( y, Four_Zeros );
+
+		// Tallest texel of the cell each ray is in, and the cell size
+		fltx4 cellMax = Four_Zeros;
+		fltx4 cellSize = Four_Ones;
+		for ( int i = 0; i < 4; ++i )
+		{
+			if ( !SubInt( active, i ) )
+				continue;
+
+			int nLevel = (int)SubFloat( level, i );
+			int nX = clamp( (int)SubFloat( x, i ), 0, nCols - 1 ) >> nLevel;
+			int nY = clamp( (int)SubFloat( y, i ), 0, nRows - 1 ) >> nLevel;
+			SubFloat( cellMax, i ) = m_pLevelBase[nLevel][ nY * m_nLevelStride[nLevel] + nX ];
+			SubFloat( cellSize, i ) = (float)( 1 << nLevel );
+		}
+
+		fltx4 rayHeight = MaddSIMD( distance, rays.m_Slope, originHeight );
+		fltx4 over = CmpGtSIMD( rayHeight, cellMax );
+
+		// Distance to the side of the cell the ray leaves through
+		fltx4 invCellSize = ReciprocalSIMD( cellSize );
+		fltx4 cellX = MulSIMD( FloorSIMD( MulSIMD( x, invCellSize ) ), cellSize );
+		fltx4 cellY = MulSIMD( FloorSIMD( MulSIMD( y, invCellSize ) ), cellSize );
+		fltx4 toEdgeX = MaskedAssign( rays.m_PositiveX, SubSIMD( AddSIMD( cellX, cellSize ), x ), SubSIMD( x, cellX ) );
+		fltx4 toEdgeY = MaskedAssign( rays.m_PositiveY, SubSIMD( AddSIMD( cellY, cellSize ), y ), SubSIMD( y, cellY ) );
+		fltx4 toEdge = MinSIMD( MulSIMD( toEdgeX, rays.m_InvAbsDirX ), MulSIMD( toEdgeY, rays.m_InvAbsDirY ) );
+
+		// Over the cell: skip it, and try a bigger one when that also takes the ray into the next
+		// cell of the level above. Under it: look at the smaller cells inside, or stop if it
+		// already is a texel
+		fltx4 step = AddSIMD( toEdge, stepBias );
+		fltx4 invParentSize = MulSIMD( invCellSize, Four_PointFives );
+		fltx4 parentX = FloorSIMD( MaddSIMD( x, invParentSize, Four_Ones ) );
+		fltx4 parentY = FloorSIMD( MaddSIMD( y, invParentSize, Four_Ones ) );
+		fltx4 nextParentX = FloorSIMD( MaddSIMD( MaddSIMD( step, rays.m_DirX, x ), invParentSize, Four_Ones ) );
+		fltx4 nextParentY = FloorSIMD( MaddSIMD( MaddSIMD( step, rays.m_DirY, y ), invParentSize, Four_Ones ) );
+		fltx4 climb = AndNotSIMD( AndSIMD( CmpEqSIMD( parentX, nextParentX ), CmpEqSIMD( parentY, nextParentY ) ), over );
+
+		fltx4 advance = AndSIMD( active, over );
+		distance = MaskedAssign( advance, AddSIMD( distance, step ), distance );
+		level = MaskedAssign( climb, MinSIMD( AddSIMD( level, Four_Ones ), topLevel ), MaskedAssign( over, level, SubSIMD( level, Four_Ones ) ) );
+
+		fltx4 blocked = AndNotSIMD( over, AndSIMD( active, CmpEqSIMD( cellSize, Four_Ones ) ) );
+		hit = OrSIMD( hit, blocked );
+
+		// Above everything, or around the whole tile
+		fltx4 escaped = OrSIMD( CmpGtSIMD( MaddSIMD( distance, rays.m_Slope, originHeight ), maxHeight ), CmpGtSIMD( distance, maxDistance ) );
+		active = AndNotSIMD( OrSIMD( blocked, escaped ), active );
+	}
+
+	return hit;
+}
+
+void CHeightFieldMarcher::Trace( FloatBitMap_t *pResult )
+{
+	int nRows = m_Height.NumRows();
+	int nJobs = ( nRows + SSBUMP_ROWS_PER_JOB - 1 ) / SSBUMP_ROWS_PER_JOB;
+	if ( !m_pThreadPool || nJobs <= 1 )
+	{
+		ProcessRows( pResult, 0, nRows );
+	}
+	else
+	{
+		ParallelLoopProcessChunks( m_pThreadPool, pResult, 0, nRows, nJobs, this, &CHeightFieldMarcher::ProcessRows );
+	}
+}
+
+void CHeightFieldMarcher::ProcessRows( FloatBitMap_t *pResult, int nFirstRow, int nRowCount )
+{
+	int nCols = m_Height.NumCols();
+	const float *pLevel0 = m_pLevelBase[0];
+	for ( int y = nFirstRow; y < nFirstRow + nRowCount; ++y )
+	{
+		for ( int x = 0; x < nCols; ++x )
+		{
+			float flHeight = pLevel0[ y * m_nLevelStride[0] + x ] + SSBUMP_RAY_BIAS;
+
+			fltx4 basisSum[NUM_BUMP_VECTS] = { Four_Zeros, Four_Zeros, Four_Zeros };
+			fltx4 aoSum = Four_Zeros;
+			for ( int i = 0; i < m_Rays.Count(); ++i )
+			{
+				const SSBumpRayGroup_t &rays = m_Rays[i];
+				fltx4 hit = MarchRays( x + 0.5f, y + 0.5f, flHeight, rays );
+				for ( int b = 0; b < NUM_BUMP_VECTS; ++b )
+				{
+					basisSum[b] = AddSIMD( basisSum[b], AndNotSIMD( hit, rays.m_BasisWeight[b] ) );
+				}
+				aoSum = AddSIMD( aoSum, AndNotSIMD( hit, rays.m_AOWeight ) );
+			}
+
+			for ( int b = 0; b < NUM_BUMP_VECTS; ++b )
+			{
+				float flSum = SubFloat( basisSum[b], 0 ) + SubFloat( basisSum[b], 1 ) + SubFloat( basisSum[b], 2 ) + SubFloat( basisSum[b], 3 );
+				pResult->Pixel( x, y, 0, b ) = flSum / m_flTotalBasisWeight[b];
+			}
+			float flAO = SubFloat( aoSum, 0 ) + SubFloat( aoSum, 1 ) + SubFloat( aoSum, 2 ) + SubFloat( aoSum, 3 );
+			pResult->Pixel( x, y, 0, FBM_ATTR_ALPHA ) = flAO / m_flTotalAOWeight;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Each of RGB is the part of the light along its bump basis vector that isn't blocked, 1 for a
+// flat unshadowed surface. Ambient occlusion is the cosine weighted part of the sky that is seen
+//-----------------------------------------------------------------------------
+FloatBitMap_t *FloatBitMap_t::ComputeSelfShadowedBumpmapFromHeightInAlphaChannelMarched(
+	float bump_scale, int nrays_to_trace_per_pixel, uint32 nOptionFlags, FloatBitMap_t *pMRAO ) const
+{
+	Assert( !pMRAO || ( pMRAO->NumCols() == NumCols() && pMRAO->NumRows() == NumRows() ) );
+
+	FloatBitMap_t *pRet = new FloatBitMap_t( NumCols(), NumRows() );
+	CHeightFieldMarcher marcher( *this, bump_scale, MAX( 1, nrays_to_trace_per_pixel ), sm_pFBMThreadPool );
+	marcher.Trace( pRet );
+
+	for ( int y = 0; y < NumRows(); ++y )
+	{
+		for ( int x = 0; x < NumCols(); ++x )
+		{
+			float flAO = pRet->Pixel( x, y, 0, FBM_ATTR_ALPHA );
+			if ( pMRAO )
+			{
+				pMRAO->Pixel( x, y, 0, FBM_ATTR_BLUE ) = flAO;
+			}
+
+			if ( nOptionFlags & SSBUMP_OPTION_NONDIRECTIONAL )
+			{
+				pRet->Pixel( x, y, 0, FBM_ATTR_RED ) = flAO;
+				pRet->Pixel( x, y, 0, FBM_ATTR_GREEN ) = flAO;
+				pRet->Pixel( x, y, 0, FBM_ATTR_BLUE ) = flAO;
+			}
+
+			if ( ( nOptionFlags & SSBUMP_MOD2X_DETAIL_TEXTURE ) && HasAllocatedMemory( FBM_ATTR_BLUE ) )
+			{
+				float flLuminance = 0.299f * Pixel( x, y, 0, FBM_ATTR_RED ) + 0.587f * Pixel( x, y, 0, FBM_ATTR_GREEN ) + 0.114f * Pixel( x, y, 0, FBM_ATTR_BLUE );
+				for ( int c = 0; c < 3; ++c )
+				{
+					pRet->Pixel( x, y, 0, c ) *= 0.5f * flLuminance;
+				}
+			}
+
+			pRet->Pixel( x, y, 0, FBM_ATTR_ALPHA ) = 1.0f;
+		}
+	}
+
+	return pRet;
+}
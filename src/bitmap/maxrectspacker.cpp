@@ -0,0 +1,420 @@
+//==================================================================================================
+//
+// MaxRects texture atlas packer
+//
+// A placed texture splits every free rectangle it overlaps into the up to four strips around it,
+// then free rectangles contained in another one are dropped. Removing a texture gives its space
+// back as a free rectangle and joins it with the free rectangles around it, so the cost follows
+// the free list near the hole rather than the number of textures on the page.
+//
+//==================================================================================================
+
+#include "bitmap/maxrectspacker.h"
+#include "tier1/utlvector.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+
+//-----------------------------------------------------------------------------
+// Rectangle helpers
+//-----------------------------------------------------------------------------
+static inline bool RectContains( const Rect_t &outer, const Rect_t &inner )
+{
+	return ( inner.x >= outer.x ) && ( inner.y >= outer.y ) &&
+		( inner.x + inner.width <= outer.x + outer.width ) &&
+		( inner.y + inner.height <= outer.y + outer.height );
+}
+
+static inline bool RectsOverlap( const Rect_t &a, const Rect_t &b )
+{
+	return ( a.x < b.x + b.width ) && ( b.x < a.x + a.width ) &&
+		( a.y < b.y + b.height ) && ( b.y < a.y + a.height );
+}
+
+
+//-----------------------------------------------------------------------------
+// Constructor, destructor
+//-----------------------------------------------------------------------------
+CMaxRectsTexturePacker::CMaxRectsTexturePacker( int texWidth, int texHeight, int pixelGap, bool bAllowRotation )
+{
+	m_PageWidth = texWidth;
+	m_PageHeight = texHeight;
+	m_PixelGap = pixelGap;
+	m_bAllowRotation = bAllowRotation;
+	Clear();
+}
+
+CMaxRectsTexturePacker::~CMaxRectsTexturePacker()
+{
+}
+
+
+//-----------------------------------------------------------------------------
+// Empties the page. The free area runs a gap past the page edges so the gap
+// kept after each texture can fall off the page
+//-----------------------------------------------------------------------------
+void CMaxRectsTexturePacker::Clear()
+{
+	m_Entries.RemoveAll();
+	m_UnusedEntries.RemoveAll();
+	m_FreeRects.RemoveAll();
+	m_nUsedArea = 0;
+
+	Rect_t page;
+	page.x = 0;
+	page.y = 0;
+	page.width = m_PageWidth + m_PixelGap;
+	page.height = m_PageHeight + m_PixelGap;
+	m_FreeRects.AddToTail( page );
+}
+
+
+//-----------------------------------------------------------------------------
+// Best short side fit: the free rectangle leaving the smallest leftover along
+// its shorter side wins, ties go to the smaller leftover along the longer one
+//-----------------------------------------------------------------------------
+bool CMaxRectsTexturePacker::FindPosition( int nWidth, int nHeight, Rect_t *pRect, bool *pRotated ) const
+{
+	int nBestShort = INT_MAX;
+	int nBestLong = INT_MAX;
+	int nOrientations = ( m_bAllowRotation && nWidth != nHeight ) ? 2 : 1;
+
+	for ( int i = 0; i < m_FreeRects.Count(); ++i )
+	{
+		const Rect_t &free = m_FreeRects[i];
+		for ( int o = 0; o < nOrientations; ++o )
+		{
+			int w = o ? nHeight : nWidth;
+			int h = o ? nWidth : nHeight;
+			if ( w > free.width || h > free.height )
+				continue;
+
+			int nLeftX = free.width - w;
+			int nLeftY = free.height - h;
+			int nShort = MIN( nLeftX, nLeftY );
+			int nLong = MAX( nLeftX, nLeftY );
+			if ( nShort < nBestShort || ( nShort == nBestShort && nLong < nBestLong ) )
+			{
+				nBestShort = nShort;
+				nBestLong = nLong;
+				pRect->x = free.x;
+				pRect->y = free.y;
+				pRect->width = w;
+				pRect->height = h;
+				*pRotated = ( o != 0 );
+			}
+		}
+	}
+
+	return nBestShort != INT_MAX;
+}
+
+
+//-----------------------------------------------------------------------------
+// Adds a free rectangle unless it is empty
+//-----------------------------------------------------------------------------
+void CMaxRectsTexturePacker::AddFreeRect( const Rect_t &rect )
+{
+	if ( rect.width > 0 && rect.height > 0 )
+	{
+		m_FreeRects.AddToTail( rect );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Splits every free rectangle the used one overlaps into the strips left of,
+// right of, above and below it. Only the pieces from this split can be
+// contained in something else, the older ones were pruned already
+//-----------------------------------------------------------------------------
+void CMaxRectsTexturePacker::Place( const Rect_t &used )
+{
+	int nOldCount = m_FreeRects.Count();
+	int nKept = 0;
+	for ( int i = 0; i < nOldCount; ++i )
+	{
+		Rect_t free = m_FreeRects[i];
+		if ( !RectsOverlap( free, used ) )
+		{
+			m_FreeRects[nKept++] = free;
+			continue;
+		}
+
+		Rect_t piece;
+		if ( used.x > free.x )
+		{
+			piece = free;
+			piece.width = used.x - free.x;
+			AddFreeRect( piece );
+		}
+		if ( used.x + used.width < free.x + free.width )
+		{
+			piece = free;
+			piece.x = used.x + used.width;
+			piece.width = free.x + free.width - piece.x;
+			AddFreeRect( piece );
+		}
+		if ( used.y > free.y )
+		{
+			piece = free;
+			piece.height = used.y - free.y;
+			AddFreeRect( piece );
+		}
+		if ( used.y + used.height < free.y + free.height )
+		{
+			piece = free;
+			piece.y = used.y + used.height;
+			piece.height = free.y + free.height - piece.y;
+			AddFreeRect( piece );
+		}
+	}
+
+	// Close the hole left by the split rectangles, the new pieces go right after the kept ones
+	int nNew = m_FreeRects.Count() - nOldCount;
+	for ( int i = 0; i < nNew; ++i )
+	{
+		m_FreeRects[nKept + i] = m_FreeRects[nOldCount + i];
+	}
+	m_FreeRects.RemoveMultipleFromTail( nOldCount - nKept );
+
+	PruneFreeRects( nKept );
+}
+
+
+//-----------------------------------------------------------------------------
+// Drops the free rectangles from nFirstNew on that lie inside another one, and
+// the older ones that lie inside one of those. Dropped ones are marked with a
+// zero width first so the indices hold until the list is compacted
+//-----------------------------------------------------------------------------
+void CMaxRectsTexturePacker::PruneFreeRects( int nFirstNew )
+{
+	int nCount = m_FreeRects.Count();
+	for ( int i = nFirstNew; i < nCount; ++i )
+	{
+		for ( int j = 0; j < nCount && m_FreeRects[i].width; ++j )
+		{
+			if ( i == j || !m_FreeRects[j].width )
+				continue;
+
+			// Of two equal rectangles only the later one goes
+			if ( RectContains( m_FreeRects[j], m_FreeRects[i] ) && ( j < i || !RectContains( m_FreeRects[i], m_FreeRects[j] ) ) )
+			{
+				m_FreeRects[i].width = 0;
+			}
+			else if ( RectContains( m_FreeRects[i], m_FreeRects[j] ) )
+			{
+				m_FreeRects[j].width = 0;
+			}
+		}
+	}
+
+	int nKept = 0;
+	for ( int i = 0; i < nCount; ++i )
+	{
+		if ( m_FreeRects[i].width )
+		{
+			m_FreeRects[nKept++] = m_FreeRects[i];
+		}
+	}
+	m_FreeRects.RemoveMultipleFromTail( nCount - nKept );
+}
+
+
+//-----------------------------------------------------------------------------
+// Inserts a texture, returns the entry index or -1 when it doesn't fit
+//-----------------------------------------------------------------------------
+int CMaxRectsTexturePacker::InsertRect( const Rect_t& texRect, int nodeIndex )
+{
+	if ( texRect.width <= 0 || texRect.height <= 0 )
+		return -1;
+
+	Rect_t used;
+	bool bRotated;
+	if ( !FindPosition( texRect.width + m_PixelGap, texRect.height + m_PixelGap, &used, &bRotated ) )
+		return -1;
+
+	Place( used );
+
+	TreeEntry_t entry;
+	entry.rc.x = used.x;
+	entry.rc.y = used.y;
+	entry.rc.width = used.width - m_PixelGap;
+	entry.rc.height = used.height - m_PixelGap;
+	entry.bInUse = true;
+	entry.bRotated = bRotated;
+	m_nUsedArea += texRect.width * texRect.height;
+
+	if ( m_UnusedEntries.Count() )
+	{
+		int nIndex = m_UnusedEntries.Tail();
+		m_UnusedEntries.RemoveMultipleFromTail( 1 );
+		m_Entries[nIndex] = entry;
+		return nIndex;
+	}
+	return m_Entries.AddToTail( entry );
+}
+
+
+//-----------------------------------------------------------------------------
+// Batch insertion, largest first
+//-----------------------------------------------------------------------------
+struct PackerBatchRect_t
+{
+	int m_nArea;
+	int m_nLongSide;
+	int m_nIndex;
+};
+
+static int __cdecl CompareBatchRects( const PackerBatchRect_t *pA, const PackerBatchRect_t *pB )
+{
+	if ( pA->m_nArea != pB->m_nArea )
+		return ( pA->m_nArea > pB->m_nArea ) ? -1 : 1;
+	if ( pA->m_nLongSide != pB->m_nLongSide )
+		return ( pA->m_nLongSide > pB->m_nLongSide ) ? -1 : 1;
+
+	// Keeps the order stable so the same input always packs the same way
+	return pA->m_nIndex - pB->m_nIndex;
+}
+
+int CMaxRectsTexturePacker::InsertRects( const Rect_t *pTexRects, int nCount, int *pIndicesOut )
+{
+	CUtlVector< PackerBatchRect_t > order;
+	order.SetCount( nCount );
+	for ( int i = 0; i < nCount; ++i )
+	{
+		order[i].m_nArea = pTexRects[i].width * pTexRects[i].height;
+		order[i].m_nLongSide = MAX( pTexRects[i].width, pTexRects[i].height );
+		order[i].m_nIndex = i;
+	}
+	order.Sort( CompareBatchRects );
+
+	int nInserted = 0;
+	for ( int i = 0; i < nCount; ++i )
+	{
+		int nIndex = order[i].m_nIndex;
+		pIndicesOut[nIndex] = InsertRect( pTexRects[nIndex] );
+		if ( pIndicesOut[nIndex] >= 0 )
+		{
+			++nInserted;
+		}
+	}
+	return nInserted;
+}
+
+
+//-----------------------------------------------------------------------------
+// Joins two free rectangles along one axis: their combined extent along it
+// times their overlap along the other. Everything in the result lies in one
+// of the two as long as their extents along the joining axis touch or overlap
+//-----------------------------------------------------------------------------
+static bool JoinRects( const Rect_t &a, const Rect_t &b, bool bAlongX, Rect_t *pJoined )
+{
+	int aStart = bAlongX ? a.x : a.y;
+	int aEnd = aStart + ( bAlongX ? a.width : a.height );
+	int bStart = bAlongX ? b.x : b.y;
+	int bEnd = bStart + ( bAlongX ? b.width : b.height );
+	if ( aStart > bEnd || bStart > aEnd )
+		return false;
+
+	int aCrossStart = bAlongX ? a.y : a.x;
+	int aCrossEnd = aCrossStart + ( bAlongX ? a.height : a.width );
+	int bCrossStart = bAlongX ? b.y : b.x;
+	int bCrossEnd = bCrossStart + ( bAlongX ? b.height : b.width );
+	int nCrossStart = MAX( aCrossStart, bCrossStart );
+	int nCrossEnd = MIN( aCrossEnd, bCrossEnd );
+	if ( nCrossEnd <= nCrossStart )
+		return false;
+
+	int nStart = MIN( aStart, bStart );
+	int nEnd = MAX( aEnd, bEnd );
+	pJoined->x = bAlongX ? nStart : nCrossStart;
+	pJoined->y = bAlongX ? nCrossStart : nStart;
+	pJoined->width = bAlongX ? nEnd - nStart : nCrossEnd - nCrossStart;
+	pJoined->height = bAlongX ? nCrossEnd - nCrossStart : nEnd - nStart;
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Gives a freed rectangle back to the page. Every free rectangle that grows out
+// of it reaches into it, so only joins that overlap it are followed; the rest
+// of the free list was maximal already. Joins are made with the older free
+// rectangles and with each other, which covers a hole bridging two free ones
+//-----------------------------------------------------------------------------
+void CMaxRectsTexturePacker::AddFreedRect( const Rect_t &freed )
+{
+	int nFirstNew = m_FreeRects.Count();
+	m_FreeRects.AddToTail( freed );
+
+	for ( int i = nFirstNew; i < m_FreeRects.Count(); ++i )
+	{
+		for ( int j = 0; j < m_FreeRects.Count(); ++j )
+		{
+			if ( i == j )
+				continue;
+
+			// Copies, adding to the list can move it
+			Rect_t a = m_FreeRects[i];
+			Rect_t b = m_FreeRects[j];
+			for ( int nAxis = 0; nAxis < 2; ++nAxis )
+			{
+				Rect_t joined;
+				if ( !JoinRects( a, b, nAxis == 0, &joined ) || !RectsOverlap( joined, freed ) )
+					continue;
+				if ( RectContains( a, joined ) || RectContains( b, joined ) )
+					continue;
+
+				bool bKnown = false;
+				for ( int k = 0; k < m_FreeRects.Count() && !bKnown; ++k )
+				{
+					bKnown = RectContains( m_FreeRects[k], joined );
+				}
+				if ( !bKnown )
+				{
+					m_FreeRects.AddToTail( joined );
+				}
+			}
+		}
+	}
+
+	PruneFreeRects( nFirstNew );
+}
+
+
+//-----------------------------------------------------------------------------
+// Removes a texture and gives its space, gap included, back to the free list
+//-----------------------------------------------------------------------------
+bool CMaxRectsTexturePacker::RemoveRect( int nodeIndex )
+{
+	if ( !m_Entries.IsValidIndex( nodeIndex ) || !m_Entries[nodeIndex].bInUse )
+		return false;
+
+	TreeEntry_t &removed = m_Entries[nodeIndex];
+	removed.bInUse = false;
+	m_nUsedArea -= removed.rc.width * removed.rc.height;
+	m_UnusedEntries.AddToTail( nodeIndex );
+
+	// The last one out leaves the whole page
+	if ( m_UnusedEntries.Count() == m_Entries.Count() )
+	{
+		Clear();
+		return true;
+	}
+
+	Rect_t freed = removed.rc;
+	freed.width += m_PixelGap;
+	freed.height += m_PixelGap;
+	AddFreedRect( freed );
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Share of the page covered by textures
+//-----------------------------------------------------------------------------
+float CMaxRectsTexturePacker::GetOccupancy() const
+{
+	int nPageArea = m_PageWidth * m_PageHeight;
+	return ( nPageArea > 0 ) ? (float)m_nUsedArea / (float)nPageArea : 0.0f;
+}
@@ -0,0 +1,576 @@
+//==================================================================================================
+//
+// Mip chains for PBR texture sets
+//
+// Each mip is filtered from the linear working copy of the one above it with a separable tent
+// filter as wide as two texels of the smaller mip, which is the [1 3 3 1] kernel for power of two
+// sizes. Columns are filtered first, four texels at a time across the row, then rows.
+//
+//==================================================================================================
+
+#include <math.h>
+
+#include "bitmap/mipchain.h"
+#include "mathlib/ssemath.h"
+#include "vstdlib/jobthread.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// A tent as wide as two destination texels covers at most 2 * 3 + 2 texels, when a side of 3 goes to 1
+#define MIPCHAIN_MAX_TAPS			8
+
+// Rows of a mip handed to a thread at a time
+#define MIPCHAIN_ROWS_PER_JOB		16
+
+// Iterations of the search for the alpha test reference that keeps the coverage of mip 0
+#define MIPCHAIN_COVERAGE_STEPS		10
+
+// Normals averaged to nearly nothing, their variance is clamped rather than infinite
+#define MIPCHAIN_MIN_NORMAL_LENGTH	( 1.0f / 64.0f )
+
+//-----------------------------------------------------------------------------
+// sRGB transfer functions
+//-----------------------------------------------------------------------------
+static inline float SRGBToLinear( float flValue )
+{
+	if ( flValue <= 0.04045f )
+		return MAX( flValue, 0.0f ) * ( 1.0f / 12.92f );
+	return powf( ( MIN( flValue, 1.0f ) + 0.055f ) * ( 1.0f / 1.055f ), 2.4f );
+}
+
+static inline float LinearToSRGB( float flValue )
+{
+	if ( flValue <= 0.0031308f )
+		return MAX( flValue, 0.0f ) * 12.92f;
+	return 1.055f * powf( MIN( flValue, 1.0f ), 1.0f / 2.4f ) - 0.055f;
+}
+
+//-----------------------------------------------------------------------------
+// Source texels and weights of one destination texel along one axis
+//-----------------------------------------------------------------------------
+struct MipFilterTaps_t
+{
+	int		m_nCount;
+	int		m_nIndex[MIPCHAIN_MAX_TAPS];
+	float	m_flWeight[MIPCHAIN_MAX_TAPS];
+};
+
+static void ComputeFilterTaps( int nSrcSize, int nDstSize, bool bClamp, CUtlVector< MipFilterTaps_t > &taps )
+{
+	taps.SetCount( nDstSize );
+	float flScale = (float)nSrcSize / (float)nDstSize;
+	for ( int i = 0; i < nDstSize; ++i )
+	{
+		MipFilterTaps_t &tap = taps[i];
+		tap.m_nCount = 0;
+
+		float flCenter = ( i + 0.5f ) * flScale;
+		int nFirst = (int)floorf( flCenter - flScale );
+		int nLast = (int)ceilf( flCenter + flScale );
+		float flTotal = 0.0f;
+		for ( int j = nFirst; j <= nLast && tap.m_nCount < MIPCHAIN_MAX_TAPS; ++j )
+		{
+			float flWeight = 1.0f - fabsf( j + 0.5f - flCenter ) / flScale;
+			if ( flWeight <= 0.0f )
+				continue;
+
+			int nIndex = j;
+			if ( bClamp )
+			{
+				nIndex = clamp( j, 0, nSrcSize - 1 );
+			}
+			else
+			{
+				nIndex = ( ( j % nSrcSize ) + nSrcSize ) % nSrcSize;
+			}
+			tap.m_nIndex[tap.m_nCount] = nIndex;
+			tap.m_flWeight[tap.m_nCount] = flWeight;
+			++tap.m_nCount;
+			flTotal += flWeight;
+		}
+
+		for ( int j = 0; j < tap.m_nCount; ++j )
+		{
+			tap.m_flWeight[j] /= flTotal;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Runs each step of building a mip over bands of rows
+//-----------------------------------------------------------------------------
+enum MipChainPass_t
+{
+	MIPCHAIN_PASS_DECODE = 0,		// Stored values to the linear working copy of mip 0
+	MIPCHAIN_PASS_FILTER_Y,
+	MIPCHAIN_PASS_FILTER_Z,
+	MIPCHAIN_PASS_FILTER_X,
+	MIPCHAIN_PASS_ENCODE,			// Working copy to stored values, with the variance of normals
+};
+
+class CMipChainBuilder
+{
+public:
+	CMipChainBuilder( const MipChainParams_t &params );
+
+	void RunPass( MipChainPass_t pass, const FloatBitMap_t *pSrc, FloatBitMap_t *pDst, float *pVariance = NULL, float flAlphaScale = 1.0f );
+	void ProcessRows( MipChainPass_t *pPass, int nFirstRow, int nRowCount );
+
+	// Each axis of pSrc to the size of pDst
+	void ComputeTaps( const FloatBitMap_t *pSrc, const FloatBitMap_t *pDst );
+
+private:
+	void DecodeRow( int y, int z );
+	void FilterRowY( int y, int z );
+	void FilterRowZ( int y, int z );
+	void FilterRowX( int y, int z );
+	void EncodeRow( int y, int z );
+
+	const MipChainParams_t		&m_Params;
+	const FloatBitMap_t			*m_pSrc;
+	FloatBitMap_t				*m_pDst;
+	float						*m_pVariance;
+	float						m_flAlphaScale;
+	CUtlVector< MipFilterTaps_t >	m_TapsX;
+	CUtlVector< MipFilterTaps_t >	m_TapsY;
+	CUtlVector< MipFilterTaps_t >	m_TapsZ;
+};
+
+CMipChainBuilder::CMipChainBuilder( const MipChainParams_t &params ) : m_Params( params )
+{
+	m_pSrc = NULL;
+	m_pDst = NULL;
+	m_pVariance = NULL;
+	m_flAlphaScale = 1.0f;
+}
+
+void CMipChainBuilder::ComputeTaps( const FloatBitMap_t *pSrc, const FloatBitMap_t *pDst )
+{
+	ComputeFilterTaps( pSrc->NumCols(), pDst->NumCols(), ( m_Params.m_nFlags & DOWNSAMPLE_CLAMPS ) != 0, m_TapsX );
+	ComputeFilterTaps( pSrc->NumRows(), pDst->NumRows(), ( m_Params.m_nFlags & DOWNSAMPLE_CLAMPT ) != 0, m_TapsY );
+	ComputeFilterTaps( pSrc->NumSlices(), pDst->NumSlices(), ( m_Params.m_nFlags & DOWNSAMPLE_CLAMPU ) != 0, m_TapsZ );
+}
+
+void CMipChainBuilder::RunPass( MipChainPass_t pass, const FloatBitMap_t *pSrc, FloatBitMap_t *pDst, float *pVariance, float flAlphaScale )
+{
+	m_pSrc = pSrc;
+	m_pDst = pDst;
+	m_pVariance = pVariance;
+	m_flAlphaScale = flAlphaScale;
+
+	int nRows = pDst->NumRows() * pDst->NumSlices();
+	int nJobs = ( nRows + MIPCHAIN_ROWS_PER_JOB - 1 ) / MIPCHAIN_ROWS_PER_JOB;
+	IThreadPool *pThreadPool = m_Params.m_pThreadPool ? m_Params.m_pThreadPool : FloatBitMap_t::GetThreadPool();
+	if ( !pThreadPool || nJobs == 1 )
+	{
+		ProcessRows( &pass, 0, nRows );
+		return;
+	}
+
+	ParallelLoopProcessChunks( pThreadPool, &pass, 0, nRows, nJobs, this, &CMipChainBuilder::ProcessRows );
+}
+
+void CMipChainBuilder::ProcessRows( MipChainPass_t *pPass, int nFirstRow, int nRowCount )
+{
+	int nRows = m_pDst->NumRows();
+	for ( int i = nFirstRow; i < nFirstRow + nRowCount; ++i )
+	{
+		int y = i % nRows;
+		int z = i / nRows;
+		switch ( *pPass )
+		{
+		case MIPCHAIN_PASS_DECODE:
+			DecodeRow( y, z );
+			break;
+		case MIPCHAIN_PASS_FILTER_Y:
+			FilterRowY( y, z );
+			break;
+		case MIPCHAIN_PASS_FILTER_Z:
+			FilterRowZ( y, z );
+			break;
+		case MIPCHAIN_PASS_FILTER_X:
+			FilterRowX( y, z );
+			break;
+		case MIPCHAIN_PASS_ENCODE:
+			EncodeRow( y, z );
+			break;
+		}
+	}
+}
+
+void CMipChainBuilder::DecodeRow( int y, int z )
+{
+	float *pRed = m_pDst->RowPtr<float>( FBM_ATTR_RED, y, z );
+	float *pGreen = m_pDst->RowPtr<float>( FBM_ATTR_GREEN, y, z );
+	float *pBlue = m_pDst->RowPtr<float>( FBM_ATTR_BLUE, y, z );
+	float *pAlpha = m_pDst->RowPtr<float>( FBM_ATTR_ALPHA, y, z );
+
+	// The source may hold some channels as constants, read it a texel at a time
+	int nWidth = m_pDst->NumCols();
+	for ( int x = 0; x < nWidth; ++x )
+	{
+		float r = m_pSrc->Pixel( x, y, z, FBM_ATTR_RED );
+		float g = m_pSrc->Pixel( x, y, z, FBM_ATTR_GREEN );
+		float b = m_pSrc->Pixel( x, y, z, FBM_ATTR_BLUE );
+		switch ( m_Params.m_Type )
+		{
+		case MIPCHAIN_SRGB:
+			r = SRGBToLinear( r );
+			g = SRGBToLinear( g );
+			b = SRGBToLinear( b );
+			break;
+
+		case MIPCHAIN_NORMAL:
+			{
+				Vector vecNormal( r * 2.0f - 1.0f, g * 2.0f - 1.0f, b * 2.0f - 1.0f );
+				if ( VectorNormalize( vecNormal ) == 0.0f )
+				{
+					vecNormal.Init( 0.0f, 0.0f, 1.0f );
+				}
+				r = vecNormal.x;
+				g = vecNormal.y;
+				b = vecNormal.z;
+			}
+			break;
+
+		default:
+			break;
+		}
+
+		pRed[x] = r;
+		pGreen[x] = g;
+		pBlue[x] = b;
+		pAlpha[x] = m_pSrc->Pixel( x, y, z, FBM_ATTR_ALPHA );
+	}
+}
+
+void CMipChainBuilder::FilterRowY( int y, int z )
+{
+	const MipFilterTaps_t &tap = m_TapsY[y];
+	int nQuads = m_pDst->NumQuadsPerRow();
+	for ( int c = 0; c < FBM_ATTR_COUNT; ++c )
+	{
+		fltx4 *pOut = m_pDst->RowPtr<fltx4>( c, y, z );
+		const fltx4 *pIn = m_pSrc->RowPtr<fltx4>( c, tap.m_nIndex[0], z );
+		fltx4 weight = ReplicateX4( tap.m_flWeight[0] );
+		for ( int i = 0; i < nQuads; ++i )
+		{
+			pOut[i] = MulSIMD( pIn[i], weight );
+		}
+
+		for ( int t = 1; t < tap.m_nCount; ++t )
+		{
+			pIn = m_pSrc->RowPtr<fltx4>( c, tap.m_nIndex[t], z );
+			weight = ReplicateX4( tap.m_flWeight[t] );
+			for ( int i = 0; i < nQuads; ++i )
+			{
+				pOut[i] = MaddSIMD( pIn[i], weight, pOut[i] );
+			}
+		}
+	}
+}
+
+void CMipChainBuilder::FilterRowZ( int y, int z )
+{
+	const MipFilterTaps_t &tap = m_TapsZ[z];
+	int nQuads = m_pDst->NumQuadsPerRow();
+	for ( int c = 0; c < FBM_ATTR_COUNT; ++c )
+	{
+		fltx4 *pOut = m_pDst->RowPtr<fltx4>( c, y, z );
+		const fltx4 *pIn = m_pSrc->RowPtr<fltx4>( c, y, tap.m_nIndex[0] );
+		fltx4 weight = ReplicateX4( tap.m_flWeight[0] );
+		for ( int i = 0; i < nQuads; ++i )
+		{
+			pOut[i] = MulSIMD( pIn[i], weight );
+		}
+
+		for ( int t = 1; t < tap.m_nCount; ++t )
+		{
+			pIn = m_pSrc->RowPtr<fltx4>( c, y, tap.m_nIndex[t] );
+			weight = ReplicateX4( tap.m_flWeight[t] );
+			for ( int i = 0; i < nQuads; ++i )
+			{
+				pOut[i] = MaddSIMD( pIn[i], weight, pOut[i] );
+			}
+		}
+	}
+}
+
+void CMipChainBuilder::FilterRowX( int y, int z )
+{
+	int nWidth = m_pDst->NumCols();
+	for ( int c = 0; c < FBM_ATTR_COUNT; ++c )
+	{
+		float *pOut = m_pDst->RowPtr<float>( c, y, z );
+		const float *pIn = m_pSrc->RowPtr<float>( c, y, z );
+		for ( int x = 0; x < nWidth; ++x )
+		{
+			const MipFilterTaps_t &tap = m_TapsX[x];
+			float flSum = 0.0f;
+			for ( int t = 0; t < tap.m_nCount; ++t )
+			{
+				flSum += pIn[ tap.m_nIndex[t] ] * tap.m_flWeight[t];
+			}
+			pOut[x] = flSum;
+		}
+	}
+}
+
+void CMipChainBuilder::EncodeRow( int y, int z )
+{
+	const float *pInRed = m_pSrc->RowPtr<float>( FBM_ATTR_RED, y, z );
+	const float *pInGreen = m_pSrc->RowPtr<float>( FBM_ATTR_GREEN, y, z );
+	const float *pInBlue = m_pSrc->RowPtr<float>( FBM_ATTR_BLUE, y, z );
+	const float *pInAlpha = m_pSrc->RowPtr<float>( FBM_ATTR_ALPHA, y, z );
+	float *pRed = m_pDst->RowPtr<float>( FBM_ATTR_RED, y, z );
+	float *pGreen = m_pDst->RowPtr<float>( FBM_ATTR_GREEN, y, z );
+	float *pBlue = m_pDst->RowPtr<float>( FBM_ATTR_BLUE, y, z );
+	float *pAlpha = m_pDst->RowPtr<float>( FBM_ATTR_ALPHA, y, z );
+
+	int nWidth = m_pDst->NumCols();
+	for ( int x = 0; x < nWidth; ++x )
+	{
+		switch ( m_Params.m_Type )
+		{
+		case MIPCHAIN_SRGB:
+			pRed[x] = LinearToSRGB( pInRed[x] );
+			pGreen[x] = LinearToSRGB( pInGreen[x] );
+			pBlue[x] = LinearToSRGB( pInBlue[x] );
+			break;
+
+		case MIPCHAIN_NORMAL:
+			{
+				// Averaged unit normals are shorter the more they diverge, 1 / length - 1 is the
+				// variance of their angle (Toksvig)
+				Vector vecNormal( pInRed[x], pInGreen[x], pInBlue[x] );
+				float flLength = VectorNormalize( vecNormal );
+				if ( flLength == 0.0f )
+				{
+					vecNormal.Init( 0.0f, 0.0f, 1.0f );
+				}
+				flLength = clamp( flLength, MIPCHAIN_MIN_NORMAL_LENGTH, 1.0f );
+				if ( m_pVariance )
+				{
+					m_pVariance[ ( z * m_pDst->NumRows() + y ) * nWidth + x ] = ( 1.0f - flLength ) / flLength;
+				}
+				pRed[x] = vecNormal.x * 0.5f + 0.5f;
+				pGreen[x] = vecNormal.y * 0.5f + 0.5f;
+				pBlue[x] = vecNormal.z * 0.5f + 0.5f;
+			}
+			break;
+
+		default:
+			pRed[x] = pInRed[x];
+			pGreen[x] = pInGreen[x];
+			pBlue[x] = pInBlue[x];
+			break;
+		}
+
+		pAlpha[x] = MIN( pInAlpha[x] * m_flAlphaScale, 1.0f );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Alpha test coverage
+//-----------------------------------------------------------------------------
+static float ComputeAlphaCoverage( const FloatBitMap_t &bitmap, float flReference )
+{
+	int nCovered = 0;
+	int nWidth = bitmap.NumCols();
+	for ( int z = 0; z < bitmap.NumSlices(); ++z )
+	{
+		for ( int y = 0; y < bitmap.NumRows(); ++y )
+		{
+			const float *pAlpha = bitmap.RowPtr<float>( FBM_ATTR_ALPHA, y, z );
+			for ( int x = 0; x < nWidth; ++x )
+			{
+				nCovered += ( pAlpha[x] > flReference );
+			}
+		}
+	}
+	return (float)nCovered / (float)( nWidth * bitmap.NumRows() * bitmap.NumSlices() );
+}
+
+// Scale of the alpha of a mip that makes as much of it pass the alpha test as passes in mip 0. Mips
+// of alpha tested textures otherwise lose coverage as alpha is averaged towards the reference
+static float ComputeAlphaScale( const FloatBitMap_t &bitmap, float flThreshold, float flCoverage )
+{
+	float flMin = 0.0f;
+	float flMax = 1.0f;
+	float flReference = 0.5f;
+	for ( int i = 0; i < MIPCHAIN_COVERAGE_STEPS; ++i )
+	{
+		float flMipCoverage = ComputeAlphaCoverage( bitmap, flReference );
+		if ( flMipCoverage > flCoverage )
+		{
+			flMin = flReference;
+		}
+		else if ( flMipCoverage < flCoverage )
+		{
+			flMax = flReference;
+		}
+		else
+		{
+			break;
+		}
+		flReference = ( flMin + flMax ) * 0.5f;
+	}
+	return flThreshold / MAX( flReference, 1.0f / 255.0f );
+}
+
+//-----------------------------------------------------------------------------
+// Mip chain
+//-----------------------------------------------------------------------------
+CMipChain::CMipChain()
+{
+	m_Type = MIPCHAIN_LINEAR;
+}
+
+CMipChain::~CMipChain()
+{
+	Purge();
+}
+
+void CMipChain::Purge()
+{
+	m_Mips.PurgeAndDeleteElements();
+	for ( int i = 0; i < m_Variance.Count(); ++i )
+	{
+		delete[] m_Variance[i];
+	}
+	m_Variance.Purge();
+}
+
+int CMipChain::MipCount() const
+{
+	return m_Mips.Count();
+}
+
+FloatBitMap_t &CMipChain::Mip( int nMip ) const
+{
+	return *m_Mips[nMip];
+}
+
+float CMipChain::NormalVariance( int nMip, int x, int y, int z ) const
+{
+	if ( nMip >= m_Variance.Count() || !m_Variance[nMip] )
+		return 0.0f;
+
+	const FloatBitMap_t &mip = *m_Mips[nMip];
+	return m_Variance[nMip][ ( z * mip.NumRows() + y ) * mip.NumCols() + x ];
+}
+
+bool CMipChain::Generate( const FloatBitMap_t &source, const MipChainParams_t &params )
+{
+	Purge();
+	if ( source.NumCols() <= 0 || source.NumRows() <= 0 || source.NumSlices() <= 0 )
+		return false;
+
+	m_Type = params.m_Type;
+	CMipChainBuilder builder( params );
+
+	// Working copies are linear and unscaled, the alpha test scale of a mip is not carried into the next
+	FloatBitMap_t working[2];
+	FloatBitMap_t filteredY, filteredZ;
+	working[0].Init( source.NumCols(), source.NumRows(), source.NumSlices() );
+	builder.RunPass( MIPCHAIN_PASS_DECODE, &source, &working[0] );
+
+	bool bAlphaTest = ( params.m_nFlags & DOWNSAMPLE_ALPHATEST ) != 0;
+	float flCoverage = bAlphaTest ? ComputeAlphaCoverage( working[0], params.m_flAlphaThreshold ) : 0.0f;
+
+	for ( int nMip = 0; ; ++nMip )
+	{
+		FloatBitMap_t &current = working[ nMip & 1 ];
+		int nWidth = current.NumCols();
+		int nHeight = current.NumRows();
+		int nDepth = current.NumSlices();
+
+		FloatBitMap_t *pMip = new FloatBitMap_t;
+		pMip->Init( nWidth, nHeight, nDepth );
+		m_Mips.AddToTail( pMip );
+
+		float *pVariance = NULL;
+		if ( m_Type == MIPCHAIN_NORMAL )
+		{
+			pVariance = new float[ nWidth * nHeight * nDepth ];
+		}
+		m_Variance.AddToTail( pVariance );
+
+		float flAlphaScale = ( bAlphaTest && nMip > 0 ) ? ComputeAlphaScale( current, params.m_flAlphaThreshold, flCoverage ) : 1.0f;
+		builder.RunPass( MIPCHAIN_PASS_ENCODE, &current, pMip, pVariance, flAlphaScale );
+
+		if ( nWidth == 1 && nHeight == 1 && nDepth == 1 )
+			break;
+
+		FloatBitMap_t &next = working[ ( nMip + 1 ) & 1 ];
+		next.Init( MAX( nWidth >> 1, 1 ), MAX( nHeight >> 1, 1 ), MAX( nDepth >> 1, 1 ) );
+		builder.ComputeTaps( &current, &next );
+
+		filteredY.Init( nWidth, next.NumRows(), nDepth );
+		builder.RunPass( MIPCHAIN_PASS_FILTER_Y, &current, &filteredY );
+
+		const FloatBitMap_t *pFiltered = &filteredY;
+		if ( nDepth > 1 )
+		{
+			filteredZ.Init( nWidth, next.NumRows(), next.NumSlices() );
+			builder.RunPass( MIPCHAIN_PASS_FILTER_Z, &filteredY, &filteredZ );
+			pFiltered = &filteredZ;
+		}
+
+		builder.RunPass( MIPCHAIN_PASS_FILTER_X, pFiltered, &next );
+	}
+
+	// The variance of mip 0 is what the source normals carry, none
+	if ( m_Type == MIPCHAIN_NORMAL )
+	{
+		const FloatBitMap_t &mip = *m_Mips[0];
+		memset( m_Variance[0], 0, mip.NumCols() * mip.NumRows() * mip.NumSlices() * sizeof( float ) );
+	}
+	return true;
+}
+
+void CMipChain::ApplyNormalVariance( const CMipChain &normals, float flScale )
+{
+	if ( normals.m_Type != MIPCHAIN_NORMAL || !normals.MipCount() )
+		return;
+
+	for ( int nMip = 0; nMip < MipCount(); ++nMip )
+	{
+		FloatBitMap_t &mip = *m_Mips[nMip];
+		int nWidth = mip.NumCols();
+		int nHeight = mip.NumRows();
+		int nDepth = mip.NumSlices();
+
+		// The largest normal map mip no wider than this one
+		int nNormalMip = 0;
+		while ( nNormalMip < normals.MipCount() - 1 && normals.Mip( nNormalMip ).NumCols() > nWidth )
+		{
+			++nNormalMip;
+		}
+
+		const FloatBitMap_t &normalMip = normals.Mip( nNormalMip );
+		for ( int z = 0; z < nDepth; ++z )
+		{
+			int nz = MIN( z * normalMip.NumSlices() / nDepth, normalMip.NumSlices() - 1 );
+			for ( int y = 0; y < nHeight; ++y )
+			{
+				int ny = MIN( y * normalMip.NumRows() / nHeight, normalMip.NumRows() - 1 );
+				float *pRoughness = mip.RowPtr<float>( FBM_ATTR_GREEN, y, z );
+				for ( int x = 0; x < nWidth; ++x )
+				{
+					int nx = MIN( x * normalMip.NumCols() / nWidth, normalMip.NumCols() - 1 );
+					float flVariance = normals.NormalVariance( nNormalMip, nx, ny, nz );
+					if ( flVariance <= 0.0f )
+						continue;
+
+					// GGX alpha is roughness squared, and the variance adds to alpha squared
+					float flRoughness = clamp( pRoughness[x], 0.0f, 1.0f );
+					float flAlpha2 = flRoughness * flRoughness * flRoughness * flRoughness;
+					flAlpha2 = MIN( flAlpha2 + 2.0f * flScale * flVariance, 1.0f );
+					pRoughness[x] = sqrtf( sqrtf( flAlpha2 ) );
+				}
+			}
+		}
+	}
+}
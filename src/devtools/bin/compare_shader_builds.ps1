@@ -0,0 +1,49 @@
+[CmdletBinding()]
+param (
+    [Parameter(Mandatory=$true)][string[]]$Shaders,
+    [Parameter(Mandatory=$true)][string]$ShaderPath,
+    [Parameter(Mandatory=$false)][string]$Version = "30",
+    [Parameter(Mandatory=$false)][System.UInt32]$Threads,
+    [Parameter(Mandatory=$false)][string]$Materials
+)
+
+# Builds each shader from scratch and reports what it costs to have it: static combos (total,
+# left after skips, left after aliasing identical sources), compile time, vcs bytes, and with
+# -Materials the per material pixel cost of the combos shadercost picks for that tree.
+#
+# compare_shader_builds.ps1 -Shaders pbr_ps30.fxc,pbr_uber_ps30.fxc -ShaderPath ..\..\materialsystem\stdshaders -Materials ..\..\..\game\usermod\materials
+
+$results = @()
+foreach ($shader in $Shaders) {
+	$shaderName = [System.IO.Path]::GetFileNameWithoutExtension($shader)
+	$result = [ordered]@{ Shader = $shaderName }
+
+	# "pbr_ps30.fxc: 12 files, 3072 static combos, 2304 live, 1730 unique, 574 aliased (...)"
+	$prep = & "$PSScriptRoot\fxcprep" "-ver" $Version "-I" $ShaderPath (Join-Path $ShaderPath $shader) | Out-String
+	if ($prep -match '(\d+) static combos, (\d+) live, (\d+) unique') {
+		$result.StaticCombos = [int]$Matches[1]
+		$result.LiveCombos = [int]$Matches[2]
+		$result.UniqueCombos = [int]$Matches[3]
+	}
+
+	$arguments = @("-ver", $Version, "-shaderpath", $ShaderPath, $shader)
+	if ($Threads -ne 0) {
+		$arguments = @("-threads", $Threads) + $arguments
+	}
+	$time = Measure-Command { & "$PSScriptRoot\ShaderCompile2" $arguments | Out-Null }
+	$result.CompileSeconds = [math]::Round($time.TotalSeconds, 1)
+
+	$vcs = Join-Path $ShaderPath "shaders\fxc\$shaderName.vcs"
+	$result.VcsBytes = (Get-Item $vcs).Length
+
+	if ($Materials) {
+		# Mean over the materials of the tree, each weighted once
+		$report = & "$PSScriptRoot\shadercost" "-fxc" (Join-Path $ShaderPath $shader) "-vcs" $vcs "-csv" $Materials | ConvertFrom-Csv
+		$result.MeanCost = [math]::Round(($report | Measure-Object -Property cost -Average).Average, 1)
+		$result.MeanFlashlightCost = [math]::Round(($report | Measure-Object -Property flashlightcost -Average).Average, 1)
+	}
+
+	$results += [pscustomobject]$result
+}
+
+$results | Format-Table -AutoSize
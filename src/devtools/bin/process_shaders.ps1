@@ -3,13 +3,94 @@ param (
     [Parameter(Mandatory=$true, ValueFromPipeline=$true)][System.IO.FileInfo]$File,
     [Parameter(Mandatory=$true)][string]$Version,
     [Parameter(Mandatory=$false)][switch]$Dynamic,
-    [Parameter(Mandatory=$false)][System.UInt32]$Threads
+    [Parameter(Mandatory=$false)][System.UInt32]$Threads,
+    [Parameter(Mandatory=$false)][string]$CacheDir = $env:SHADER_CACHE_DIR,
+    [Parameter(Mandatory=$false)][switch]$NoCache
 )
 
 if ($Version -notin @("20b", "30", "40", "41", "50", "51")) {
 	return
 }
 
+# Compiled shaders are cached by content: the key hashes the compiler binary, the target
+# version, the combo declarations and the preprocessed source of every static combo, as
+# fxcprep writes it with -hashes. A header edit that doesn't change what any combo
+# preprocesses to still hits. Without fxcprep next to the compiler the shader is compiled
+# uncached. The cache directory can live on a network share, entries are published with a
+# single rename.
+if (-not $CacheDir) {
+	$CacheDir = Join-Path $File.DirectoryName "shadercache"
+}
+
+$compilerHash = (Get-FileHash -Algorithm SHA256 "$PSScriptRoot\ShaderCompile2.exe").Hash
+$fxcprep = "$PSScriptRoot\fxcprep.exe"
+$includePattern = '^\s*#\s*include\s*[<"]([^>"]+)[>"]'
+$comboPattern = '^\s*//\s*(STATIC|DYNAMIC|SKIP|CENTROID)\s*:'
+
+# The .inc is generated from the combo declarations, which live in comments and don't
+# reach the preprocessed source
+function Add-ComboDeclarations([string]$Path, [hashtable]$Visited, [System.Text.StringBuilder]$Out) {
+	$fullPath = [System.IO.Path]::GetFullPath($Path)
+	if ($Visited.ContainsKey($fullPath)) {
+		return
+	}
+	$Visited[$fullPath] = $true
+
+	$directory = [System.IO.Path]::GetDirectoryName($fullPath)
+	foreach ($line in [System.IO.File]::ReadAllLines($fullPath)) {
+		if ($line -match $comboPattern) {
+			[void]$Out.AppendLine(($line -replace '\s+', ' ').Trim())
+		}
+		elseif ($line -match $includePattern) {
+			$includePath = Join-Path $directory $Matches[1]
+			if (-not (Test-Path $includePath)) {
+				$includePath = Join-Path $File.DirectoryName $Matches[1]
+			}
+			if (Test-Path $includePath) {
+				Add-ComboDeclarations $includePath $Visited $Out
+			}
+		}
+	}
+}
+
+# Returns $null when the shader can't be preprocessed, it is then compiled uncached
+function Get-ShaderCacheKey([string]$ShaderFile) {
+	$shaderPath = Join-Path $File.DirectoryName $ShaderFile
+	$hashesFile = [System.IO.Path]::GetTempFileName()
+	try {
+		$arguments = @("-ver", $Version, "-I", $File.DirectoryName, "-hashes", $hashesFile, $shaderPath)
+		if ($Threads -ne 0) {
+			$arguments = @("-threads", $Threads) + $arguments
+		}
+		& $fxcprep $arguments | Out-Null
+		if ($LASTEXITCODE -ne 0) {
+			return $null
+		}
+
+		$source = New-Object System.Text.StringBuilder
+		[void]$source.AppendLine("compiler $compilerHash")
+		[void]$source.AppendLine("version $Version")
+		Add-ComboDeclarations $shaderPath @{} $source
+		[void]$source.Append([System.IO.File]::ReadAllText($hashesFile))
+	}
+	finally {
+		Remove-Item $hashesFile -Force -ErrorAction SilentlyContinue
+	}
+
+	$sha = [System.Security.Cryptography.SHA256]::Create()
+	$bytes = $sha.ComputeHash([System.Text.Encoding]::UTF8.GetBytes($source.ToString()))
+	return [System.BitConverter]::ToString($bytes).Replace("-", "")
+}
+
+function Invoke-ShaderCompile([string]$ShaderFile) {
+	if ($Threads -ne 0) {
+		& "$PSScriptRoot\ShaderCompile2" "-threads" $Threads "-ver" $Version "-shaderpath" $File.DirectoryName $ShaderFile | Out-Host
+	} else {
+		& "$PSScriptRoot\ShaderCompile2" "-ver" $Version "-shaderpath" $File.DirectoryName $ShaderFile | Out-Host
+	}
+	return $LASTEXITCODE -eq 0
+}
+
 $fileList = $File.OpenText()
 while ($null -ne ($line = $fileList.ReadLine())) {
 	if ($line -match '^\s*$' -or $line -match '^\s*//') {
@@ -21,11 +102,45 @@ while ($null -ne ($line = $fileList.ReadLine())) {
 		continue
 	}
 
-	if ($Threads -ne 0) {
-		& "$PSScriptRoot\ShaderCompile2" "-threads" $Threads "-ver" $Version "-shaderpath" $File.DirectoryName $line
+	if ($NoCache -or -not (Test-Path $fxcprep)) {
+		[void](Invoke-ShaderCompile $line)
+		continue
+	}
+
+	# Outputs of one shader, relative to the shader directory
+	$shaderName = [System.IO.Path]::GetFileNameWithoutExtension($line)
+	$outputs = @("shaders\fxc\$shaderName.vcs", "include\$shaderName.inc")
+
+	$key = Get-ShaderCacheKey $line
+	if (-not $key) {
+		[void](Invoke-ShaderCompile $line)
 		continue
 	}
+	$entry = Join-Path $CacheDir "$shaderName\$key"
 
-	& "$PSScriptRoot\ShaderCompile2" "-ver" $Version "-shaderpath" $File.DirectoryName $line
+	if (Test-Path $entry) {
+		Write-Host "$line - cache hit ($key)"
+		foreach ($output in $outputs) {
+			Copy-Item (Join-Path $entry ([System.IO.Path]::GetFileName($output))) (Join-Path $File.DirectoryName $output) -Force
+		}
+		continue
+	}
+
+	if (-not (Invoke-ShaderCompile $line)) {
+		continue
+	}
+
+	# Publish the entry: fill a private directory, then rename it into place
+	$staging = Join-Path $CacheDir "$shaderName\$key.$PID.tmp"
+	New-Item -ItemType Directory -Force -Path $staging | Out-Null
+	foreach ($output in $outputs) {
+		Copy-Item (Join-Path $File.DirectoryName $output) $staging -Force
+	}
+	try {
+		Rename-Item $staging $key -ErrorAction Stop
+	} catch {
+		# Someone else published the same key first
+		Remove-Item $staging -Recurse -Force
+	}
 }
-$fileList.Close()
+$fileList.Close()
\ No newline at end of file
@@ -18,30 +18,200 @@
 #include "renderparm.h"
 #include "mathlib/vmatrix.h"
 #include "tier1/strtools.h"
+#include "tier1/generichash.h"
+#include "tier1/mempool.h"
+#include "tier1/utlrbtree.h"
 #include "convar.h"
 #include "tier0/vprof.h"
 
 // NOTE: This must be the last include file in a .cpp file!
 #include "tier0/memdbgon.h"
 
+//-----------------------------------------------------------------------------
+// Instance command buffers. Passes that build the same commands share one
+// buffer, most vertex lit and skinned materials only differ in their snapshot
+// state. Buffers live in pools of a few size classes and are found by contents
+//-----------------------------------------------------------------------------
+struct InstanceCommandBuffer_t
+{
+	int m_nRefCount;
+	int m_nSize;
+	unsigned int m_nHash;
+	int m_nSizeClass;
+
+	// The commands follow the header, 16 byte aligned like the pool blocks
+	unsigned char *Base() { return (unsigned char *)( this + 1 ); }
+	static InstanceCommandBuffer_t *FromBase( unsigned char *pBase ) { return (InstanceCommandBuffer_t *)pBase - 1; }
+};
+
+class CInstanceCommandBufferCache
+{
+public:
+	CInstanceCommandBufferCache();
+	~CInstanceCommandBufferCache();
+
+	// Returns a shared copy of the commands, release it when done
+	unsigned char *AddRef( const unsigned char *pCommands, int nSize );
+	void Release( unsigned char *pCommandBuffer );
+
+	void PrintStats();
+
+private:
+	enum
+	{
+		SMALLEST_SIZE_CLASS = 64,
+		SIZE_CLASS_COUNT = 5,			// Up to 1024 bytes, header included
+	};
+
+	static bool BufferLessFunc( InstanceCommandBuffer_t * const &pLeft, InstanceCommandBuffer_t * const &pRight );
+
+	CUtlMemoryPool *m_pPools[SIZE_CLASS_COUNT];
+	CUtlRBTree< InstanceCommandBuffer_t *, int > m_Buffers;
+	CThreadFastMutex m_Mutex;
+
+	int m_nReferences;
+	int m_nBytes;
+	int m_nBytesReferenced;
+};
+
+CInstanceCommandBufferCache::CInstanceCommandBufferCache() : m_Buffers( 0, 0, BufferLessFunc )
+{
+	for ( int i = 0; i < SIZE_CLASS_COUNT; ++i )
+	{
+		m_pPools[i] = new CUtlMemoryPool( SMALLEST_SIZE_CLASS << i, 64, CUtlMemoryPool::GROW_SLOW, "CInstanceCommandBufferCache", 16 );
+	}
+	m_nReferences = 0;
+	m_nBytes = 0;
+	m_nBytesReferenced = 0;
+}
+
+CInstanceCommandBufferCache::~CInstanceCommandBufferCache()
+{
+	for ( int i = 0; i < SIZE_CLASS_COUNT; ++i )
+	{
+		delete m_pPools[i];
+	}
+}
+
+bool CInstanceCommandBufferCache::BufferLessFunc( InstanceCommandBuffer_t * const &pLeft, InstanceCommandBuffer_t * const &pRight )
+{
+	if ( pLeft->m_nHash != pRight->m_nHash )
+		return pLeft->m_nHash < pRight->m_nHash;
+	if ( pLeft->m_nSize != pRight->m_nSize )
+		return pLeft->m_nSize < pRight->m_nSize;
+	return memcmp( pLeft->Base(), pRight->Base(), pLeft->m_nSize ) < 0;
+}
+
+unsigned char *CInstanceCommandBufferCache::AddRef( const unsigned char *pCommands, int nSize )
+{
+	AUTO_LOCK( m_Mutex );
+
+	int nSizeClass = 0;
+	while ( nSizeClass < SIZE_CLASS_COUNT - 1 && ( SMALLEST_SIZE_CLASS << nSizeClass ) < (int)sizeof( InstanceCommandBuffer_t ) + nSize )
+	{
+		++nSizeClass;
+	}
+	Assert( ( SMALLEST_SIZE_CLASS << nSizeClass ) >= (int)sizeof( InstanceCommandBuffer_t ) + nSize );
+
+	// Built in place, it becomes the shared copy if nobody has the same commands yet
+	InstanceCommandBuffer_t *pBuffer = (InstanceCommandBuffer_t *)m_pPools[nSizeClass]->Alloc();
+	pBuffer->m_nRefCount = 1;
+	pBuffer->m_nSize = nSize;
+	pBuffer->m_nHash = HashBlock( pCommands, nSize );
+	pBuffer->m_nSizeClass = nSizeClass;
+	memcpy( pBuffer->Base(), pCommands, nSize );
+
+	++m_nReferences;
+	m_nBytesReferenced += nSize;
+
+	int i = m_Buffers.Find( pBuffer );
+	if ( i != m_Buffers.InvalidIndex() )
+	{
+		m_pPools[nSizeClass]->Free( pBuffer );
+		pBuffer = m_Buffers[i];
+		++pBuffer->m_nRefCount;
+		return pBuffer->Base();
+	}
+
+	m_Buffers.Insert( pBuffer );
+	m_nBytes += SMALLEST_SIZE_CLASS << nSizeClass;
+	return pBuffer->Base();
+}
+
+void CInstanceCommandBufferCache::Release( unsigned char *pCommandBuffer )
+{
+	AUTO_LOCK( m_Mutex );
+
+	InstanceCommandBuffer_t *pBuffer = InstanceCommandBuffer_t::FromBase( pCommandBuffer );
+	Assert( pBuffer->m_nRefCount > 0 );
+	--m_nReferences;
+	m_nBytesReferenced -= pBuffer->m_nSize;
+	if ( --pBuffer->m_nRefCount > 0 )
+		return;
+
+	m_Buffers.Remove( pBuffer );
+	m_nBytes -= SMALLEST_SIZE_CLASS << pBuffer->m_nSizeClass;
+	m_pPools[pBuffer->m_nSizeClass]->Free( pBuffer );
+}
+
+void CInstanceCommandBufferCache::PrintStats()
+{
+	AUTO_LOCK( m_Mutex );
+
+	Msg( "%d instance command buffers for %d passes, %d bytes pooled for %d bytes of commands\n",
+		m_Buffers.Count(), m_nReferences, m_nBytes, m_nBytesReferenced );
+	for ( int i = 0; i < SIZE_CLASS_COUNT; ++i )
+	{
+		Msg( "  %4d byte blocks: %d used, %d peak, %d bytes reserved\n", m_pPools[i]->BlockSize(),
+			m_pPools[i]->Count(), m_pPools[i]->PeakCount(), m_pPools[i]->Size() );
+	}
+}
+
+// Never destroyed. Materials still loaded when the DLL's statics go away release
+// their buffers after that, a static cache would be gone by then
+static CInstanceCommandBufferCache &InstanceCommandBufferCache()
+{
+	static CInstanceCommandBufferCache *s_pCache = new CInstanceCommandBufferCache;
+	return *s_pCache;
+}
+
+CON_COMMAND( mat_shader_instance_buffers, "Prints the sharing and the pool use of the per-instance shader command buffers" )
+{
+	InstanceCommandBufferCache().PrintStats();
+}
+
+
 //-----------------------------------------------------------------------------
 // Storage buffer used for instance command buffers
 //-----------------------------------------------------------------------------
+static CMemoryPoolMT &PerInstanceContextDataPool();
+
 class CPerInstanceContextData : public CBasePerInstanceContextData
 {
 public:
-	CPerInstanceContextData() : m_pCommandBuffer( NULL ), m_nSize( 0 ) {}
+	// From a pool that is never destroyed either, for the same reason as the cache
+	void *operator new( size_t nSize ) { MEM_ALLOC_CREDIT_( "CPerInstanceContextData pool" ); return PerInstanceContextDataPool().Alloc( nSize ); }
+	void *operator new( size_t nSize, int nBlockUse, const char *pFileName, int nLine ) { MEM_ALLOC_CREDIT_( "CPerInstanceContextData pool" ); return PerInstanceContextDataPool().Alloc( nSize ); }
+	void operator delete( void *p ) { PerInstanceContextDataPool().Free( p ); }
+	void operator delete( void *p, int nBlockUse, const char *pFileName, int nLine ) { PerInstanceContextDataPool().Free( p ); }
+
+	CPerInstanceContextData() : m_pCommandBuffer( NULL ) {}
 	virtual ~CPerInstanceContextData()
 	{ 
 		if ( m_pCommandBuffer )
 		{
-			delete m_pCommandBuffer; 
+			InstanceCommandBufferCache().Release( m_pCommandBuffer );
 		}
 	}
 	unsigned char *m_pCommandBuffer;
-	int m_nSize;
 };
 
+static CMemoryPoolMT &PerInstanceContextDataPool()
+{
+	static CMemoryPoolMT *s_pPool = new CMemoryPoolMT( sizeof( CPerInstanceContextData ), 256, CUtlMemoryPool::GROW_SLOW, "CPerInstanceContextData pool" );
+	return *s_pPool;
+}
+
 
 //-----------------------------------------------------------------------------
 // Globals
@@ -301,18 +471,15 @@ void CBaseShader::PI_EndCommandBuffer()
 			pContextData = new CPerInstanceContextData;
 			s_pInstanceDataPtr[ s_nPassCount ] = pContextData;
 		}
-		unsigned char *pBuf = pContextData->m_pCommandBuffer;
-		if ( pContextData->m_nSize < nSize )
+
+		// The old buffer may be shared, so it's swapped rather than written over. The new
+		// reference is taken first, re-snapshotting the same commands keeps the same buffer
+		unsigned char *pOldBuf = pContextData->m_pCommandBuffer;
+		pContextData->m_pCommandBuffer = InstanceCommandBufferCache().AddRef( (const unsigned char *)s_InstanceCommandBuffer.Base(), nSize );
+		if ( pOldBuf )
 		{
-			if ( pContextData->m_pCommandBuffer )
-			{
-				delete pContextData->m_pCommandBuffer;
-			}
-			pBuf = new unsigned char[nSize];
-			pContextData->m_pCommandBuffer = pBuf;
-			pContextData->m_nSize = nSize;
+			InstanceCommandBufferCache().Release( pOldBuf );
 		}
-		memcpy( pBuf, s_InstanceCommandBuffer.Base(), nSize );
 	}
 }
 
@@ -6,6 +6,7 @@
 
 #include "icvar.h"
 #include "tier1/tier1.h"
+#include "tier0/vprof.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -40,3 +41,25 @@ void InitShaderLibCVars( CreateInterfaceFn cvarFactory )
 		ConVar_Register( FCVAR_MATERIAL_SYSTEM_THREAD, &g_ConVarAccessor );
 	}
 }
+
+
+// ------------------------------------------------------------------------------------------- //
+// Timeline capture of the VPROF scopes of the shader DLL on every thread, see tier0/vproftrace.h
+// ------------------------------------------------------------------------------------------- //
+CON_COMMAND( mat_shader_trace_start, "Starts a timeline capture of the shader DLL VPROF scopes, on every thread" )
+{
+	VProfTrace().Start();
+}
+
+CON_COMMAND( mat_shader_trace_stop, "Stops the shader DLL timeline capture and writes it as Chrome trace JSON. Usage: mat_shader_trace_stop [file]" )
+{
+	VProfTrace().Stop();
+
+	const char *pFileName = ( args.ArgC() > 1 ) ? args[1] : "shadertrace.json";
+	if ( !VProfTrace().WriteChromeTrace( pFileName ) )
+	{
+		Warning( "mat_shader_trace_stop: can't write %s\n", pFileName );
+		return;
+	}
+	Msg( "Wrote %d events to %s, %d dropped\n", VProfTrace().GetEventCount(), pFileName, VProfTrace().GetDroppedEventCount() );
+}
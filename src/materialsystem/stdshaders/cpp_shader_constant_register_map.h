@@ -58,4 +58,9 @@
 #define PSREG_CONSTANT_45	45
 #define PSREG_CONSTANT_46	46
 #define PSREG_CONSTANT_47	47
-#define PSREG_CONSTANT_48	48
\ No newline at end of file
+#define PSREG_CONSTANT_48	48
+
+#define PSREG_BOOL_CONSTANT_00	0
+#define PSREG_BOOL_CONSTANT_01	1
+#define PSREG_BOOL_CONSTANT_02	2
+#define PSREG_BOOL_CONSTANT_03	3
\ No newline at end of file
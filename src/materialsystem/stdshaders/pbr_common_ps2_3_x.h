@@ -76,6 +76,15 @@ float3x3 compute_tangent_frame(float3 N, float3 P, float2 uv, out float3 T, out
     return float3x3(T, B, N);
 }
 
+// Build the same matrix from the interpolated vertex tangent, binormal sign in tangentS_sign.w
+// Avoids the derivatives above and the seams they produce on UV borders
+float3x3 vertex_tangent_frame(float3 N, float4 tangentS_sign, out float3 T, out float3 B)
+{
+    T = normalize(tangentS_sign.xyz);
+    B = cross(N, T) * tangentS_sign.w;
+    return float3x3(T, B, N);
+}
+
 float GetAttenForLight(float4 lightAtten, int lightNum)
 {
 #if (NUM_LIGHTS > 1)
@@ -114,12 +123,12 @@ float3 calculateLight(float3 lightIn, float3 lightIntensity, float3 lightOut, fl
     // Diffuse scattering happens due to light being refracted multiple times by a dielectric medium
     // Metals on the other hand either reflect or absorb energso diffuse contribution is always, zero
     // To be energy conserving we must scale diffuse BRDF contribution based on Fresnel factor & metalness
-#if SPECULAR
-    // Metalness is not used if F0 map is available
     float3 kd = float3(1, 1, 1) - F;
-#else
-    float3 kd = lerp(float3(1, 1, 1) - F, float3(0, 0, 0), metalness);
-#endif
+    // Metalness is not used if F0 map is available
+    if (!SPECULAR)
+    {
+        kd = lerp(kd, float3(0, 0, 0), metalness);
+    }
 
     float3 diffuseBRDF = kd * albedo;
 
@@ -132,13 +141,14 @@ float3 calculateLight(float3 lightIn, float3 lightIntensity, float3 lightOut, fl
     float3 result = (diffuseBRDF + specularBRDF) * lightIntensity * cosLightIn;
 #endif
 
-#if LIGHTWARPTEXTURE
-	// Lightwarp. Diffuse term computed as half lambertian (looks better)
-    float fHalfLambert = saturate(NDotL * 0.5 + 0.5);
-    float3 warp = tex1D(lightWarpSampler, fHalfLambert).rgb;
-	
-    result = (diffuseBRDF * warp + specularBRDF) * lightIntensity;
-#endif
+    if (LIGHTWARPTEXTURE)
+    {
+        // Lightwarp. Diffuse term computed as half lambertian (looks better)
+        float fHalfLambert = saturate(NDotL * 0.5 + 0.5);
+        float3 warp = tex1D(lightWarpSampler, fHalfLambert).rgb;
+
+        result = (diffuseBRDF * warp + specularBRDF) * lightIntensity;
+    }
 
 	return result;
 }
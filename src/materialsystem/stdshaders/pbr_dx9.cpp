@@ -15,6 +15,7 @@
 // Includes for PS30
 #include "pbr_vs30.inc"
 #include "pbr_ps30.inc"
+#include "pbr_uber_ps30.inc"
 
 // Defining samplers
 const Sampler_t SAMPLER_BASETEXTURE = SHADER_SAMPLER0;
@@ -39,6 +40,8 @@ const Sampler_t SAMPLER_BUMPSTRETCH = SHADER_SAMPLER15;
 static ConVar mat_fullbright("mat_fullbright", "0", FCVAR_CHEAT);
 static ConVar mat_specular("mat_specular", "1", FCVAR_NONE);
 static ConVar mat_pbr_parallaxmap("mat_pbr_parallaxmap", "1");
+static ConVar mat_pbr_staticflowcontrol("mat_pbr_staticflowcontrol", "0", FCVAR_NONE,
+    "Use the pixel shader build that branches on boolean constants for envambient, emissive, specular and lightwarp. Requires mat_reloadallmaterials.");
 
 // Variables for this shader
 struct PBR_Vars_t
@@ -83,6 +86,19 @@ struct PBR_Vars_t
     int bumpStretchTexture;
 };
 
+// Per material state carried from the snapshot to the dynamic state
+class CPBR_DX9_Context : public CBasePerMaterialContextData
+{
+public:
+    CPBR_DX9_Context()
+    {
+        m_bStaticFlowControl = false;
+    }
+
+    // Which pixel shader build the snapshot picked
+    bool m_bStaticFlowControl;
+};
+
 // Beginning the shader
 BEGIN_VS_SHADER(PBR, "PBR shader")
 
@@ -274,7 +290,7 @@ BEGIN_VS_SHADER(PBR, "PBR shader")
         {
             SET_FLAGS2(MATERIAL_VAR2_SUPPORTS_HW_SKINNING);             // Required for skinning
             SET_FLAGS2(MATERIAL_VAR2_DIFFUSE_BUMPMAPPED_MODEL);         // Required for dynamic lighting
-            SET_FLAGS2(MATERIAL_VAR2_NEEDS_TANGENT_SPACES);             // Required for dynamic lighting
+            SET_FLAGS2(MATERIAL_VAR2_NEEDS_TANGENT_SPACES);             // Required for vertex tangents
             SET_FLAGS2(MATERIAL_VAR2_LIGHTING_VERTEX_LIT);              // Required for dynamic lighting
             SET_FLAGS2(MATERIAL_VAR2_NEEDS_BAKED_LIGHTING_SNAPSHOTS);   // Required for ambient cube
             SET_FLAGS2(MATERIAL_VAR2_SUPPORTS_FLASHLIGHT);              // Required for flashlight
@@ -320,6 +336,13 @@ BEGIN_VS_SHADER(PBR, "PBR shader")
         BlendType_t nBlendType = EvaluateBlendRequirements(info.baseTexture, true);
         bool bFullyOpaque = (nBlendType != BT_BLENDADD) && (nBlendType != BT_BLEND) && !bIsAlphaTested;
 
+        CPBR_DX9_Context *pContextData = reinterpret_cast<CPBR_DX9_Context *>(*pContextDataPtr);
+        if (!pContextData)
+        {
+            pContextData = new CPBR_DX9_Context;
+            *pContextDataPtr = pContextData;
+        }
+
         if (IsSnapshotting())
         {
             // If alphatest is on, enable it
@@ -414,8 +437,8 @@ BEGIN_VS_SHADER(PBR, "PBR shader")
             {
                 // We only need the position and surface normal
                 unsigned int flags = VERTEX_POSITION | VERTEX_NORMAL | VERTEX_FORMAT_COMPRESSED;
-                // We need three texcoords, all in the default float2 size
-                pShaderShadow->VertexShaderVertexFormat(flags, 1, 0, 0);
+                // One texcoord, plus the tangent S and binormal sign in the userdata stream
+                pShaderShadow->VertexShaderVertexFormat(flags, 1, 0, 4);
             }
             else
             {
@@ -443,19 +466,37 @@ BEGIN_VS_SHADER(PBR, "PBR shader")
             SET_STATIC_VERTEX_SHADER(pbr_vs30);
 
             // Setting up static pixel shader
-            DECLARE_STATIC_PIXEL_SHADER(pbr_ps30);
-            SET_STATIC_PIXEL_SHADER_COMBO(FLASHLIGHT, bHasFlashlight);
-            SET_STATIC_PIXEL_SHADER_COMBO(FLASHLIGHTDEPTHFILTERMODE, nShadowFilterMode);
-            SET_STATIC_PIXEL_SHADER_COMBO(LIGHTMAPPED, bLightMapped);
-            SET_STATIC_PIXEL_SHADER_COMBO(USEENVAMBIENT, bUseEnvAmbient);
-            SET_STATIC_PIXEL_SHADER_COMBO(EMISSIVE, bHasEmissionTexture);
-            SET_STATIC_PIXEL_SHADER_COMBO(SPECULAR, bHasSpecularTexture);
-            SET_STATIC_PIXEL_SHADER_COMBO(PARALLAXOCCLUSION, useParallax);
-            SET_STATIC_PIXEL_SHADER_COMBO(WORLD_NORMAL, bWorldNormal);
-            SET_STATIC_PIXEL_SHADER_COMBO(LIGHTWARPTEXTURE, bLightwarpTexture);
-            SET_STATIC_PIXEL_SHADER_COMBO(WRINKLEMAP, bWrinkleMapping);
-            SET_STATIC_PIXEL_SHADER_COMBO(SUBSURFACESCATTERING, bThicknessTexture);
-            SET_STATIC_PIXEL_SHADER(pbr_ps30);
+            // The convar is only read here; the dynamic state follows whatever this snapshot picked
+            pContextData->m_bStaticFlowControl = mat_pbr_staticflowcontrol.GetBool();
+            if (pContextData->m_bStaticFlowControl)
+            {
+                // Envambient, emissive, specular and lightwarp are boolean constants in this build
+                DECLARE_STATIC_PIXEL_SHADER(pbr_uber_ps30);
+                SET_STATIC_PIXEL_SHADER_COMBO(FLASHLIGHT, bHasFlashlight);
+                SET_STATIC_PIXEL_SHADER_COMBO(FLASHLIGHTDEPTHFILTERMODE, nShadowFilterMode);
+                SET_STATIC_PIXEL_SHADER_COMBO(LIGHTMAPPED, bLightMapped);
+                SET_STATIC_PIXEL_SHADER_COMBO(PARALLAXOCCLUSION, useParallax);
+                SET_STATIC_PIXEL_SHADER_COMBO(WORLD_NORMAL, bWorldNormal);
+                SET_STATIC_PIXEL_SHADER_COMBO(WRINKLEMAP, bWrinkleMapping);
+                SET_STATIC_PIXEL_SHADER_COMBO(SUBSURFACESCATTERING, bThicknessTexture);
+                SET_STATIC_PIXEL_SHADER(pbr_uber_ps30);
+            }
+            else
+            {
+                DECLARE_STATIC_PIXEL_SHADER(pbr_ps30);
+                SET_STATIC_PIXEL_SHADER_COMBO(FLASHLIGHT, bHasFlashlight);
+                SET_STATIC_PIXEL_SHADER_COMBO(FLASHLIGHTDEPTHFILTERMODE, nShadowFilterMode);
+                SET_STATIC_PIXEL_SHADER_COMBO(LIGHTMAPPED, bLightMapped);
+                SET_STATIC_PIXEL_SHADER_COMBO(USEENVAMBIENT, bUseEnvAmbient);
+                SET_STATIC_PIXEL_SHADER_COMBO(EMISSIVE, bHasEmissionTexture);
+                SET_STATIC_PIXEL_SHADER_COMBO(SPECULAR, bHasSpecularTexture);
+                SET_STATIC_PIXEL_SHADER_COMBO(PARALLAXOCCLUSION, useParallax);
+                SET_STATIC_PIXEL_SHADER_COMBO(WORLD_NORMAL, bWorldNormal);
+                SET_STATIC_PIXEL_SHADER_COMBO(LIGHTWARPTEXTURE, bLightwarpTexture);
+                SET_STATIC_PIXEL_SHADER_COMBO(WRINKLEMAP, bWrinkleMapping);
+                SET_STATIC_PIXEL_SHADER_COMBO(SUBSURFACESCATTERING, bThicknessTexture);
+                SET_STATIC_PIXEL_SHADER(pbr_ps30);
+            }
 
             // Setting up fog
             if (bHasFlashlight)
@@ -665,6 +706,7 @@ BEGIN_VS_SHADER(PBR, "PBR shader")
             SET_DYNAMIC_VERTEX_SHADER(pbr_vs30);
 
             // Setting up dynamic pixel shader
+            // Both pixel shader builds have the same dynamic combos, so the index is shared
             DECLARE_DYNAMIC_PIXEL_SHADER(pbr_ps30);
             SET_DYNAMIC_PIXEL_SHADER_COMBO(NUM_LIGHTS, lightState.m_nNumLights);
             SET_DYNAMIC_PIXEL_SHADER_COMBO(WRITEWATERFOGTODESTALPHA, bWriteWaterFogToAlpha);
@@ -674,6 +716,19 @@ BEGIN_VS_SHADER(PBR, "PBR shader")
             SET_DYNAMIC_PIXEL_SHADER_COMBO(UBERLIGHT, flashlightState.m_bUberlight);
             SET_DYNAMIC_PIXEL_SHADER(pbr_ps30);
 
+            // Feature switches for the static flow control build
+            if (pContextData->m_bStaticFlowControl)
+            {
+                BOOL bFeatures[4] =
+                {
+                    bUseEnvAmbient,
+                    bHasEmissionTexture,
+                    bHasSpecularTexture,
+                    bLightwarpTexture
+                };
+                pShaderAPI->SetBooleanPixelShaderConstant(PSREG_PBR_BOOL_USEENVAMBIENT, bFeatures, 4);
+            }
+
             // Setting up base texture transform
             SetVertexShaderTextureTransform(VERTEX_SHADER_SHADER_SPECIFIC_CONST_0, info.baseTextureTransform);
 
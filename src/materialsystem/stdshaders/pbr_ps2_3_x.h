@@ -0,0 +1,334 @@
+//==================================================================================================
+//
+// Physically Based Rendering pixel shader body, shared by pbr_ps30 and pbr_uber_ps30
+//
+// EMISSIVE, SPECULAR, LIGHTWARPTEXTURE and USEENVAMBIENT are only tested with if(), never #if,
+// so they can be either static combos or boolean constants (static flow control)
+//
+//==================================================================================================
+
+#include "common_ps_fxc.h"
+#include "common_flashlight_fxc.h"
+#include "common_lightmappedgeneric_fxc.h"
+#include "shader_constant_register_map.h"
+
+#if STATIC_FLOW_CONTROL
+// These features are not combos in this build, branch on boolean constants instead
+const bool g_bUseEnvAmbient                     : register(PSREG_PBR_BOOL_USEENVAMBIENT);
+const bool g_bEmissive                          : register(PSREG_PBR_BOOL_EMISSIVE);
+const bool g_bSpecular                          : register(PSREG_PBR_BOOL_SPECULAR);
+const bool g_bLightwarpTexture                  : register(PSREG_PBR_BOOL_LIGHTWARPTEXTURE);
+#define USEENVAMBIENT                           g_bUseEnvAmbient
+#define EMISSIVE                                g_bEmissive
+#define SPECULAR                                g_bSpecular
+#define LIGHTWARPTEXTURE                        g_bLightwarpTexture
+#endif
+
+#include "pbr_common_ps2_3_x.h"
+
+// Models interpolate the vertex tangent frame, brushes reconstruct it from derivatives
+#define VERTEX_TANGENT ( !LIGHTMAPPED )
+
+const float4 g_DiffuseModulation                : register(PSREG_DIFFUSE_MODULATION);
+const float4 g_ShadowTweaks                     : register(PSREG_ENVMAP_TINT__SHADOW_TWEAKS);
+const float3 cAmbientCube[6]                    : register(PSREG_AMBIENT_CUBE);
+const float4 g_EyePos                           : register(PSREG_EYEPOS_SPEC_EXPONENT);
+const float4 g_FogParams                        : register(PSREG_FOG_PARAMS);
+const float4 g_FlashlightAttenuationFactors     : register(PSREG_FLASHLIGHT_ATTENUATION);
+const float4 g_FlashlightPos                    : register(PSREG_FLASHLIGHT_POSITION_RIM_BOOST);
+const float4x4 g_FlashlightWorldToTexture       : register(PSREG_FLASHLIGHT_TO_WORLD_TEXTURE);
+PixelShaderLightInfo cLightInfo[3]              : register(PSREG_LIGHT_INFO_ARRAY);         // 2 registers each - 6 registers total (4th light spread across w's)
+const float4 g_BaseColor                        : register(PSREG_SELFILLUMTINT);
+
+#if PARALLAXOCCLUSION
+const float4 g_ParallaxParms                    : register(PSREG_SHADER_CONTROLS);
+#define PARALLAX_DEPTH                          g_ParallaxParms.r
+#define PARALLAX_CENTER                         g_ParallaxParms.g
+#endif
+
+#if UBERLIGHT
+const float3 g_vSmoothEdge0						: register(PSREG_UBERLIGHT_SMOOTH_EDGE_0);
+const float3 g_vSmoothEdge1						: register(PSREG_UBERLIGHT_SMOOTH_EDGE_1);
+const float3 g_vSmoothOneOverWidth				: register(PSREG_UBERLIGHT_SMOOTH_EDGE_OOW);
+const float4 g_vShearRound						: register(PSREG_UBERLIGHT_SHEAR_ROUND);
+const float4 g_aAbB								: register(PSREG_UBERLIGHT_AABB);
+const float4x4 g_FlashlightWorldToLight			: register(PSREG_UBERLIGHT_WORLD_TO_LIGHT);
+#endif
+
+const float4 g_MRAOFactors						: register(PSREG_PBR_MRAO_FACTORS); // Metalness, roughness, AO, SSAO factor
+const float4 g_EmissiveSpecularSSSFactors		: register(PSREG_PBR_EXTRA_FACTORS); // Emissive, specular factor, SSS intensity, SSS power scale
+const float4 g_SSSColor							: register(PSREG_PBR_SSS_COLOR); // Subsurface scattering color
+
+sampler BaseTextureSampler          : register(s0);     // Base map, selfillum in alpha
+sampler NormalTextureSampler        : register(s1);     // Normal map
+sampler EnvmapSampler               : register(s2);     // Cubemap
+sampler LightwarpSampler            : register(s3);     // Lightwarp texture
+sampler ThicknessTextureSampler     : register(s3);	    // SSS thickness texture
+sampler ShadowDepthSampler          : register(s4);     // Flashlight shadow depth map sampler
+sampler RandRotSampler              : register(s5);     // RandomRotation sampler
+sampler FlashlightSampler           : register(s6);     // Flashlight cookie 
+sampler LightmapSampler             : register(s7);     // Lightmap
+#if WRINKLEMAP
+sampler WrinkleSampler				: register(s8);		// Compression base
+sampler StretchSampler				: register(s9);		// Expansion base
+sampler NormalWrinkleSampler		: register(s14);	// Compression normal
+sampler NormalStretchSampler		: register(s15);	// Expansion normal
+#endif
+sampler MRAOTextureSampler          : register(s10);    // MRAO texture
+sampler EmissionTextureSampler      : register(s11);    // Emission texture
+sampler SpecularTextureSampler      : register(s12);    // Specular F0 texture
+
+sampler AmbientOcclusionSampler	    : register(s13);	 // SFM SSAO sampler
+
+#define ENVMAPLOD (g_EyePos.a)
+
+struct PS_INPUT
+{
+	float2 vPos						: VPOS;
+    float2 baseTexCoord             : TEXCOORD0;
+    float4 lightAtten               : TEXCOORD1;
+    float3 worldNormal              : TEXCOORD2;
+    float3 worldPos                 : TEXCOORD3;
+    float4 projPos_wrinkleWeight    : TEXCOORD4; // wrinkle weight in w
+    float4 lightmapTexCoord1And2    : TEXCOORD5; 
+    float4 lightmapTexCoord3        : TEXCOORD6;
+    float4 worldTangentS_sign       : TEXCOORD7; // Binormal sign in w
+};
+
+// Entry point
+float4 main(PS_INPUT i) : COLOR
+{
+    float3 EnvAmbientCube[6];
+    if (USEENVAMBIENT)
+    {
+        setupEnvMapAmbientCube(EnvAmbientCube, EnvmapSampler);
+    }
+    else
+    {
+        for (int k = 0; k < 6; ++k)
+            EnvAmbientCube[k] = cAmbientCube[k];
+    }
+
+    float3 surfNormal = normalize(i.worldNormal);
+    float3 surfTangent;
+    float3 surfBase; 
+#if VERTEX_TANGENT
+    float3x3 normalBasis = vertex_tangent_frame(surfNormal, i.worldTangentS_sign, surfTangent, surfBase);
+#else
+    float flipSign;
+    float3x3 normalBasis = compute_tangent_frame(surfNormal, i.worldPos, i.baseTexCoord , surfTangent, surfBase, flipSign);
+#endif
+
+#if PARALLAXOCCLUSION
+    float3 outgoingLightRay = g_EyePos.xyz - i.worldPos;
+    float3 outgoingLightDirectionTS = worldToRelative( outgoingLightRay, surfTangent, surfBase, surfNormal);
+    float2 correctedTexCoord = parallaxCorrect(i.baseTexCoord, outgoingLightDirectionTS , outgoingLightRay, i.worldNormal, NormalTextureSampler , PARALLAX_DEPTH , PARALLAX_CENTER);
+#else
+    float2 correctedTexCoord = i.baseTexCoord;
+#endif
+
+    float4 albedo = tex2D(BaseTextureSampler, correctedTexCoord);
+	
+	float wrinkleAmount, stretchAmount, textureAmount;
+#if WRINKLEMAP
+	{
+		float wrinkleWeight = i.projPos_wrinkleWeight.w;
+
+		wrinkleAmount = saturate(-wrinkleWeight);	// One of these two is zero
+		stretchAmount = saturate(wrinkleWeight);	// while the other is in the 0..1 range
+
+		textureAmount = 1.0f - wrinkleAmount - stretchAmount; // These should sum to one
+
+		float4 wrinkleColor = tex2D(WrinkleSampler, correctedTexCoord);
+		float4 stretchColor = tex2D(StretchSampler, correctedTexCoord);
+
+		// Apply wrinkle blend to only RGB
+		albedo.rgb =  (textureAmount * albedo) 
+					+ (wrinkleAmount * wrinkleColor) 
+					+ (stretchAmount * stretchColor);
+	}
+#endif
+	
+    albedo.xyz *= g_BaseColor;
+	
+	float3 normalTexel = tex2D(NormalTextureSampler, correctedTexCoord).xyz;
+#if WRINKLEMAP
+	{
+		float3 wrinkleNormal = tex2D(NormalWrinkleSampler, correctedTexCoord).xyz;
+		float3 stretchNormal = tex2D(NormalStretchSampler, correctedTexCoord).xyz;
+		normalTexel = textureAmount * normalTexel + wrinkleAmount * wrinkleNormal + stretchAmount * stretchNormal;
+	}
+#endif
+	
+    float3 textureNormal = normalize((normalTexel - float3(0.5, 0.5, 0.5)) * 2);
+    float3 normal = normalize(mul(textureNormal, normalBasis)); // World Normal
+
+    float3 mrao = saturate(tex2D(MRAOTextureSampler, correctedTexCoord).xyz * g_MRAOFactors.xyz);
+	
+    float metalness = mrao.x;
+	float roughness = mrao.y;
+	float ambientOcclusion = mrao.z;
+	
+    float3 emission = 0.0;
+    if (EMISSIVE)
+    {
+        emission = tex2D(EmissionTextureSampler, correctedTexCoord).xyz * g_EmissiveSpecularSSSFactors.x;
+    }
+
+    float3 specular = 0.0;
+    if (SPECULAR)
+    {
+        specular = saturate(tex2D(SpecularTextureSampler, correctedTexCoord).xyz * g_EmissiveSpecularSSSFactors.y);
+    }
+
+#if SUBSURFACESCATTERING
+    float3 thickness = tex2D(ThicknessTextureSampler, correctedTexCoord).xyz;
+#endif
+
+	// SSAO samplo
+	float ssao = lerp( 1.0f, tex2D( AmbientOcclusionSampler, ComputeScreenPos( i.vPos ) ).r, g_MRAOFactors.w );
+	ambientOcclusion *= ssao;
+	
+#if !VERTEX_TANGENT
+    textureNormal.y *= flipSign; // Fixup textureNormal for ambient lighting
+#endif
+
+    float3 outgoingLightDirection = normalize(g_EyePos.xyz - i.worldPos); // Lo
+    float lightDirectionAngle = max(0, dot(normal, outgoingLightDirection)); // cosLo
+
+    float3 specularReflectionVector = 2.0 * lightDirectionAngle * normal - outgoingLightDirection; // Lr
+
+    float3 fresnelReflectance; // F0
+    if (SPECULAR)
+    {
+        fresnelReflectance = specular.rgb;
+    }
+    else
+    {
+        float3 dielectricCoefficient = 0.04; //F0 dielectric
+        fresnelReflectance = lerp(dielectricCoefficient, albedo.rgb, metalness);
+    }
+
+	float3 projPos = i.projPos_wrinkleWeight.xyz;
+
+    // Start ambient
+    float3 ambientLighting = 0.0;
+    if (!FLASHLIGHT)
+    {
+        float3 diffuseIrradiance = ambientLookup(normal, EnvAmbientCube, textureNormal, i.lightmapTexCoord1And2, i.lightmapTexCoord3, LightmapSampler, g_DiffuseModulation);
+        // return float4(diffuseIrradiance, 1); // testing diffuse irraciance
+        float3 ambientLightingFresnelTerm = fresnelSchlickRoughness(fresnelReflectance, lightDirectionAngle, roughness); // F
+        float3 diffuseContributionFactor = 1 - ambientLightingFresnelTerm; // kd
+        if (!SPECULAR)
+        {
+            diffuseContributionFactor = lerp(diffuseContributionFactor, 0, metalness);
+        }
+        float3 diffuseIBL = diffuseContributionFactor * albedo.rgb * diffuseIrradiance;
+
+        float4 specularUV = float4(specularReflectionVector, roughness * ENVMAPLOD);
+        float3 lookupHigh = ENV_MAP_SCALE * texCUBElod(EnvmapSampler, specularUV).xyz;
+        float3 lookupLow = PixelShaderAmbientLight(specularReflectionVector, EnvAmbientCube);
+        float3 specularIrradiance = lerp(lookupHigh, lookupLow, roughness * roughness);
+        float3 specularIBL = specularIrradiance * EnvBRDFApprox(fresnelReflectance, roughness, lightDirectionAngle);
+
+        ambientLighting = (diffuseIBL + specularIBL) * ambientOcclusion;
+    }
+    // End ambient
+
+    // Start direct
+    float3 directLighting = 0.0;
+    if (!FLASHLIGHT) {
+        for (uint n = 0; n < NUM_LIGHTS; ++n)
+        {
+            float3 LightIn = normalize(PixelShaderGetLightVector(i.worldPos, cLightInfo, n));
+            float3 LightColor = PixelShaderGetLightColor(cLightInfo, n) * GetAttenForLight(i.lightAtten, n); // Li
+
+            directLighting += calculateLight(LightIn, LightColor, outgoingLightDirection,
+                    normal, fresnelReflectance, roughness, metalness, lightDirectionAngle, albedo.rgb, LightwarpSampler);
+            
+#if SUBSURFACESCATTERING
+            float3 sssContribution = ComputeSubsurfaceScattering(normal, LightIn, outgoingLightDirection,
+                thickness.r, g_SSSColor.rgb, g_EmissiveSpecularSSSFactors.z, g_EmissiveSpecularSSSFactors.w);
+            directLighting += sssContribution * LightColor;
+#endif	
+        }
+    }
+    // End direct
+
+    // Start flashlight
+    if (FLASHLIGHT)
+    {
+        float4 flashlightSpacePosition = mul(float4(i.worldPos, 1.0), g_FlashlightWorldToTexture);
+        clip( flashlightSpacePosition.w ); // stop projected textures from projecting backwards (only really happens if they have a big FOV because they get frustum culled.)
+        float3 vProjCoords = flashlightSpacePosition.xyz / flashlightSpacePosition.w;
+
+        float3 delta = g_FlashlightPos.xyz - i.worldPos;
+        float distSquared = dot(delta, delta);
+        float dist = sqrt(distSquared);
+
+        float3 flashlightColor = tex2D(FlashlightSampler, vProjCoords.xy);
+        flashlightColor *= cFlashlightColor.xyz;
+		
+		float fAtten = saturate(dot(g_FlashlightAttenuationFactors.xyz, float3(1.0, 1.0 / dist, 1.0 / distSquared)));
+
+#if FLASHLIGHTSHADOWS
+        float flashlightShadow = DoFlashlightShadow(ShadowDepthSampler, RandRotSampler, vProjCoords, projPos, FLASHLIGHTDEPTHFILTERMODE, g_ShadowTweaks, true);
+        float flashlightAttenuated = lerp(flashlightShadow, 1.0, g_ShadowTweaks.y);         // Blend between fully attenuated and not attenuated
+        flashlightShadow = saturate(lerp(flashlightAttenuated, flashlightShadow, fAtten));  // Blend between shadow and above, according to light attenuation
+
+        flashlightColor *= flashlightShadow;
+#endif
+
+		flashlightColor *= fAtten;
+
+#if UBERLIGHT
+		float4 uberLightPosition = mul( float4( i.worldPos.xyz, 1.0f ), g_FlashlightWorldToLight ).yzxw;
+		flashlightColor *= uberlight( uberLightPosition.xyz, g_vSmoothEdge0, g_vSmoothEdge1,
+				           g_vSmoothOneOverWidth, g_vShearRound.xy, g_aAbB, g_vShearRound.zw );
+#endif
+
+        float farZ = g_FlashlightAttenuationFactors.w;
+        float endFalloffFactor = RemapValClamped(dist, farZ, 0.6 * farZ, 0.0, 1.0);
+
+        float3 flashLightIntensity = flashlightColor * endFalloffFactor;
+        
+        float3 flashLightIn = normalize(delta);
+
+        directLighting += max(0, calculateLight(flashLightIn, flashLightIntensity, outgoingLightDirection,
+                normal, fresnelReflectance, roughness, metalness, lightDirectionAngle, albedo.rgb, LightwarpSampler));
+                
+#if SUBSURFACESCATTERING
+        float3 sssContribution = ComputeSubsurfaceScattering(normal, flashLightIn, outgoingLightDirection,
+            thickness.r, g_SSSColor.rgb, g_EmissiveSpecularSSSFactors.z, g_EmissiveSpecularSSSFactors.w);
+        directLighting += sssContribution * flashLightIntensity;
+#endif
+    }
+    // End flashlight
+
+float fogFactor = 0.0f;
+#if !FLASHLIGHT
+fogFactor = CalcPixelFogFactor(PIXELFOGTYPE, g_FogParams, g_EyePos.xyz, i.worldPos.xyz, projPos.z);
+#endif
+
+float alpha = 0.0f;
+#if WRITEWATERFOGTODESTALPHA && (PIXELFOGTYPE == PIXEL_FOG_TYPE_HEIGHT)
+    alpha = fogFactor;
+#else
+    alpha = albedo.a;
+#endif
+
+    bool bWriteDepthToAlpha = (WRITE_DEPTH_TO_DESTALPHA != 0) && (WRITEWATERFOGTODESTALPHA == 0);
+
+    float3 combinedLighting = directLighting + ambientLighting;
+    if (EMISSIVE && !FLASHLIGHT)
+    {
+        combinedLighting += emission;
+    }
+
+#if ( WORLD_NORMAL )
+	float fSSAODepth = i.lightmapTexCoord3.w;
+	return float4( normal, fSSAODepth );
+#else
+    return FinalOutput(float4(combinedLighting, alpha), fogFactor, PIXELFOGTYPE, TONEMAP_SCALE_LINEAR, bWriteDepthToAlpha, projPos.z);
+#endif
+}
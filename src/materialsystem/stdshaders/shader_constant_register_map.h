@@ -60,6 +60,12 @@
 #define PSREG_PBR_EXTRA_FACTORS					PSREG_CONSTANT_47
 #define	PSREG_PBR_SSS_COLOR						PSREG_CONSTANT_48
 
+// Boolean constants, only read by the static flow control build (pbr_uber_ps30)
+#define PSREG_PBR_BOOL_USEENVAMBIENT			PSREG_BOOL_CONSTANT_00
+#define PSREG_PBR_BOOL_EMISSIVE					PSREG_BOOL_CONSTANT_01
+#define PSREG_PBR_BOOL_SPECULAR					PSREG_BOOL_CONSTANT_02
+#define PSREG_PBR_BOOL_LIGHTWARPTEXTURE			PSREG_BOOL_CONSTANT_03
+
 #ifndef C_CODE_HACK
 //for fxc code, map the constants to register names.
 #define PSREG_CONSTANT_00	c0
@@ -111,4 +117,9 @@
 #define PSREG_CONSTANT_46	c46
 #define PSREG_CONSTANT_47	c47
 #define PSREG_CONSTANT_48	c48
+
+#define PSREG_BOOL_CONSTANT_00	b0
+#define PSREG_BOOL_CONSTANT_01	b1
+#define PSREG_BOOL_CONSTANT_02	b2
+#define PSREG_BOOL_CONSTANT_03	b3
 #endif
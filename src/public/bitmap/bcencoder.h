@@ -0,0 +1,75 @@
+//==================================================================================================
+//
+// Block compression of RGBA8888 images to DXT1, DXT5, ATI1N and ATI2N
+//
+// Blocks are fit on the principal axis of their pixels and refined by least squares, with the
+// error measured the way the channels are used: linear for packed data such as MRAO, luminance
+// weighted for gamma encoded color and angular for tangent space normals. Rows of blocks can be
+// encoded in parallel on a thread pool.
+//
+//==================================================================================================
+
+#ifndef BCENCODER_H
+#define BCENCODER_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "bitmap/imageformat.h"
+
+class IThreadPool;
+
+enum BCQuality_t
+{
+	BC_QUALITY_FAST = 0,		// Bounding box endpoints
+	BC_QUALITY_NORMAL,			// Principal axis endpoints refined by least squares
+	BC_QUALITY_EXHAUSTIVE,		// Also searches the endpoints around the best fit
+
+	BC_QUALITY_COUNT
+};
+
+enum BCErrorMetric_t
+{
+	BC_METRIC_LINEAR = 0,		// Independent channels such as MRAO, weighted equally
+	BC_METRIC_SRGB,				// Gamma encoded color, channels weighted by their share of luminance
+	BC_METRIC_NORMAL,			// Tangent space normals in RGB, error is the angle between normals
+
+	BC_METRIC_COUNT
+};
+
+struct BCEncodeParams_t
+{
+	BCEncodeParams_t()
+	{
+		m_Quality = BC_QUALITY_NORMAL;
+		m_Metric = BC_METRIC_LINEAR;
+		m_pThreadPool = NULL;
+		m_nAlphaThreshold = 128;
+	}
+
+	BCQuality_t		m_Quality;
+	BCErrorMetric_t	m_Metric;
+	IThreadPool		*m_pThreadPool;			// Rows of blocks are spread over it, NULL encodes on the calling thread
+	int				m_nAlphaThreshold;		// Lower alpha is transparent in IMAGE_FORMAT_DXT1_ONEBITALPHA
+};
+
+// True for DXT1, DXT1_ONEBITALPHA, DXT5, ATI1N and ATI2N
+bool BCCanEncode( ImageFormat fmt );
+
+// Encodes an RGBA8888 image of any size, partial blocks repeat the edge pixels. ATI1N stores red,
+// ATI2N stores red in its first block and green in its second
+bool BCEncodeImage( const uint8 *pSrc, int nWidth, int nHeight, int nSrcStride, ImageFormat dstFormat,
+	uint8 *pDst, const BCEncodeParams_t &params );
+
+// Decodes DXT1, DXT1_ONEBITALPHA, DXT3, DXT5, ATI1N and ATI2N to RGBA8888. ATI2N gets the z of
+// the normal in blue
+bool BCDecodeImage( const uint8 *pSrc, ImageFormat srcFormat, int nWidth, int nHeight, uint8 *pDst, int nDstStride );
+
+// True for the formats above and the uncompressed 8 bit per channel RGBA, RGB, I, IA and A formats
+bool CanDecodeToRGBA8888( ImageFormat fmt );
+
+// Decodes a tightly packed image in any of those formats to RGBA8888
+bool DecodeToRGBA8888( const uint8 *pSrc, ImageFormat srcFormat, int nWidth, int nHeight, uint8 *pDst );
+
+#endif // BCENCODER_H
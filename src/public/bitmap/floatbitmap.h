@@ -187,6 +187,18 @@ public:
 		uint32 flags                                  // SPF_xxx
 		);
 
+	// Solves the same equation as Poisson with multigrid V-cycles, each of which costs a few
+	// iterations of Poisson but removes the error at every scale. Locked pixels are the ones with
+	// alpha 0, the others converge to the same values whatever their alpha. Edges wrap. Work is
+	// spread over the thread pool given to SetThreadPool
+	void PoissonMultigrid( FloatBitMap_t * deltas[4],
+		int nVCycles,
+		uint32 flags                                  // SPF_xxx
+		);
+
+	// same as MakeTileable, solved with PoissonMultigrid
+	void MakeTileableMultigrid( void );
+
 	void QuarterSize( FloatBitMap_t *pBitmap );				// get a new one downsampled
 	void QuarterSizeBlocky( FloatBitMap_t *pBitmap );		// get a new one downsampled
 	void QuarterSizeWithGaussian( FloatBitMap_t *pBitmap );	// downsample 2x using a gaussian
@@ -226,6 +238,16 @@ public:
 		uint32 nOptionFlags = 0								// SSBUMP_OPTION_XXX
 		) const;
 
+	// same as ComputeSelfShadowedBumpmapFromHeightInAlphaChannel, but the rays are marched
+	// through a max mip pyramid of the height field instead of traced against its triangles, so
+	// it is much faster and doesn't need raytrace.lib. Edges wrap. If pMRAO is given, the ambient
+	// occlusion is written to its blue channel. It must be the same size as this bitmap
+	FloatBitMap_t * ComputeSelfShadowedBumpmapFromHeightInAlphaChannelMarched(
+		float bump_scale, int nrays_to_trace_per_pixel = 100,
+		uint32 nOptionFlags = 0,							// SSBUMP_OPTION_XXX
+		FloatBitMap_t *pMRAO = NULL
+		) const;
+
 
 	// generate a conventional normal map from a source with height stored in alpha.
 	FloatBitMap_t *ComputeBumpmapFromHeightInAlphaChannel( float bump_scale ) const ;
@@ -236,8 +258,13 @@ public:
 	// convolution that can be done via fft.
 	void TileableBilateralFilter( int radius_in_pixels, float edge_threshold_value );
 
+	// same as TileableBilateralFilter, approximated with a bilateral grid so that the cost no
+	// longer grows with the radius. Small radii fall back to TileableBilateralFilter
+	void TileableBilateralGridFilter( int radius_in_pixels, float edge_threshold_value );
+
 	// Sets a thread pool for all float bitmap work to be done on
 	static void SetThreadPool( IThreadPool* pPool );
+	static IThreadPool *GetThreadPool() { return sm_pFBMThreadPool; }
 
 protected:
 	void QuarterSize2D( FloatBitMap_t *pDest, int nStart, int nCount );
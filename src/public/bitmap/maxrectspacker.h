@@ -0,0 +1,88 @@
+//==================================================================================================
+//
+// MaxRects texture atlas packer
+//
+// Keeps every maximal free rectangle of the page, overlapping each other, and places a texture
+// in the one it fills best along its shorter side. With rotation allowed a texture may be turned
+// 90 degrees when that fits better, which callers then have to honour. The interface matches
+// CTexturePacker, except that any texture can be removed and its space is
+// given back to the page rather than only the last leaves of a tree.
+//
+//==================================================================================================
+
+#ifndef MAXRECTSPACKER_H
+#define MAXRECTSPACKER_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier1/utlvector.h"
+#include "bitmap/texturepacker.h"
+
+//-----------------------------------------------------------------------------
+// Purpose: manages texture packing of textures as they are added.
+//-----------------------------------------------------------------------------
+class CMaxRectsTexturePacker
+{
+public:
+	struct TreeEntry_t
+	{
+		Rect_t			rc;						// Where the texture went, width and height swapped when rotated
+		bool			bInUse;
+		bool			bRotated;				// Turned 90 degrees clockwise to fit
+	};
+
+	CMaxRectsTexturePacker( int texWidth = DEFAULT_TEXTURE_PAGE_WIDTH, int texHeight = DEFAULT_TEXTURE_PAGE_WIDTH, int pixelGap = 0, bool bAllowRotation = false );
+	~CMaxRectsTexturePacker();
+
+	// Returns the entry index, -1 if it doesn't fit. The node index is there to match
+	// CTexturePacker, there is no tree and it is ignored
+	int InsertRect( const Rect_t& texRect, int nodeIndex = -1 );
+
+	// Inserts largest first, which packs tighter than the order given. pIndicesOut gets the entry
+	// index of each rect, -1 for the ones that didn't fit. Returns how many did
+	int InsertRects( const Rect_t *pTexRects, int nCount, int *pIndicesOut );
+
+	bool RemoveRect( int nodeIndex );
+	const TreeEntry_t &GetEntry( int i )
+	{
+		return m_Entries[i];
+	}
+	int GetPageWidth()
+	{
+		return m_PageWidth;
+	}
+	int GetPageHeight()
+	{
+		return m_PageHeight;
+	}
+
+	// Share of the page covered by textures, gaps excluded
+	float GetOccupancy() const;
+
+	// clears the page
+	void Clear();
+
+private:
+	bool FindPosition( int nWidth, int nHeight, Rect_t *pRect, bool *pRotated ) const;
+	void Place( const Rect_t &rect );
+	void AddFreeRect( const Rect_t &rect );
+	void AddFreedRect( const Rect_t &freed );
+	void PruneFreeRects( int nFirstNew );
+
+	// Pixel gap between textures.
+	int m_PixelGap;
+	int m_PageWidth;
+	int m_PageHeight;
+	bool m_bAllowRotation;
+
+	// Free rectangles include the gap, which is kept to the right of and below each texture
+	CUtlVector< Rect_t > m_FreeRects;
+	CUtlVector< TreeEntry_t > m_Entries;
+	CUtlVector< int > m_UnusedEntries;			// Removed entries, reused before new ones are added
+	int m_nUsedArea;
+};
+
+
+#endif // MAXRECTSPACKER_H
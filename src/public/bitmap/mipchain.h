@@ -0,0 +1,78 @@
+//==================================================================================================
+//
+// Mip chains for PBR texture sets
+//
+// Every mip is filtered from the one above it in linear space: gamma encoded color is converted to
+// linear light first and normals are averaged as vectors, then renormalized. The length lost by
+// averaging is the variance of the normals under the texel, which the MRAO chain of the same
+// material adds to its roughness so that bumps too small to be seen still widen the highlight.
+//
+//==================================================================================================
+
+#ifndef MIPCHAIN_H
+#define MIPCHAIN_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "bitmap/floatbitmap.h"
+#include "tier1/utlvector.h"
+
+class IThreadPool;
+
+enum MipChainType_t
+{
+	MIPCHAIN_LINEAR = 0,		// Height, masks and MRAO, filtered as stored
+	MIPCHAIN_SRGB,				// Gamma encoded color in RGB, filtered in linear light
+	MIPCHAIN_NORMAL,			// Tangent space normals stored as ( n + 1 ) / 2 in RGB
+
+	MIPCHAIN_TYPE_COUNT
+};
+
+struct MipChainParams_t
+{
+	MipChainParams_t()
+	{
+		m_Type = MIPCHAIN_LINEAR;
+		m_nFlags = 0;
+		m_flAlphaThreshold = 0.5f;
+		m_pThreadPool = NULL;
+	}
+
+	MipChainType_t	m_Type;
+	int				m_nFlags;				// DownsampleFlags_t. Edges wrap unless clamped, DOWNSAMPLE_ALPHATEST keeps the alpha tested coverage
+	float			m_flAlphaThreshold;		// Alpha test reference for DOWNSAMPLE_ALPHATEST
+	IThreadPool		*m_pThreadPool;			// Rows of each mip are spread over it, NULL for the FloatBitMap_t::SetThreadPool one
+};
+
+//-----------------------------------------------------------------------------
+// Every mip of a texture down to 1x1, mip 0 is a copy of the source
+//-----------------------------------------------------------------------------
+class CMipChain
+{
+public:
+	CMipChain();
+	~CMipChain();
+
+	// Values are as stored in the texture, 0-1. Volume textures are reduced in depth too
+	bool Generate( const FloatBitMap_t &source, const MipChainParams_t &params );
+	void Purge();
+
+	int MipCount() const;
+	FloatBitMap_t &Mip( int nMip ) const;
+
+	// Variance of the normals under a texel of a normal map mip, 0 at mip 0 and for other types
+	float NormalVariance( int nMip, int x, int y, int z = 0 ) const;
+
+	// Raises the roughness in the green channel of an MRAO chain by the variance of a normal map
+	// chain (Toksvig). The two can differ in size, mips covering the same footprint are matched
+	void ApplyNormalVariance( const CMipChain &normals, float flScale = 1.0f );
+
+private:
+	CUtlVector< FloatBitMap_t * >	m_Mips;
+	CUtlVector< float * >			m_Variance;		// Per texel of each mip, normal maps only
+	MipChainType_t					m_Type;
+};
+
+#endif // MIPCHAIN_H
@@ -0,0 +1,311 @@
+//==================================================================================================
+//
+// Purpose: Hardware performance counters through perf_event_open
+//
+// The PME headers program the counter MSRs through a Windows driver. On Linux the kernel does
+// that for us: each counter is a perf event of the calling thread, optionally inherited by the
+// threads it creates afterwards, counted in user mode only. Counts are scaled by the time the
+// event was actually on the PMU when the kernel had to multiplex them.
+//
+// Reading a counter is a system call, so scopes should be around work of a few microseconds or
+// more. Everywhere else Init() fails and the counters read as unavailable.
+//
+//==================================================================================================
+
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <string.h>
+#include "tier0/platform.h"
+#include "tier0/fasttimer.h"
+
+#ifdef _LINUX
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+enum PerfCounter_t
+{
+	PERF_COUNTER_CYCLES = 0,
+	PERF_COUNTER_INSTRUCTIONS,
+	PERF_COUNTER_L1D_MISSES,
+	PERF_COUNTER_LLC_MISSES,
+	PERF_COUNTER_BRANCH_MISSES,
+
+	PERF_COUNTER_COUNT
+};
+
+//-----------------------------------------------------------------------------
+// Counts of one measurement, only the counters in the valid mask were counted
+//-----------------------------------------------------------------------------
+struct PerfCounterValues_t
+{
+	uint64	m_nValues[PERF_COUNTER_COUNT];
+	uint32	m_nValidMask;
+
+	PerfCounterValues_t()								{ Init(); }
+	void Init()											{ memset( m_nValues, 0, sizeof( m_nValues ) ); m_nValidMask = 0; }
+
+	bool IsValid( PerfCounter_t counter ) const			{ return ( m_nValidMask & ( 1 << counter ) ) != 0; }
+	uint64 Get( PerfCounter_t counter ) const			{ return m_nValues[counter]; }
+
+	// Instructions per cycle, 0 when either wasn't counted
+	double GetIPC() const
+	{
+		if ( !IsValid( PERF_COUNTER_CYCLES ) || !IsValid( PERF_COUNTER_INSTRUCTIONS ) || !m_nValues[PERF_COUNTER_CYCLES] )
+			return 0.0;
+		return (double)m_nValues[PERF_COUNTER_INSTRUCTIONS] / (double)m_nValues[PERF_COUNTER_CYCLES];
+	}
+
+	// Events per thousand instructions, the usual way to compare miss counts across workloads
+	double GetPerKiloInstruction( PerfCounter_t counter ) const
+	{
+		if ( !IsValid( counter ) || !IsValid( PERF_COUNTER_INSTRUCTIONS ) || !m_nValues[PERF_COUNTER_INSTRUCTIONS] )
+			return 0.0;
+		return 1000.0 * (double)m_nValues[counter] / (double)m_nValues[PERF_COUNTER_INSTRUCTIONS];
+	}
+
+	PerfCounterValues_t &operator+=( const PerfCounterValues_t &other )
+	{
+		for ( int i = 0; i < PERF_COUNTER_COUNT; ++i )
+		{
+			m_nValues[i] += other.m_nValues[i];
+		}
+		m_nValidMask = m_nValidMask ? ( m_nValidMask & other.m_nValidMask ) : other.m_nValidMask;
+		return *this;
+	}
+
+	// dest = end - start
+	static void Sub( const PerfCounterValues_t &end, const PerfCounterValues_t &start, PerfCounterValues_t &dest )
+	{
+		for ( int i = 0; i < PERF_COUNTER_COUNT; ++i )
+		{
+			dest.m_nValues[i] = end.m_nValues[i] - start.m_nValues[i];
+		}
+		dest.m_nValidMask = end.m_nValidMask & start.m_nValidMask;
+	}
+};
+
+//-----------------------------------------------------------------------------
+// The counters of the calling thread. They run from Init() on, measurements
+// are differences of two Read() calls
+//-----------------------------------------------------------------------------
+class CPerfCounters
+{
+public:
+	CPerfCounters();
+	~CPerfCounters();
+
+	// With bChildThreads the counts include the threads created after this call, added in when
+	// they exit. Returns false when no counter could be opened
+	bool Init( bool bChildThreads = false );
+	void Shutdown();
+
+	bool IsValid() const								{ return m_nValidMask != 0; }
+	bool IsValid( PerfCounter_t counter ) const			{ return ( m_nValidMask & ( 1 << counter ) ) != 0; }
+
+	void Read( PerfCounterValues_t &values ) const;
+
+	static const char *GetName( PerfCounter_t counter );
+
+private:
+	int		m_nFiles[PERF_COUNTER_COUNT];
+	uint32	m_nValidMask;
+};
+
+inline CPerfCounters::CPerfCounters()
+{
+	for ( int i = 0; i < PERF_COUNTER_COUNT; ++i )
+	{
+		m_nFiles[i] = -1;
+	}
+	m_nValidMask = 0;
+}
+
+inline CPerfCounters::~CPerfCounters()
+{
+	Shutdown();
+}
+
+inline const char *CPerfCounters::GetName( PerfCounter_t counter )
+{
+	static const char *s_pNames[PERF_COUNTER_COUNT] = { "cycles", "instructions", "L1D misses", "LLC misses", "branch misses" };
+	return s_pNames[counter];
+}
+
+#ifdef _LINUX
+
+inline bool CPerfCounters::Init( bool bChildThreads )
+{
+	Shutdown();
+
+	static const uint32 s_nTypes[PERF_COUNTER_COUNT] =
+	{
+		PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+	};
+	static const uint64 s_nConfigs[PERF_COUNTER_COUNT] =
+	{
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_L1D | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 ),
+		PERF_COUNT_HW_CACHE_MISSES,
+		PERF_COUNT_HW_BRANCH_MISSES,
+	};
+
+	for ( int i = 0; i < PERF_COUNTER_COUNT; ++i )
+	{
+		struct perf_event_attr attr;
+		memset( &attr, 0, sizeof( attr ) );
+		attr.size = sizeof( attr );
+		attr.type = s_nTypes[i];
+		attr.config = s_nConfigs[i];
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.inherit = bChildThreads ? 1 : 0;
+
+		// Counters the CPU or the kernel settings don't allow are left out
+		m_nFiles[i] = (int)syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+		if ( m_nFiles[i] >= 0 )
+		{
+			m_nValidMask |= 1 << i;
+		}
+	}
+	return m_nValidMask != 0;
+}
+
+inline void CPerfCounters::Shutdown()
+{
+	for ( int i = 0; i < PERF_COUNTER_COUNT; ++i )
+	{
+		if ( m_nFiles[i] >= 0 )
+		{
+			close( m_nFiles[i] );
+			m_nFiles[i] = -1;
+		}
+	}
+	m_nValidMask = 0;
+}
+
+inline void CPerfCounters::Read( PerfCounterValues_t &values ) const
+{
+	values.Init();
+	for ( int i = 0; i < PERF_COUNTER_COUNT; ++i )
+	{
+		if ( m_nFiles[i] < 0 )
+			continue;
+
+		// Value, time enabled, time running
+		uint64 data[3];
+		if ( read( m_nFiles[i], data, sizeof( data ) ) != (ssize_t)sizeof( data ) || !data[2] )
+			continue;
+
+		values.m_nValues[i] = ( data[2] < data[1] ) ? (uint64)( (double)data[0] * (double)data[1] / (double)data[2] ) : data[0];
+		values.m_nValidMask |= 1 << i;
+	}
+}
+
+#else
+
+inline bool CPerfCounters::Init( bool bChildThreads )
+{
+	return false;
+}
+
+inline void CPerfCounters::Shutdown()
+{
+}
+
+inline void CPerfCounters::Read( PerfCounterValues_t &values ) const
+{
+	values.Init();
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+// CFastTimer that counts events too
+//-----------------------------------------------------------------------------
+class CPerfCounterTimer
+{
+public:
+	CPerfCounterTimer( const CPerfCounters &counters ) : m_Counters( counters ) {}
+
+	void				Start();
+	void				End();
+
+	const CCycleCount &	GetDuration() const					{ return m_Timer.GetDuration(); }
+	const PerfCounterValues_t &GetCounts() const			{ return m_Counts; }
+
+private:
+	const CPerfCounters	&m_Counters;
+	CFastTimer			m_Timer;
+	PerfCounterValues_t	m_Start;
+	PerfCounterValues_t	m_Counts;
+};
+
+inline void CPerfCounterTimer::Start()
+{
+	m_Counters.Read( m_Start );
+	m_Timer.Start();
+}
+
+inline void CPerfCounterTimer::End()
+{
+	m_Timer.End();
+	PerfCounterValues_t end;
+	m_Counters.Read( end );
+	PerfCounterValues_t::Sub( end, m_Start, m_Counts );
+}
+
+//-----------------------------------------------------------------------------
+// Adds the time and the counts of the block it's in to totals, like CTimeAdder
+//-----------------------------------------------------------------------------
+class CPerfCounterAdder
+{
+public:
+	CPerfCounterAdder( const CPerfCounters &counters, CCycleCount *pTime, PerfCounterValues_t *pCounts );
+	~CPerfCounterAdder();
+
+	void				End();
+
+private:
+	CPerfCounterTimer	m_Timer;
+	CCycleCount			*m_pTime;
+	PerfCounterValues_t	*m_pCounts;
+};
+
+inline CPerfCounterAdder::CPerfCounterAdder( const CPerfCounters &counters, CCycleCount *pTime, PerfCounterValues_t *pCounts ) : m_Timer( counters )
+{
+	m_pTime = pTime;
+	m_pCounts = pCounts;
+	m_Timer.Start();
+}
+
+inline CPerfCounterAdder::~CPerfCounterAdder()
+{
+	End();
+}
+
+inline void CPerfCounterAdder::End()
+{
+	if ( m_pCounts )
+	{
+		m_Timer.End();
+		if ( m_pTime )
+		{
+			*m_pTime += m_Timer.GetDuration();
+		}
+		*m_pCounts += m_Timer.GetCounts();
+		m_pTime = NULL;
+		m_pCounts = NULL;
+	}
+}
+
+#endif // PERFCOUNTERS_H
@@ -0,0 +1,246 @@
+//==================================================================================================
+//
+// Purpose: Calibrated time stamp counter for short measurements
+//
+// CCycleCount converts cycles with g_ClockSpeed, the rated clock tier0 reads at startup. The TSC
+// only ticks at a fixed rate when CPUID reports it invariant, and the rated clock is not that rate
+// on every CPU. CTSCClock::Init() checks for an invariant TSC and measures its rate against
+// CLOCK_MONOTONIC_RAW on Linux or Plat_FloatTime() elsewhere, then points g_ClockSpeed at it so
+// CCycleCount and CFastTimer convert with the measured rate too.
+//
+// Without an invariant TSC the clock falls back to CLOCK_MONOTONIC_RAW, or Plat_FloatTime(),
+// in nanoseconds, and g_ClockSpeed is left alone.
+//
+// CPreciseTimer reads the clock serialized: Start() waits for the instructions before it to
+// finish, End() for the timed ones, so short blocks are not smeared by out of order execution.
+//
+//==================================================================================================
+
+#ifndef TSCTIMER_H
+#define TSCTIMER_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/platform.h"
+#include "tier0/fasttimer.h"
+
+#if defined( COMPILER_MSVC )
+#include <intrin.h>
+#include <emmintrin.h>
+#elif defined( __GNUC__ )
+#include <cpuid.h>
+#include <x86intrin.h>
+#include <time.h>
+#endif
+
+#define TSC_CALIBRATION_MILLISECONDS	50
+#define TSC_FALLBACK_FREQUENCY			1000000000	// Nanoseconds
+
+struct TSCClockState_t
+{
+	bool	m_bInitialized;
+	bool	m_bInvariant;			// Ticks at a fixed rate, across frequency changes and sleep states
+	bool	m_bRDTSCP;
+	uint64	m_nFrequency;			// Ticks per second
+	uint64	m_nOverhead;			// Ticks of an empty serialized begin and end
+};
+
+class CTSCClock
+{
+public:
+	// Detects and calibrates, the first call takes TSC_CALIBRATION_MILLISECONDS. Returns whether
+	// the TSC is used
+	static bool Init();
+
+	static bool IsInvariant()							{ return GetState().m_bInvariant; }
+	static uint64 GetFrequency()						{ return GetState().m_nFrequency ? GetState().m_nFrequency : TSC_FALLBACK_FREQUENCY; }
+
+	// What an empty measurement reads, subtract it from sub-microsecond ones
+	static uint64 GetOverhead()							{ return GetState().m_nOverhead; }
+
+	// Serialized reads, for the start and the end of a measurement
+	static inline uint64 ReadBegin();
+	static inline uint64 ReadEnd();
+
+	static double TicksToMicroseconds( uint64 nTicks )	{ return (double)nTicks * 1000000.0 / (double)GetFrequency(); }
+	static double TicksToNanoseconds( uint64 nTicks )	{ return (double)nTicks * 1000000000.0 / (double)GetFrequency(); }
+
+private:
+	// Zero until Init(), which reads as the fallback clock
+	static TSCClockState_t &GetState()
+	{
+		static TSCClockState_t s_State;
+		return s_State;
+	}
+
+	static void CPUID( uint32 nLeaf, uint32 *pRegisters );
+	static uint64 ReadReferenceNanoseconds();
+	static uint64 ReadFallback();
+};
+
+
+//-----------------------------------------------------------------------------
+// Inline methods
+//-----------------------------------------------------------------------------
+inline void CTSCClock::CPUID( uint32 nLeaf, uint32 *pRegisters )
+{
+#if defined( COMPILER_MSVC )
+	__cpuid( (int *)pRegisters, (int)nLeaf );
+#else
+	__cpuid( nLeaf, pRegisters[0], pRegisters[1], pRegisters[2], pRegisters[3] );
+#endif
+}
+
+inline uint64 CTSCClock::ReadReferenceNanoseconds()
+{
+#ifdef _LINUX
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC_RAW, &ts );
+	return (uint64)ts.tv_sec * 1000000000ull + (uint64)ts.tv_nsec;
+#else
+	return (uint64)( Plat_FloatTime() * 1000000000.0 );
+#endif
+}
+
+inline uint64 CTSCClock::ReadFallback()
+{
+	return ReadReferenceNanoseconds();
+}
+
+inline uint64 CTSCClock::ReadBegin()
+{
+	if ( !GetState().m_bInvariant )
+		return ReadFallback();
+
+	// Waits for everything before to complete before reading
+	_mm_lfence();
+	uint64 nTicks = __rdtsc();
+	_mm_lfence();
+	return nTicks;
+}
+
+inline uint64 CTSCClock::ReadEnd()
+{
+	if ( !GetState().m_bInvariant )
+		return ReadFallback();
+
+	// RDTSCP waits for the timed instructions, the fence keeps later ones from starting early
+	uint64 nTicks;
+	if ( GetState().m_bRDTSCP )
+	{
+		unsigned int nAux;
+		nTicks = __rdtscp( &nAux );
+	}
+	else
+	{
+		_mm_lfence();
+		nTicks = __rdtsc();
+	}
+	_mm_lfence();
+	return nTicks;
+}
+
+inline bool CTSCClock::Init()
+{
+	TSCClockState_t &state = GetState();
+	if ( state.m_bInitialized )
+		return state.m_bInvariant;
+
+	uint32 nRegisters[4];
+	CPUID( 0x80000000, nRegisters );
+	uint32 nMaxExtendedLeaf = nRegisters[0];
+	bool bInvariant = false;
+	if ( nMaxExtendedLeaf >= 0x80000001 )
+	{
+		CPUID( 0x80000001, nRegisters );
+		state.m_bRDTSCP = ( nRegisters[3] & ( 1 << 27 ) ) != 0;
+	}
+	if ( nMaxExtendedLeaf >= 0x80000007 )
+	{
+		CPUID( 0x80000007, nRegisters );
+		bInvariant = ( nRegisters[3] & ( 1 << 8 ) ) != 0;
+	}
+
+	state.m_bInvariant = false;
+	state.m_nFrequency = TSC_FALLBACK_FREQUENCY;
+	if ( bInvariant )
+	{
+		// Pairs the counter with the reference clock, each read bracketed by two TSC reads taken
+		// as close together as a few tries get them
+		uint64 nTicks[2], nNanoseconds[2];
+		for ( int nSample = 0; nSample < 2; ++nSample )
+		{
+			uint64 nBestWindow = (uint64)-1;
+			for ( int nTry = 0; nTry < 16; ++nTry )
+			{
+				uint64 nBefore = __rdtsc();
+				uint64 nReference = ReadReferenceNanoseconds();
+				uint64 nAfter = __rdtsc();
+				if ( nAfter - nBefore < nBestWindow )
+				{
+					nBestWindow = nAfter - nBefore;
+					nTicks[nSample] = nBefore + ( nAfter - nBefore ) / 2;
+					nNanoseconds[nSample] = nReference;
+				}
+			}
+
+			// Spins rather than sleeps, the reference clock is what matters here
+			while ( !nSample && ReadReferenceNanoseconds() - nNanoseconds[0] < TSC_CALIBRATION_MILLISECONDS * 1000000ull )
+			{
+			}
+		}
+
+		uint64 nElapsed = nNanoseconds[1] - nNanoseconds[0];
+		if ( nTicks[1] > nTicks[0] && nElapsed )
+		{
+			state.m_nFrequency = (uint64)( (double)( nTicks[1] - nTicks[0] ) * 1000000000.0 / (double)nElapsed );
+			state.m_bInvariant = true;
+
+			g_ClockSpeed = state.m_nFrequency;
+			g_dwClockSpeed = (unsigned long)g_ClockSpeed;
+			g_ClockSpeedMicrosecondsMultiplier = 1000000.0 / (double)g_ClockSpeed;
+			g_ClockSpeedMillisecondsMultiplier = 1000.0 / (double)g_ClockSpeed;
+			g_ClockSpeedSecondsMultiplier = 1.0 / (double)g_ClockSpeed;
+		}
+	}
+
+	// The smallest of a few empty measurements, the others caught an interrupt or a cold cache
+	state.m_nOverhead = (uint64)-1;
+	for ( int i = 0; i < 64; ++i )
+	{
+		uint64 nStart = ReadBegin();
+		uint64 nEnd = ReadEnd();
+		if ( nEnd - nStart < state.m_nOverhead )
+		{
+			state.m_nOverhead = nEnd - nStart;
+		}
+	}
+
+	state.m_bInitialized = true;
+	return state.m_bInvariant;
+}
+
+
+//-----------------------------------------------------------------------------
+// Timer for blocks down to a few tens of nanoseconds, on CTSCClock
+//-----------------------------------------------------------------------------
+class CPreciseTimer
+{
+public:
+	void		Start()							{ m_nStart = CTSCClock::ReadBegin(); }
+	void		End()							{ m_nDuration = CTSCClock::ReadEnd() - m_nStart; }
+
+	// Ticks of CTSCClock, the read overhead taken out
+	uint64		GetTicks() const				{ return ( m_nDuration > CTSCClock::GetOverhead() ) ? m_nDuration - CTSCClock::GetOverhead() : 0; }
+	double		GetNanoseconds() const			{ return CTSCClock::TicksToNanoseconds( GetTicks() ); }
+	double		GetMicroseconds() const			{ return CTSCClock::TicksToMicroseconds( GetTicks() ); }
+	double		GetSeconds() const				{ return (double)GetTicks() / (double)CTSCClock::GetFrequency(); }
+
+private:
+	uint64		m_nStart;
+	uint64		m_nDuration;
+};
+
+#endif // TSCTIMER_H
@@ -803,6 +803,358 @@ private:
 	CTSListBase m_FreeNodes;
 };
 
+//-----------------------------------------------------------------------------
+// Bounded lock free queue, multiple producers and multiple consumers.
+//
+// A ring of CAPACITY cells (a power of two), each with a sequence number that
+// says whether it's ready to be written or read for the current lap. A push or
+// a pop is one compare and swap on the enqueue or dequeue position, no nodes
+// are allocated. The batch versions claim a run of cells with one exchange.
+//
+// Same PushItem()/PopItem()/Count() as CTSQueue, so it can be given to
+// CCallQueueT. PushItem() never waits: when the ring is full the item goes to
+// a CTSQueue behind it, and so does every push after it until the consumers
+// have emptied that, so one producer's items still come out in order. Those
+// pushes allocate a node each, size the ring for the most items queued before
+// someone pops. TryPushItem() and PushItems() stay bounded and fail while
+// anything is in the overflow. A pop that gets to a cell a producer has
+// claimed and not written yet waits for it, so a failed pop means empty.
+//-----------------------------------------------------------------------------
+#ifdef _X360
+#define TSRINGQUEUE_CACHE_LINE_SIZE 128
+#else
+#define TSRINGQUEUE_CACHE_LINE_SIZE 64
+#endif
+
+template <typename T, int CAPACITY = 1024>
+class CTSRingQueue
+{
+public:
+	CTSRingQueue()
+	{
+		COMPILE_TIME_ASSERT( CAPACITY >= 2 && ( CAPACITY & ( CAPACITY - 1 ) ) == 0 );
+		for ( int i = 0; i < CAPACITY; i++ )
+		{
+			m_Cells[i].m_nSequence = i;
+		}
+		m_nEnqueuePos = 0;
+		m_nDequeuePos = 0;
+	}
+
+	bool TryPushItem( const T &item )
+	{
+		return ( PushItems( &item, 1 ) == 1 );
+	}
+
+	void PushItem( const T &item )
+	{
+		if ( TryPushItem( item ) )
+			return;
+
+		// Counted first so no push that starts after this one goes to the ring ahead of it
+		++m_nOverflow;
+		m_Overflow.PushItem( item );
+	}
+
+	bool PopItem( T *pResult )
+	{
+		return ( PopItems( pResult, 1 ) == 1 );
+	}
+
+	// Pushes as many of the items as there's room for in the ring, in order, returns how many
+	int PushItems( const T *pItems, int nItems )
+	{
+		if ( m_nOverflow != 0 )
+			return 0;
+
+		uint32 nPos;
+		int nClaimed;
+		for ( ;; )
+		{
+			nPos = m_nEnqueuePos;
+
+			// Cells only turn over to the next lap when claimed through the position, so the
+			// writable run found here is still free if the exchange succeeds
+			nClaimed = 0;
+			while ( nClaimed < nItems && nClaimed < CAPACITY && (int32)( m_Cells[( nPos + nClaimed ) & ( CAPACITY - 1 )].m_nSequence - ( nPos + nClaimed ) ) == 0 )
+			{
+				nClaimed++;
+			}
+			if ( !nClaimed )
+			{
+				// Full, unless another producer just moved the position
+				if ( (int32)( m_Cells[nPos & ( CAPACITY - 1 )].m_nSequence - nPos ) < 0 )
+					return 0;
+				continue;
+			}
+			if ( ThreadInterlockedAssignIf( (int32 *)&m_nEnqueuePos, (int32)( nPos + nClaimed ), (int32)nPos ) )
+				break;
+			ThreadPause();
+		}
+
+		for ( int i = 0; i < nClaimed; i++ )
+		{
+			Cell_t &cell = m_Cells[( nPos + i ) & ( CAPACITY - 1 )];
+			cell.m_Item = pItems[i];
+			ThreadMemoryBarrier();
+			cell.m_nSequence = nPos + i + 1;
+		}
+		return nClaimed;
+	}
+
+	// Pops up to nMaxItems in order, returns how many. The ring is older than the overflow
+	int PopItems( T *pResults, int nMaxItems )
+	{
+		// Looked at before the ring: a producer only overflows once its earlier pushes are claimed
+		// in the ring, so the overflow seen here is next once every claimed position is popped.
+		// Looking after could take an item that overflowed while the ring was being filled
+		bool bOverflow = ( m_nOverflow != 0 );
+		ThreadMemoryBarrier();
+		int nPopped = PopRingItems( pResults, nMaxItems );
+		if ( !bOverflow || nPopped )
+			return nPopped;
+
+		// A push that claimed a position before the overflow filled still goes ahead of it
+		while ( m_nDequeuePos != m_nEnqueuePos )
+		{
+			nPopped = PopRingItems( pResults, nMaxItems );
+			if ( nPopped )
+				return nPopped;
+			ThreadPause();
+		}
+
+		while ( nPopped < nMaxItems && m_nOverflow != 0 && m_Overflow.PopItem( &pResults[nPopped] ) )
+		{
+			--m_nOverflow;
+			nPopped++;
+		}
+		return nPopped;
+	}
+
+	// Claimed positions, so items still being written or read count
+	int Count() const
+	{
+		int32 nCount = (int32)( m_nEnqueuePos - m_nDequeuePos );
+		return ( ( nCount < 0 ) ? 0 : ( ( nCount > CAPACITY ) ? CAPACITY : nCount ) ) + m_nOverflow;
+	}
+
+	// Of the ring, the overflow is unbounded
+	int Capacity() const
+	{
+		return CAPACITY;
+	}
+
+	// Items that didn't fit in the ring and are still queued behind it
+	int OverflowCount() const
+	{
+		return m_nOverflow;
+	}
+
+	// Note: RemoveAll and Purge are *not* threadsafe
+	void RemoveAll()
+	{
+		T dummy;
+		while ( PopItem( &dummy ) )
+			continue;
+	}
+
+	void Purge()
+	{
+		RemoveAll();
+		m_Overflow.Purge();
+	}
+
+private:
+	int PopRingItems( T *pResults, int nMaxItems )
+	{
+		uint32 nPos;
+		int nClaimed;
+		for ( ;; )
+		{
+			nPos = m_nDequeuePos;
+
+			nClaimed = 0;
+			while ( nClaimed < nMaxItems && nClaimed < CAPACITY && (int32)( m_Cells[( nPos + nClaimed ) & ( CAPACITY - 1 )].m_nSequence - ( nPos + nClaimed + 1 ) ) == 0 )
+			{
+				nClaimed++;
+			}
+			if ( !nClaimed )
+			{
+				// Empty, unless another consumer just moved the position or a producer has claimed
+				// it and is still writing. That one is waited for, empty has to mean empty, as it
+				// does for CTSQueue: CCallQueueT stops draining at the first failed pop
+				if ( (int32)( m_Cells[nPos & ( CAPACITY - 1 )].m_nSequence - ( nPos + 1 ) ) < 0 )
+				{
+					if ( m_nEnqueuePos == nPos )
+						return 0;
+					ThreadPause();
+				}
+				continue;
+			}
+			if ( ThreadInterlockedAssignIf( (int32 *)&m_nDequeuePos, (int32)( nPos + nClaimed ), (int32)nPos ) )
+				break;
+			ThreadPause();
+		}
+
+		for ( int i = 0; i < nClaimed; i++ )
+		{
+			Cell_t &cell = m_Cells[( nPos + i ) & ( CAPACITY - 1 )];
+			pResults[i] = cell.m_Item;
+			ThreadMemoryBarrier();
+			cell.m_nSequence = nPos + i + CAPACITY;
+		}
+		return nClaimed;
+	}
+
+	struct Cell_t
+	{
+		volatile uint32	m_nSequence;
+		T				m_Item;
+	};
+
+	// Every producer writes the enqueue position and every consumer the dequeue one, so each
+	// gets a cache line of its own
+	char			m_Pad0[TSRINGQUEUE_CACHE_LINE_SIZE];
+	volatile uint32	m_nEnqueuePos;
+	char			m_Pad1[TSRINGQUEUE_CACHE_LINE_SIZE - sizeof( uint32 )];
+	volatile uint32	m_nDequeuePos;
+	char			m_Pad2[TSRINGQUEUE_CACHE_LINE_SIZE - sizeof( uint32 )];
+	Cell_t			m_Cells[CAPACITY];
+
+	CTSQueue<T>		m_Overflow;
+	CInterlockedInt	m_nOverflow;			// Pushed to the overflow and not popped yet
+};
+
+//-----------------------------------------------------------------------------
+// Work stealing deque (Chase and Lev), of pointers or other word sized items.
+//
+// The thread that owns it pushes and pops at the bottom, last in first out, and
+// only races the other threads for the last item. Any thread steals from the
+// top, first in first out, with one compare and swap. The owner grows the array
+// when it's full. The old arrays are kept until the deque goes away because a
+// thief may still be reading one.
+//-----------------------------------------------------------------------------
+template <typename T>
+class CTSWorkStealingDeque
+{
+public:
+	CTSWorkStealingDeque( int nInitialSize = 256 )
+	{
+		Assert( nInitialSize >= 2 && ( nInitialSize & ( nInitialSize - 1 ) ) == 0 );
+		m_pArray = NewArray( nInitialSize, NULL );
+		m_nTop = 0;
+		m_nBottom = 0;
+	}
+
+	~CTSWorkStealingDeque()
+	{
+		Array_t *pArray = m_pArray;
+		while ( pArray )
+		{
+			Array_t *pPrev = pArray->m_pPrev;
+			delete [] (byte *)pArray;
+			pArray = pPrev;
+		}
+	}
+
+	// Owner only
+	void PushItem( const T &item )
+	{
+		int32 nBottom = m_nBottom;
+		Array_t *pArray = m_pArray;
+		if ( nBottom - m_nTop >= pArray->m_nSize )
+		{
+			pArray = Grow( pArray, m_nTop, nBottom );
+		}
+		pArray->m_Items[nBottom & ( pArray->m_nSize - 1 )] = item;
+		ThreadMemoryBarrier();
+		m_nBottom = nBottom + 1;
+	}
+
+	// Owner only
+	bool PopItem( T *pResult )
+	{
+		int32 nBottom = m_nBottom - 1;
+		Array_t *pArray = m_pArray;
+
+		// The new bottom has to be visible to thieves before the top is read, an interlocked
+		// store orders the two where a plain one wouldn't
+		ThreadInterlockedExchange( &m_nBottom, nBottom );
+		int32 nTop = m_nTop;
+		if ( nBottom - nTop < 0 )
+		{
+			m_nBottom = nTop;
+			return false;
+		}
+
+		*pResult = pArray->m_Items[nBottom & ( pArray->m_nSize - 1 )];
+		if ( nBottom - nTop > 0 )
+			return true;
+
+		// The last one, a thief may be taking it too
+		bool bWon = ThreadInterlockedAssignIf( &m_nTop, nTop + 1, nTop );
+		m_nBottom = nTop + 1;
+		return bWon;
+	}
+
+	// Any thread. Fails when empty or when another thread took the item first
+	bool StealItem( T *pResult )
+	{
+		int32 nTop = m_nTop;
+		ThreadMemoryBarrier();
+		int32 nBottom = m_nBottom;
+		if ( nBottom - nTop <= 0 )
+			return false;
+
+		Array_t *pArray = m_pArray;
+		T item = pArray->m_Items[nTop & ( pArray->m_nSize - 1 )];
+		if ( !ThreadInterlockedAssignIf( &m_nTop, nTop + 1, nTop ) )
+			return false;
+
+		*pResult = item;
+		return true;
+	}
+
+	// Approximate while other threads use it
+	int Count() const
+	{
+		int32 nCount = m_nBottom - m_nTop;
+		return ( nCount > 0 ) ? nCount : 0;
+	}
+
+private:
+	struct Array_t
+	{
+		Array_t		*m_pPrev;
+		int32		m_nSize;
+		T volatile	m_Items[1];
+	};
+
+	static Array_t *NewArray( int nSize, Array_t *pPrev )
+	{
+		Array_t *pArray = (Array_t *)new byte[sizeof( Array_t ) + ( nSize - 1 ) * sizeof( T )];
+		pArray->m_pPrev = pPrev;
+		pArray->m_nSize = nSize;
+		return pArray;
+	}
+
+	Array_t *Grow( Array_t *pArray, int32 nTop, int32 nBottom )
+	{
+		Array_t *pNewArray = NewArray( pArray->m_nSize * 2, pArray );
+		for ( int32 i = nTop; i != nBottom; i++ )
+		{
+			pNewArray->m_Items[i & ( pNewArray->m_nSize - 1 )] = pArray->m_Items[i & ( pArray->m_nSize - 1 )];
+		}
+		ThreadMemoryBarrier();
+		m_pArray = pNewArray;
+		return pNewArray;
+	}
+
+	Array_t * volatile	m_pArray;
+	volatile int32		m_nTop;
+	volatile int32		m_nBottom;
+};
+
 #include "tier0/memdbgoff.h"
 
 #endif // TSLIST_H
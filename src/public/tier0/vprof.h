@@ -12,6 +12,7 @@
 #include "tier0/fasttimer.h"
 #include "tier0/l2cache.h"
 #include "tier0/threadtools.h"
+#include "tier0/vproftrace.h"
 
 // VProf is enabled by default in all configurations -except- X360 Retail.
 #ifndef _LINUX
@@ -76,8 +77,8 @@
 
 #define VPROF_ONLY( expression )	expression
 
-#define VPROF_ENTER_SCOPE( name )			g_VProfCurrentProfile.EnterScope( name, 1, VPROF_BUDGETGROUP_OTHER_UNACCOUNTED, false, 0 )
-#define VPROF_EXIT_SCOPE()					g_VProfCurrentProfile.ExitScope()
+#define VPROF_ENTER_SCOPE( name )			do { g_VProfCurrentProfile.EnterScope( name, 1, VPROF_BUDGETGROUP_OTHER_UNACCOUNTED, false, 0 ); VProfTrace().BeginScope( name, VPROF_BUDGETGROUP_OTHER_UNACCOUNTED ); } while ( 0 )
+#define VPROF_EXIT_SCOPE()					do { VProfTrace().EndScope(); g_VProfCurrentProfile.ExitScope(); } while ( 0 )
 
 #define VPROF_BUDGET_GROUP_ID_UNACCOUNTED 0
 
@@ -1250,12 +1251,14 @@ inline unsigned int CVProfile::GetMultiTraceIndex()
 inline CVProfScope::CVProfScope( const tchar * pszName, int detailLevel, const tchar *pBudgetGroupName, bool bAssertAccounted, int budgetFlags )
 { 
 	g_VProfCurrentProfile.EnterScope( pszName, detailLevel, pBudgetGroupName, bAssertAccounted, budgetFlags ); 
+	VProfTrace().BeginScope( pszName, pBudgetGroupName );
 }
 
 //-------------------------------------
 
 inline CVProfScope::~CVProfScope()					
 { 
+	VProfTrace().EndScope();
 	g_VProfCurrentProfile.ExitScope(); 
 }
 
@@ -0,0 +1,399 @@
+//==================================================================================================
+//
+// Purpose: Timeline capture of VPROF scopes, written as Chrome trace events
+//
+// CVProfile keeps one tree for the thread it targets and drops scopes entered on any other thread.
+// While a capture runs, every VPROF scope also records a begin and an end event with a timestamp
+// into a buffer owned by the thread that entered it. Only that thread writes its buffer and events
+// are published with an interlocked store, so recording takes no lock. The capture is written as
+// Chrome trace event JSON, which chrome://tracing and ui.perfetto.dev open.
+//
+// tier0 ships prebuilt, so the capture lives in this header and each module including it has its
+// own. Timestamps are the cycle counter of CCycleCount on every module, captures of several
+// modules taken at the same time line up when their files are loaded together.
+//
+//==================================================================================================
+
+#ifndef VPROFTRACE_H
+#define VPROFTRACE_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include "tier0/platform.h"
+#include "tier0/fasttimer.h"
+#include "tier0/threadtools.h"
+
+#define VPROF_TRACE_EVENTS_PER_BLOCK		4096
+#define VPROF_TRACE_MAX_BLOCKS_PER_THREAD	256			// 1M events, 24MB on 32 bit
+#define VPROF_TRACE_MAX_THREAD_NAME			64
+
+enum VProfTraceEventType_t
+{
+	VPROF_TRACE_BEGIN = 0,
+	VPROF_TRACE_END,
+};
+
+struct VProfTraceEvent_t
+{
+	const tchar		*m_pszName;
+	const tchar		*m_pszBudgetGroup;
+	uint64			m_nTimestamp;
+	int				m_nType;
+};
+
+struct VProfTraceBlock_t
+{
+	VProfTraceEvent_t	m_Events[VPROF_TRACE_EVENTS_PER_BLOCK];
+	VProfTraceBlock_t	*m_pNext;
+};
+
+//-----------------------------------------------------------------------------
+// Events of one thread. Blocks are kept for the life of the module and reused
+// by the next capture, readers never see one go away
+//-----------------------------------------------------------------------------
+struct VProfTraceThread_t
+{
+	ThreadId_t			m_nThreadId;
+	char				m_szName[VPROF_TRACE_MAX_THREAD_NAME];
+	VProfTraceBlock_t	*m_pFirstBlock;
+	VProfTraceBlock_t	*m_pWriteBlock;
+	int					m_nWriteIndex;
+	int					m_nEpoch;				// Capture the events belong to
+	int					m_nDepth;				// Begins recorded without their end yet
+	int					m_nSkippedDepth;		// Begins dropped on a full buffer or after Stop(), their ends are dropped too
+	int					m_nDropped;
+	int32 volatile		m_nPublished;			// Events readers may look at
+	VProfTraceThread_t	*m_pNext;
+};
+
+class CVProfTrace
+{
+public:
+	CVProfTrace();
+	~CVProfTrace();
+
+	// Starting discards the previous capture. Scopes already open when it starts are left out,
+	// the ones open when it stops still record their end
+	void Start();
+	void Stop();
+	bool IsCapturing() const { return m_bCapturing; }
+
+	inline void BeginScope( const tchar *pszName, const tchar *pszBudgetGroup );
+	inline void EndScope();
+
+	// Names the calling thread on the timeline
+	void SetThreadName( const char *pszName );
+
+	// Writes the capture, best after Stop() so every scope has its end
+	bool WriteChromeTrace( const char *pszFileName );
+
+	int GetEventCount();
+	int GetDroppedEventCount();
+
+private:
+	VProfTraceThread_t *GetThread( bool bCreate = true );
+	void Record( VProfTraceThread_t *pThread, int nType, const tchar *pszName, const tchar *pszBudgetGroup );
+	static void WriteJSONString( FILE *fp, const tchar *pszString );
+
+	bool volatile			m_bCapturing;
+	int32 volatile			m_nEpoch;
+	uint64					m_nStartTimestamp;
+	VProfTraceThread_t * volatile m_pThreads;
+};
+
+// One per module, see above
+inline CVProfTrace &VProfTrace()
+{
+	static CVProfTrace s_Trace;
+	return s_Trace;
+}
+
+
+//-----------------------------------------------------------------------------
+// Inline methods
+//-----------------------------------------------------------------------------
+inline CVProfTrace::CVProfTrace()
+{
+	m_bCapturing = false;
+	m_nEpoch = 0;
+	m_nStartTimestamp = 0;
+	m_pThreads = NULL;
+}
+
+inline CVProfTrace::~CVProfTrace()
+{
+	VProfTraceThread_t *pThread = m_pThreads;
+	while ( pThread )
+	{
+		VProfTraceBlock_t *pBlock = pThread->m_pFirstBlock;
+		while ( pBlock )
+		{
+			VProfTraceBlock_t *pNextBlock = pBlock->m_pNext;
+			delete pBlock;
+			pBlock = pNextBlock;
+		}
+		VProfTraceThread_t *pNext = pThread->m_pNext;
+		delete pThread;
+		pThread = pNext;
+	}
+}
+
+inline void CVProfTrace::Start()
+{
+	m_bCapturing = false;
+	m_nStartTimestamp = CCycleCount::GetTimestamp();
+	ThreadInterlockedIncrement( &m_nEpoch );
+	m_bCapturing = true;
+}
+
+inline void CVProfTrace::Stop()
+{
+	m_bCapturing = false;
+}
+
+//-----------------------------------------------------------------------------
+// The buffer of the calling thread, added to the list the first time the
+// thread records something
+//-----------------------------------------------------------------------------
+inline VProfTraceThread_t *CVProfTrace::GetThread( bool bCreate )
+{
+	static CTHREADLOCALPTR( VProfTraceThread_t ) s_pThread;
+	VProfTraceThread_t *pThread = s_pThread;
+	if ( pThread || !bCreate )
+		return pThread;
+
+	pThread = new VProfTraceThread_t;
+	memset( pThread, 0, sizeof( *pThread ) );
+	pThread->m_nThreadId = ThreadGetCurrentId();
+	pThread->m_nEpoch = m_nEpoch - 1;
+	pThread->m_pFirstBlock = new VProfTraceBlock_t;
+	pThread->m_pFirstBlock->m_pNext = NULL;
+
+	VProfTraceThread_t *pHead;
+	do
+	{
+		pHead = m_pThreads;
+		pThread->m_pNext = pHead;
+	}
+	while ( ThreadInterlockedCompareExchangePointer( (void * volatile *)&m_pThreads, pThread, pHead ) != pHead );
+
+	s_pThread = pThread;
+	return pThread;
+}
+
+//-----------------------------------------------------------------------------
+// A begin only goes in when there is room left for the ends of every scope
+// open at that point, so a full buffer never leaves a scope without its end
+//-----------------------------------------------------------------------------
+inline void CVProfTrace::Record( VProfTraceThread_t *pThread, int nType, const tchar *pszName, const tchar *pszBudgetGroup )
+{
+	if ( pThread->m_nEpoch != m_nEpoch )
+	{
+		// First event of a new capture, start over at the first block
+		pThread->m_pWriteBlock = pThread->m_pFirstBlock;
+		pThread->m_nWriteIndex = 0;
+		pThread->m_nDepth = 0;
+		pThread->m_nSkippedDepth = 0;
+		pThread->m_nDropped = 0;
+		ThreadInterlockedExchange( &pThread->m_nPublished, 0 );
+		pThread->m_nEpoch = m_nEpoch;
+	}
+
+	if ( nType == VPROF_TRACE_BEGIN )
+	{
+		const int nCapacity = VPROF_TRACE_EVENTS_PER_BLOCK * VPROF_TRACE_MAX_BLOCKS_PER_THREAD;
+		if ( !m_bCapturing || pThread->m_nSkippedDepth || pThread->m_nPublished + pThread->m_nDepth + 2 > nCapacity )
+		{
+			++pThread->m_nSkippedDepth;
+			pThread->m_nDropped += m_bCapturing;
+			return;
+		}
+		++pThread->m_nDepth;
+	}
+	else
+	{
+		if ( pThread->m_nSkippedDepth )
+		{
+			--pThread->m_nSkippedDepth;
+			return;
+		}
+		if ( !pThread->m_nDepth )
+			return;
+		--pThread->m_nDepth;
+	}
+
+	if ( pThread->m_nWriteIndex == VPROF_TRACE_EVENTS_PER_BLOCK )
+	{
+		if ( !pThread->m_pWriteBlock->m_pNext )
+		{
+			VProfTraceBlock_t *pBlock = new VProfTraceBlock_t;
+			pBlock->m_pNext = NULL;
+			ThreadInterlockedExchangePointer( (void * volatile *)&pThread->m_pWriteBlock->m_pNext, pBlock );
+		}
+		pThread->m_pWriteBlock = pThread->m_pWriteBlock->m_pNext;
+		pThread->m_nWriteIndex = 0;
+	}
+
+	VProfTraceEvent_t &event = pThread->m_pWriteBlock->m_Events[pThread->m_nWriteIndex++];
+	event.m_pszName = pszName;
+	event.m_pszBudgetGroup = pszBudgetGroup;
+	event.m_nTimestamp = CCycleCount::GetTimestamp();
+	event.m_nType = nType;
+
+	// Makes the event visible to readers after its contents
+	ThreadInterlockedExchange( &pThread->m_nPublished, pThread->m_nPublished + 1 );
+}
+
+inline void CVProfTrace::BeginScope( const tchar *pszName, const tchar *pszBudgetGroup )
+{
+	if ( m_bCapturing )
+	{
+		Record( GetThread(), VPROF_TRACE_BEGIN, pszName, pszBudgetGroup );
+	}
+	else if ( m_pThreads )
+	{
+		// A scope entered after the capture stopped, inside ones it recorded, ends before they do
+		// and its end must not close them
+		VProfTraceThread_t *pThread = GetThread( false );
+		if ( pThread && pThread->m_nEpoch == m_nEpoch && ( pThread->m_nDepth || pThread->m_nSkippedDepth ) )
+		{
+			++pThread->m_nSkippedDepth;
+		}
+	}
+}
+
+inline void CVProfTrace::EndScope()
+{
+	// Scopes still open when the capture stops record their end, threads that never
+	// recorded a begin have nothing to end
+	if ( m_pThreads )
+	{
+		VProfTraceThread_t *pThread = GetThread( false );
+		if ( pThread )
+		{
+			Record( pThread, VPROF_TRACE_END, NULL, NULL );
+		}
+	}
+}
+
+inline void CVProfTrace::SetThreadName( const char *pszName )
+{
+	VProfTraceThread_t *pThread = GetThread();
+	strncpy( pThread->m_szName, pszName, sizeof( pThread->m_szName ) - 1 );
+	pThread->m_szName[sizeof( pThread->m_szName ) - 1] = '\0';
+}
+
+inline int CVProfTrace::GetEventCount()
+{
+	int nEvents = 0;
+	for ( VProfTraceThread_t *pThread = m_pThreads; pThread; pThread = pThread->m_pNext )
+	{
+		if ( pThread->m_nEpoch == m_nEpoch )
+		{
+			nEvents += pThread->m_nPublished;
+		}
+	}
+	return nEvents;
+}
+
+inline int CVProfTrace::GetDroppedEventCount()
+{
+	int nDropped = 0;
+	for ( VProfTraceThread_t *pThread = m_pThreads; pThread; pThread = pThread->m_pNext )
+	{
+		if ( pThread->m_nEpoch == m_nEpoch )
+		{
+			nDropped += pThread->m_nDropped;
+		}
+	}
+	return nDropped;
+}
+
+inline void CVProfTrace::WriteJSONString( FILE *fp, const tchar *pszString )
+{
+	fputc( '"', fp );
+	for ( const tchar *p = pszString ? pszString : ""; *p; ++p )
+	{
+		unsigned int c = (unsigned int)*p;
+		if ( c == '"' || c == '\\' )
+		{
+			fprintf( fp, "\\%c", (char)c );
+		}
+		else if ( c < 0x20 || c > 0x7e )
+		{
+			fprintf( fp, "\\u%04x", c & 0xffff );
+		}
+		else
+		{
+			fputc( (char)c, fp );
+		}
+	}
+	fputc( '"', fp );
+}
+
+//-----------------------------------------------------------------------------
+// Chrome trace event JSON: B and E duration events per thread, microseconds
+// since the capture started, plus thread names as metadata events
+//-----------------------------------------------------------------------------
+inline bool CVProfTrace::WriteChromeTrace( const char *pszFileName )
+{
+	FILE *fp = fopen( pszFileName, "wt" );
+	if ( !fp )
+		return false;
+
+	// Every module of the process writes the same pid so their files merge into one process
+	const int nPID = 1;
+	const int nEpoch = m_nEpoch;
+	bool bFirst = true;
+	fprintf( fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[" );
+	for ( VProfTraceThread_t *pThread = m_pThreads; pThread; pThread = pThread->m_pNext )
+	{
+		if ( pThread->m_nEpoch != nEpoch )
+			continue;
+
+		uint64 nThreadId = (uint64)pThread->m_nThreadId;
+		if ( pThread->m_szName[0] )
+		{
+			fprintf( fp, "%s\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%llu,\"args\":{\"name\":", bFirst ? "" : ",", nPID, (unsigned long long)nThreadId );
+			WriteJSONString( fp, pThread->m_szName );
+			fprintf( fp, "}}" );
+			bFirst = false;
+		}
+
+		int nEvents = pThread->m_nPublished;
+		const VProfTraceBlock_t *pBlock = pThread->m_pFirstBlock;
+		for ( int i = 0; i < nEvents; ++i )
+		{
+			if ( i && !( i % VPROF_TRACE_EVENTS_PER_BLOCK ) )
+			{
+				pBlock = pBlock->m_pNext;
+			}
+			const VProfTraceEvent_t &event = pBlock->m_Events[i % VPROF_TRACE_EVENTS_PER_BLOCK];
+			double flMicroseconds = (double)(int64)( event.m_nTimestamp - m_nStartTimestamp ) * g_ClockSpeedMicrosecondsMultiplier;
+			if ( event.m_nType == VPROF_TRACE_BEGIN )
+			{
+				fprintf( fp, "%s\n{\"ph\":\"B\",\"pid\":%d,\"tid\":%llu,\"ts\":%.3f,\"name\":", bFirst ? "" : ",", nPID, (unsigned long long)nThreadId, flMicroseconds );
+				WriteJSONString( fp, event.m_pszName );
+				fprintf( fp, ",\"cat\":" );
+				WriteJSONString( fp, event.m_pszBudgetGroup );
+				fprintf( fp, "}" );
+			}
+			else
+			{
+				fprintf( fp, "%s\n{\"ph\":\"E\",\"pid\":%d,\"tid\":%llu,\"ts\":%.3f}", bFirst ? "" : ",", nPID, (unsigned long long)nThreadId, flMicroseconds );
+			}
+			bFirst = false;
+		}
+	}
+	fprintf( fp, "\n],\"otherData\":{\"droppedEvents\":%d}}\n", GetDroppedEventCount() );
+
+	bool bSuccess = !ferror( fp );
+	fclose( fp );
+	return bSuccess;
+}
+
+#endif // VPROFTRACE_H
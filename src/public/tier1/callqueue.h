@@ -7,6 +7,7 @@
 #ifndef CALLQUEUE_H
 #define CALLQUEUE_H
 
+#include "tier0/memalloc.h"
 #include "tier0/tslist.h"
 #include "functors.h"
 #include "vstdlib/jobthread.h"
@@ -27,7 +28,7 @@
 	template <typename FUNCTION_RETTYPE FUNC_TEMPLATE_FUNC_PARAMS_##N FUNC_TEMPLATE_ARG_PARAMS_##N> \
 	void QueueCall(FUNCTION_RETTYPE (*pfnProxied)( FUNC_BASE_TEMPLATE_FUNC_PARAMS_##N ) FUNC_ARG_FORMAL_PARAMS_##N ) \
 		{ \
-		QueueFunctorInternal( CreateFunctor( pfnProxied FUNC_FUNCTOR_CALL_ARGS_##N ) ); \
+		QueueFunctorInternal( GetFunctorFactory().CreateFunctor( pfnProxied FUNC_FUNCTOR_CALL_ARGS_##N ) ); \
 		}
 
 //-------------------------------------
@@ -36,7 +37,7 @@
 	template <typename OBJECT_TYPE_PTR, typename FUNCTION_CLASS, typename FUNCTION_RETTYPE FUNC_TEMPLATE_FUNC_PARAMS_##N FUNC_TEMPLATE_ARG_PARAMS_##N> \
 	void QueueCall(OBJECT_TYPE_PTR pObject, FUNCTION_RETTYPE ( FUNCTION_CLASS::*pfnProxied )( FUNC_BASE_TEMPLATE_FUNC_PARAMS_##N ) FUNC_ARG_FORMAL_PARAMS_##N ) \
 		{ \
-		QueueFunctorInternal( CreateFunctor( pObject, pfnProxied FUNC_FUNCTOR_CALL_ARGS_##N ) ); \
+		QueueFunctorInternal( GetFunctorFactory().CreateFunctor( pObject, pfnProxied FUNC_FUNCTOR_CALL_ARGS_##N ) ); \
 		}
 
 //-------------------------------------
@@ -45,7 +46,7 @@
 	template <typename OBJECT_TYPE_PTR, typename FUNCTION_CLASS, typename FUNCTION_RETTYPE FUNC_TEMPLATE_FUNC_PARAMS_##N FUNC_TEMPLATE_ARG_PARAMS_##N> \
 	void QueueCall(OBJECT_TYPE_PTR pObject, FUNCTION_RETTYPE ( FUNCTION_CLASS::*pfnProxied )( FUNC_BASE_TEMPLATE_FUNC_PARAMS_##N ) const FUNC_ARG_FORMAL_PARAMS_##N ) \
 		{ \
-		QueueFunctorInternal( CreateFunctor( pObject, pfnProxied FUNC_FUNCTOR_CALL_ARGS_##N ) ); \
+		QueueFunctorInternal( GetFunctorFactory().CreateFunctor( pObject, pfnProxied FUNC_FUNCTOR_CALL_ARGS_##N ) ); \
 		}
 
 //-------------------------------------
@@ -54,7 +55,7 @@
 	template <typename OBJECT_TYPE_PTR, typename FUNCTION_CLASS, typename FUNCTION_RETTYPE FUNC_TEMPLATE_FUNC_PARAMS_##N FUNC_TEMPLATE_ARG_PARAMS_##N> \
 	void QueueRefCall(OBJECT_TYPE_PTR pObject, FUNCTION_RETTYPE ( FUNCTION_CLASS::*pfnProxied )( FUNC_BASE_TEMPLATE_FUNC_PARAMS_##N ) FUNC_ARG_FORMAL_PARAMS_##N ) \
 		{ \
-		QueueFunctorInternal( CreateRefCountingFunctor( pObject, pfnProxied FUNC_FUNCTOR_CALL_ARGS_##N ) ); \
+		QueueFunctorInternal( GetFunctorFactory().CreateRefCountingFunctor( pObject, pfnProxied FUNC_FUNCTOR_CALL_ARGS_##N ) ); \
 		}
 
 //-------------------------------------
@@ -63,7 +64,7 @@
 	template <typename OBJECT_TYPE_PTR, typename FUNCTION_CLASS, typename FUNCTION_RETTYPE FUNC_TEMPLATE_FUNC_PARAMS_##N FUNC_TEMPLATE_ARG_PARAMS_##N> \
 	void QueueRefCall(OBJECT_TYPE_PTR pObject, FUNCTION_RETTYPE ( FUNCTION_CLASS::*pfnProxied )( FUNC_BASE_TEMPLATE_FUNC_PARAMS_##N ) const FUNC_ARG_FORMAL_PARAMS_##N ) \
 		{ \
-		QueueFunctorInternal( CreateRefCountingFunctor( pObject, pfnProxied FUNC_FUNCTOR_CALL_ARGS_##N ) ); \
+		QueueFunctorInternal( GetFunctorFactory().CreateRefCountingFunctor( pObject, pfnProxied FUNC_FUNCTOR_CALL_ARGS_##N ) ); \
 		\
 		}
 
@@ -75,8 +76,149 @@
 	FUNC_GENERATE_ALL( DEFINE_CALLQUEUE_REF_COUNTING_CONST_MEMBER_QUEUE_CALL )
 
 //-----------------------------------------------------
+// Where a call queue's functors come from. The queue also tells the factory
+// about functors it was handed rather than created, and about the ones it has
+// run and released, so a factory that owns the memory knows when it's free
+//-----------------------------------------------------
+
+class CCallQueueHeapFunctors : public CDefaultFunctorFactory
+{
+public:
+	void OnQueueFunctor()						{}
+	void OnReleaseFunctors( int nFunctors )		{}
+};
+
+//-----------------------------------------------------
+// Functors placement constructed one after the other in blocks the factory
+// owns, the first one inline and each next one twice the size of the last.
+// Release() only destructs, and once every functor queued has been released
+// the blocks are reused from the start, so a queue that has run once doesn't
+// allocate again. Functors must not be kept past their call.
+//
+// Functors pending are counted in the high half of the state and bytes handed
+// out in the low half, so making room for one is a single interlocked add.
+//-----------------------------------------------------
+
+#define CALLQUEUE_FUNCTOR_ALIGNMENT		8
+#define CALLQUEUE_ARENA_MAX_BLOCKS		20
+#define CALLQUEUE_ARENA_ONE_PENDING		( (int64)1 << 32 )
+
+typedef CRefCounted1<CFunctor, CRefCountServiceDestruct<CRefMT> > CCallQueueArenaFunctorBase;
 
-template <typename QUEUE_TYPE = CTSQueue<CFunctor *> >
+template <int BLOCK_SIZE = 4096>
+class CCallQueueArenaFunctors : public CCustomizedFunctorFactory< CCallQueueArenaFunctors<BLOCK_SIZE>, CCallQueueArenaFunctorBase >
+{
+public:
+	CCallQueueArenaFunctors()
+		: m_nState( 0 )
+	{
+		COMPILE_TIME_ASSERT( BLOCK_SIZE % CALLQUEUE_FUNCTOR_ALIGNMENT == 0 );
+		memset( (void *)m_pBlocks, 0, sizeof( m_pBlocks ) );
+		m_pBlocks[0] = (byte *)m_InlineBlock;
+		this->SetAllocator( this );
+	}
+
+	~CCallQueueArenaFunctors()
+	{
+		Assert( !( m_nState >> 32 ) );
+		for ( int i = 1; i < CALLQUEUE_ARENA_MAX_BLOCKS; i++ )
+		{
+			MemAlloc_FreeAligned( m_pBlocks[i] );
+		}
+	}
+
+	// From the factory, on whichever thread is queuing
+	void *Alloc( size_t nBytes )
+	{
+		nBytes = AlignValue( nBytes, CALLQUEUE_FUNCTOR_ALIGNMENT );
+		Assert( nBytes <= BLOCK_SIZE );
+
+		int64 nAdd = CALLQUEUE_ARENA_ONE_PENDING + nBytes;
+		for ( ;; )
+		{
+			uint32 nOffset = (uint32)ThreadInterlockedExchangeAdd64( &m_nState, nAdd );
+			nAdd = nBytes;
+
+			uint32 nBlockStart = 0;
+			uint32 nBlockSize = BLOCK_SIZE;
+			int iBlock = 0;
+			while ( nOffset >= nBlockStart + nBlockSize )
+			{
+				nBlockStart += nBlockSize;
+				nBlockSize *= 2;
+				iBlock++;
+			}
+			Assert( iBlock < CALLQUEUE_ARENA_MAX_BLOCKS );
+
+			// Room that runs past the end of a block is left unused, the next add lands in the next one
+			if ( nOffset + nBytes <= nBlockStart + nBlockSize )
+			{
+				return GetBlock( iBlock, nBlockSize ) + ( nOffset - nBlockStart );
+			}
+		}
+	}
+
+	void OnQueueFunctor()
+	{
+		ThreadInterlockedExchangeAdd64( &m_nState, CALLQUEUE_ARENA_ONE_PENDING );
+	}
+
+	// Once per CallQueued(), the functors are all destructed by now
+	void OnReleaseFunctors( int nFunctors )
+	{
+		if ( !nFunctors )
+		{
+			return;
+		}
+
+		int64 nState = ThreadInterlockedExchangeAdd64( &m_nState, -nFunctors * CALLQUEUE_ARENA_ONE_PENDING ) - nFunctors * CALLQUEUE_ARENA_ONE_PENDING;
+		Assert( nState >= 0 );
+
+		// Nothing pending, start over unless another thread made room for one since
+		if ( !( nState >> 32 ) )
+		{
+			ThreadInterlockedAssignIf64( &m_nState, 0, nState );
+		}
+	}
+
+	// Blocks past the inline one
+	int GetBlockCount() const
+	{
+		int nBlocks = 0;
+		while ( nBlocks + 1 < CALLQUEUE_ARENA_MAX_BLOCKS && m_pBlocks[nBlocks + 1] )
+		{
+			nBlocks++;
+		}
+		return nBlocks;
+	}
+
+private:
+	byte *GetBlock( int iBlock, uint32 nBlockSize )
+	{
+		byte *pBlock = m_pBlocks[iBlock];
+		if ( !pBlock )
+		{
+			// Two threads can get here for the same block, the one that loses frees its own
+			MEM_ALLOC_CREDIT_( "CCallQueueArenaFunctors" );
+			pBlock = (byte *)MemAlloc_AllocAligned( nBlockSize, CALLQUEUE_FUNCTOR_ALIGNMENT );
+			byte *pOther = (byte *)ThreadInterlockedCompareExchangePointer( (void * volatile *)&m_pBlocks[iBlock], pBlock, NULL );
+			if ( pOther )
+			{
+				MemAlloc_FreeAligned( pBlock );
+				pBlock = pOther;
+			}
+		}
+		return pBlock;
+	}
+
+	uint64 m_InlineBlock[BLOCK_SIZE / sizeof( uint64 )];
+	byte * volatile m_pBlocks[CALLQUEUE_ARENA_MAX_BLOCKS];
+	volatile int64 m_nState;
+};
+
+//-----------------------------------------------------
+
+template <typename QUEUE_TYPE = CTSQueue<CFunctor *>, class FUNCTOR_FACTORY = CCallQueueHeapFunctors >
 class CCallQueueT
 {
 public:
@@ -121,6 +263,7 @@ public:
 		m_queue.PushItem( NULL );
 
 		CFunctor *pFunctor;
+		int nCalls = 0;
 
 		while ( m_queue.PopItem( &pFunctor ) && pFunctor != NULL )
 		{
@@ -132,8 +275,10 @@ public:
 #endif
 			(*pFunctor)();
 			pFunctor->Release();
+			nCalls++;
 		}
 
+		m_FunctorFactory.OnReleaseFunctors( nCalls );
 	}
 
 	void ParallelCallQueued( IThreadPool *pPool = NULL )
@@ -156,13 +301,14 @@ public:
 		else
 		{
 			int *pDummy = NULL;
-			ParallelProcess( pPool, pDummy, nNumThreads, this, &CCallQueueT<>::ExecuteWrapper );
+			ParallelProcess( pPool, pDummy, nNumThreads, this, &CCallQueueT<QUEUE_TYPE, FUNCTOR_FACTORY>::ExecuteWrapper );
 		}
 	}
 
 	void QueueFunctor( CFunctor *pFunctor )
 	{
 		Assert( pFunctor );
+		m_FunctorFactory.OnQueueFunctor();
 		QueueFunctorInternal( RetAddRef( pFunctor ) );
 	}
 
@@ -171,16 +317,25 @@ public:
 		m_queue.PushItem( NULL );
 
 		CFunctor *pFunctor;
+		int nReleased = 0;
 
 		while ( m_queue.PopItem( &pFunctor ) && pFunctor != NULL )
 		{
 			pFunctor->Release();
+			nReleased++;
 		}
+
+		m_FunctorFactory.OnReleaseFunctors( nReleased );
 	}
 
 	FUNC_GENERATE_QUEUE_METHODS();
 
 private:
+	FUNCTOR_FACTORY &GetFunctorFactory()
+	{
+		return m_FunctorFactory;
+	}
+
 	void ExecuteWrapper( int &nDummy )						// to match paralell process function template
 	{
 		CallQueued();
@@ -199,10 +354,12 @@ private:
 		{
 			(*pFunctor)();
 			pFunctor->Release();
+			m_FunctorFactory.OnReleaseFunctors( 1 );
 		}
 	}
 
 	QUEUE_TYPE m_queue;
+	FUNCTOR_FACTORY m_FunctorFactory;
 	bool m_bNoQueue;
 	unsigned m_nCurSerialNumber;
 	unsigned m_nBreakSerialNumber;
@@ -212,6 +369,32 @@ class CCallQueue : public CCallQueueT<>
 {
 };
 
+//-----------------------------------------------------
+// Queue on a ring of CAPACITY calls, nothing allocated per call while it has
+// room. Calls queued past that don't wait, they go to an unbounded CTSQueue
+// behind the ring and allocate a node each until CallQueued() has drained it.
+// CallQueued() itself queues one more entry, so size CAPACITY above the most
+// calls queued between two CallQueued() to stay allocation free
+//-----------------------------------------------------
+
+template <int CAPACITY = 4096>
+class CRingCallQueue : public CCallQueueT< CTSRingQueue<CFunctor *, CAPACITY> >
+{
+};
+
+//-----------------------------------------------------
+// Queue whose functors live in blocks it owns, see CCallQueueArenaFunctors
+//-----------------------------------------------------
+
+template <typename QUEUE_TYPE = CTSQueue<CFunctor *>, int BLOCK_SIZE = 4096>
+class CArenaCallQueueT : public CCallQueueT< QUEUE_TYPE, CCallQueueArenaFunctors<BLOCK_SIZE> >
+{
+};
+
+class CArenaCallQueue : public CArenaCallQueueT<>
+{
+};
+
 //-----------------------------------------------------
 // Optional interface that can be bound to concrete CCallQueue
 //-----------------------------------------------------
@@ -227,6 +410,11 @@ public:
 	FUNC_GENERATE_QUEUE_METHODS();
 
 private:
+	CDefaultFunctorFactory GetFunctorFactory()
+	{
+		return CDefaultFunctorFactory();
+	}
+
 	virtual void QueueFunctorInternal( CFunctor *pFunctor ) = 0;
 };
 
@@ -514,7 +514,7 @@ typedef CRefCounted1<CFunctor, CRefCountServiceMT> CFunctorBase;
 
 #define DEFINE_FUNCTOR_TEMPLATE(N) \
 	template <typename FUNC_TYPE FUNC_TEMPLATE_ARG_PARAMS_##N, class FUNCTOR_BASE = CFunctorBase> \
-	class CFunctor##N : public CFunctorBase \
+	class CFunctor##N : public FUNCTOR_BASE \
 	{ \
 	public: \
 		CFunctor##N( FUNC_TYPE pfnProxied FUNC_ARG_FORMAL_PARAMS_##N ) : m_pfnProxied( pfnProxied ) FUNC_CALL_ARGS_INIT_##N {} \
@@ -0,0 +1,67 @@
+//==================================================================================================
+//
+// Purpose: Thread exit slot of CMemoryArena, which needs the platform headers
+//
+// Add this file to every project that uses tier1/memarena.h.
+//
+//==================================================================================================
+
+#if defined( _WIN32 ) && !defined( _X360 )
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "tier1/memarena.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+CMemoryArenaThreadSlot::CMemoryArenaThreadSlot()
+{
+#ifdef _WIN32
+	// Fiber local storage is the one Win32 slot with a callback on thread exit
+	m_nIndex = FlsAlloc( OnThreadExit );
+	m_bValid = ( m_nIndex != FLS_OUT_OF_INDEXES );
+#else
+	m_bValid = ( pthread_key_create( &m_Key, OnThreadExit ) == 0 );
+#endif
+}
+
+CMemoryArenaThreadSlot::~CMemoryArenaThreadSlot()
+{
+	// FlsFree runs the callback for every thread still holding a value
+	IsTornDown() = true;
+	if ( m_bValid )
+	{
+#ifdef _WIN32
+		FlsFree( m_nIndex );
+#else
+		pthread_key_delete( m_Key );
+#endif
+	}
+}
+
+// Without a slot the arena is kept until the process exits, as it would be anyway
+void CMemoryArenaThreadSlot::Set( CMemoryArena *pArena )
+{
+	if ( m_bValid )
+	{
+#ifdef _WIN32
+		FlsSetValue( m_nIndex, pArena );
+#else
+		pthread_setspecific( m_Key, pArena );
+#endif
+	}
+}
+
+#ifdef _WIN32
+void __stdcall CMemoryArenaThreadSlot::OnThreadExit( void *pArena )
+#else
+void CMemoryArenaThreadSlot::OnThreadExit( void *pArena )
+#endif
+{
+	if ( pArena && !IsTornDown() )
+	{
+		CMemoryArena::ReleaseThreadArena( (CMemoryArena *)pArena );
+	}
+}
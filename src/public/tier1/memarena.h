@@ -0,0 +1,383 @@
+//==================================================================================================
+//
+// Purpose: Linear arena for short-lived allocations, on CMemoryStack
+//
+// Allocating is a pointer bump and freeing is dropping back to a mark, so a frame or a scope that
+// makes many small temporary allocations never goes through g_pMemAlloc and its lock. Each thread
+// has its own arena from CMemoryArena::GetThreadArena(), no locking is needed on it, and it is
+// released with its reservation when the thread exits.
+//
+// An arena that runs out of reserved space keeps working: the rest of the scope's allocations go
+// to the heap and are freed with the scope, and DumpStats() reports them so the size can be raised.
+//
+//==================================================================================================
+
+#ifndef MEMARENA_H
+#define MEMARENA_H
+
+#if defined( _WIN32 )
+#pragma once
+#endif
+
+#include "tier0/dbg.h"
+#include "tier0/memalloc.h"
+#include "tier0/threadtools.h"
+#include "tier1/memstack.h"
+#include "tier1/strtools.h"
+#include "tier1/utlvector.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#define MEMARENA_ALIGNMENT			16
+#define MEMARENA_COMMIT_SIZE		( 64 * 1024 )
+
+// Address space reserved per thread, committed as it's used
+#ifdef PLATFORM_64BITS
+#define MEMARENA_THREAD_MAX_SIZE	( 256 * 1024 * 1024 )
+#else
+#define MEMARENA_THREAD_MAX_SIZE	( 32 * 1024 * 1024 )
+#endif
+
+struct MemoryArenaMark_t
+{
+	MemoryStackMark_t	m_nStackMark;
+	int					m_nOverflowCount;
+};
+
+class CMemoryArena
+{
+public:
+	CMemoryArena();
+	~CMemoryArena();
+
+	bool Init( const char *pszName, unsigned nMaxSize = MEMARENA_THREAD_MAX_SIZE, unsigned nCommitSize = MEMARENA_COMMIT_SIZE );
+	void Term();
+
+	// Never returns NULL, nAlignment is a power of two
+	void *Alloc( unsigned nBytes, unsigned nAlignment = MEMARENA_ALIGNMENT );
+	template< class T > T *AllocArray( int nCount )	{ return (T *)Alloc( nCount * sizeof( T ), ( __alignof( T ) > MEMARENA_ALIGNMENT ) ? __alignof( T ) : MEMARENA_ALIGNMENT ); }
+
+	MemoryArenaMark_t GetMark();
+	void FreeToMark( const MemoryArenaMark_t &mark );
+	void FreeAll();
+
+	unsigned GetUsed()								{ return m_Stack.GetBase() ? m_Stack.GetUsed() : 0; }
+	const char *GetName() const						{ return m_szName; }
+
+	// Use, peak use and the allocations that didn't fit
+	void DumpStats();
+
+	// The calling thread's arena, created on first use and released when the thread exits
+	static CMemoryArena &GetThreadArena();
+	static void DumpAllStats();
+
+private:
+	void *AllocOverflow( unsigned nBytes, unsigned nAlignment );
+	static CMemoryArena *&GetFirstThreadArena();
+	static CThreadFastMutex &GetThreadArenaMutex();
+	static CMemoryArena *AccessThreadArena( bool bSet = false, CMemoryArena *pArena = NULL );
+	static void ReleaseThreadArena( CMemoryArena *pArena );
+
+	friend class CMemoryArenaThreadSlot;
+
+	struct OverflowAlloc_t
+	{
+		void		*m_pMemory;
+		unsigned	m_nBytes;
+	};
+
+	CMemoryStack			m_Stack;
+	CUtlVector< OverflowAlloc_t > m_Overflow;	// Heap allocations of the current scopes, in order
+	char					m_szName[32];
+
+	int64					m_nAllocations;
+	int64					m_nOverflowAllocations;
+	int64					m_nResets;
+	unsigned				m_nPeakUsed;
+	unsigned				m_nOverflowBytes;
+	unsigned				m_nPeakOverflowBytes;
+
+	CMemoryArena			*m_pNextThreadArena;
+};
+
+//-----------------------------------------------------------------------------
+// Releases each thread's arena when the thread exits. The slot goes away with
+// the module, which stops the callbacks first: arenas of threads still running
+// then are left to the process rather than freed under them. Defined in
+// memarena.cpp, with the platform headers
+//-----------------------------------------------------------------------------
+class CMemoryArenaThreadSlot
+{
+public:
+	CMemoryArenaThreadSlot();
+	~CMemoryArenaThreadSlot();
+
+	void Set( CMemoryArena *pArena );
+
+private:
+#ifdef _WIN32
+	static void __stdcall OnThreadExit( void *pArena );
+	unsigned long		m_nIndex;
+#else
+	static void OnThreadExit( void *pArena );
+	pthread_key_t		m_Key;
+#endif
+	bool				m_bValid;
+	static bool volatile &IsTornDown();
+};
+
+//-----------------------------------------------------------------------------
+// Frees everything allocated from the arena while it's in scope
+//-----------------------------------------------------------------------------
+class CMemoryArenaScope
+{
+public:
+	CMemoryArenaScope( CMemoryArena &arena = CMemoryArena::GetThreadArena() ) : m_Arena( arena ), m_Mark( arena.GetMark() ) {}
+	~CMemoryArenaScope()							{ m_Arena.FreeToMark( m_Mark ); }
+
+	CMemoryArena &GetArena()						{ return m_Arena; }
+
+private:
+	CMemoryArena		&m_Arena;
+	MemoryArenaMark_t	m_Mark;
+};
+
+//-----------------------------------------------------------------------------
+// Like CAlignedNewDelete, but new comes from the calling thread's arena. delete
+// is a no-op, the object goes away with the enclosing CMemoryArenaScope, so the
+// destructor must not own anything the scope doesn't
+//-----------------------------------------------------------------------------
+template< int bytesAlignment = MEMARENA_ALIGNMENT, class T = aligned_tmp_t >
+class CArenaAlignedNewDelete : public T
+{
+public:
+	void *operator new( size_t nSize )
+	{
+		return CMemoryArena::GetThreadArena().Alloc( (unsigned)nSize, bytesAlignment );
+	}
+
+	void *operator new( size_t nSize, int nBlockUse, const char *pFileName, int nLine )
+	{
+		return CMemoryArena::GetThreadArena().Alloc( (unsigned)nSize, bytesAlignment );
+	}
+
+	void operator delete( void *pData )
+	{
+	}
+
+	void operator delete( void *pData, int nBlockUse, const char *pFileName, int nLine )
+	{
+	}
+};
+
+
+//-----------------------------------------------------------------------------
+// Inline methods
+//-----------------------------------------------------------------------------
+inline CMemoryArena::CMemoryArena()
+{
+	m_szName[0] = 0;
+	m_nAllocations = 0;
+	m_nOverflowAllocations = 0;
+	m_nResets = 0;
+	m_nPeakUsed = 0;
+	m_nOverflowBytes = 0;
+	m_nPeakOverflowBytes = 0;
+	m_pNextThreadArena = NULL;
+}
+
+inline CMemoryArena::~CMemoryArena()
+{
+	Term();
+}
+
+inline bool CMemoryArena::Init( const char *pszName, unsigned nMaxSize, unsigned nCommitSize )
+{
+	Term();
+	V_strncpy( m_szName, pszName, sizeof( m_szName ) );
+
+	// Without the reservation every allocation overflows, still correct, just not fast
+	return m_Stack.Init( nMaxSize, nCommitSize, 0, MEMARENA_ALIGNMENT );
+}
+
+inline void CMemoryArena::Term()
+{
+	FreeAll();
+	m_Stack.Term();
+}
+
+inline void *CMemoryArena::Alloc( unsigned nBytes, unsigned nAlignment )
+{
+	Assert( nAlignment && !( nAlignment & ( nAlignment - 1 ) ) );
+	++m_nAllocations;
+
+	void *pResult = NULL;
+	if ( m_Stack.GetBase() )
+	{
+		// The stack aligns to MEMARENA_ALIGNMENT, more is padding
+		unsigned nPadding = ( nAlignment > MEMARENA_ALIGNMENT ) ? nAlignment - MEMARENA_ALIGNMENT : 0;
+		pResult = m_Stack.Alloc( nBytes + nPadding );
+		if ( pResult )
+		{
+			pResult = (void *)AlignValue( (byte *)pResult, nAlignment );
+			unsigned nUsed = m_Stack.GetUsed();
+			if ( nUsed > m_nPeakUsed )
+			{
+				m_nPeakUsed = nUsed;
+			}
+			return pResult;
+		}
+	}
+
+	return AllocOverflow( nBytes, nAlignment );
+}
+
+inline void *CMemoryArena::AllocOverflow( unsigned nBytes, unsigned nAlignment )
+{
+	void *pResult = MemAlloc_AllocAligned( nBytes ? nBytes : 1, ( nAlignment > MEMARENA_ALIGNMENT ) ? nAlignment : MEMARENA_ALIGNMENT );
+	OverflowAlloc_t &overflow = m_Overflow[m_Overflow.AddToTail()];
+	overflow.m_pMemory = pResult;
+	overflow.m_nBytes = nBytes;
+
+	++m_nOverflowAllocations;
+	m_nOverflowBytes += nBytes;
+	if ( m_nOverflowBytes > m_nPeakOverflowBytes )
+	{
+		m_nPeakOverflowBytes = m_nOverflowBytes;
+	}
+	return pResult;
+}
+
+inline MemoryArenaMark_t CMemoryArena::GetMark()
+{
+	MemoryArenaMark_t mark;
+	mark.m_nStackMark = m_Stack.GetBase() ? m_Stack.GetCurrentAllocPoint() : 0;
+	mark.m_nOverflowCount = m_Overflow.Count();
+	return mark;
+}
+
+inline void CMemoryArena::FreeToMark( const MemoryArenaMark_t &mark )
+{
+	++m_nResets;
+
+	// Committed pages are kept, the next scope will want them again
+	if ( m_Stack.GetBase() )
+	{
+		m_Stack.FreeToAllocPoint( mark.m_nStackMark, false );
+	}
+
+	for ( int i = m_Overflow.Count() - 1; i >= mark.m_nOverflowCount; --i )
+	{
+		MemAlloc_FreeAligned( m_Overflow[i].m_pMemory );
+		m_nOverflowBytes -= m_Overflow[i].m_nBytes;
+	}
+	if ( m_Overflow.Count() > mark.m_nOverflowCount )
+	{
+		m_Overflow.SetCountNonDestructively( mark.m_nOverflowCount );
+	}
+}
+
+inline void CMemoryArena::FreeAll()
+{
+	MemoryArenaMark_t mark;
+	mark.m_nStackMark = 0;
+	mark.m_nOverflowCount = 0;
+	FreeToMark( mark );
+}
+
+inline void CMemoryArena::DumpStats()
+{
+	Msg( "%s: %u KB used, %u KB peak of %u KB, %lld allocations, %lld resets\n", m_szName,
+		GetUsed() / 1024, m_nPeakUsed / 1024, m_Stack.GetBase() ? (unsigned)m_Stack.GetMaxSize() / 1024 : 0,
+		m_nAllocations, m_nResets );
+	if ( m_nOverflowAllocations )
+	{
+		Msg( "%s: %lld allocations didn't fit and went to the heap, %u KB at peak\n", m_szName,
+			m_nOverflowAllocations, m_nPeakOverflowBytes / 1024 );
+	}
+}
+
+inline CMemoryArena *&CMemoryArena::GetFirstThreadArena()
+{
+	static CMemoryArena *s_pFirst = NULL;
+	return s_pFirst;
+}
+
+inline CThreadFastMutex &CMemoryArena::GetThreadArenaMutex()
+{
+	static CThreadFastMutex s_Mutex;
+	return s_Mutex;
+}
+
+// The calling thread's arena, NULL before first use and once released. With bSet it stores pArena
+inline CMemoryArena *CMemoryArena::AccessThreadArena( bool bSet, CMemoryArena *pArena )
+{
+	static CTHREADLOCALPTR( CMemoryArena ) s_pThreadArena;
+	if ( bSet )
+	{
+		s_pThreadArena = pArena;
+	}
+	return s_pThreadArena;
+}
+
+inline CMemoryArena &CMemoryArena::GetThreadArena()
+{
+	CMemoryArena *pArena = AccessThreadArena();
+	if ( !pArena )
+	{
+		// The mutex is made first so it outlives the slot
+		GetThreadArenaMutex();
+		static CMemoryArenaThreadSlot s_Slot;
+
+		pArena = new CMemoryArena;
+		char szName[32];
+		V_snprintf( szName, sizeof( szName ), "arena %u", (unsigned)ThreadGetCurrentId() );
+		pArena->Init( szName );
+
+		AUTO_LOCK( GetThreadArenaMutex() );
+		pArena->m_pNextThreadArena = GetFirstThreadArena();
+		GetFirstThreadArena() = pArena;
+		AccessThreadArena( true, pArena );
+		s_Slot.Set( pArena );
+	}
+	return *pArena;
+}
+
+// Called on the exiting thread. Anything it still runs after this gets a new arena
+inline void CMemoryArena::ReleaseThreadArena( CMemoryArena *pArena )
+{
+	AccessThreadArena( true, NULL );
+	{
+		AUTO_LOCK( GetThreadArenaMutex() );
+		CMemoryArena **ppLink = &GetFirstThreadArena();
+		while ( *ppLink && *ppLink != pArena )
+		{
+			ppLink = &( *ppLink )->m_pNextThreadArena;
+		}
+		if ( *ppLink )
+		{
+			*ppLink = pArena->m_pNextThreadArena;
+		}
+	}
+	delete pArena;
+}
+
+inline bool volatile &CMemoryArenaThreadSlot::IsTornDown()
+{
+	static bool volatile s_bTornDown = false;
+	return s_bTornDown;
+}
+
+// The counters of other threads' arenas are read without a lock, call it when they're idle
+inline void CMemoryArena::DumpAllStats()
+{
+	AUTO_LOCK( GetThreadArenaMutex() );
+	for ( CMemoryArena *pArena = GetFirstThreadArena(); pArena; pArena = pArena->m_pNextThreadArena )
+	{
+		pArena->DumpStats();
+	}
+}
+
+#endif // MEMARENA_H
@@ -24,6 +24,10 @@
 #include "tier1/utlvector.h"
 #include "tier1/utlrbtree.h"
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 //-----------------------------------------------------------------------------
 // Purpose: Optimized pool memory allocator
 //-----------------------------------------------------------------------------
@@ -114,12 +118,357 @@ public:
 	void*		AllocZero( size_t amount )	{ AUTO_LOCK( m_mutex ); return CUtlMemoryPool::AllocZero( amount ); }
 	void		Free(void *pMem) { AUTO_LOCK( m_mutex ); CUtlMemoryPool::Free( pMem ); }
 
+	// Up to nCount blocks, or frees nCount blocks, under one lock. Returns how many it got
+	int			AllocMultiple( void **ppMem, int nCount );
+	void		FreeMultiple( void **ppMem, int nCount );
+
 	// Frees everything
 	void		Clear() { AUTO_LOCK( m_mutex ); return CUtlMemoryPool::Clear(); }
-private:
+protected:
 	CThreadFastMutex m_mutex; // @TODO: Rework to use tslist (toml 7/6/2007)
 };
 
+inline int CMemoryPoolMT::AllocMultiple( void **ppMem, int nCount )
+{
+	AUTO_LOCK( m_mutex );
+	for ( int i = 0; i < nCount; i++ )
+	{
+		ppMem[i] = CUtlMemoryPool::Alloc();
+		if ( !ppMem[i] )
+			return i;
+	}
+	return nCount;
+}
+
+inline void CMemoryPoolMT::FreeMultiple( void **ppMem, int nCount )
+{
+	AUTO_LOCK( m_mutex );
+	for ( int i = 0; i < nCount; i++ )
+	{
+		CUtlMemoryPool::Free( ppMem[i] );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// A CMemoryPoolMT with a cache per thread in front of it. Each thread keeps two
+// magazines of free blocks for the pool and only goes to the shared depot, a
+// lock free list of full magazines, when both are empty or both are full. The
+// pool's mutex is only taken to refill or flush a whole magazine.
+//
+// Blocks sitting in a cache count as allocated in Count(). A thread that exits
+// keeps its magazines until the pool is destroyed, threads that come and go
+// should call FlushThreadCache() first. Every magazine is on the pool's own
+// list as well, so the pool frees them all whichever thread holds them. Past
+// MEMPOOL_MAX_CACHED_POOLS pools in the module, new pools lock on every call
+// like CMemoryPoolMT.
+//
+// Add tier1/mempoolthreadslot.cpp to every project that uses it.
+//-----------------------------------------------------------------------------
+#define MEMPOOL_MAGAZINE_SIZE			32
+#define MEMPOOL_MAX_DEPOT_MAGAZINES		64	// Full magazines past this go back to the pool
+#define MEMPOOL_MAX_CACHED_POOLS		64
+
+class CThreadCachedMemoryPool
+{
+public:
+	CThreadCachedMemoryPool( int blockSize, int numElements, int growMode = CUtlMemoryPool::GROW_FAST, const char *pszAllocOwner = NULL, int nAlignment = 0 );
+	~CThreadCachedMemoryPool();
+
+	void*		Alloc();
+	void*		Alloc( size_t amount )		{ Assert( amount <= (size_t)BlockSize() ); return Alloc(); }
+	void*		AllocZero();
+	void*		AllocZero( size_t amount )	{ Assert( amount <= (size_t)BlockSize() ); return AllocZero(); }
+	void		Free( void *pMem );
+
+	// Returns the calling thread's cached blocks to the pool
+	void		FlushThreadCache();
+
+	// Frees everything, no other thread may be using the pool
+	void		Clear();
+
+	int			Count() const		{ return m_Pool.Count(); }
+	int			PeakCount() const	{ return m_Pool.PeakCount(); }
+	int			BlockSize() const	{ return m_Pool.BlockSize(); }
+	int			Size() const		{ return m_Pool.Size(); }
+	bool		IsAllocationWithinPool( void *pMem ) const	{ return m_Pool.IsAllocationWithinPool( pMem ); }
+
+private:
+	struct TSLIST_NODE_ALIGN Magazine_t : public TSLNodeBase_t
+	{
+		Magazine_t	*m_pNextAllocated;	// The pool's list of every magazine it made
+		int			m_nCount;
+		void		*m_pBlocks[MEMPOOL_MAGAZINE_SIZE];
+	};
+
+	struct ThreadCache_t
+	{
+		Magazine_t	*m_pLoaded;
+		Magazine_t	*m_pPrevious;
+	};
+
+	ThreadCache_t	*GetThreadCache();
+	Magazine_t		*GetEmptyMagazine();
+	void			Refill( Magazine_t *pMagazine );
+	void			Flush( Magazine_t *pMagazine );
+
+	static ThreadCache_t *AccessThreadCaches( bool bSet = false, ThreadCache_t *pThreadCaches = NULL );
+	static void		ReleaseThreadCaches( ThreadCache_t *pThreadCaches );
+
+	friend class CMemoryPoolThreadSlot;
+
+	CMemoryPoolMT	m_Pool;
+	CTSListBase		m_FullMagazines;
+	CTSListBase		m_EmptyMagazines;
+	Magazine_t * volatile m_pAllMagazines;	// Only ever pushed to until the pool goes away
+	int				m_nPoolIndex;			// -1 when the pool isn't cached
+};
+
+//-----------------------------------------------------------------------------
+// Frees each thread's CThreadCachedMemoryPool caches when the thread exits. The
+// slot goes away with the module, which stops the callbacks first: caches of
+// threads still running then are left to the process rather than freed under
+// them. Defined in mempoolthreadslot.cpp, with the platform headers
+//-----------------------------------------------------------------------------
+class CMemoryPoolThreadSlot
+{
+public:
+	CMemoryPoolThreadSlot();
+	~CMemoryPoolThreadSlot();
+
+	void Set( void *pThreadCaches );
+
+private:
+#ifdef _WIN32
+	static void __stdcall OnThreadExit( void *pThreadCaches );
+	unsigned long		m_nIndex;
+#else
+	static void OnThreadExit( void *pThreadCaches );
+	pthread_key_t		m_Key;
+#endif
+	bool				m_bValid;
+	static bool volatile &IsTornDown();
+};
+
+inline bool volatile &CMemoryPoolThreadSlot::IsTornDown()
+{
+	static bool volatile s_bTornDown = false;
+	return s_bTornDown;
+}
+
+inline CThreadCachedMemoryPool::CThreadCachedMemoryPool( int blockSize, int numElements, int growMode, const char *pszAllocOwner, int nAlignment ) :
+	m_Pool( blockSize, numElements, growMode, pszAllocOwner, nAlignment )
+{
+	static CInterlockedInt s_nPoolCount;
+	m_nPoolIndex = s_nPoolCount++;
+	if ( m_nPoolIndex >= MEMPOOL_MAX_CACHED_POOLS )
+	{
+		m_nPoolIndex = -1;
+	}
+	m_pAllMagazines = NULL;
+}
+
+inline CThreadCachedMemoryPool::~CThreadCachedMemoryPool()
+{
+	// Other threads' caches still point at their magazines, but pool indices
+	// aren't reused so those entries are never looked at again
+	Magazine_t *pMagazine = m_pAllMagazines;
+	while ( pMagazine )
+	{
+		Magazine_t *pNext = pMagazine->m_pNextAllocated;
+		Flush( pMagazine );
+		MemAlloc_FreeAligned( pMagazine );
+		pMagazine = pNext;
+	}
+}
+
+// Indexed by pool, pool indices aren't reused so a destroyed pool's entry is never seen again
+inline CThreadCachedMemoryPool::ThreadCache_t *CThreadCachedMemoryPool::AccessThreadCaches( bool bSet, ThreadCache_t *pThreadCaches )
+{
+	static CTHREADLOCALPTR( ThreadCache_t ) s_pThreadCaches;
+	if ( bSet )
+	{
+		s_pThreadCaches = pThreadCaches;
+	}
+	return s_pThreadCaches;
+}
+
+// Called on the exiting thread. The magazines stay on their pools' lists, anything the
+// thread still frees after this gets a new array
+inline void CThreadCachedMemoryPool::ReleaseThreadCaches( ThreadCache_t *pThreadCaches )
+{
+	AccessThreadCaches( true, NULL );
+	delete[] pThreadCaches;
+}
+
+inline CThreadCachedMemoryPool::ThreadCache_t *CThreadCachedMemoryPool::GetThreadCache()
+{
+	if ( m_nPoolIndex < 0 )
+		return NULL;
+
+	ThreadCache_t *pThreadCaches = AccessThreadCaches();
+	if ( !pThreadCaches )
+	{
+		static CMemoryPoolThreadSlot s_Slot;
+
+		pThreadCaches = new ThreadCache_t[MEMPOOL_MAX_CACHED_POOLS];
+		memset( pThreadCaches, 0, MEMPOOL_MAX_CACHED_POOLS * sizeof( ThreadCache_t ) );
+		AccessThreadCaches( true, pThreadCaches );
+		s_Slot.Set( pThreadCaches );
+	}
+
+	ThreadCache_t *pCache = &pThreadCaches[m_nPoolIndex];
+	if ( !pCache->m_pLoaded )
+	{
+		pCache->m_pLoaded = GetEmptyMagazine();
+		pCache->m_pPrevious = GetEmptyMagazine();
+	}
+	return pCache;
+}
+
+inline CThreadCachedMemoryPool::Magazine_t *CThreadCachedMemoryPool::GetEmptyMagazine()
+{
+	Magazine_t *pMagazine = (Magazine_t *)m_EmptyMagazines.Pop();
+	if ( !pMagazine )
+	{
+		pMagazine = (Magazine_t *)MemAlloc_AllocAligned( sizeof( Magazine_t ), TSLIST_NODE_ALIGNMENT );
+		pMagazine->m_nCount = 0;
+
+		Magazine_t *pHead;
+		do
+		{
+			pHead = m_pAllMagazines;
+			pMagazine->m_pNextAllocated = pHead;
+		} while ( ThreadInterlockedCompareExchangePointer( (void * volatile *)&m_pAllMagazines, pMagazine, pHead ) != pHead );
+	}
+	return pMagazine;
+}
+
+inline void CThreadCachedMemoryPool::Refill( Magazine_t *pMagazine )
+{
+	pMagazine->m_nCount += m_Pool.AllocMultiple( &pMagazine->m_pBlocks[pMagazine->m_nCount], MEMPOOL_MAGAZINE_SIZE - pMagazine->m_nCount );
+}
+
+inline void CThreadCachedMemoryPool::Flush( Magazine_t *pMagazine )
+{
+	m_Pool.FreeMultiple( pMagazine->m_pBlocks, pMagazine->m_nCount );
+	pMagazine->m_nCount = 0;
+}
+
+inline void *CThreadCachedMemoryPool::Alloc()
+{
+	ThreadCache_t *pCache = GetThreadCache();
+	if ( !pCache )
+		return m_Pool.Alloc();
+
+	Magazine_t *pLoaded = pCache->m_pLoaded;
+	if ( !pLoaded->m_nCount )
+	{
+		if ( pCache->m_pPrevious->m_nCount )
+		{
+			pCache->m_pLoaded = pCache->m_pPrevious;
+			pCache->m_pPrevious = pLoaded;
+		}
+		else
+		{
+			// Both empty, trade the spare for a full one from the depot or fill it from the pool
+			Magazine_t *pFull = (Magazine_t *)m_FullMagazines.Pop();
+			if ( pFull )
+			{
+				m_EmptyMagazines.Push( pCache->m_pPrevious );
+				pCache->m_pPrevious = pLoaded;
+				pCache->m_pLoaded = pFull;
+			}
+			else
+			{
+				Refill( pLoaded );
+				if ( !pLoaded->m_nCount )
+					return NULL;
+			}
+		}
+		pLoaded = pCache->m_pLoaded;
+	}
+	return pLoaded->m_pBlocks[--pLoaded->m_nCount];
+}
+
+inline void *CThreadCachedMemoryPool::AllocZero()
+{
+	void *pMem = Alloc();
+	if ( pMem )
+	{
+		memset( pMem, 0, BlockSize() );
+	}
+	return pMem;
+}
+
+inline void CThreadCachedMemoryPool::Free( void *pMem )
+{
+	if ( !pMem )
+		return;
+
+	ThreadCache_t *pCache = GetThreadCache();
+	if ( !pCache )
+	{
+		m_Pool.Free( pMem );
+		return;
+	}
+
+	Magazine_t *pLoaded = pCache->m_pLoaded;
+	if ( pLoaded->m_nCount == MEMPOOL_MAGAZINE_SIZE )
+	{
+		Magazine_t *pPrevious = pCache->m_pPrevious;
+		if ( pPrevious->m_nCount < MEMPOOL_MAGAZINE_SIZE )
+		{
+			pCache->m_pLoaded = pPrevious;
+			pCache->m_pPrevious = pLoaded;
+		}
+		else
+		{
+			// Both full, the spare goes to the depot, or back to the pool when the depot has plenty
+			Magazine_t *pEmpty;
+			if ( m_FullMagazines.Count() < MEMPOOL_MAX_DEPOT_MAGAZINES )
+			{
+				m_FullMagazines.Push( pPrevious );
+				pEmpty = GetEmptyMagazine();
+			}
+			else
+			{
+				Flush( pPrevious );
+				pEmpty = pPrevious;
+			}
+			pCache->m_pPrevious = pLoaded;
+			pCache->m_pLoaded = pEmpty;
+		}
+		pLoaded = pCache->m_pLoaded;
+	}
+	pLoaded->m_pBlocks[pLoaded->m_nCount++] = pMem;
+}
+
+inline void CThreadCachedMemoryPool::FlushThreadCache()
+{
+	ThreadCache_t *pCache = GetThreadCache();
+	if ( pCache )
+	{
+		Flush( pCache->m_pLoaded );
+		Flush( pCache->m_pPrevious );
+	}
+}
+
+inline void CThreadCachedMemoryPool::Clear()
+{
+	// The blocks go with the pool's memory, the magazines are kept
+	Magazine_t *pMagazine;
+	while ( ( pMagazine = (Magazine_t *)m_FullMagazines.Pop() ) != NULL )
+	{
+		m_EmptyMagazines.Push( pMagazine );
+	}
+	for ( pMagazine = m_pAllMagazines; pMagazine; pMagazine = pMagazine->m_pNextAllocated )
+	{
+		pMagazine->m_nCount = 0;
+	}
+	m_Pool.Clear();
+}
+
 
 //-----------------------------------------------------------------------------
 // Wrapper macro to make an allocator that returns particular typed allocations
@@ -423,6 +772,18 @@ inline void CClassMemoryPool<T>::Clear()
 #define DEFINE_FIXEDSIZE_ALLOCATOR_MT( _class, _initsize, _grow )					\
 	CMemoryPoolMT   _class::s_Allocator(sizeof(_class), _initsize, _grow, #_class " pool")
 
+#define DECLARE_FIXEDSIZE_ALLOCATOR_CACHED( _class )								\
+	public:																		\
+	   inline void* operator new( size_t size ) { MEM_ALLOC_CREDIT_(#_class " pool"); return s_Allocator.Alloc(size); }   \
+	   inline void* operator new( size_t size, int nBlockUse, const char *pFileName, int nLine ) { MEM_ALLOC_CREDIT_(#_class " pool"); return s_Allocator.Alloc(size); }   \
+	   inline void  operator delete( void* p ) { s_Allocator.Free(p); }		\
+	   inline void  operator delete( void* p, int nBlockUse, const char *pFileName, int nLine ) { s_Allocator.Free(p); }   \
+	private:																		\
+		static   CThreadCachedMemoryPool   s_Allocator
+
+#define DEFINE_FIXEDSIZE_ALLOCATOR_CACHED( _class, _initsize, _grow )				\
+	CThreadCachedMemoryPool   _class::s_Allocator(sizeof(_class), _initsize, _grow, #_class " pool")
+
 //-----------------------------------------------------------------------------
 // Macros that make it simple to make a class use a fixed-size allocator
 // This version allows us to use a memory pool which is externally defined...
@@ -0,0 +1,67 @@
+//==================================================================================================
+//
+// Purpose: Thread exit slot of CThreadCachedMemoryPool, which needs the platform headers
+//
+// Add this file to every project that uses CThreadCachedMemoryPool from tier1/mempool.h.
+//
+//==================================================================================================
+
+#if defined( _WIN32 ) && !defined( _X360 )
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "tier1/mempool.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+CMemoryPoolThreadSlot::CMemoryPoolThreadSlot()
+{
+#ifdef _WIN32
+	// Fiber local storage is the one Win32 slot with a callback on thread exit
+	m_nIndex = FlsAlloc( OnThreadExit );
+	m_bValid = ( m_nIndex != FLS_OUT_OF_INDEXES );
+#else
+	m_bValid = ( pthread_key_create( &m_Key, OnThreadExit ) == 0 );
+#endif
+}
+
+CMemoryPoolThreadSlot::~CMemoryPoolThreadSlot()
+{
+	// FlsFree runs the callback for every thread still holding a value
+	IsTornDown() = true;
+	if ( m_bValid )
+	{
+#ifdef _WIN32
+		FlsFree( m_nIndex );
+#else
+		pthread_key_delete( m_Key );
+#endif
+	}
+}
+
+// Without a slot the caches are kept until the process exits
+void CMemoryPoolThreadSlot::Set( void *pThreadCaches )
+{
+	if ( m_bValid )
+	{
+#ifdef _WIN32
+		FlsSetValue( m_nIndex, pThreadCaches );
+#else
+		pthread_setspecific( m_Key, pThreadCaches );
+#endif
+	}
+}
+
+#ifdef _WIN32
+void __stdcall CMemoryPoolThreadSlot::OnThreadExit( void *pThreadCaches )
+#else
+void CMemoryPoolThreadSlot::OnThreadExit( void *pThreadCaches )
+#endif
+{
+	if ( pThreadCaches && !IsTornDown() )
+	{
+		CThreadCachedMemoryPool::ReleaseThreadCaches( (CThreadCachedMemoryPool::ThreadCache_t *)pThreadCaches );
+	}
+}
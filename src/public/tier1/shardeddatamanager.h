@@ -0,0 +1,823 @@
+//==================================================================================================
+//
+// Purpose: Memory budgeted resource cache with the handles of CDataManager, split into shards
+//
+// CDataManager keeps every resource on one LRU list behind one mutex, and moves a resource on the
+// list each time it's locked, unlocked or touched. Here the resources are spread over SHARD_COUNT
+// shards, each with its own mutex, its own share of the memory budget and its own eviction. A
+// resource stays in one slot for its whole life: using it sets a referenced bit, and eviction is
+// CLOCK, a hand going round the slots that clears the bit of the resources used since it last
+// passed and evicts the first one that wasn't. Touching needs no lock at all.
+//
+// STORAGE_TYPE is the same as for CDataManager: static CreateResource() and EstimatedSize() of the
+// create params, DestroyResource(), Size() and GetData(). LockResource() keeps a resource from
+// being evicted until the matching UnlockResource(), handles of destroyed resources stop resolving.
+//
+// Resources evicted to stay in budget are destroyed right away by the thread that needed the room,
+// or with SetAsyncEviction() queued for ProcessEvictions(), so a job or the end of a frame pays
+// for freeing them instead. Queued ones still count in UsedSize() until they're destroyed. An
+// IEvictionListener hears about each one before it's destroyed.
+//
+//==================================================================================================
+
+#ifndef SHARDEDDATAMANAGER_H
+#define SHARDEDDATAMANAGER_H
+
+#if defined( _WIN32 )
+#pragma once
+#endif
+
+#include "tier0/dbg.h"
+#include "tier0/threadtools.h"
+#include "tier0/tslist.h"
+#include "tier1/datamanager.h"
+#include "tier1/utlvector.h"
+
+#define SHARDEDDATAMANAGER_CHUNK_SIZE		256		// Slots are allocated this many at a time and never move
+#define SHARDEDDATAMANAGER_CACHE_LINE_SIZE	64
+
+template< class STORAGE_TYPE, class CREATE_PARAMS, class LOCK_TYPE = STORAGE_TYPE *, class MUTEX_TYPE = CThreadFastMutex, int SHARD_COUNT = 16 >
+class CShardedDataManager
+{
+public:
+	//-----------------------------------------------------
+	// Told about resources evicted to stay in budget or flushed, on the thread that destroys them
+	//-----------------------------------------------------
+	class IEvictionListener
+	{
+	public:
+		// The handle no longer resolves, pStore is destroyed when this returns
+		virtual void OnResourceEvicted( memhandle_t hMem, STORAGE_TYPE *pStore ) = 0;
+	};
+
+	CShardedDataManager( unsigned int size = (unsigned)-1 );
+	~CShardedDataManager();
+
+	//-----------------------------------------------------
+	// Resources
+	//-----------------------------------------------------
+
+	// Goes to the next shard in turn, or to the one nHash picks so related resources share a lock
+	memhandle_t CreateResource( const CREATE_PARAMS &createParams, bool bCreateLocked = false );
+	memhandle_t CreateResourceInShard( const CREATE_PARAMS &createParams, unsigned int nHash, bool bCreateLocked = false );
+	void DestroyResource( memhandle_t hMem );
+
+	LOCK_TYPE LockResource( memhandle_t hMem );
+	LOCK_TYPE LockResourceReturnCount( int *pCount, memhandle_t hMem );
+	int UnlockResource( memhandle_t hMem );
+
+	// Counts as a use, keeps it from the next pass of the eviction hand
+	void TouchResource( memhandle_t hMem );
+
+	// Lets the eviction hand take it the next time it passes
+	void MarkAsStale( memhandle_t hMem );
+
+	int LockCount( memhandle_t hMem );
+	int BreakLock( memhandle_t hMem );
+	int BreakAllLocks();
+
+	// For convenience, offers no lock protection
+	LOCK_TYPE GetResource_NoLock( memhandle_t hMem );
+	LOCK_TYPE GetResource_NoLockNoLRUTouch( memhandle_t hMem );
+
+	//-----------------------------------------------------
+	// Memory. Sizes are totals of every shard, each shard gets an equal share of the target
+	//-----------------------------------------------------
+	unsigned int TargetSize();
+	unsigned int AvailableSize();
+	unsigned int UsedSize();				// Counts evictions queued and not yet destroyed
+
+	void SetTargetSize( unsigned int targetSize );
+	void SetShardTargetSize( int iShard, unsigned int targetSize );
+	unsigned int ShardTargetSize( int iShard )		{ return m_Shards[iShard].m_nTargetSize; }
+	unsigned int ShardUsedSize( int iShard )		{ return m_Shards[iShard].m_nUsed; }
+	int ShardCount() const							{ return SHARD_COUNT; }
+
+	void NotifySizeChanged( memhandle_t hMem, unsigned int oldSize, unsigned int newSize );
+
+	// NOTE: flush is equivalent to Destroy, except that the eviction listener hears of it
+	unsigned int FlushAllUnlocked();
+	unsigned int FlushToTargetSize();
+	unsigned int FlushAll();
+	unsigned int Purge( unsigned int nBytesToPurge );
+	unsigned int EnsureCapacity( unsigned int size );
+
+	//-----------------------------------------------------
+	// Eviction
+	//-----------------------------------------------------
+	void SetEvictionListener( IEvictionListener *pListener )	{ m_pEvictionListener = pListener; }
+	void SetAsyncEviction( bool bAsync )						{ m_bAsyncEviction = bAsync; }
+
+	// Destroys up to nMaxResources of the queued evictions, returns how many. Any thread
+	int ProcessEvictions( int nMaxResources = INT_MAX );
+	unsigned int PendingEvictionSize()							{ return m_nPendingEvictionSize; }
+
+	void SetFreeOnDestruct( bool value )						{ m_bFreeOnDestruct = value; }
+
+	// Debugging only!!!! In the order they'd be evicted in, shard after shard
+	void GetLRUHandleList( CUtlVector< memhandle_t >& list );
+	void GetLockHandleList( CUtlVector< memhandle_t >& list );
+
+private:
+	enum
+	{
+		SLOTS_PER_SHARD = 0xFFFF / SHARD_COUNT,
+		CHUNKS_PER_SHARD = ( SLOTS_PER_SHARD + SHARDEDDATAMANAGER_CHUNK_SIZE - 1 ) / SHARDEDDATAMANAGER_CHUNK_SIZE,
+	};
+
+	struct Entry_t
+	{
+		STORAGE_TYPE		*m_pStore;			// NULL when the slot is free
+		unsigned int		m_nSize;
+		int					m_iNextFree;
+		volatile uint32		m_nState;			// Serial << 1 | referenced, one word so a touch without the lock can check the serial
+		uint16				m_nLockCount;
+	};
+
+	struct Shard_t
+	{
+		MUTEX_TYPE			m_Mutex;
+		Entry_t * volatile	m_pChunks[CHUNKS_PER_SHARD];
+		int					m_nSlots;			// Ever used, the hand goes round these
+		int					m_iFirstFree;
+		int					m_iClockHand;
+		unsigned int		m_nTargetSize;
+		unsigned int		m_nUsed;
+		char				m_Pad[SHARDEDDATAMANAGER_CACHE_LINE_SIZE];	// Keeps neighboring shards' locks apart
+	};
+
+	struct Eviction_t
+	{
+		memhandle_t			m_hMem;
+		STORAGE_TYPE		*m_pStore;
+		unsigned int		m_nSize;
+	};
+
+	memhandle_t CreateResourceInternal( int iShard, const CREATE_PARAMS &createParams, bool bCreateLocked );
+
+	static uint16 SerialOf( const Entry_t &entry )								{ return (uint16)( entry.m_nState >> 1 ); }
+	static bool IsReferenced( const Entry_t &entry )							{ return ( entry.m_nState & 1 ) != 0; }
+
+	// Shard lock held, or the slot free and not yet handed out
+	static void SetState( Entry_t &entry, uint16 nSerial, bool bReferenced )	{ entry.m_nState = ( (uint32)nSerial << 1 ) | ( bReferenced ? 1 : 0 ); }
+
+	// Without the lock. Only changes the bit while the slot still has the handle's serial
+	Entry_t *SetReferenced( memhandle_t hMem, bool bReferenced );
+
+	// Shards only, without the evictions queued
+	unsigned int ResidentSize();
+
+	// Handles are ( serial << 16 ) | ( slot * SHARD_COUNT + shard + 1 ), never 0 or INVALID_MEMHANDLE
+	static memhandle_t ToHandle( int iShard, int iSlot, uint16 nSerial )	{ return (memhandle_t)(uintp)( ( (unsigned int)nSerial << 16 ) | (unsigned int)( iSlot * SHARD_COUNT + iShard + 1 ) ); }
+	static int ShardOf( memhandle_t hMem )									{ return (int)( ( ( (unsigned int)(uintp)hMem & 0xFFFF ) - 1 ) % SHARD_COUNT ); }
+	static int SlotOf( memhandle_t hMem )									{ return (int)( ( ( (unsigned int)(uintp)hMem & 0xFFFF ) - 1 ) / SHARD_COUNT ); }
+
+	// NULL unless the handle is live. Without the shard lock the answer may be stale by the time it's used
+	Entry_t *FindEntry( memhandle_t hMem );
+
+	// Shard lock held. Returns the storage to destroy
+	STORAGE_TYPE *FreeEntry( Shard_t &shard, Entry_t *pEntry, int iSlot );
+
+	// Take the shard lock themselves
+	bool EvictOne( int iShard );
+	void DisposeEvicted( memhandle_t hMem, STORAGE_TYPE *pStore, unsigned int nSize );
+	unsigned int EnsureShardCapacity( int iShard, unsigned int size );
+	unsigned int FlushShard( int iShard, bool bIncludeLocked );
+
+	Shard_t					m_Shards[SHARD_COUNT];
+	CInterlockedInt			m_nNextShard;
+
+	IEvictionListener		*m_pEvictionListener;
+	CTSQueue< Eviction_t >	m_PendingEvictions;
+	CInterlockedUInt		m_nPendingEvictionSize;
+	bool					m_bAsyncEviction;
+	bool					m_bFreeOnDestruct;
+};
+
+#define SHARDED_DATA_MANAGER_TEMPLATE	template< class STORAGE_TYPE, class CREATE_PARAMS, class LOCK_TYPE, class MUTEX_TYPE, int SHARD_COUNT >
+#define SHARDED_DATA_MANAGER_CLASS		CShardedDataManager< STORAGE_TYPE, CREATE_PARAMS, LOCK_TYPE, MUTEX_TYPE, SHARD_COUNT >
+
+
+//-----------------------------------------------------------------------------
+// Inline methods
+//-----------------------------------------------------------------------------
+SHARDED_DATA_MANAGER_TEMPLATE
+inline SHARDED_DATA_MANAGER_CLASS::CShardedDataManager( unsigned int size )
+{
+	COMPILE_TIME_ASSERT( SHARD_COUNT >= 1 && SHARD_COUNT <= 256 && ( SHARD_COUNT & ( SHARD_COUNT - 1 ) ) == 0 );
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		Shard_t &shard = m_Shards[i];
+		for ( int j = 0; j < CHUNKS_PER_SHARD; j++ )
+		{
+			shard.m_pChunks[j] = NULL;
+		}
+		shard.m_nSlots = 0;
+		shard.m_iFirstFree = -1;
+		shard.m_iClockHand = 0;
+		shard.m_nUsed = 0;
+	}
+	SetTargetSize( size );
+
+	m_pEvictionListener = NULL;
+	m_bAsyncEviction = false;
+	m_bFreeOnDestruct = true;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline SHARDED_DATA_MANAGER_CLASS::~CShardedDataManager()
+{
+	if ( m_bFreeOnDestruct )
+	{
+		FlushAll();
+	}
+	ProcessEvictions();
+
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		for ( int j = 0; j < CHUNKS_PER_SHARD; j++ )
+		{
+			delete [] m_Shards[i].m_pChunks[j];
+		}
+	}
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline memhandle_t SHARDED_DATA_MANAGER_CLASS::CreateResource( const CREATE_PARAMS &createParams, bool bCreateLocked )
+{
+	return CreateResourceInternal( (unsigned)( m_nNextShard++ ) % SHARD_COUNT, createParams, bCreateLocked );
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline memhandle_t SHARDED_DATA_MANAGER_CLASS::CreateResourceInShard( const CREATE_PARAMS &createParams, unsigned int nHash, bool bCreateLocked )
+{
+	// Folds the high bits in, hashes often differ only there
+	return CreateResourceInternal( ( nHash ^ ( nHash >> 16 ) ^ ( nHash >> 24 ) ) % SHARD_COUNT, createParams, bCreateLocked );
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline memhandle_t SHARDED_DATA_MANAGER_CLASS::CreateResourceInternal( int iShard, const CREATE_PARAMS &createParams, bool bCreateLocked )
+{
+	EnsureShardCapacity( iShard, STORAGE_TYPE::EstimatedSize( createParams ) );
+	STORAGE_TYPE *pStore = STORAGE_TYPE::CreateResource( createParams );
+
+	Shard_t &shard = m_Shards[iShard];
+	AUTO_LOCK_( MUTEX_TYPE, shard.m_Mutex );
+
+	int iSlot = shard.m_iFirstFree;
+	Entry_t *pEntry;
+	if ( iSlot >= 0 )
+	{
+		pEntry = &shard.m_pChunks[iSlot / SHARDEDDATAMANAGER_CHUNK_SIZE][iSlot % SHARDEDDATAMANAGER_CHUNK_SIZE];
+		shard.m_iFirstFree = pEntry->m_iNextFree;
+	}
+	else
+	{
+		if ( shard.m_nSlots >= SLOTS_PER_SHARD )
+		{
+			AssertMsg( false, "CShardedDataManager: out of handles\n" );
+			pStore->DestroyResource();
+			return INVALID_MEMHANDLE;
+		}
+
+		iSlot = shard.m_nSlots;
+		int iChunk = iSlot / SHARDEDDATAMANAGER_CHUNK_SIZE;
+		if ( !shard.m_pChunks[iChunk] )
+		{
+			Entry_t *pChunk = new Entry_t[SHARDEDDATAMANAGER_CHUNK_SIZE];
+			for ( int i = 0; i < SHARDEDDATAMANAGER_CHUNK_SIZE; i++ )
+			{
+				pChunk[i].m_pStore = NULL;
+				SetState( pChunk[i], 1, false );
+			}
+
+			// Lookups without the lock may see the chunk as soon as it's stored
+			ThreadMemoryBarrier();
+			shard.m_pChunks[iChunk] = pChunk;
+		}
+		pEntry = &shard.m_pChunks[iChunk][iSlot % SHARDEDDATAMANAGER_CHUNK_SIZE];
+		shard.m_nSlots++;
+	}
+
+	pEntry->m_pStore = pStore;
+	pEntry->m_nSize = pStore->Size();
+	pEntry->m_nLockCount = bCreateLocked ? 1 : 0;
+	SetState( *pEntry, SerialOf( *pEntry ), true );
+	shard.m_nUsed += pEntry->m_nSize;
+	return ToHandle( iShard, iSlot, SerialOf( *pEntry ) );
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline void SHARDED_DATA_MANAGER_CLASS::DestroyResource( memhandle_t hMem )
+{
+	STORAGE_TYPE *pStore;
+	{
+		Shard_t &shard = m_Shards[ShardOf( hMem )];
+		AUTO_LOCK_( MUTEX_TYPE, shard.m_Mutex );
+		Entry_t *pEntry = FindEntry( hMem );
+		if ( !pEntry )
+			return;
+
+		Assert( pEntry->m_nLockCount == 0 );
+		pStore = FreeEntry( shard, pEntry, SlotOf( hMem ) );
+	}
+	pStore->DestroyResource();
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline LOCK_TYPE SHARDED_DATA_MANAGER_CLASS::LockResource( memhandle_t hMem )
+{
+	int nCount;
+	return LockResourceReturnCount( &nCount, hMem );
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline LOCK_TYPE SHARDED_DATA_MANAGER_CLASS::LockResourceReturnCount( int *pCount, memhandle_t hMem )
+{
+	*pCount = 0;
+	if ( hMem == INVALID_MEMHANDLE )
+		return NULL;
+
+	Shard_t &shard = m_Shards[ShardOf( hMem )];
+	AUTO_LOCK_( MUTEX_TYPE, shard.m_Mutex );
+	Entry_t *pEntry = FindEntry( hMem );
+	if ( !pEntry )
+		return NULL;
+
+	pEntry->m_nLockCount++;
+	SetState( *pEntry, SerialOf( *pEntry ), true );
+	*pCount = pEntry->m_nLockCount;
+	return pEntry->m_pStore->GetData();
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline int SHARDED_DATA_MANAGER_CLASS::UnlockResource( memhandle_t hMem )
+{
+	if ( hMem == INVALID_MEMHANDLE )
+		return 0;
+
+	Shard_t &shard = m_Shards[ShardOf( hMem )];
+	AUTO_LOCK_( MUTEX_TYPE, shard.m_Mutex );
+	Entry_t *pEntry = FindEntry( hMem );
+	if ( !pEntry )
+		return 0;
+
+	Assert( pEntry->m_nLockCount > 0 );
+	if ( pEntry->m_nLockCount > 0 )
+	{
+		pEntry->m_nLockCount--;
+	}
+
+	// Like going to the tail of the LRU once the last lock is gone
+	SetState( *pEntry, SerialOf( *pEntry ), true );
+	return pEntry->m_nLockCount;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline void SHARDED_DATA_MANAGER_CLASS::TouchResource( memhandle_t hMem )
+{
+	SetReferenced( hMem, true );
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline void SHARDED_DATA_MANAGER_CLASS::MarkAsStale( memhandle_t hMem )
+{
+	SetReferenced( hMem, false );
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline int SHARDED_DATA_MANAGER_CLASS::LockCount( memhandle_t hMem )
+{
+	if ( hMem == INVALID_MEMHANDLE )
+		return 0;
+
+	Shard_t &shard = m_Shards[ShardOf( hMem )];
+	AUTO_LOCK_( MUTEX_TYPE, shard.m_Mutex );
+	Entry_t *pEntry = FindEntry( hMem );
+	return pEntry ? pEntry->m_nLockCount : 0;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline int SHARDED_DATA_MANAGER_CLASS::BreakLock( memhandle_t hMem )
+{
+	if ( hMem == INVALID_MEMHANDLE )
+		return 0;
+
+	Shard_t &shard = m_Shards[ShardOf( hMem )];
+	AUTO_LOCK_( MUTEX_TYPE, shard.m_Mutex );
+	Entry_t *pEntry = FindEntry( hMem );
+	if ( !pEntry )
+		return 0;
+
+	int nLockCount = pEntry->m_nLockCount;
+	pEntry->m_nLockCount = 0;
+	return nLockCount;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline int SHARDED_DATA_MANAGER_CLASS::BreakAllLocks()
+{
+	int nBroken = 0;
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		Shard_t &shard = m_Shards[i];
+		AUTO_LOCK_( MUTEX_TYPE, shard.m_Mutex );
+		for ( int iSlot = 0; iSlot < shard.m_nSlots; iSlot++ )
+		{
+			Entry_t &entry = shard.m_pChunks[iSlot / SHARDEDDATAMANAGER_CHUNK_SIZE][iSlot % SHARDEDDATAMANAGER_CHUNK_SIZE];
+			if ( entry.m_pStore && entry.m_nLockCount )
+			{
+				entry.m_nLockCount = 0;
+				nBroken++;
+			}
+		}
+	}
+	return nBroken;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline LOCK_TYPE SHARDED_DATA_MANAGER_CLASS::GetResource_NoLock( memhandle_t hMem )
+{
+	Entry_t *pEntry = SetReferenced( hMem, true );
+	if ( !pEntry )
+		return NULL;
+
+	STORAGE_TYPE *pStore = pEntry->m_pStore;
+	return pStore ? pStore->GetData() : NULL;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline LOCK_TYPE SHARDED_DATA_MANAGER_CLASS::GetResource_NoLockNoLRUTouch( memhandle_t hMem )
+{
+	Entry_t *pEntry = FindEntry( hMem );
+	STORAGE_TYPE *pStore = pEntry ? pEntry->m_pStore : NULL;
+	return pStore ? pStore->GetData() : NULL;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline unsigned int SHARDED_DATA_MANAGER_CLASS::TargetSize()
+{
+	unsigned int nTotal = 0;
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		unsigned int nTarget = m_Shards[i].m_nTargetSize;
+		nTotal = ( nTotal + nTarget < nTotal ) ? (unsigned)-1 : nTotal + nTarget;
+	}
+	return nTotal;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline unsigned int SHARDED_DATA_MANAGER_CLASS::AvailableSize()
+{
+	unsigned int nAvailable = 0;
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		unsigned int nTarget = m_Shards[i].m_nTargetSize;
+		unsigned int nUsed = m_Shards[i].m_nUsed;
+		unsigned int nShardAvailable = ( nUsed < nTarget ) ? nTarget - nUsed : 0;
+		nAvailable = ( nAvailable + nShardAvailable < nAvailable ) ? (unsigned)-1 : nAvailable + nShardAvailable;
+	}
+
+	// Queued evictions are still in memory, as UsedSize() says
+	unsigned int nPending = m_nPendingEvictionSize;
+	return ( nAvailable > nPending ) ? nAvailable - nPending : 0;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline unsigned int SHARDED_DATA_MANAGER_CLASS::UsedSize()
+{
+	return ResidentSize() + m_nPendingEvictionSize;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline unsigned int SHARDED_DATA_MANAGER_CLASS::ResidentSize()
+{
+	unsigned int nUsed = 0;
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		nUsed += m_Shards[i].m_nUsed;
+	}
+	return nUsed;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline void SHARDED_DATA_MANAGER_CLASS::SetTargetSize( unsigned int targetSize )
+{
+	unsigned int nShardSize = ( targetSize == (unsigned)-1 ) ? (unsigned)-1 : targetSize / SHARD_COUNT;
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		m_Shards[i].m_nTargetSize = nShardSize;
+	}
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline void SHARDED_DATA_MANAGER_CLASS::SetShardTargetSize( int iShard, unsigned int targetSize )
+{
+	m_Shards[iShard].m_nTargetSize = targetSize;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline void SHARDED_DATA_MANAGER_CLASS::NotifySizeChanged( memhandle_t hMem, unsigned int oldSize, unsigned int newSize )
+{
+	if ( hMem == INVALID_MEMHANDLE )
+		return;
+
+	Shard_t &shard = m_Shards[ShardOf( hMem )];
+	AUTO_LOCK_( MUTEX_TYPE, shard.m_Mutex );
+	Entry_t *pEntry = FindEntry( hMem );
+	if ( !pEntry )
+		return;
+
+	Assert( pEntry->m_nSize == oldSize );
+	shard.m_nUsed += newSize - pEntry->m_nSize;
+	pEntry->m_nSize = newSize;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline unsigned int SHARDED_DATA_MANAGER_CLASS::FlushAllUnlocked()
+{
+	unsigned int nFreed = 0;
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		nFreed += FlushShard( i, false );
+	}
+	return nFreed;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline unsigned int SHARDED_DATA_MANAGER_CLASS::FlushToTargetSize()
+{
+	unsigned int nFreed = 0;
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		nFreed += EnsureShardCapacity( i, 0 );
+	}
+	return nFreed;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline unsigned int SHARDED_DATA_MANAGER_CLASS::FlushAll()
+{
+	unsigned int nFreed = 0;
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		nFreed += FlushShard( i, true );
+	}
+	return nFreed;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline unsigned int SHARDED_DATA_MANAGER_CLASS::Purge( unsigned int nBytesToPurge )
+{
+	// Takes turns between the shards so none is emptied for the others. Evicting to the queue
+	// doesn't change UsedSize(), so this goes by what the shards hold
+	unsigned int nInitialUsed = ResidentSize();
+	unsigned int nTargetUsed = ( nBytesToPurge < nInitialUsed ) ? nInitialUsed - nBytesToPurge : 0;
+	int nIdleShards = 0;
+	for ( int i = 0; ResidentSize() > nTargetUsed && nIdleShards < SHARD_COUNT; i = ( i + 1 ) % SHARD_COUNT )
+	{
+		nIdleShards = EvictOne( i ) ? 0 : nIdleShards + 1;
+	}
+	return nInitialUsed - MIN( nInitialUsed, ResidentSize() );
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline unsigned int SHARDED_DATA_MANAGER_CLASS::EnsureCapacity( unsigned int size )
+{
+	unsigned int nAvailable = AvailableSize();
+	return ( nAvailable < size ) ? Purge( size - nAvailable ) : 0;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline int SHARDED_DATA_MANAGER_CLASS::ProcessEvictions( int nMaxResources )
+{
+	int nProcessed = 0;
+	Eviction_t eviction;
+	while ( nProcessed < nMaxResources && m_PendingEvictions.PopItem( &eviction ) )
+	{
+		if ( m_pEvictionListener )
+		{
+			m_pEvictionListener->OnResourceEvicted( eviction.m_hMem, eviction.m_pStore );
+		}
+		eviction.m_pStore->DestroyResource();
+		m_nPendingEvictionSize -= eviction.m_nSize;
+		nProcessed++;
+	}
+	return nProcessed;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline void SHARDED_DATA_MANAGER_CLASS::GetLRUHandleList( CUtlVector< memhandle_t >& list )
+{
+	// The hand evicts what isn't referenced on its first pass, the rest on its second
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		Shard_t &shard = m_Shards[i];
+		AUTO_LOCK_( MUTEX_TYPE, shard.m_Mutex );
+		for ( int nPass = 0; nPass < 2; nPass++ )
+		{
+			for ( int j = 0; j < shard.m_nSlots; j++ )
+			{
+				int iSlot = ( shard.m_iClockHand + j ) % shard.m_nSlots;
+				Entry_t &entry = shard.m_pChunks[iSlot / SHARDEDDATAMANAGER_CHUNK_SIZE][iSlot % SHARDEDDATAMANAGER_CHUNK_SIZE];
+				if ( entry.m_pStore && !entry.m_nLockCount && IsReferenced( entry ) == ( nPass != 0 ) )
+				{
+					list.AddToTail( ToHandle( i, iSlot, SerialOf( entry ) ) );
+				}
+			}
+		}
+	}
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline void SHARDED_DATA_MANAGER_CLASS::GetLockHandleList( CUtlVector< memhandle_t >& list )
+{
+	for ( int i = 0; i < SHARD_COUNT; i++ )
+	{
+		Shard_t &shard = m_Shards[i];
+		AUTO_LOCK_( MUTEX_TYPE, shard.m_Mutex );
+		for ( int iSlot = 0; iSlot < shard.m_nSlots; iSlot++ )
+		{
+			Entry_t &entry = shard.m_pChunks[iSlot / SHARDEDDATAMANAGER_CHUNK_SIZE][iSlot % SHARDEDDATAMANAGER_CHUNK_SIZE];
+			if ( entry.m_pStore && entry.m_nLockCount )
+			{
+				list.AddToTail( ToHandle( i, iSlot, SerialOf( entry ) ) );
+			}
+		}
+	}
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline typename SHARDED_DATA_MANAGER_CLASS::Entry_t *SHARDED_DATA_MANAGER_CLASS::FindEntry( memhandle_t hMem )
+{
+	unsigned int nHandle = (unsigned int)(uintp)hMem;
+	unsigned int nIndex = nHandle & 0xFFFF;
+	if ( hMem == INVALID_MEMHANDLE || !nIndex )
+		return NULL;
+
+	int iSlot = SlotOf( hMem );
+	if ( iSlot >= SLOTS_PER_SHARD )
+		return NULL;
+
+	Entry_t *pChunk = m_Shards[ShardOf( hMem )].m_pChunks[iSlot / SHARDEDDATAMANAGER_CHUNK_SIZE];
+	if ( !pChunk )
+		return NULL;
+
+	Entry_t *pEntry = &pChunk[iSlot % SHARDEDDATAMANAGER_CHUNK_SIZE];
+	return ( SerialOf( *pEntry ) == ( nHandle >> 16 ) && pEntry->m_pStore ) ? pEntry : NULL;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline typename SHARDED_DATA_MANAGER_CLASS::Entry_t *SHARDED_DATA_MANAGER_CLASS::SetReferenced( memhandle_t hMem, bool bReferenced )
+{
+	Entry_t *pEntry = FindEntry( hMem );
+	if ( !pEntry )
+		return NULL;
+
+	// The slot may have been freed and handed out again since it was found, and the serial changes
+	// with the bit in one exchange, so a stale handle never marks the resource that took the slot
+	uint32 nSerial = ( (unsigned int)(uintp)hMem >> 16 ) << 1;
+	for ( ;; )
+	{
+		uint32 nState = pEntry->m_nState;
+		if ( ( nState & ~1u ) != nSerial )
+			return NULL;
+
+		uint32 nNewState = bReferenced ? ( nState | 1 ) : ( nState & ~1u );
+		if ( nNewState == nState || ThreadInterlockedAssignIf( (int32 *)&pEntry->m_nState, (int32)nNewState, (int32)nState ) )
+			return pEntry;
+	}
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline STORAGE_TYPE *SHARDED_DATA_MANAGER_CLASS::FreeEntry( Shard_t &shard, Entry_t *pEntry, int iSlot )
+{
+	STORAGE_TYPE *pStore = pEntry->m_pStore;
+	shard.m_nUsed -= pEntry->m_nSize;
+
+	// Old handles stop resolving, serials skip the ones that could make INVALID_MEMHANDLE
+	uint16 nSerial = SerialOf( *pEntry ) + 1;
+	SetState( *pEntry, ( nSerial == 0 || nSerial == 0xFFFF ) ? 1 : nSerial, false );
+	pEntry->m_pStore = NULL;
+	pEntry->m_nSize = 0;
+	pEntry->m_nLockCount = 0;
+	pEntry->m_iNextFree = shard.m_iFirstFree;
+	shard.m_iFirstFree = iSlot;
+	return pStore;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline bool SHARDED_DATA_MANAGER_CLASS::EvictOne( int iShard )
+{
+	memhandle_t hMem;
+	STORAGE_TYPE *pStore;
+	unsigned int nSize;
+	{
+		Shard_t &shard = m_Shards[iShard];
+		AUTO_LOCK_( MUTEX_TYPE, shard.m_Mutex );
+
+		// Two turns at most: the first may only clear referenced bits
+		Entry_t *pVictim = NULL;
+		int iVictim = -1;
+		for ( int nSteps = 2 * shard.m_nSlots; nSteps > 0; nSteps-- )
+		{
+			int iSlot = shard.m_iClockHand;
+			shard.m_iClockHand = ( iSlot + 1 < shard.m_nSlots ) ? iSlot + 1 : 0;
+
+			Entry_t &entry = shard.m_pChunks[iSlot / SHARDEDDATAMANAGER_CHUNK_SIZE][iSlot % SHARDEDDATAMANAGER_CHUNK_SIZE];
+			if ( !entry.m_pStore || entry.m_nLockCount )
+				continue;
+
+			// Cleared with an exchange so a touch racing the hand isn't lost
+			uint32 nState = entry.m_nState;
+			if ( nState & 1 )
+			{
+				ThreadInterlockedAssignIf( (int32 *)&entry.m_nState, (int32)( nState & ~1u ), (int32)nState );
+				continue;
+			}
+
+			pVictim = &entry;
+			iVictim = iSlot;
+			break;
+		}
+
+		if ( !pVictim )
+			return false;
+
+		hMem = ToHandle( iShard, iVictim, SerialOf( *pVictim ) );
+		nSize = pVictim->m_nSize;
+		pStore = FreeEntry( shard, pVictim, iVictim );
+	}
+
+	DisposeEvicted( hMem, pStore, nSize );
+	return true;
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline void SHARDED_DATA_MANAGER_CLASS::DisposeEvicted( memhandle_t hMem, STORAGE_TYPE *pStore, unsigned int nSize )
+{
+	if ( m_bAsyncEviction )
+	{
+		Eviction_t eviction;
+		eviction.m_hMem = hMem;
+		eviction.m_pStore = pStore;
+		eviction.m_nSize = nSize;
+		m_nPendingEvictionSize += nSize;
+		m_PendingEvictions.PushItem( eviction );
+		return;
+	}
+
+	if ( m_pEvictionListener )
+	{
+		m_pEvictionListener->OnResourceEvicted( hMem, pStore );
+	}
+	pStore->DestroyResource();
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline unsigned int SHARDED_DATA_MANAGER_CLASS::EnsureShardCapacity( int iShard, unsigned int size )
+{
+	// Reads without the lock, the shard only has to be roughly in budget
+	Shard_t &shard = m_Shards[iShard];
+	unsigned int nInitialUsed = shard.m_nUsed;
+	while ( shard.m_nUsed > shard.m_nTargetSize || shard.m_nTargetSize - shard.m_nUsed < size )
+	{
+		if ( !EvictOne( iShard ) )
+			break;
+	}
+	return nInitialUsed - MIN( nInitialUsed, shard.m_nUsed );
+}
+
+SHARDED_DATA_MANAGER_TEMPLATE
+inline unsigned int SHARDED_DATA_MANAGER_CLASS::FlushShard( int iShard, bool bIncludeLocked )
+{
+	CUtlVector< Eviction_t > flushed;
+	{
+		Shard_t &shard = m_Shards[iShard];
+		AUTO_LOCK_( MUTEX_TYPE, shard.m_Mutex );
+		for ( int iSlot = 0; iSlot < shard.m_nSlots; iSlot++ )
+		{
+			Entry_t &entry = shard.m_pChunks[iSlot / SHARDEDDATAMANAGER_CHUNK_SIZE][iSlot % SHARDEDDATAMANAGER_CHUNK_SIZE];
+			if ( !entry.m_pStore || ( entry.m_nLockCount && !bIncludeLocked ) )
+				continue;
+
+			Eviction_t &eviction = flushed[flushed.AddToTail()];
+			eviction.m_hMem = ToHandle( iShard, iSlot, SerialOf( entry ) );
+			eviction.m_nSize = entry.m_nSize;
+			eviction.m_pStore = FreeEntry( shard, &entry, iSlot );
+		}
+	}
+
+	unsigned int nFreed = 0;
+	for ( int i = 0; i < flushed.Count(); i++ )
+	{
+		DisposeEvicted( flushed[i].m_hMem, flushed[i].m_pStore, flushed[i].m_nSize );
+		nFreed += flushed[i].m_nSize;
+	}
+	return nFreed;
+}
+
+#undef SHARDED_DATA_MANAGER_TEMPLATE
+#undef SHARDED_DATA_MANAGER_CLASS
+
+#endif // SHARDEDDATAMANAGER_H
@@ -509,6 +509,7 @@ public:
 private:
 	//-----------------------------------------------------
 	friend class CThreadPool;
+	friend class CWorkStealingThreadPool;
 
 	JobStatus_t			m_status;
 	JobPriority_t		m_priority;
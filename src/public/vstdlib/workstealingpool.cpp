@@ -0,0 +1,90 @@
+//==================================================================================================
+//
+// Purpose: Worker placement for CWorkStealingThreadPool, which needs the platform headers
+//
+// Add this file to every project that uses vstdlib/workstealingpool.h.
+//
+//==================================================================================================
+
+#if defined( _WIN32 ) && !defined( _X360 )
+// The processor group functions are Windows 7 and up
+#if !defined( _WIN32_WINNT ) || ( _WIN32_WINNT < 0x0601 )
+#undef _WIN32_WINNT
+#define _WIN32_WINNT 0x0601
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined( _LINUX )
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#include "vstdlib/workstealingpool.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// Every processor in every group, numbered group by group
+int CWorkStealingThreadPool::GetProcessorCount()
+{
+	int nProcessors = 0;
+#if defined( _WIN32 ) && !defined( _X360 )
+	for ( WORD nGroup = 0; nGroup < GetActiveProcessorGroupCount(); nGroup++ )
+	{
+		nProcessors += GetActiveProcessorCount( nGroup );
+	}
+#elif defined( _LINUX )
+	nProcessors = MIN( (int)sysconf( _SC_NPROCESSORS_ONLN ), CPU_SETSIZE );
+#else
+	nProcessors = MIN( (int)GetCPUInformation().m_nLogicalProcessors, 31 );
+#endif
+	return MAX( nProcessors, 1 );
+}
+
+// To that one processor, or to any in its group where a thread can't span groups. ThreadSetAffinity()
+// takes 32 processors at most and only ever the first group, so it's only the fallback
+void CWorkStealingThreadPool::SetProcessorAffinity( ThreadHandle_t hThread, int iProcessor, bool bOnlyThatOne )
+{
+#if defined( _WIN32 ) && !defined( _X360 )
+	WORD nGroups = GetActiveProcessorGroupCount();
+	WORD nGroup = 0;
+	int nInGroup = (int)GetActiveProcessorCount( 0 );
+	while ( iProcessor >= nInGroup && nGroup + 1 < nGroups )
+	{
+		iProcessor -= nInGroup;
+		nInGroup = (int)GetActiveProcessorCount( ++nGroup );
+	}
+
+	GROUP_AFFINITY affinity;
+	memset( &affinity, 0, sizeof( affinity ) );
+	affinity.Group = nGroup;
+	if ( bOnlyThatOne )
+	{
+		affinity.Mask = (KAFFINITY)1 << ( iProcessor % nInGroup );
+	}
+	else
+	{
+		affinity.Mask = ( nInGroup >= (int)( 8 * sizeof( KAFFINITY ) ) ) ? ~(KAFFINITY)0 : ( ( (KAFFINITY)1 << nInGroup ) - 1 );
+	}
+	SetThreadGroupAffinity( (HANDLE)hThread, &affinity, NULL );
+#elif defined( _LINUX )
+	cpu_set_t processors;
+	CPU_ZERO( &processors );
+	if ( bOnlyThatOne )
+	{
+		CPU_SET( iProcessor, &processors );
+	}
+	else
+	{
+		for ( int i = 0; i < GetProcessorCount(); i++ )
+		{
+			CPU_SET( i, &processors );
+		}
+	}
+	pthread_setaffinity_np( (pthread_t)hThread, sizeof( processors ), &processors );
+#else
+	int nProcessors = GetProcessorCount();
+	ThreadSetAffinity( hThread, bOnlyThatOne ? ( 1 << ( iProcessor % nProcessors ) ) : ( 1 << nProcessors ) - 1 );
+#endif
+}
@@ -0,0 +1,736 @@
+//==================================================================================================
+//
+// Purpose: IThreadPool on work stealing deques, portable to wherever tier0 runs
+//
+// CThreadPool in vstdlib keeps every job in one shared queue. Here each worker has a work stealing
+// deque per job priority: jobs added from a worker go on its own deques, where it takes them back
+// last in first out while their data is still in its cache, and idle workers steal the oldest ones
+// from the other end. Jobs added from other threads go to a shared lock free queue per priority.
+// Higher priorities are looked at first, in every queue.
+//
+// A thread in YieldWait() runs the jobs it waits for if no worker has started them, and helps with
+// queued work while they finish elsewhere, so jobs can add jobs and wait for them. JF_SERIAL jobs
+// have a shared queue per priority and never run two at a time.
+//
+// CParallelProcessor, CParallelLoopProcessor and the ParallelProcess helpers run on it unchanged.
+//
+//==================================================================================================
+
+#ifndef WORKSTEALINGPOOL_H
+#define WORKSTEALINGPOOL_H
+
+#if defined( _WIN32 )
+#pragma once
+#endif
+
+#include "tier0/dbg.h"
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+#include "tier0/tslist.h"
+#include "tier1/strtools.h"
+#include "tier1/utlvector.h"
+#include "vstdlib/jobthread.h"
+
+#define WSPOOL_PRIORITIES			( JP_HIGH + 1 )
+#define WSPOOL_SPIN_COUNT			64		// Pauses before an idle worker yields, and yields before it sleeps
+
+//-----------------------------------------------------------------------------
+// What GetDummyJob() hands out when a call runs right away
+//-----------------------------------------------------------------------------
+class CWorkStealingDummyJob : public CJob
+{
+	virtual JobStatus_t DoExecute()				{ return JOB_OK; }
+};
+
+//-----------------------------------------------------------------------------
+
+class CWorkStealingThreadPool : public CRefCounted1<IThreadPool, CRefCountServiceMT>
+{
+public:
+	CWorkStealingThreadPool();
+	~CWorkStealingThreadPool();
+
+	//-----------------------------------------------------
+	// IThreadPool
+	//-----------------------------------------------------
+	virtual bool Start( const ThreadPoolStartParams_t &startParams = ThreadPoolStartParams_t() )	{ return Start( startParams, NULL ); }
+	virtual bool Start( const ThreadPoolStartParams_t &startParams, const char *pszNameOverride );
+	virtual bool Stop( int timeout = TT_INFINITE );
+
+	virtual unsigned GetJobCount()				{ return m_nJobs; }
+	virtual int NumThreads()					{ return m_Workers.Count(); }
+	virtual int NumIdleThreads()				{ return m_nIdle; }
+
+	virtual int SuspendExecution();
+	virtual int ResumeExecution();
+
+	using IThreadPool::YieldWait;
+	virtual int YieldWait( CThreadEvent **pEvents, int nEvents, bool bWaitAll = true, unsigned timeout = TT_INFINITE );
+	virtual int YieldWait( CJob **ppJobs, int nJobs, bool bWaitAll = true, unsigned timeout = TT_INFINITE );
+	virtual void Yield( unsigned timeout );
+
+	virtual void AddJob( CJob *pJob );
+
+	// Jobs already queued keep the priority they were queued with
+	virtual void ChangePriority( CJob *pJob, JobPriority_t priority );
+
+	virtual int ExecuteToPriority( JobPriority_t toPriority, JobFilter_t pfnFilter = NULL );
+	virtual int AbortAll();
+
+	virtual void AddPerFrameJob( CJob *pJob );
+	virtual int YieldWaitPerFrameJobs();
+
+	virtual void Distribute( bool bDistribute = true, int *pAffinityTable = NULL );
+
+	//-----------------------------------------------------
+	// Jobs each worker ran since Start(), and how many of them it stole
+	//-----------------------------------------------------
+	void PrintStats();
+
+private:
+	struct Worker_t
+	{
+		CWorkStealingThreadPool			*m_pPool;
+		int								m_iThread;
+		ThreadHandle_t					m_hThread;
+		CTSWorkStealingDeque<CJob *>	m_Jobs[WSPOOL_PRIORITIES];
+		CThreadEvent					m_WakeEvent;
+		volatile int32					m_nSleeping;		// Cleared by whoever wakes it
+		uint32							m_nNextVictim;
+		int								m_nExecuted;
+		int								m_nStolen;
+		char							m_Pad[TSRINGQUEUE_CACHE_LINE_SIZE];	// Workers are allocated separately, keeps them off each other's lines
+	};
+
+	virtual void AddFunctorInternal( CFunctor *pFunctor, CJob **ppJob = NULL, const char *pszDescription = NULL, unsigned flags = 0 );
+	virtual CJob *GetDummyJob();
+
+	static uintp WorkerThreadFunc( void *pParam );
+	static Worker_t *AccessThreadWorker( Worker_t *pSetWorker = NULL );
+
+	// In workstealingpool.cpp, which has the platform headers
+	static int GetProcessorCount();
+	static void SetProcessorAffinity( ThreadHandle_t hThread, int iProcessor, bool bOnlyThatOne );
+
+	void WorkerMain( Worker_t *pWorker );
+	void ParkWorker( Worker_t *pWorker );
+	void WakeWorker();
+	void WakeAllWorkers();
+
+	Worker_t *GetCurrentWorker();
+	void PushJob( CJob *pJob );
+	CJob *GetJob( Worker_t *pWorker, JobPriority_t toPriority = JP_LOW );
+	void ExecuteJob( CJob *pJob, Worker_t *pWorker );
+	bool ExecuteOneJob();
+	void EndSerialJob( CJob *pJob );
+
+	CUtlVector<Worker_t *>		m_Workers;
+	CTSQueue<CJob *>			m_QueuedJobs[WSPOOL_PRIORITIES];	// Added from threads that aren't workers
+	CTSQueue<CJob *>			m_SerialJobs[WSPOOL_PRIORITIES];
+	volatile int32				m_nSerialRunning;
+	CInterlockedInt				m_nJobs;							// Queued and not yet taken
+	CInterlockedInt				m_nIdle;
+	CInterlockedInt				m_nSuspend;
+	volatile int32				m_nSleepers;
+	volatile bool				m_bExit;
+
+	CThreadFastMutex			m_PerFrameMutex;
+	CUtlVector<CJob *>			m_PerFrameJobs;
+
+	CJob						*m_pDummyJob;
+	char						m_szName[32];
+};
+
+//-----------------------------------------------------------------------------
+// Like CreateNewThreadPool() and DestroyThreadPool()
+//-----------------------------------------------------------------------------
+inline IThreadPool *CreateWorkStealingThreadPool()
+{
+	return new CWorkStealingThreadPool;
+}
+
+inline void DestroyWorkStealingThreadPool( IThreadPool *pPool )
+{
+	if ( pPool )
+	{
+		pPool->Stop();
+		pPool->Release();
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Inline methods
+//-----------------------------------------------------------------------------
+inline CWorkStealingThreadPool::CWorkStealingThreadPool()
+{
+	m_nSerialRunning = 0;
+	m_nSleepers = 0;
+	m_bExit = false;
+	m_szName[0] = 0;
+
+	m_pDummyJob = new CWorkStealingDummyJob;
+	m_pDummyJob->Execute();
+}
+
+inline CWorkStealingThreadPool::~CWorkStealingThreadPool()
+{
+	Stop();
+	AbortAll();
+	m_pDummyJob->Release();
+}
+
+inline bool CWorkStealingThreadPool::Start( const ThreadPoolStartParams_t &startParams, const char *pszNameOverride )
+{
+	if ( m_Workers.Count() )
+		return false;
+
+	int nThreads = startParams.nThreads;
+	if ( nThreads < 0 )
+	{
+		nThreads = MAX( 1, GetCPUInformation().m_nLogicalProcessors - 1 );
+	}
+	nThreads = MIN( nThreads, TP_MAX_POOL_THREADS );
+
+	V_strncpy( m_szName, pszNameOverride ? pszNameOverride : ( startParams.bIOThreads ? "IOJob" : "CmpJob" ), sizeof( m_szName ) );
+	m_bExit = false;
+
+	// Every worker is in the list before any of them starts looking for others to steal from
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		Worker_t *pWorker = new Worker_t;
+		pWorker->m_pPool = this;
+		pWorker->m_iThread = i;
+		pWorker->m_hThread = NULL;
+		pWorker->m_nSleeping = 0;
+		pWorker->m_nNextVictim = i + 1;
+		pWorker->m_nExecuted = 0;
+		pWorker->m_nStolen = 0;
+		m_Workers.AddToTail( pWorker );
+	}
+
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		Worker_t *pWorker = m_Workers[i];
+		pWorker->m_hThread = CreateSimpleThread( WorkerThreadFunc, pWorker, ( startParams.nStackSize > 0 ) ? startParams.nStackSize : 0 );
+
+		char szThreadName[48];
+		V_snprintf( szThreadName, sizeof( szThreadName ), "%s%d", m_szName, i );
+		ThreadSetDebugName( pWorker->m_hThread, szThreadName );
+		if ( startParams.iThreadPriority != SHRT_MIN )
+		{
+			ThreadSetPriority( pWorker->m_hThread, startParams.iThreadPriority );
+		}
+	}
+
+	if ( startParams.bUseAffinityTable )
+	{
+		Distribute( true, (int *)startParams.iAffinityTable );
+	}
+	else if ( startParams.fDistribute == TRS_TRUE )
+	{
+		Distribute( true );
+	}
+	return true;
+}
+
+inline bool CWorkStealingThreadPool::Stop( int timeout )
+{
+	if ( !m_Workers.Count() )
+		return true;
+
+	m_bExit = true;
+	WakeAllWorkers();
+
+	for ( int i = 0; i < m_Workers.Count(); i++ )
+	{
+		if ( !ThreadJoin( m_Workers[i]->m_hThread, timeout ) )
+			return false;
+	}
+
+	// Whatever is left in the workers' deques is aborted with them
+	AbortAll();
+	for ( int i = 0; i < m_Workers.Count(); i++ )
+	{
+		ReleaseThreadHandle( m_Workers[i]->m_hThread );
+		delete m_Workers[i];
+	}
+	m_Workers.RemoveAll();
+	m_bExit = false;
+	return true;
+}
+
+inline int CWorkStealingThreadPool::SuspendExecution()
+{
+	int nSuspend = m_nSuspend++;
+
+	// Jobs already taken run to the end first, like CThreadPool. A worker suspending from inside
+	// a job is the one that won't go idle
+	int nIdle = m_Workers.Count() - ( GetCurrentWorker() ? 1 : 0 );
+	while ( m_nIdle < nIdle )
+	{
+		ThreadSleep( 0 );
+	}
+	return nSuspend;
+}
+
+inline int CWorkStealingThreadPool::ResumeExecution()
+{
+	int nSuspend = m_nSuspend--;
+	if ( nSuspend == 1 )
+	{
+		WakeAllWorkers();
+	}
+	return nSuspend;
+}
+
+inline int CWorkStealingThreadPool::YieldWait( CThreadEvent **pEvents, int nEvents, bool bWaitAll, unsigned timeout )
+{
+	uint32 nStartTime = Plat_MSTime();
+	for ( ;; )
+	{
+		uint32 result = CThreadEvent::WaitForMultiple( nEvents, pEvents, bWaitAll, 0 );
+		if ( result != TW_TIMEOUT )
+			return result;
+
+		if ( timeout != TT_INFINITE && Plat_MSTime() - nStartTime >= timeout )
+			return TW_TIMEOUT;
+
+		if ( !ExecuteOneJob() )
+		{
+			result = CThreadEvent::WaitForMultiple( nEvents, pEvents, bWaitAll, 1 );
+			if ( result != TW_TIMEOUT )
+				return result;
+		}
+	}
+}
+
+inline int CWorkStealingThreadPool::YieldWait( CJob **ppJobs, int nJobs, bool bWaitAll, unsigned timeout )
+{
+	uint32 nStartTime = Plat_MSTime();
+	for ( ;; )
+	{
+		int iFirstFinished = -1;
+		int iUnfinished = -1;
+		int nFinished = 0;
+		for ( int i = 0; i < nJobs; i++ )
+		{
+			// Nobody has started it, so run it here. It's still queued, whoever takes it finds it done
+			CJob *pJob = ppJobs[i];
+			if ( !pJob->IsFinished() && !( pJob->GetFlags() & JF_SERIAL ) )
+			{
+				pJob->TryExecute();
+			}
+
+			if ( pJob->IsFinished() )
+			{
+				nFinished++;
+				if ( iFirstFinished < 0 )
+				{
+					iFirstFinished = i;
+				}
+			}
+			else
+			{
+				iUnfinished = i;
+			}
+		}
+
+		if ( bWaitAll ? ( nFinished == nJobs ) : ( nFinished > 0 ) )
+			return bWaitAll ? 0 : iFirstFinished;
+
+		if ( timeout != TT_INFINITE && Plat_MSTime() - nStartTime >= timeout )
+			return TW_TIMEOUT;
+
+		// The rest are running on other threads, help with other work meanwhile
+		if ( !ExecuteOneJob() )
+		{
+			ppJobs[iUnfinished]->AccessEvent()->Wait( 1 );
+		}
+	}
+}
+
+inline void CWorkStealingThreadPool::Yield( unsigned timeout )
+{
+	if ( !ExecuteOneJob() )
+	{
+		ThreadSleep( timeout );
+	}
+}
+
+inline void CWorkStealingThreadPool::AddJob( CJob *pJob )
+{
+	if ( !pJob )
+		return;
+
+	// Without threads only queue what was asked to be
+	pJob->AddRef();
+	if ( !m_Workers.Count() && !( pJob->GetFlags() & JF_QUEUE ) )
+	{
+		pJob->Execute();
+		pJob->Release();
+		return;
+	}
+
+	// Already run or aborted, nothing to queue
+	if ( !pJob->CanExecute() )
+	{
+		pJob->Release();
+		return;
+	}
+
+	pJob->m_pThreadPool = this;
+	pJob->m_status = JOB_STATUS_PENDING;
+	PushJob( pJob );
+}
+
+inline void CWorkStealingThreadPool::ChangePriority( CJob *pJob, JobPriority_t priority )
+{
+	pJob->SetPriority( priority );
+}
+
+inline int CWorkStealingThreadPool::ExecuteToPriority( JobPriority_t toPriority, JobFilter_t pfnFilter )
+{
+	Worker_t *pWorker = GetCurrentWorker();
+	CUtlVector<CJob *> skippedJobs;
+	int nExecuted = 0;
+
+	CJob *pJob;
+	while ( ( pJob = GetJob( pWorker, toPriority ) ) != NULL )
+	{
+		if ( pfnFilter && !pfnFilter( pJob ) )
+		{
+			EndSerialJob( pJob );
+			skippedJobs.AddToTail( pJob );
+			continue;
+		}
+
+		ExecuteJob( pJob, pWorker );
+		nExecuted++;
+	}
+
+	for ( int i = 0; i < skippedJobs.Count(); i++ )
+	{
+		PushJob( skippedJobs[i] );
+	}
+	return nExecuted;
+}
+
+inline int CWorkStealingThreadPool::AbortAll()
+{
+	int nAborted = 0;
+
+	CJob *pJob;
+	while ( ( pJob = GetJob( NULL ) ) != NULL )
+	{
+		EndSerialJob( pJob );
+		pJob->Abort();
+		pJob->Release();
+		nAborted++;
+	}
+	return nAborted;
+}
+
+inline void CWorkStealingThreadPool::AddPerFrameJob( CJob *pJob )
+{
+	if ( !pJob )
+		return;
+
+	pJob->AddRef();
+	{
+		AUTO_LOCK( m_PerFrameMutex );
+		m_PerFrameJobs.AddToTail( pJob );
+	}
+	AddJob( pJob );
+}
+
+inline int CWorkStealingThreadPool::YieldWaitPerFrameJobs()
+{
+	CUtlVector<CJob *> jobs;
+	{
+		AUTO_LOCK( m_PerFrameMutex );
+		jobs.Swap( m_PerFrameJobs );
+	}
+
+	if ( jobs.Count() )
+	{
+		YieldWait( jobs.Base(), jobs.Count() );
+		for ( int i = 0; i < jobs.Count(); i++ )
+		{
+			jobs[i]->Release();
+		}
+	}
+	return jobs.Count();
+}
+
+inline void CWorkStealingThreadPool::Distribute( bool bDistribute, int *pAffinityTable )
+{
+	// Thread 0 is left to the main thread
+	int nProcessors = GetProcessorCount();
+	for ( int i = 0; i < m_Workers.Count(); i++ )
+	{
+		if ( bDistribute && nProcessors > 1 )
+		{
+			SetProcessorAffinity( m_Workers[i]->m_hThread, ( pAffinityTable ? pAffinityTable[i] : ( i + 1 ) ) % nProcessors, true );
+		}
+		else
+		{
+			SetProcessorAffinity( m_Workers[i]->m_hThread, i % nProcessors, false );
+		}
+	}
+}
+
+inline void CWorkStealingThreadPool::PrintStats()
+{
+	for ( int i = 0; i < m_Workers.Count(); i++ )
+	{
+		Worker_t *pWorker = m_Workers[i];
+		Msg( "%s%d: %d jobs, %d stolen\n", m_szName, i, pWorker->m_nExecuted, pWorker->m_nStolen );
+	}
+}
+
+inline void CWorkStealingThreadPool::AddFunctorInternal( CFunctor *pFunctor, CJob **ppJob, const char *pszDescription, unsigned flags )
+{
+	// The job takes over the reference to the functor
+	CJob *pJob = new CFunctorJob( pFunctor, pszDescription );
+	pJob->SetFlags( flags );
+	AddJob( pJob );
+
+	if ( ppJob )
+	{
+		*ppJob = pJob;
+	}
+	else
+	{
+		pJob->Release();
+	}
+}
+
+inline CJob *CWorkStealingThreadPool::GetDummyJob()
+{
+	m_pDummyJob->AddRef();
+	return m_pDummyJob;
+}
+
+inline uintp CWorkStealingThreadPool::WorkerThreadFunc( void *pParam )
+{
+	Worker_t *pWorker = (Worker_t *)pParam;
+	AccessThreadWorker( pWorker );
+	pWorker->m_pPool->WorkerMain( pWorker );
+	return 0;
+}
+
+inline CWorkStealingThreadPool::Worker_t *CWorkStealingThreadPool::AccessThreadWorker( Worker_t *pSetWorker )
+{
+	static CTHREADLOCALPTR( Worker_t ) s_pWorker;
+	if ( pSetWorker )
+	{
+		s_pWorker = pSetWorker;
+	}
+	return s_pWorker;
+}
+
+inline void CWorkStealingThreadPool::WorkerMain( Worker_t *pWorker )
+{
+	++m_nIdle;
+
+	int nIdleSpins = 0;
+	while ( !m_bExit )
+	{
+		// Busy before looking, and the suspend count read again after, so SuspendExecution()
+		// never sees every worker idle while one holds a job
+		CJob *pJob = NULL;
+		if ( !m_nSuspend )
+		{
+			--m_nIdle;
+			pJob = m_nSuspend ? NULL : GetJob( pWorker );
+			if ( pJob )
+			{
+				ExecuteJob( pJob, pWorker );
+				++m_nIdle;
+				nIdleSpins = 0;
+				continue;
+			}
+			++m_nIdle;
+		}
+
+		// Work usually turns up again soon, so spin a little before going to sleep
+		nIdleSpins++;
+		if ( nIdleSpins < WSPOOL_SPIN_COUNT )
+		{
+			ThreadPause();
+		}
+		else if ( nIdleSpins < 2 * WSPOOL_SPIN_COUNT )
+		{
+			ThreadSleep( 0 );
+		}
+		else
+		{
+			ParkWorker( pWorker );
+			nIdleSpins = 0;
+		}
+	}
+
+	--m_nIdle;
+}
+
+inline void CWorkStealingThreadPool::ParkWorker( Worker_t *pWorker )
+{
+	// Announced before the job count is read, and PushJob() counts the job before it reads the
+	// sleepers, so one of the two always sees the other
+	ThreadInterlockedExchange( &pWorker->m_nSleeping, 1 );
+	ThreadInterlockedIncrement( &m_nSleepers );
+
+	bool bHasWork = ( m_bExit || ( !m_nSuspend && m_nJobs > 0 ) );
+	if ( bHasWork && ThreadInterlockedAssignIf( &pWorker->m_nSleeping, 0, 1 ) )
+	{
+		// Counted but not found: a job on its way into a queue, or serial jobs waiting their turn
+		ThreadSleep( 1 );
+	}
+	else
+	{
+		// Either asleep until woken, or already picked by a waker whose Set() is coming
+		pWorker->m_WakeEvent.Wait();
+	}
+
+	ThreadInterlockedDecrement( &m_nSleepers );
+}
+
+inline void CWorkStealingThreadPool::WakeWorker()
+{
+	if ( !ThreadInterlockedExchangeAdd( &m_nSleepers, 0 ) )
+		return;
+
+	for ( int i = 0; i < m_Workers.Count(); i++ )
+	{
+		Worker_t *pWorker = m_Workers[i];
+		if ( pWorker->m_nSleeping && ThreadInterlockedAssignIf( &pWorker->m_nSleeping, 0, 1 ) )
+		{
+			pWorker->m_WakeEvent.Set();
+			return;
+		}
+	}
+}
+
+inline void CWorkStealingThreadPool::WakeAllWorkers()
+{
+	for ( int i = 0; i < m_Workers.Count(); i++ )
+	{
+		Worker_t *pWorker = m_Workers[i];
+		if ( ThreadInterlockedAssignIf( &pWorker->m_nSleeping, 0, 1 ) )
+		{
+			pWorker->m_WakeEvent.Set();
+		}
+	}
+}
+
+inline CWorkStealingThreadPool::Worker_t *CWorkStealingThreadPool::GetCurrentWorker()
+{
+	Worker_t *pWorker = AccessThreadWorker();
+	return ( pWorker && pWorker->m_pPool == this ) ? pWorker : NULL;
+}
+
+inline void CWorkStealingThreadPool::PushJob( CJob *pJob )
+{
+	++m_nJobs;
+
+	int iPriority = clamp( (int)pJob->GetPriority(), (int)JP_LOW, (int)JP_HIGH );
+	Worker_t *pWorker;
+	if ( pJob->GetFlags() & JF_SERIAL )
+	{
+		m_SerialJobs[iPriority].PushItem( pJob );
+	}
+	else if ( ( pWorker = GetCurrentWorker() ) != NULL )
+	{
+		pWorker->m_Jobs[iPriority].PushItem( pJob );
+	}
+	else
+	{
+		m_QueuedJobs[iPriority].PushItem( pJob );
+	}
+
+	WakeWorker();
+}
+
+inline CJob *CWorkStealingThreadPool::GetJob( Worker_t *pWorker, JobPriority_t toPriority )
+{
+	CJob *pJob = NULL;
+	int nWorkers = m_Workers.Count();
+	for ( int iPriority = JP_HIGH; !pJob && iPriority >= toPriority; iPriority-- )
+	{
+		// One serial job at a time, EndSerialJob() lets the next one go
+		if ( m_SerialJobs[iPriority].Count() && ThreadInterlockedAssignIf( &m_nSerialRunning, 1, 0 ) )
+		{
+			if ( m_SerialJobs[iPriority].PopItem( &pJob ) )
+				break;
+			ThreadInterlockedExchange( &m_nSerialRunning, 0 );
+			pJob = NULL;
+		}
+
+		if ( pWorker && pWorker->m_Jobs[iPriority].PopItem( &pJob ) )
+			break;
+
+		if ( m_QueuedJobs[iPriority].PopItem( &pJob ) )
+			break;
+
+		// Steal, starting after the last worker stolen from so thieves spread out
+		uint32 nFirstVictim = pWorker ? pWorker->m_nNextVictim : 0;
+		for ( int i = 0; i < nWorkers; i++ )
+		{
+			Worker_t *pVictim = m_Workers[( nFirstVictim + i ) % nWorkers];
+			if ( pVictim != pWorker && pVictim->m_Jobs[iPriority].StealItem( &pJob ) )
+			{
+				if ( pWorker )
+				{
+					pWorker->m_nNextVictim = nFirstVictim + i;
+					pWorker->m_nStolen++;
+				}
+				break;
+			}
+			pJob = NULL;
+		}
+	}
+
+	if ( pJob )
+	{
+		--m_nJobs;
+	}
+	return pJob;
+}
+
+inline void CWorkStealingThreadPool::ExecuteJob( CJob *pJob, Worker_t *pWorker )
+{
+	if ( pWorker )
+	{
+		pJob->SetServiceThread( pWorker->m_iThread );
+		pWorker->m_nExecuted++;
+	}
+
+	pJob->Execute();
+	EndSerialJob( pJob );
+	pJob->Release();
+}
+
+inline bool CWorkStealingThreadPool::ExecuteOneJob()
+{
+	if ( m_nSuspend )
+		return false;
+
+	Worker_t *pWorker = GetCurrentWorker();
+	CJob *pJob = GetJob( pWorker );
+	if ( !pJob )
+		return false;
+
+	ExecuteJob( pJob, pWorker );
+	return true;
+}
+
+inline void CWorkStealingThreadPool::EndSerialJob( CJob *pJob )
+{
+	if ( pJob->GetFlags() & JF_SERIAL )
+	{
+		ThreadInterlockedExchange( &m_nSerialRunning, 0 );
+	}
+}
+
+#endif // WORKSTEALINGPOOL_H
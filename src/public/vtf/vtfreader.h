@@ -0,0 +1,150 @@
+//==================================================================================================
+//
+// Read-only access to VTF files without copying the image data
+//
+// The file is memory mapped and only the header and resource dictionary are parsed. Image and
+// resource data are returned as pointers into the mapping, so pages are only read once they are
+// touched.
+//
+//==================================================================================================
+
+#ifndef VTFREADER_H
+#define VTFREADER_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "bitmap/imageformat.h"
+#include "mathlib/vector.h"
+#include "tier0/platform.h"
+
+// 65535 texels wide, the largest a VTF header can describe
+#define MAX_VTF_MIP_LEVELS		16
+
+//-----------------------------------------------------------------------------
+// Memory mapped VTF file, versions 7.0 through 7.5
+//-----------------------------------------------------------------------------
+class CVTFReader
+{
+public:
+	CVTFReader();
+	~CVTFReader();
+
+	// Maps the file and validates the header, the resource dictionary and the
+	// extent of the image data. Returns false for anything malformed
+	bool Open( const char *pFileName );
+
+	// Same, on a file already in memory. The memory has to outlive the reader
+	bool OpenMemory( const void *pData, size_t nSize );
+
+	// Same, on the first nDataSize bytes of a file of nFileSize bytes, enough for the header
+	// and resource dictionary. Data past nDataSize is never returned
+	bool OpenHeader( const void *pData, size_t nDataSize, size_t nFileSize );
+
+	void Close();
+	bool IsOpen() const { return m_pFile != NULL; }
+
+	// The file, for callers that read parts of it themselves. DataSize() is less than
+	// FileSize() after OpenHeader
+	const uint8 *FileData() const { return m_pFile; }
+	size_t FileSize() const { return m_nFileSize; }
+	size_t DataSize() const { return m_nDataSize; }
+
+	int MajorVersion() const { return m_nMajorVersion; }
+	int MinorVersion() const { return m_nMinorVersion; }
+
+	// Attributes...
+	int Width() const { return m_nWidth; }
+	int Height() const { return m_nHeight; }
+	int Depth() const { return m_nDepth; }
+	int MipCount() const { return m_nMipCount; }
+	int FrameCount() const { return m_nFrameCount; }
+	int StartFrame() const { return m_nStartFrame; }
+	int FaceCount() const { return m_nFaceCount; }
+	int Flags() const { return m_nFlags; }
+	ImageFormat Format() const { return m_Format; }
+	float BumpScale() const { return m_flBumpScale; }
+
+	// NOTE: reflectivity[0] = blue, [1] = greem, [2] = red
+	const Vector &Reflectivity() const { return m_vecReflectivity; }
+
+	int LowResWidth() const { return m_nLowResWidth; }
+	int LowResHeight() const { return m_nLowResHeight; }
+	ImageFormat LowResFormat() const { return m_LowResFormat; }
+
+	// NULL when the file has no low-res image
+	const uint8 *LowResImageData( int *pSizeInBytes = NULL ) const;
+
+	// Resource dictionary, empty before 7.3. Types are compared without the flag byte
+	int ResourceCount() const { return m_nResourceCount; }
+	uint32 ResourceType( int nResource ) const;
+	bool HasResourceEntry( uint32 eType ) const;
+
+	// Returns the resource data, or NULL if the resource isn't present. Resources
+	// without a data chunk return their 4 byte dictionary value
+	const void *GetResourceData( uint32 eType, size_t *pDataSize ) const;
+
+	// False for files with only a header, low-res image or resources
+	bool HasImageData() const { return m_nImageOffset != 0; }
+
+	// Computes the dimensions of a particular mip level
+	void ComputeMipLevelDimensions( int iMipLevel, int *pMipWidth, int *pMipHeight, int *pMipDepth ) const;
+
+	// Computes the size (in bytes) of a single mipmap of a single face of a single frame
+	int ComputeMipSize( int iMipLevel ) const;
+
+	// Where the image data of a frame, face and mip level is, measured from file start
+	void ImageFileInfo( int nFrame, int nFace, int nMip, int *pStartLocation, int *pSizeInBytes ) const;
+
+	// Returns the data of one slice of a frame, face and mip level, NULL if out of range
+	// or not in memory. Slices of a volume texture follow each other
+	const uint8 *ImageData( int iFrame, int iFace, int iMipLevel, int iSlice = 0, int *pSizeInBytes = NULL ) const;
+
+	// Size of an image of any format, 0 for unknown formats
+	static int ImageSize( ImageFormat fmt, int nWidth, int nHeight, int nDepth );
+
+private:
+	bool Parse();
+	bool ParseResources( uint32 *pLowResOffset, uint32 *pImageOffset );
+	const uint8 *FindResource( uint32 eType ) const;
+
+	const uint8		*m_pFile;
+	size_t			m_nFileSize;
+	size_t			m_nDataSize;		// Bytes of the file at m_pFile
+	void			*m_pMapping;		// Platform mapping, NULL for OpenMemory
+	size_t			m_nMappingSize;
+#ifdef _WIN32
+	void			*m_hFile;
+	void			*m_hFileMapping;
+#endif
+
+	int				m_nMajorVersion;
+	int				m_nMinorVersion;
+	int				m_nWidth;
+	int				m_nHeight;
+	int				m_nDepth;
+	int				m_nMipCount;
+	int				m_nFrameCount;
+	int				m_nStartFrame;
+	int				m_nFaceCount;
+	int				m_nFlags;
+	ImageFormat		m_Format;
+	float			m_flBumpScale;
+	Vector			m_vecReflectivity;
+
+	int				m_nLowResWidth;
+	int				m_nLowResHeight;
+	ImageFormat		m_LowResFormat;
+	uint32			m_nLowResOffset;
+	int				m_nLowResSize;
+
+	const uint8		*m_pResources;		// Dictionary in the file
+	int				m_nResourceCount;
+
+	uint32			m_nImageOffset;		// 0 when the file has no image data
+	uint32			m_nMipOffset[MAX_VTF_MIP_LEVELS];	// Of the first frame and face of each mip
+	int				m_nMipSize[MAX_VTF_MIP_LEVELS];
+};
+
+#endif // VTFREADER_H
@@ -0,0 +1,122 @@
+//==================================================================================================
+//
+// Mip-tail-first VTF loading for texture streaming
+//
+// VTF files store the smallest mip first, so the low resolution tail of a texture is one short
+// read near the start of the file. Open() reads the header and that tail synchronously, the
+// larger mips are read on a background thread as the texture is asked for at a larger size on
+// screen. Textures that are the most magnified relative to their resident mip load first.
+//
+//==================================================================================================
+
+#ifndef VTFSTREAMER_H
+#define VTFSTREAMER_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "vtf/vtfreader.h"
+#include "tier0/threadtools.h"
+#include "tier1/utlvector.h"
+#include "tier1/utlpriorityqueue.h"
+
+typedef int VTFStreamHandle_t;
+#define VTF_STREAM_INVALID_HANDLE	( (VTFStreamHandle_t)-1 )
+
+// Mips no larger than this on a side are read when the texture is opened
+#define VTF_STREAM_DEFAULT_TAIL_SIZE	64
+
+//-----------------------------------------------------------------------------
+// Streams the mips of VTF files from disk
+//-----------------------------------------------------------------------------
+class CVTFStreamer
+{
+public:
+	CVTFStreamer();
+	~CVTFStreamer();
+
+	// Starts and stops the loader thread. Shutdown closes every texture
+	bool Init();
+	void Shutdown();
+
+	// Reads the header and every mip no larger than nTailSize texels on a side. The top mip is
+	// limited by the TextureLODControlSettings_t of the file, then lowered by nPicMip
+	VTFStreamHandle_t Open( const char *pFileName, int nTailSize = VTF_STREAM_DEFAULT_TAIL_SIZE, int nPicMip = 0 );
+	void Close( VTFStreamHandle_t hTexture );
+
+	// Header of the texture. Its image data accessors return NULL, use GetImageData. The header
+	// never changes after Open and the reference stays valid until Close of the texture
+	const CVTFReader &GetHeader( VTFStreamHandle_t hTexture ) const;
+
+	// Asks for the mip that covers flScreenSize pixels along the larger side. Larger mips load
+	// in the background, mips more than one level above the request are freed right away
+	void RequestScreenSize( VTFStreamHandle_t hTexture, float flScreenSize );
+
+	// Mip range of the texture: the largest one it can load and the start of the tail
+	int GetTopMip( VTFStreamHandle_t hTexture ) const;
+	int GetTailMip( VTFStreamHandle_t hTexture ) const;
+
+	// Largest mip in memory, every smaller one is in memory too
+	int GetResidentMip( VTFStreamHandle_t hTexture ) const;
+
+	// Data of a resident mip, NULL for one that isn't. Stays valid until the next
+	// RequestScreenSize or Close of the texture
+	const uint8 *GetImageData( VTFStreamHandle_t hTexture, int iFrame, int iFace, int iMipLevel, int *pSizeInBytes = NULL ) const;
+
+	// Image memory of every open texture
+	size_t GetResidentMemory() const;
+
+	// Waits until every requested mip is loaded
+	void Flush();
+
+private:
+	struct StreamingTexture_t
+	{
+		char		m_szFileName[MAX_PATH];
+		uint8		*m_pHeaderData;
+		CVTFReader	m_Header;
+		uint8		*m_pTailData;
+		int			m_nTailSize;
+		uint8		*m_pMipData[MAX_VTF_MIP_LEVELS];	// Every frame and face of a mip, as stored in the file
+		int			m_nTopMip;
+		int			m_nTailMip;
+		int			m_nResidentMip;
+		int			m_nWantedMip;
+		float		m_flScreenSize;
+		int			m_nSerial;			// Changes when the slot is reused
+		int			m_nRequestSerial;	// Changes with each request, older queue entries are stale
+		bool		m_bInUse;
+	};
+
+	struct MipRequest_t
+	{
+		VTFStreamHandle_t	m_hTexture;
+		int					m_nSerial;
+		int					m_nRequestSerial;
+		float				m_flPriority;
+	};
+
+	static bool RequestLessFunc( const MipRequest_t &a, const MipRequest_t &b );
+	static uintp LoaderThreadFunc( void *pParam );
+	void LoaderThread();
+
+	StreamingTexture_t *GetTexture( VTFStreamHandle_t hTexture ) const;
+	void QueueRequest( VTFStreamHandle_t hTexture, StreamingTexture_t *pTexture );
+	void FreeMips( StreamingTexture_t *pTexture, int nFirstKeptMip );
+	int MipFileRange( const StreamingTexture_t *pTexture, int nMip, int *pStart ) const;
+	bool ReadFileRange( const char *pFileName, int nStart, int nSize, uint8 *pDest ) const;
+
+	CUtlVector< StreamingTexture_t * >	m_Textures;
+	CUtlVector< VTFStreamHandle_t >		m_FreeTextures;
+	CUtlPriorityQueue< MipRequest_t >	m_Requests;
+
+	mutable CThreadMutex	m_Mutex;			// Guards everything the loader thread touches
+	CThreadEvent			m_RequestEvent;
+	ThreadHandle_t			m_hLoaderThread;
+	bool					m_bExit;
+	bool					m_bLoading;
+	size_t					m_nResidentMemory;
+};
+
+#endif // VTFSTREAMER_H
@@ -0,0 +1,448 @@
+//==================================================================================================
+//
+// bitmapbench: times bitmaptools algorithms against the ones they stand in for
+//
+// bilateral: TileableBilateralGridFilter against the brute force TileableBilateralFilter on a noisy
+// tileable test image, one row per radius. Both get the same input; the difference column is the
+// RMS and largest per channel difference of the grid result from the brute force one, and the
+// noise column how much of the added noise each filter leaves.
+//
+// maxrects: CMaxRectsTexturePacker against CTexturePacker on the same random texture sizes, taken
+// in the order they were made and then largest first, opening a new page whenever one is full.
+// Reports the time to pack all of them, the pages used and the occupancy of the full pages, then
+// the time for CMaxRectsTexturePacker to remove and reinsert a quarter of a page's textures.
+//
+// Usage: bitmapbench bilateral [-size n] [-radii 4,8,16,32] [-threshold f] [-threads n]
+//        bitmapbench maxrects [-count n] [-page n] [-gap n] [-minsize n] [-maxsize n]
+//
+//==================================================================================================
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tier0/platform.h"
+#include "tier0/tsctimer.h"
+#include "tier1/strtools.h"
+#include "tier1/utlvector.h"
+#include "bitmap/floatbitmap.h"
+#include "bitmap/maxrectspacker.h"
+#include "bitmap/texturepacker.h"
+#include "vstdlib/jobthread.h"
+#include "vstdlib/workstealingpool.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+static uint32 s_nRandomState = 0x9e3779b9;
+
+static float RandomFloat01()
+{
+	// xorshift32
+	s_nRandomState ^= s_nRandomState << 13;
+	s_nRandomState ^= s_nRandomState >> 17;
+	s_nRandomState ^= s_nRandomState << 5;
+	return ( s_nRandomState >> 8 ) * ( 1.0f / 16777216.0f );
+}
+
+// Comma separated list of integers
+static void ParseIntList( const char *pList, CUtlVector< int > &values )
+{
+	values.RemoveAll();
+	while ( *pList )
+	{
+		values.AddToTail( atoi( pList ) );
+		const char *pComma = strchr( pList, ',' );
+		if ( !pComma )
+			break;
+		pList = pComma + 1;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Bilateral filter
+//-----------------------------------------------------------------------------
+
+// Baked AO and roughness look alike: flat areas with hard edges between them and a slow
+// gradient on top, tileable. Noise of +-flNoise is added, the clean image is kept to compare to
+static void MakeBilateralTestImage( FloatBitMap_t &image, FloatBitMap_t *pClean, int nSize, float flNoise )
+{
+	s_nRandomState = 0x9e3779b9;
+	image.Init( nSize, nSize );
+	if ( pClean )
+	{
+		pClean->Init( nSize, nSize );
+	}
+
+	int nCell = MAX( nSize / 8, 1 );
+	for ( int y = 0; y < nSize; ++y )
+	{
+		for ( int x = 0; x < nSize; ++x )
+		{
+			float flGradient = 0.25f + 0.25f * sinf( 2.0f * M_PI_F * x / nSize ) * cosf( 2.0f * M_PI_F * y / nSize );
+			float flValue = ( ( x / nCell + y / nCell ) & 1 ) ? flGradient + 0.4f : flGradient;
+			for ( int c = 0; c < 4; ++c )
+			{
+				if ( pClean )
+				{
+					pClean->Pixel( x, y, 0, c ) = flValue;
+				}
+				image.Pixel( x, y, 0, c ) = flValue + flNoise * ( 2.0f * RandomFloat01() - 1.0f );
+			}
+		}
+	}
+}
+
+static void CompareImages( const FloatBitMap_t &a, const FloatBitMap_t &b, float *pRMS, float *pMax )
+{
+	double flSum = 0.0;
+	float flMax = 0.0f;
+	for ( int y = 0; y < a.NumRows(); ++y )
+	{
+		for ( int x = 0; x < a.NumCols(); ++x )
+		{
+			for ( int c = 0; c < 4; ++c )
+			{
+				float flDiff = fabsf( a.Pixel( x, y, 0, c ) - b.Pixel( x, y, 0, c ) );
+				flSum += flDiff * flDiff;
+				flMax = MAX( flMax, flDiff );
+			}
+		}
+	}
+	*pRMS = sqrtf( (float)( flSum / ( 4.0 * a.NumRows() * a.NumCols() ) ) );
+	*pMax = flMax;
+}
+
+static int BenchBilateral( int argc, char **argv )
+{
+	int nSize = 256;
+	float flThreshold = 0.2f;
+	float flNoise = 0.05f;
+	int nThreads = 1;
+	CUtlVector< int > radii;
+	ParseIntList( "4,8,16,32", radii );
+
+	for ( int i = 0; i < argc; ++i )
+	{
+		bool bHasValue = i + 1 < argc;
+		if ( !V_stricmp( argv[i], "-size" ) && bHasValue )
+		{
+			nSize = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-radii" ) && bHasValue )
+		{
+			ParseIntList( argv[++i], radii );
+		}
+		else if ( !V_stricmp( argv[i], "-threshold" ) && bHasValue )
+		{
+			flThreshold = (float)atof( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-threads" ) && bHasValue )
+		{
+			nThreads = atoi( argv[++i] );
+		}
+		else
+		{
+			return -1;
+		}
+	}
+	nSize = MAX( nSize, 8 );
+
+	IThreadPool *pThreadPool = NULL;
+	if ( nThreads > 1 )
+	{
+		pThreadPool = CreateWorkStealingThreadPool();
+		ThreadPoolStartParams_t startParams;
+		startParams.nThreads = nThreads - 1;
+		pThreadPool->Start( startParams );
+	}
+	FloatBitMap_t::SetThreadPool( pThreadPool );
+
+	FloatBitMap_t clean, noisy;
+	MakeBilateralTestImage( noisy, &clean, nSize, flNoise );
+	float flNoiseRMS, flNoiseMax;
+	CompareImages( noisy, clean, &flNoiseRMS, &flNoiseMax );
+
+	printf( "%dx%d RGBA, threshold %.2f, noise rms %.4f, %d threads\n", nSize, nSize, flThreshold, flNoiseRMS, MAX( nThreads, 1 ) );
+	printf( "%6s %12s %12s %8s %10s %10s %12s %12s\n", "radius", "brute ms", "grid ms", "speedup", "diff rms", "diff max", "brute noise", "grid noise" );
+	for ( int i = 0; i < radii.Count(); ++i )
+	{
+		int nRadius = radii[i];
+		FloatBitMap_t brute, grid;
+		MakeBilateralTestImage( brute, NULL, nSize, flNoise );
+		MakeBilateralTestImage( grid, NULL, nSize, flNoise );
+
+		CPreciseTimer timer;
+		timer.Start();
+		brute.TileableBilateralFilter( nRadius, flThreshold );
+		timer.End();
+		double flBruteTime = timer.GetSeconds();
+
+		timer.Start();
+		grid.TileableBilateralGridFilter( nRadius, flThreshold );
+		timer.End();
+		double flGridTime = timer.GetSeconds();
+
+		float flDiffRMS, flDiffMax, flBruteNoise, flGridNoise, flUnused;
+		CompareImages( grid, brute, &flDiffRMS, &flDiffMax );
+		CompareImages( brute, clean, &flBruteNoise, &flUnused );
+		CompareImages( grid, clean, &flGridNoise, &flUnused );
+		printf( "%6d %12.1f %12.1f %7.1fx %10.4f %10.4f %12.4f %12.4f\n", nRadius, 1000.0 * flBruteTime, 1000.0 * flGridTime,
+			flBruteTime / MAX( flGridTime, 1e-9 ), flDiffRMS, flDiffMax, flBruteNoise, flGridNoise );
+	}
+
+	FloatBitMap_t::SetThreadPool( NULL );
+	if ( pThreadPool )
+	{
+		pThreadPool->Stop();
+		DestroyWorkStealingThreadPool( pThreadPool );
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Texture packers
+//-----------------------------------------------------------------------------
+struct PackResult_t
+{
+	double m_flSeconds;
+	int m_nPages;
+	float m_flFullOccupancy;		// Mean over every page but the last
+};
+
+static int __cdecl CompareRectsLargestFirst( const Rect_t *pA, const Rect_t *pB )
+{
+	int nAreaA = pA->width * pA->height;
+	int nAreaB = pB->width * pB->height;
+	if ( nAreaA != nAreaB )
+		return ( nAreaA > nAreaB ) ? -1 : 1;
+	return MAX( pB->width, pB->height ) - MAX( pA->width, pA->height );
+}
+
+static int __cdecl CompareInts( const int *pA, const int *pB )
+{
+	return *pA - *pB;
+}
+
+static void AddPage( PackResult_t &result, int nPageArea, int nUsedArea, bool bLast )
+{
+	++result.m_nPages;
+	if ( !bLast )
+	{
+		result.m_flFullOccupancy += (float)nUsedArea / (float)nPageArea;
+	}
+}
+
+static void FinishPages( PackResult_t &result )
+{
+	result.m_flFullOccupancy = ( result.m_nPages > 1 ) ? result.m_flFullOccupancy / ( result.m_nPages - 1 ) : 0.0f;
+}
+
+// Both packers take the textures one at a time in the order given and open a new page when one is
+// full
+template < class PACKER >
+static PackResult_t PackPages( const CUtlVector< Rect_t > &rects, int nPage, int nGap )
+{
+	PackResult_t result = { 0.0, 0, 0.0f };
+	CUtlVector< Rect_t > left, next;
+	left.AddMultipleToTail( rects.Count(), rects.Base() );
+
+	CPreciseTimer timer;
+	timer.Start();
+	PACKER packer( nPage, nPage, nGap );
+	while ( left.Count() )
+	{
+		packer.Clear();
+		int nUsedArea = 0;
+		next.RemoveAll();
+		for ( int i = 0; i < left.Count(); ++i )
+		{
+			if ( packer.InsertRect( left[i] ) < 0 )
+			{
+				next.AddToTail( left[i] );
+			}
+			else
+			{
+				nUsedArea += left[i].width * left[i].height;
+			}
+		}
+		if ( !nUsedArea )
+			break;
+
+		left.Swap( next );
+		AddPage( result, nPage * nPage, nUsedArea, left.Count() == 0 );
+	}
+	timer.End();
+	result.m_flSeconds = timer.GetSeconds();
+	FinishPages( result );
+	return result;
+}
+
+static int BenchMaxRects( int argc, char **argv )
+{
+	int nCount = 10000;
+	int nPage = 2048;
+	int nGap = 1;
+	int nMinSize = 4;
+	int nMaxSize = 128;
+
+	for ( int i = 0; i < argc; ++i )
+	{
+		bool bHasValue = i + 1 < argc;
+		if ( !V_stricmp( argv[i], "-count" ) && bHasValue )
+		{
+			nCount = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-page" ) && bHasValue )
+		{
+			nPage = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-gap" ) && bHasValue )
+		{
+			nGap = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-minsize" ) && bHasValue )
+		{
+			nMinSize = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-maxsize" ) && bHasValue )
+		{
+			nMaxSize = atoi( argv[++i] );
+		}
+		else
+		{
+			return -1;
+		}
+	}
+	nCount = MAX( nCount, 1 );
+	nGap = MAX( nGap, 0 );
+	nMinSize = MAX( nMinSize, 1 );
+	nMaxSize = MAX( nMaxSize, nMinSize );
+	nPage = MAX( nPage, nMaxSize + nGap );
+
+	// Sides spread evenly in log2, the way sprite sheets and decals mix a few large textures with
+	// many small ones
+	s_nRandomState = 0x9e3779b9;
+	float flLogMin = logf( (float)nMinSize );
+	float flLogRange = logf( (float)nMaxSize ) - flLogMin;
+	CUtlVector< Rect_t > rects;
+	rects.SetCount( nCount );
+	for ( int i = 0; i < nCount; ++i )
+	{
+		rects[i].x = 0;
+		rects[i].y = 0;
+		rects[i].width = (int)( expf( flLogMin + flLogRange * RandomFloat01() ) + 0.5f );
+		rects[i].height = (int)( expf( flLogMin + flLogRange * RandomFloat01() ) + 0.5f );
+	}
+
+	printf( "%d textures %d to %d pixels a side, %dx%d pages, gap %d\n", nCount, nMinSize, nMaxSize, nPage, nPage, nGap );
+	printf( "%-14s %-16s %10s %6s %15s\n", "order", "packer", "ms", "pages", "full occupancy" );
+	for ( int nOrder = 0; nOrder < 2; ++nOrder )
+	{
+		const char *pOrder = nOrder ? "largest first" : "arrival";
+		if ( nOrder )
+		{
+			rects.Sort( CompareRectsLargestFirst );
+		}
+		PackResult_t tree = PackPages< CTexturePacker >( rects, nPage, nGap );
+		PackResult_t maxRects = PackPages< CMaxRectsTexturePacker >( rects, nPage, nGap );
+		printf( "%-14s %-16s %10.1f %6d %14.1f%%\n", pOrder, "CTexturePacker", 1000.0 * tree.m_flSeconds, tree.m_nPages, 100.0f * tree.m_flFullOccupancy );
+		printf( "%-14s %-16s %10.1f %6d %14.1f%%\n", pOrder, "MaxRects", 1000.0 * maxRects.m_flSeconds, maxRects.m_nPages, 100.0f * maxRects.m_flFullOccupancy );
+	}
+
+	// Churn on one page: take out a random quarter of what is on it and put it back, largest first
+	CMaxRectsTexturePacker packer( nPage, nPage, nGap );
+	CUtlVector< int > indices;
+	indices.SetCount( nCount );
+	packer.InsertRects( rects.Base(), nCount, indices.Base() );
+	float flFullPage = packer.GetOccupancy();
+
+	CUtlVector< int > placed;
+	for ( int i = 0; i < nCount; ++i )
+	{
+		if ( indices[i] >= 0 )
+		{
+			placed.AddToTail( i );
+		}
+	}
+	CUtlVector< int > removed;
+	for ( int i = placed.Count() - 1; i >= 0; --i )
+	{
+		// Partial Fisher-Yates for the last quarter
+		int j = (int)( RandomFloat01() * ( i + 1 ) );
+		V_swap( placed[i], placed[j] );
+		if ( removed.Count() < placed.Count() / 4 )
+		{
+			removed.AddToTail( placed[i] );
+		}
+	}
+
+	CPreciseTimer timer;
+	timer.Start();
+	for ( int i = 0; i < removed.Count(); ++i )
+	{
+		packer.RemoveRect( indices[removed[i]] );
+	}
+	timer.End();
+	double flRemoveTime = timer.GetSeconds();
+
+	removed.Sort( CompareInts );
+	int nReinserted = 0;
+	timer.Start();
+	for ( int i = 0; i < removed.Count(); ++i )
+	{
+		nReinserted += ( packer.InsertRect( rects[removed[i]] ) >= 0 );
+	}
+	timer.End();
+	double flReinsertTime = timer.GetSeconds();
+
+	printf( "churn on a page of %d: removed %d in %.1f ms, reinserted %d of them in %.1f ms, occupancy %.1f%% -> %.1f%%\n",
+		placed.Count(), removed.Count(), 1000.0 * flRemoveTime, nReinserted, 1000.0 * flReinsertTime,
+		100.0f * flFullPage, 100.0f * packer.GetOccupancy() );
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Main
+//-----------------------------------------------------------------------------
+struct Benchmark_t
+{
+	const char *m_pName;
+	int ( *m_pFunc )( int argc, char **argv );	// -1 for bad arguments
+	const char *m_pUsage;
+};
+
+static const Benchmark_t s_Benchmarks[] =
+{
+	{ "bilateral", BenchBilateral, "[-size n] [-radii 4,8,16,32] [-threshold f] [-threads n]" },
+	{ "maxrects", BenchMaxRects, "[-count n] [-page n] [-gap n] [-minsize n] [-maxsize n]" },
+};
+
+static void PrintUsage()
+{
+	for ( int i = 0; i < ARRAYSIZE( s_Benchmarks ); ++i )
+	{
+		printf( "%s bitmapbench %s %s\n", i ? "      " : "usage:", s_Benchmarks[i].m_pName, s_Benchmarks[i].m_pUsage );
+	}
+}
+
+int main( int argc, char **argv )
+{
+	CTSCClock::Init();
+
+	for ( int i = 0; argc > 1 && i < ARRAYSIZE( s_Benchmarks ); ++i )
+	{
+		if ( V_stricmp( argv[1], s_Benchmarks[i].m_pName ) )
+			continue;
+
+		int nResult = s_Benchmarks[i].m_pFunc( argc - 2, argv + 2 );
+		if ( nResult < 0 )
+		{
+			PrintUsage();
+			return 1;
+		}
+		return nResult;
+	}
+	PrintUsage();
+	return 1;
+}
@@ -0,0 +1,448 @@
+//==================================================================================================
+//
+// fxcprep: preprocesses every static combo of an fxc shader without compiling it
+//
+// Writes the include dependencies of the shader, a hash of the preprocessed source of each static
+// combo, and the static combo alias table (StaticComboAliasRecord_t) for the combos whose source
+// and set of valid dynamic combos are identical to a lower numbered combo.
+//
+// Usage: fxcprep [-threads n] [-ver 30] [-I dir] [-deps file] [-hashes file] [-aliases file]
+//                [-dump staticindex] shader.fxc
+//
+//==================================================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+#include "tier1/strtools.h"
+#include "tier1/generichash.h"
+#include "tier1/utlvector.h"
+#include "materialsystem/shader_vcs_version.h"
+
+#include "hlslpreprocessor.h"
+#include "shadercombos.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define MAX_PREP_THREADS	64
+
+struct ComboResult_t
+{
+	uint64	m_nSourceHash;
+	uint64	m_nDynamicHash;		// Which dynamic combos survive the skips
+	int		m_nLiveDynamicCombos;
+	bool	m_bLive;
+	bool	m_bError;
+};
+
+struct PrepJob_t
+{
+	const CHLSLPreprocessor		*m_pPreprocessor;
+	const CShaderCombos			*m_pCombos;
+	const int					*m_pComboSymbols;	// Preprocessor symbol of each combo
+	CUtlVector< int >			m_UnknownSymbols;	// Defined by ShaderCompile, same for every combo
+	int							m_nRootFile;
+	int							m_nDumpCombo;
+	int							m_nEndCombo;
+	CInterlockedInt				m_nNextCombo;
+	ComboResult_t				*m_pResults;
+};
+
+struct PrepThread_t
+{
+	PrepJob_t			*m_pJob;
+	ThreadHandle_t		m_hThread;
+	CUtlVector< uint8 >	m_FilesUsed;
+};
+
+static uintp PrepThreadFunc( void *pParam )
+{
+	PrepThread_t *pThread = (PrepThread_t *)pParam;
+	PrepJob_t *pJob = pThread->m_pJob;
+	const CShaderCombos &combos = *pJob->m_pCombos;
+
+	CPreprocessorContext context( *pJob->m_pPreprocessor );
+	CUtlVector< int > values;
+	values.SetCount( MAX( 1, combos.GetComboCount() ) );
+	CUtlVector< uint32 > dynamicMask;
+	dynamicMask.SetCount( ( combos.GetDynamicComboCount() + 31 ) / 32 );
+
+	for ( ;; )
+	{
+		int nStatic = pJob->m_nNextCombo++;
+		if ( nStatic >= pJob->m_nEndCombo )
+			break;
+
+		ComboResult_t &result = pJob->m_pResults[nStatic];
+		V_memset( &result, 0, sizeof( result ) );
+
+		combos.DecodeStatic( nStatic, values.Base() );
+		if ( combos.IsStaticSkipped( values.Base() ) )
+			continue;
+
+		V_memset( dynamicMask.Base(), 0, dynamicMask.Count() * sizeof( uint32 ) );
+		for ( int nDynamic = 0; nDynamic < combos.GetDynamicComboCount(); ++nDynamic )
+		{
+			combos.DecodeDynamic( nDynamic, values.Base() );
+			if ( !combos.IsDynamicSkipped( values.Base() ) )
+			{
+				dynamicMask[nDynamic >> 5] |= 1u << ( nDynamic & 31 );
+				++result.m_nLiveDynamicCombos;
+			}
+		}
+		if ( !result.m_nLiveDynamicCombos )
+			continue;
+
+		result.m_bLive = true;
+		result.m_nDynamicHash = MurmurHash64( dynamicMask.Base(), dynamicMask.Count() * sizeof( uint32 ), 0 );
+
+		context.Reset();
+		for ( int i = 0; i < combos.GetComboCount(); ++i )
+		{
+			if ( combos.GetCombo( i ).m_bStatic )
+			{
+				context.DefineValue( pJob->m_pComboSymbols[i], values[i] );
+			}
+			else
+			{
+				context.DefineUnknown( pJob->m_pComboSymbols[i] );
+			}
+		}
+		for ( int i = 0; i < pJob->m_UnknownSymbols.Count(); ++i )
+		{
+			context.DefineUnknown( pJob->m_UnknownSymbols[i] );
+		}
+
+		result.m_bError = !context.Run( pJob->m_nRootFile );
+
+		const CUtlVector< char > &output = context.GetOutput();
+		result.m_nSourceHash = MurmurHash64( output.Base(), output.Count(), 0 );
+
+		if ( nStatic == pJob->m_nDumpCombo )
+		{
+			fwrite( output.Base(), 1, output.Count(), stdout );
+		}
+	}
+
+	pThread->m_FilesUsed.SetCount( pJob->m_pPreprocessor->GetFileCount() );
+	for ( int i = 0; i < pThread->m_FilesUsed.Count(); ++i )
+	{
+		pThread->m_FilesUsed[i] = context.IsFileUsed( i );
+	}
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// "pbr_ps30" -> "ps30" and "SHADER_MODEL_PS_3_0"
+//-----------------------------------------------------------------------------
+static bool GetShaderTarget( const char *pFileName, const char *pVersion, char *pTarget, int nTargetSize, char *pModel, int nModelSize )
+{
+	char szBase[MAX_PATH];
+	V_FileBase( pFileName, szBase, sizeof( szBase ) );
+	const char *pSuffix = V_strrchr( szBase, '_' );
+	if ( !pSuffix || ( V_strncmp( pSuffix + 1, "ps", 2 ) && V_strncmp( pSuffix + 1, "vs", 2 ) ) )
+		return false;
+
+	if ( pVersion )
+	{
+		V_snprintf( pTarget, nTargetSize, "%.2s%s", pSuffix + 1, pVersion );
+	}
+	else
+	{
+		V_strncpy( pTarget, pSuffix + 1, nTargetSize );
+	}
+
+	// ps20b -> PS_2_B, ps30 -> PS_3_0
+	const char *pDigits = pTarget + 2;
+	if ( V_strlen( pDigits ) < 2 )
+		return false;
+	V_snprintf( pModel, nModelSize, "SHADER_MODEL_%c%c_%c_%c", pTarget[0], pTarget[1], pDigits[0], pDigits[2] ? pDigits[2] : pDigits[1] );
+	V_strupr( pModel );
+	return true;
+}
+
+static bool WriteFile( const char *pPath, const void *pData, int nSize )
+{
+	FILE *fp = fopen( pPath, "wb" );
+	if ( !fp )
+	{
+		fprintf( stderr, "error: can't write %s\n", pPath );
+		return false;
+	}
+	bool bSuccess = fwrite( pData, 1, nSize, fp ) == (size_t)nSize;
+	fclose( fp );
+	return bSuccess;
+}
+
+struct ComboKey_t
+{
+	uint64	m_nSourceHash;
+	uint64	m_nDynamicHash;
+	int		m_nStatic;
+};
+
+static int __cdecl CompareComboKeys( const ComboKey_t *a, const ComboKey_t *b )
+{
+	if ( a->m_nSourceHash != b->m_nSourceHash )
+		return a->m_nSourceHash < b->m_nSourceHash ? -1 : 1;
+	if ( a->m_nDynamicHash != b->m_nDynamicHash )
+		return a->m_nDynamicHash < b->m_nDynamicHash ? -1 : 1;
+	return a->m_nStatic - b->m_nStatic;
+}
+
+// The alias table is binary searched by static combo id
+static int __cdecl CompareAliases( const StaticComboAliasRecord_t *a, const StaticComboAliasRecord_t *b )
+{
+	if ( a->m_nStaticComboID != b->m_nStaticComboID )
+		return a->m_nStaticComboID < b->m_nStaticComboID ? -1 : 1;
+	return 0;
+}
+
+static void PrintUsage()
+{
+	printf( "usage: fxcprep [-threads n] [-ver 30] [-I dir] [-deps file] [-hashes file] [-aliases file]\n" );
+	printf( "               [-dump staticindex] shader.fxc\n" );
+}
+
+int main( int argc, char **argv )
+{
+	const char *pShader = NULL;
+	const char *pVersion = NULL;
+	const char *pDepsFile = NULL;
+	const char *pHashesFile = NULL;
+	const char *pAliasesFile = NULL;
+	int nThreads = GetCPUInformation().m_nLogicalProcessors;
+	int nDumpCombo = -1;
+
+	CHLSLPreprocessor pp;
+	for ( int i = 1; i < argc; ++i )
+	{
+		const char *pArg = argv[i];
+		bool bHasValue = ( i + 1 < argc );
+		if ( !V_stricmp( pArg, "-threads" ) && bHasValue )
+		{
+			nThreads = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( pArg, "-ver" ) && bHasValue )
+		{
+			pVersion = argv[++i];
+		}
+		else if ( !V_stricmp( pArg, "-I" ) && bHasValue )
+		{
+			pp.AddIncludePath( argv[++i] );
+		}
+		else if ( !V_stricmp( pArg, "-deps" ) && bHasValue )
+		{
+			pDepsFile = argv[++i];
+		}
+		else if ( !V_stricmp( pArg, "-hashes" ) && bHasValue )
+		{
+			pHashesFile = argv[++i];
+		}
+		else if ( !V_stricmp( pArg, "-aliases" ) && bHasValue )
+		{
+			pAliasesFile = argv[++i];
+		}
+		else if ( !V_stricmp( pArg, "-dump" ) && bHasValue )
+		{
+			nDumpCombo = atoi( argv[++i] );
+			nThreads = 1;
+		}
+		else if ( pArg[0] != '-' && !pShader )
+		{
+			pShader = pArg;
+		}
+		else
+		{
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	if ( !pShader )
+	{
+		PrintUsage();
+		return 1;
+	}
+	nThreads = clamp( nThreads, 1, MAX_PREP_THREADS );
+
+	double flStartTime = Plat_FloatTime();
+
+	char szTarget[16];
+	char szModel[32];
+	if ( !GetShaderTarget( pShader, pVersion, szTarget, sizeof( szTarget ), szModel, sizeof( szModel ) ) )
+	{
+		fprintf( stderr, "error: %s doesn't end in a shader target such as _ps30\n", pShader );
+		return 1;
+	}
+	pp.AddPredefinedMacro( szModel, 1 );
+
+	int nRootFile = pp.LoadFile( pShader );
+	if ( nRootFile < 0 || pp.HasErrors() )
+		return 1;
+
+	// Combo declarations can come from any file that may be included
+	CShaderCombos combos;
+	combos.SetTarget( szTarget );
+	bool bSuccess = true;
+	for ( int i = 0; i < pp.GetFileCount(); ++i )
+	{
+		bSuccess &= combos.ParseFile( pp.GetFile( i ).m_szPath );
+	}
+	if ( !bSuccess || !combos.Finalize() )
+		return 1;
+
+	CUtlVector< int > comboSymbols;
+	for ( int i = 0; i < combos.GetComboCount(); ++i )
+	{
+		comboSymbols.AddToTail( pp.AddComboMacro( combos.GetCombo( i ).m_szName ) );
+	}
+
+	PrepJob_t job;
+	job.m_pPreprocessor = &pp;
+	job.m_pCombos = &combos;
+	job.m_pComboSymbols = comboSymbols.Base();
+	job.m_UnknownSymbols.AddToTail( pp.AddComboMacro( "SHADERCOMBO" ) );
+	job.m_UnknownSymbols.AddToTail( pp.AddComboMacro( "CENTROIDMASK" ) );
+	job.m_nRootFile = nRootFile;
+	job.m_nDumpCombo = nDumpCombo;
+	job.m_nNextCombo = nDumpCombo >= 0 ? nDumpCombo : 0;
+
+	pp.FinalizeLines();
+
+	int nStaticCombos = combos.GetStaticComboCount();
+	CUtlVector< ComboResult_t > results;
+	results.SetCount( nStaticCombos );
+	V_memset( results.Base(), 0, results.Count() * sizeof( ComboResult_t ) );
+	job.m_pResults = results.Base();
+
+	if ( nDumpCombo >= 0 )
+	{
+		if ( nDumpCombo >= nStaticCombos )
+		{
+			fprintf( stderr, "error: static combo %d out of range\n", nDumpCombo );
+			return 1;
+		}
+		nStaticCombos = nDumpCombo + 1;
+	}
+	job.m_nEndCombo = nStaticCombos;
+
+	PrepThread_t *pThreads = new PrepThread_t[nThreads];
+	for ( int i = 0; i < nThreads; ++i )
+	{
+		pThreads[i].m_pJob = &job;
+		pThreads[i].m_hThread = ( i > 0 ) ? CreateSimpleThread( PrepThreadFunc, &pThreads[i] ) : NULL;
+	}
+	PrepThreadFunc( &pThreads[0] );
+
+	CUtlVector< uint8 > filesUsed;
+	filesUsed.SetCount( pp.GetFileCount() );
+	V_memset( filesUsed.Base(), 0, filesUsed.Count() );
+	for ( int i = 0; i < nThreads; ++i )
+	{
+		if ( pThreads[i].m_hThread )
+		{
+			ThreadJoin( pThreads[i].m_hThread );
+			ReleaseThreadHandle( pThreads[i].m_hThread );
+		}
+		for ( int j = 0; j < pThreads[i].m_FilesUsed.Count(); ++j )
+		{
+			filesUsed[j] |= pThreads[i].m_FilesUsed[j];
+		}
+	}
+	delete[] pThreads;
+
+	if ( nDumpCombo >= 0 )
+		return results[nDumpCombo].m_bError ? 1 : 0;
+
+	// Group identical combos, the lowest index of each group is the one that gets compiled
+	CUtlVector< ComboKey_t > keys;
+	int nErrors = 0;
+	for ( int i = 0; i < nStaticCombos; ++i )
+	{
+		if ( !results[i].m_bLive )
+			continue;
+		if ( results[i].m_bError )
+		{
+			++nErrors;
+		}
+		ComboKey_t key = { results[i].m_nSourceHash, results[i].m_nDynamicHash, i };
+		keys.AddToTail( key );
+	}
+	keys.Sort( CompareComboKeys );
+
+	CUtlVector< StaticComboAliasRecord_t > aliases;
+	for ( int i = 1; i < keys.Count(); ++i )
+	{
+		const ComboKey_t &key = keys[i];
+		const ComboKey_t &prev = keys[i - 1];
+		if ( key.m_nSourceHash != prev.m_nSourceHash || key.m_nDynamicHash != prev.m_nDynamicHash )
+			continue;
+
+		// Walk back to the first combo of the group
+		int nSource = i - 1;
+		while ( nSource > 0 && keys[nSource - 1].m_nSourceHash == key.m_nSourceHash && keys[nSource - 1].m_nDynamicHash == key.m_nDynamicHash )
+		{
+			--nSource;
+		}
+
+		StaticComboAliasRecord_t alias;
+		alias.m_nStaticComboID = key.m_nStatic;
+		alias.m_nSourceStaticCombo = keys[nSource].m_nStatic;
+		aliases.AddToTail( alias );
+	}
+	aliases.Sort( CompareAliases );
+
+	if ( pDepsFile )
+	{
+		CUtlVector< char > deps;
+		for ( int i = 0; i < pp.GetFileCount(); ++i )
+		{
+			if ( !filesUsed[i] )
+				continue;
+			const char *pPath = pp.GetFile( i ).m_szPath;
+			deps.AddMultipleToTail( V_strlen( pPath ), pPath );
+			deps.AddToTail( '\n' );
+		}
+		bSuccess &= WriteFile( pDepsFile, deps.Base(), deps.Count() );
+	}
+
+	if ( pHashesFile )
+	{
+		CUtlVector< char > hashes;
+		for ( int i = 0; i < nStaticCombos; ++i )
+		{
+			if ( !results[i].m_bLive )
+				continue;
+			char szLine[64];
+			int nLength = V_snprintf( szLine, sizeof( szLine ), "%d %016llx %016llx\n", i,
+				(unsigned long long)results[i].m_nSourceHash, (unsigned long long)results[i].m_nDynamicHash );
+			hashes.AddMultipleToTail( nLength, szLine );
+		}
+		bSuccess &= WriteFile( pHashesFile, hashes.Base(), hashes.Count() );
+	}
+
+	if ( pAliasesFile )
+	{
+		// Same layout as the duplicate block of a version 6 vcs file
+		CUtlVector< uint8 > table;
+		uint32 nCount = aliases.Count();
+		table.AddMultipleToTail( sizeof( nCount ), (uint8 *)&nCount );
+		table.AddMultipleToTail( aliases.Count() * sizeof( StaticComboAliasRecord_t ), (uint8 *)aliases.Base() );
+		bSuccess &= WriteFile( pAliasesFile, table.Base(), table.Count() );
+	}
+
+	printf( "%s: %d files, %d static combos, %d live, %d unique, %d aliased (%.3fs, %d threads)\n",
+		pShader, pp.GetFileCount(), nStaticCombos, keys.Count(), keys.Count() - aliases.Count(), aliases.Count(),
+		Plat_FloatTime() - flStartTime, nThreads );
+
+	if ( nErrors )
+	{
+		fprintf( stderr, "error: %d static combos failed to preprocess\n", nErrors );
+		return 1;
+	}
+	return bSuccess ? 0 : 1;
+}
@@ -0,0 +1,1406 @@
+//==================================================================================================
+//
+// Partial preprocessor for the FXC subset used by stdshaders
+//
+// Supported: #include, #define/#undef (object and function-like), #if/#ifdef/#ifndef/#elif/#else/
+// #endif, #pragma and #error. Stringizing and token pasting are not used by the shaders and are
+// passed through untouched.
+//
+//==================================================================================================
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include "hlslpreprocessor.h"
+#include "tier1/strtools.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define MAX_INCLUDE_DEPTH	32
+#define MAX_EXPANSION_DEPTH	32
+#define MAX_REPORTED_ERRORS	20
+
+static inline bool IsIdentStart( char c )
+{
+	return ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) || c == '_';
+}
+
+static inline bool IsIdentChar( char c )
+{
+	return IsIdentStart( c ) || ( c >= '0' && c <= '9' );
+}
+
+static inline bool IsDigit( char c )
+{
+	return c >= '0' && c <= '9';
+}
+
+static uint32 HashName( const char *pName, int nLength )
+{
+	// FNV-1a
+	uint32 nHash = 2166136261u;
+	for ( int i = 0; i < nLength; ++i )
+	{
+		nHash = ( nHash ^ (uint8)pName[i] ) * 16777619u;
+	}
+	return nHash;
+}
+
+//-----------------------------------------------------------------------------
+// CHLSLPreprocessor
+//-----------------------------------------------------------------------------
+CHLSLPreprocessor::CHLSLPreprocessor()
+{
+	m_nErrors = 0;
+	m_nReportedErrors = 0;
+	m_SymbolHash.SetCount( 1024 );
+	for ( int i = 0; i < m_SymbolHash.Count(); ++i )
+	{
+		m_SymbolHash[i] = -1;
+	}
+	m_nDefinedSymbol = AddSymbol( "defined", 7 );
+}
+
+CHLSLPreprocessor::~CHLSLPreprocessor()
+{
+	for ( int i = 0; i < m_IncludePaths.Count(); ++i )
+	{
+		delete[] m_IncludePaths[i];
+	}
+}
+
+void CHLSLPreprocessor::AddIncludePath( const char *pPath )
+{
+	int nLength = V_strlen( pPath ) + 1;
+	char *pCopy = new char[nLength];
+	V_strncpy( pCopy, pPath, nLength );
+	V_StripTrailingSlash( pCopy );
+	m_IncludePaths.AddToTail( pCopy );
+}
+
+void CHLSLPreprocessor::Error( const char *pPath, int nLine, const char *pFormat, ... )
+{
+	char szMessage[1024];
+	va_list args;
+	va_start( args, pFormat );
+	V_vsnprintf( szMessage, sizeof( szMessage ), pFormat, args );
+	va_end( args );
+
+	fprintf( stderr, "%s(%d): error: %s\n", pPath, nLine, szMessage );
+	++m_nErrors;
+}
+
+//-----------------------------------------------------------------------------
+// Symbols
+//-----------------------------------------------------------------------------
+int CHLSLPreprocessor::FindSymbol( const char *pName ) const
+{
+	int nLength = V_strlen( pName );
+	int nMask = m_SymbolHash.Count() - 1;
+	for ( int nSlot = HashName( pName, nLength ) & nMask; m_SymbolHash[nSlot] >= 0; nSlot = ( nSlot + 1 ) & nMask )
+	{
+		int nSymbol = m_SymbolHash[nSlot];
+		if ( !V_strcmp( GetSymbolName( nSymbol ), pName ) )
+			return nSymbol;
+	}
+	return -1;
+}
+
+int CHLSLPreprocessor::AddSymbol( const char *pName, int nLength )
+{
+	int nMask = m_SymbolHash.Count() - 1;
+	int nSlot = HashName( pName, nLength ) & nMask;
+	for ( ; m_SymbolHash[nSlot] >= 0; nSlot = ( nSlot + 1 ) & nMask )
+	{
+		const char *pExisting = GetSymbolName( m_SymbolHash[nSlot] );
+		if ( !V_strncmp( pExisting, pName, nLength ) && pExisting[nLength] == '\0' )
+			return m_SymbolHash[nSlot];
+	}
+
+	int nSymbol = m_SymbolOffsets.AddToTail( m_SymbolNames.Count() );
+	m_SymbolNames.AddMultipleToTail( nLength, pName );
+	m_SymbolNames.AddToTail( '\0' );
+	m_SymbolHash[nSlot] = nSymbol;
+
+	// Keep the table at most half full
+	if ( m_SymbolOffsets.Count() * 2 > m_SymbolHash.Count() )
+	{
+		m_SymbolHash.SetCount( m_SymbolHash.Count() * 2 );
+		nMask = m_SymbolHash.Count() - 1;
+		for ( int i = 0; i < m_SymbolHash.Count(); ++i )
+		{
+			m_SymbolHash[i] = -1;
+		}
+		for ( int i = 0; i < m_SymbolOffsets.Count(); ++i )
+		{
+			const char *pSymbol = GetSymbolName( i );
+			int nRehash = HashName( pSymbol, V_strlen( pSymbol ) ) & nMask;
+			while ( m_SymbolHash[nRehash] >= 0 )
+			{
+				nRehash = ( nRehash + 1 ) & nMask;
+			}
+			m_SymbolHash[nRehash] = i;
+		}
+	}
+	return nSymbol;
+}
+
+int CHLSLPreprocessor::AddComboMacro( const char *pName )
+{
+	int nSymbol = AddSymbol( pName, V_strlen( pName ) );
+	m_ComboMacros.AddToTail( nSymbol );
+	return nSymbol;
+}
+
+void CHLSLPreprocessor::AddPredefinedMacro( const char *pName, int nValue )
+{
+	PredefinedMacro_t macro;
+	macro.m_nSymbol = AddSymbol( pName, V_strlen( pName ) );
+	macro.m_nValue = nValue;
+	m_Predefined.AddToTail( macro );
+}
+
+//-----------------------------------------------------------------------------
+// File loading
+//-----------------------------------------------------------------------------
+bool CHLSLPreprocessor::ResolveInclude( const char *pIncluder, const char *pName, char *pOut, int nOutSize ) const
+{
+	char szDir[MAX_PATH];
+	V_ExtractFilePath( pIncluder, szDir, sizeof( szDir ) );
+	V_StripTrailingSlash( szDir );
+
+	for ( int i = -1; i < m_IncludePaths.Count(); ++i )
+	{
+		V_ComposeFileName( i < 0 ? szDir : m_IncludePaths[i], pName, pOut, nOutSize );
+		V_FixSlashes( pOut );
+
+		FILE *fp = fopen( pOut, "rb" );
+		if ( fp )
+		{
+			fclose( fp );
+			return true;
+		}
+	}
+	return false;
+}
+
+int CHLSLPreprocessor::LoadFile( const char *pFileName )
+{
+	char szPath[MAX_PATH];
+	V_strncpy( szPath, pFileName, sizeof( szPath ) );
+	V_FixSlashes( szPath );
+
+	for ( int i = 0; i < m_Files.Count(); ++i )
+	{
+		if ( !V_stricmp( m_Files[i].m_szPath, szPath ) )
+			return i;
+	}
+
+	FILE *fp = fopen( szPath, "rb" );
+	if ( !fp )
+	{
+		fprintf( stderr, "error: can't open %s\n", szPath );
+		++m_nErrors;
+		return -1;
+	}
+
+	fseek( fp, 0, SEEK_END );
+	int nSize = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+	CUtlVector< char > source;
+	source.SetCount( nSize + 1 );
+	nSize = fread( source.Base(), 1, nSize, fp );
+	source[nSize] = '\0';
+	fclose( fp );
+
+	int nFile = m_Files.AddToTail();
+	V_strncpy( m_Files[nFile].m_szPath, szPath, sizeof( m_Files[nFile].m_szPath ) );
+	if ( !TokenizeFile( nFile, source.Base(), nSize ) || !MatchConditionals( nFile ) )
+		return -1;
+
+	// Lines of this file are final, now pull in whatever it can include
+	int nFirstLine = m_Files[nFile].m_nFirstLine;
+	int nLineCount = m_Files[nFile].m_nLineCount;
+	for ( int i = nFirstLine; i < nFirstLine + nLineCount; ++i )
+	{
+		if ( m_Lines[i].m_nDirective != PPDIR_INCLUDE )
+			continue;
+
+		m_Lines[i].m_nArg = -1;
+		const PPToken_t *pToken = &m_Tokens[ m_Lines[i].m_nFirstToken ];
+		if ( m_Lines[i].m_nTokenCount != 1 || pToken->m_nType != PPTOKEN_STRING || pToken->m_nLength < 2 )
+		{
+			Error( szPath, m_Lines[i].m_nSourceLine, "malformed #include" );
+			continue;
+		}
+
+		char szName[MAX_PATH];
+		V_strncpy( szName, &m_TextPool[ pToken->m_nOffset + 1 ], MIN( (int)sizeof( szName ), pToken->m_nLength - 1 ) );
+
+		// Missing files are only an error for combos that reach the #include
+		char szIncludePath[MAX_PATH];
+		if ( !ResolveInclude( szPath, szName, szIncludePath, sizeof( szIncludePath ) ) )
+			continue;
+
+		m_Lines[i].m_nArg = LoadFile( szIncludePath );
+	}
+	return nFile;
+}
+
+bool CHLSLPreprocessor::TokenizeFile( int nFile, const char *pSource, int nSize )
+{
+	m_Files[nFile].m_nFirstLine = m_Lines.Count();
+
+	// Build logical lines: join continuations, replace comments with a space
+	CUtlVector< char > line;
+	int nSourceLine = 1;
+	int nLineStart = 1;
+	bool bInBlockComment = false;
+	const char *pEnd = pSource + nSize;
+	for ( const char *p = pSource; p <= pEnd; ++p )
+	{
+		char c = ( p < pEnd ) ? *p : '\n';
+
+		if ( bInBlockComment )
+		{
+			if ( c == '\n' )
+			{
+				++nSourceLine;
+			}
+			else if ( c == '*' && p + 1 < pEnd && p[1] == '/' )
+			{
+				bInBlockComment = false;
+				line.AddToTail( ' ' );
+				++p;
+			}
+			continue;
+		}
+
+		if ( c == '\\' && p + 1 < pEnd && ( p[1] == '\n' || ( p[1] == '\r' && p + 2 < pEnd && p[2] == '\n' ) ) )
+		{
+			p += ( p[1] == '\r' ) ? 2 : 1;
+			++nSourceLine;
+			continue;
+		}
+
+		if ( c == '/' && p + 1 < pEnd && p[1] == '/' )
+		{
+			while ( p + 1 < pEnd && p[1] != '\n' )
+			{
+				++p;
+			}
+			continue;
+		}
+
+		if ( c == '/' && p + 1 < pEnd && p[1] == '*' )
+		{
+			bInBlockComment = true;
+			++p;
+			continue;
+		}
+
+		if ( c == '"' )
+		{
+			// Copy string literals as is so comment markers inside them survive
+			line.AddToTail( c );
+			while ( p + 1 < pEnd && p[1] != '"' && p[1] != '\n' )
+			{
+				line.AddToTail( *++p );
+			}
+			if ( p + 1 < pEnd && p[1] == '"' )
+			{
+				line.AddToTail( *++p );
+			}
+			continue;
+		}
+
+		if ( c == '\n' )
+		{
+			TokenizeLine( line.Base(), line.Count(), nLineStart, m_Files[nFile].m_szPath );
+			line.RemoveAll();
+			nLineStart = ++nSourceLine;
+			continue;
+		}
+
+		line.AddToTail( c == '\r' || c == '\t' || c == '\f' || c == '\v' ? ' ' : c );
+	}
+
+	m_Files[nFile].m_nLineCount = m_Lines.Count() - m_Files[nFile].m_nFirstLine;
+	if ( bInBlockComment )
+	{
+		Error( m_Files[nFile].m_szPath, nSourceLine, "unterminated comment" );
+		return false;
+	}
+	return true;
+}
+
+void CHLSLPreprocessor::TokenizeLine( const char *pLine, int nLength, int nSourceLine, const char *pPath )
+{
+	const char *p = pLine;
+	const char *pEnd = pLine + nLength;
+	while ( p < pEnd && *p == ' ' )
+	{
+		++p;
+	}
+	if ( p == pEnd )
+		return;
+
+	PPLine_t newLine;
+	newLine.m_nDirective = PPDIR_TEXT;
+	newLine.m_bVerbatim = false;
+	newLine.m_nSourceLine = nSourceLine;
+	newLine.m_nArg = -1;
+
+	if ( *p == '#' )
+	{
+		++p;
+		while ( p < pEnd && *p == ' ' )
+		{
+			++p;
+		}
+		const char *pName = p;
+		while ( p < pEnd && IsIdentChar( *p ) )
+		{
+			++p;
+		}
+		int nNameLength = p - pName;
+
+		static const struct { const char *m_pName; PPDirective_t m_nDirective; } s_Directives[] =
+		{
+			{ "include", PPDIR_INCLUDE },
+			{ "define", PPDIR_DEFINE },
+			{ "undef", PPDIR_UNDEF },
+			{ "if", PPDIR_IF },
+			{ "ifdef", PPDIR_IFDEF },
+			{ "ifndef", PPDIR_IFNDEF },
+			{ "elif", PPDIR_ELIF },
+			{ "else", PPDIR_ELSE },
+			{ "endif", PPDIR_ENDIF },
+			{ "pragma", PPDIR_PRAGMA },
+			{ "error", PPDIR_ERROR },
+		};
+
+		newLine.m_nDirective = PPDIR_IGNORED;
+		for ( int i = 0; i < ARRAYSIZE( s_Directives ); ++i )
+		{
+			if ( V_strlen( s_Directives[i].m_pName ) == nNameLength && !V_strncmp( s_Directives[i].m_pName, pName, nNameLength ) )
+			{
+				newLine.m_nDirective = s_Directives[i].m_nDirective;
+				break;
+			}
+		}
+		if ( nNameLength == 0 )
+			return;	// Null directive
+	}
+
+	newLine.m_nFirstToken = m_Tokens.Count();
+	newLine.m_nTextOffset = m_TextPool.Count();
+
+	// A #define is function-like when the parenthesis directly follows the name
+	bool bFunctionLike = false;
+	bool bSpace = false;
+
+	while ( p < pEnd )
+	{
+		if ( *p == ' ' )
+		{
+			bSpace = true;
+			++p;
+			continue;
+		}
+
+		if ( m_Tokens.Count() == newLine.m_nFirstToken + 1 )
+		{
+			bFunctionLike = ( *p == '(' && !bSpace );
+		}
+		bSpace = false;
+
+		PPToken_t token;
+		token.m_nSymbol = 0;
+		const char *pStart = p;
+
+		if ( IsIdentStart( *p ) )
+		{
+			while ( p < pEnd && IsIdentChar( *p ) )
+			{
+				++p;
+			}
+			token.m_nType = PPTOKEN_IDENTIFIER;
+			token.m_nSymbol = AddSymbol( pStart, p - pStart );
+		}
+		else if ( IsDigit( *p ) || ( *p == '.' && p + 1 < pEnd && IsDigit( p[1] ) ) )
+		{
+			while ( p < pEnd && ( IsIdentChar( *p ) || *p == '.' ||
+				( ( *p == '+' || *p == '-' ) && ( p[-1] == 'e' || p[-1] == 'E' ) && !( pStart[0] == '0' && ( pStart[1] == 'x' || pStart[1] == 'X' ) ) ) ) )
+			{
+				++p;
+			}
+			token.m_nType = PPTOKEN_NUMBER;
+		}
+		else if ( *p == '"' || ( *p == '<' && newLine.m_nDirective == PPDIR_INCLUDE ) )
+		{
+			char cClose = ( *p == '<' ) ? '>' : '"';
+			++p;
+			while ( p < pEnd && *p != cClose )
+			{
+				p += ( *p == '\\' && p + 1 < pEnd ) ? 2 : 1;
+			}
+			if ( p < pEnd )
+			{
+				++p;
+			}
+			token.m_nType = PPTOKEN_STRING;
+		}
+		else
+		{
+			static const struct { char m_szOp[3]; int m_nCode; } s_Operators[] =
+			{
+				{ "&&", PPOP_AND }, { "||", PPOP_OR }, { "==", PPOP_EQ }, { "!=", PPOP_NE },
+				{ "<=", PPOP_LE }, { ">=", PPOP_GE }, { "<<", PPOP_SHL }, { ">>", PPOP_SHR },
+				{ "++", PPOP_OTHER }, { "--", PPOP_OTHER }, { "+=", PPOP_OTHER }, { "-=", PPOP_OTHER },
+				{ "*=", PPOP_OTHER }, { "/=", PPOP_OTHER }, { "%=", PPOP_OTHER }, { "&=", PPOP_OTHER },
+				{ "|=", PPOP_OTHER }, { "^=", PPOP_OTHER }, { "->", PPOP_OTHER }, { "::", PPOP_OTHER },
+				{ "##", PPOP_OTHER },
+			};
+
+			token.m_nType = PPTOKEN_PUNCT;
+			token.m_nSymbol = (uint8)*p++;
+			if ( p < pEnd )
+			{
+				for ( int i = 0; i < ARRAYSIZE( s_Operators ); ++i )
+				{
+					if ( s_Operators[i].m_szOp[0] == pStart[0] && s_Operators[i].m_szOp[1] == *p )
+					{
+						token.m_nSymbol = s_Operators[i].m_nCode;
+						++p;
+						break;
+					}
+				}
+			}
+		}
+
+		// Tokens of a line are laid out in the pool separated by single spaces, so the
+		// normalized line text is the span from the first to the last token
+		if ( m_TextPool.Count() != newLine.m_nTextOffset )
+		{
+			m_TextPool.AddToTail( ' ' );
+		}
+		token.m_nOffset = m_TextPool.Count();
+		token.m_nLength = p - pStart;
+		m_TextPool.AddMultipleToTail( p - pStart, pStart );
+		m_Tokens.AddToTail( token );
+	}
+
+	newLine.m_nTokenCount = m_Tokens.Count() - newLine.m_nFirstToken;
+	newLine.m_nTextLength = m_TextPool.Count() - newLine.m_nTextOffset;
+
+	if ( newLine.m_nDirective == PPDIR_DEFINE || newLine.m_nDirective == PPDIR_UNDEF ||
+		newLine.m_nDirective == PPDIR_IFDEF || newLine.m_nDirective == PPDIR_IFNDEF )
+	{
+		if ( !newLine.m_nTokenCount || m_Tokens[newLine.m_nFirstToken].m_nType != PPTOKEN_IDENTIFIER )
+		{
+			Error( pPath, nSourceLine, "macro name expected" );
+			return;
+		}
+	}
+
+	if ( newLine.m_nDirective == PPDIR_DEFINE )
+	{
+		ParseDefine( newLine, bFunctionLike, pPath );
+	}
+
+	m_Lines.AddToTail( newLine );
+}
+
+void CHLSLPreprocessor::ParseDefine( PPLine_t &line, bool bFunctionLike, const char *pPath )
+{
+	PPMacroDef_t def;
+	const PPToken_t *pTokens = &m_Tokens[line.m_nFirstToken];
+	def.m_nSymbol = pTokens[0].m_nSymbol;
+	def.m_nParamCount = -1;
+	def.m_nFirstParam = m_ParamPool.Count();
+
+	int nBody = 1;
+
+	if ( bFunctionLike )
+	{
+		def.m_nParamCount = 0;
+		for ( nBody = 2; nBody < line.m_nTokenCount; ++nBody )
+		{
+			const PPToken_t &token = pTokens[nBody];
+			if ( token.m_nType == PPTOKEN_PUNCT && token.m_nSymbol == ')' )
+				break;
+			if ( token.m_nType == PPTOKEN_PUNCT && token.m_nSymbol == ',' )
+				continue;
+			if ( token.m_nType != PPTOKEN_IDENTIFIER )
+			{
+				Error( pPath, line.m_nSourceLine, "malformed macro parameter list" );
+				break;
+			}
+			m_ParamPool.AddToTail( token.m_nSymbol );
+			++def.m_nParamCount;
+		}
+		++nBody;
+	}
+
+	def.m_nFirstBodyToken = line.m_nFirstToken + MIN( nBody, line.m_nTokenCount );
+	def.m_nBodyTokenCount = MAX( 0, line.m_nTokenCount - nBody );
+	line.m_nArg = m_MacroDefs.AddToTail( def );
+}
+
+//-----------------------------------------------------------------------------
+// Links every #if/#elif/#else to the next branch of its chain
+//-----------------------------------------------------------------------------
+bool CHLSLPreprocessor::MatchConditionals( int nFile )
+{
+	const PPFile_t &file = m_Files[nFile];
+	CUtlVector< int > stack;
+	for ( int i = file.m_nFirstLine; i < file.m_nFirstLine + file.m_nLineCount; ++i )
+	{
+		PPLine_t &line = m_Lines[i];
+		switch ( line.m_nDirective )
+		{
+		case PPDIR_IF:
+		case PPDIR_IFDEF:
+		case PPDIR_IFNDEF:
+			stack.AddToTail( i );
+			break;
+
+		case PPDIR_ELIF:
+		case PPDIR_ELSE:
+		case PPDIR_ENDIF:
+			if ( !stack.Count() )
+			{
+				Error( file.m_szPath, line.m_nSourceLine, "unmatched conditional directive" );
+				return false;
+			}
+			if ( m_Lines[stack.Tail()].m_nDirective == PPDIR_ELSE && line.m_nDirective != PPDIR_ENDIF )
+			{
+				Error( file.m_szPath, line.m_nSourceLine, "directive after #else" );
+				return false;
+			}
+			m_Lines[stack.Tail()].m_nArg = i;
+			stack.RemoveMultipleFromTail( 1 );
+			if ( line.m_nDirective != PPDIR_ENDIF )
+			{
+				stack.AddToTail( i );
+			}
+			break;
+		}
+	}
+
+	if ( stack.Count() )
+	{
+		Error( file.m_szPath, m_Lines[stack.Tail()].m_nSourceLine, "unterminated conditional directive" );
+		return false;
+	}
+	return true;
+}
+
+void CHLSLPreprocessor::FinalizeLines()
+{
+	// Anything that is ever a macro
+	CUtlVector< uint8 > isMacro;
+	isMacro.SetCount( GetSymbolCount() );
+	V_memset( isMacro.Base(), 0, isMacro.Count() );
+	for ( int i = 0; i < m_MacroDefs.Count(); ++i )
+	{
+		isMacro[ m_MacroDefs[i].m_nSymbol ] = 1;
+	}
+	for ( int i = 0; i < m_Predefined.Count(); ++i )
+	{
+		isMacro[ m_Predefined[i].m_nSymbol ] = 1;
+	}
+
+	for ( int i = 0; i < m_ComboMacros.Count(); ++i )
+	{
+		isMacro[ m_ComboMacros[i] ] = 1;
+	}
+
+	for ( int i = 0; i < m_Lines.Count(); ++i )
+	{
+		PPLine_t &line = m_Lines[i];
+		if ( line.m_nDirective != PPDIR_TEXT )
+			continue;
+
+		line.m_bVerbatim = true;
+		for ( int j = 0; j < line.m_nTokenCount; ++j )
+		{
+			const PPToken_t &token = m_Tokens[ line.m_nFirstToken + j ];
+			if ( token.m_nType == PPTOKEN_IDENTIFIER && isMacro[token.m_nSymbol] )
+			{
+				line.m_bVerbatim = false;
+				break;
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// CPreprocessorContext
+//-----------------------------------------------------------------------------
+CPreprocessorContext::CPreprocessorContext( const CHLSLPreprocessor &pp ) : m_pp( pp )
+{
+	MacroState_t undefined = { MACRO_UNDEFINED, -1, 0 };
+	m_InitialMacros.SetCount( pp.GetSymbolCount() );
+	for ( int i = 0; i < m_InitialMacros.Count(); ++i )
+	{
+		m_InitialMacros[i] = undefined;
+	}
+	for ( int i = 0; i < pp.m_Predefined.Count(); ++i )
+	{
+		MacroState_t &macro = m_InitialMacros[ pp.m_Predefined[i].m_nSymbol ];
+		macro.m_nState = MACRO_DEFINED;
+		macro.m_nValue = pp.m_Predefined[i].m_nValue;
+	}
+
+	m_Macros.SetCount( m_InitialMacros.Count() );
+	m_FilesUsed.SetCount( pp.GetFileCount() );
+	V_memset( m_FilesUsed.Base(), 0, m_FilesUsed.Count() );
+	m_nConditionPos = 0;
+	m_bConditionError = false;
+	m_Substitutions.SetCount( MAX_EXPANSION_DEPTH );
+	m_nSubstitutionDepth = 0;
+	m_nUnknownDepth = 0;
+	m_nLine = 0;
+	m_bError = false;
+	Reset();
+}
+
+void CPreprocessorContext::Reset()
+{
+	V_memcpy( m_Macros.Base(), m_InitialMacros.Base(), m_Macros.Count() * sizeof( MacroState_t ) );
+	m_Output.RemoveAll();
+	m_Conditionals.RemoveAll();
+	m_Expanding.RemoveAll();
+	m_nSubstitutionDepth = 0;
+	m_nUnknownDepth = 0;
+	m_bError = false;
+}
+
+void CPreprocessorContext::DefineValue( int nSymbol, int nValue )
+{
+	MacroState_t &macro = m_Macros[nSymbol];
+	macro.m_nState = MACRO_DEFINED;
+	macro.m_nDefinition = -1;
+	macro.m_nValue = nValue;
+}
+
+void CPreprocessorContext::DefineUnknown( int nSymbol )
+{
+	MacroState_t &macro = m_Macros[nSymbol];
+	macro.m_nState = MACRO_UNKNOWN_VALUE;
+	macro.m_nDefinition = -1;
+}
+
+void CPreprocessorContext::ReportError( const char *pFormat, ... )
+{
+	// Every combo that reaches a bad line reports it, keep the first few
+	m_bError = true;
+	if ( ++m_pp.m_nReportedErrors > MAX_REPORTED_ERRORS )
+		return;
+
+	char szMessage[1024];
+	va_list args;
+	va_start( args, pFormat );
+	V_vsnprintf( szMessage, sizeof( szMessage ), pFormat, args );
+	va_end( args );
+
+	const PPLine_t &line = m_pp.m_Lines[m_nLine];
+	for ( int i = 0; i < m_pp.m_Files.Count(); ++i )
+	{
+		const PPFile_t &file = m_pp.m_Files[i];
+		if ( m_nLine >= file.m_nFirstLine && m_nLine < file.m_nFirstLine + file.m_nLineCount )
+		{
+			fprintf( stderr, "%s(%d): error: %s\n", file.m_szPath, line.m_nSourceLine, szMessage );
+			break;
+		}
+	}
+}
+
+bool CPreprocessorContext::Run( int nRootFile )
+{
+	m_FilesUsed[nRootFile] = 1;
+	return RunFile( nRootFile, 0 ) && !m_bError;
+}
+
+bool CPreprocessorContext::RunFile( int nFile, int nDepth )
+{
+	const PPFile_t &file = m_pp.m_Files[nFile];
+	if ( nDepth > MAX_INCLUDE_DEPTH )
+	{
+		fprintf( stderr, "%s: error: #include nested too deeply\n", file.m_szPath );
+		return false;
+	}
+
+	int nConditionalDepth = m_Conditionals.Count();
+	int nEnd = file.m_nFirstLine + file.m_nLineCount;
+	for ( int i = file.m_nFirstLine; i < nEnd; )
+	{
+		m_nLine = i;
+		const PPLine_t &line = m_pp.m_Lines[i];
+		const PPToken_t *pTokens = &m_pp.m_Tokens[line.m_nFirstToken];
+		switch ( line.m_nDirective )
+		{
+		case PPDIR_TEXT:
+			if ( line.m_bVerbatim )
+			{
+				EmitText( &m_pp.m_TextPool[line.m_nTextOffset], line.m_nTextLength );
+				EmitText( "\n", 1 );
+			}
+			else
+			{
+				m_Scratch.RemoveAll();
+				ExpandTokens( pTokens, line.m_nTokenCount, m_Scratch );
+				EmitTokens( m_Scratch.Base(), m_Scratch.Count() );
+			}
+			break;
+
+		case PPDIR_INCLUDE:
+			if ( line.m_nArg < 0 )
+			{
+				ReportError( "can't find include file" );
+				break;
+			}
+			m_FilesUsed[line.m_nArg] = 1;
+			if ( !RunFile( line.m_nArg, nDepth + 1 ) )
+				return false;
+			break;
+
+		case PPDIR_DEFINE:
+			HandleDefine( line );
+			break;
+
+		case PPDIR_UNDEF:
+			HandleUndef( line );
+			break;
+
+		case PPDIR_IF:
+		case PPDIR_IFDEF:
+		case PPDIR_IFNDEF:
+		{
+			int nResult = EvaluateCondition( line );
+			Conditional_t &cond = m_Conditionals[ m_Conditionals.AddToTail() ];
+			cond.m_bTaken = ( nResult == 1 );
+			cond.m_bEmitted = ( nResult < 0 );
+			cond.m_bLive = ( nResult != 0 );
+			if ( nResult < 0 )
+			{
+				EmitDirective( "#if", m_Condition.Base(), m_Condition.Count() );
+				++m_nUnknownDepth;
+			}
+			else if ( nResult == 0 )
+			{
+				i = line.m_nArg;
+				continue;
+			}
+			break;
+		}
+
+		case PPDIR_ELIF:
+		{
+			Conditional_t &cond = m_Conditionals.Tail();
+			if ( cond.m_bTaken )
+			{
+				cond.m_bLive = false;
+				i = line.m_nArg;
+				continue;
+			}
+
+			int nResult = EvaluateCondition( line );
+			if ( nResult == 0 )
+			{
+				cond.m_bLive = false;
+				i = line.m_nArg;
+				continue;
+			}
+
+			cond.m_bLive = true;
+			if ( nResult == 1 )
+			{
+				// Known true after undecided branches acts as the #else
+				cond.m_bTaken = true;
+				if ( cond.m_bEmitted )
+				{
+					EmitText( "#else\n", 6 );
+				}
+			}
+			else if ( cond.m_bEmitted )
+			{
+				EmitDirective( "#elif", m_Condition.Base(), m_Condition.Count() );
+			}
+			else
+			{
+				EmitDirective( "#if", m_Condition.Base(), m_Condition.Count() );
+				cond.m_bEmitted = true;
+				++m_nUnknownDepth;
+			}
+			break;
+		}
+
+		case PPDIR_ELSE:
+		{
+			Conditional_t &cond = m_Conditionals.Tail();
+			if ( cond.m_bTaken )
+			{
+				cond.m_bLive = false;
+				i = line.m_nArg;
+				continue;
+			}
+			if ( cond.m_bEmitted )
+			{
+				EmitText( "#else\n", 6 );
+			}
+			cond.m_bTaken = true;
+			cond.m_bLive = true;
+			break;
+		}
+
+		case PPDIR_ENDIF:
+			if ( m_Conditionals.Tail().m_bEmitted )
+			{
+				EmitText( "#endif\n", 7 );
+				--m_nUnknownDepth;
+			}
+			m_Conditionals.RemoveMultipleFromTail( 1 );
+			break;
+
+		case PPDIR_PRAGMA:
+			EmitDirective( "#pragma", pTokens, line.m_nTokenCount );
+			break;
+
+		case PPDIR_ERROR:
+			EmitDirective( "#error", pTokens, line.m_nTokenCount );
+			if ( !m_nUnknownDepth )
+			{
+				m_bError = true;
+			}
+			break;
+
+		default:
+			break;
+		}
+		++i;
+	}
+
+	Assert( m_Conditionals.Count() == nConditionalDepth );
+	return m_Conditionals.Count() == nConditionalDepth;
+}
+
+void CPreprocessorContext::HandleDefine( const PPLine_t &line )
+{
+	const PPMacroDef_t &def = m_pp.m_MacroDefs[line.m_nArg];
+	MacroState_t &macro = m_Macros[def.m_nSymbol];
+	if ( m_nUnknownDepth )
+	{
+		// The definition depends on the undecided branch. Keep it in the output along with
+		// whatever it replaces, combos with a different prior definition must not match
+		char szPrior[64];
+		V_snprintf( szPrior, sizeof( szPrior ), "#pragma prior %d %d %d\n", macro.m_nState, macro.m_nDefinition, macro.m_nValue );
+		EmitText( szPrior, V_strlen( szPrior ) );
+		EmitDirective( "#define", &m_pp.m_Tokens[line.m_nFirstToken], line.m_nTokenCount );
+		macro.m_nState = MACRO_UNKNOWN;
+		return;
+	}
+
+	macro.m_nState = MACRO_DEFINED;
+	macro.m_nDefinition = line.m_nArg;
+	macro.m_nValue = 0;
+}
+
+void CPreprocessorContext::HandleUndef( const PPLine_t &line )
+{
+	const PPToken_t *pTokens = &m_pp.m_Tokens[line.m_nFirstToken];
+	MacroState_t &macro = m_Macros[pTokens[0].m_nSymbol];
+	if ( m_nUnknownDepth )
+	{
+		char szPrior[64];
+		V_snprintf( szPrior, sizeof( szPrior ), "#pragma prior %d %d %d\n", macro.m_nState, macro.m_nDefinition, macro.m_nValue );
+		EmitText( szPrior, V_strlen( szPrior ) );
+		EmitDirective( "#undef", pTokens, 1 );
+		macro.m_nState = MACRO_UNKNOWN;
+		return;
+	}
+
+	macro.m_nState = MACRO_UNDEFINED;
+	macro.m_nDefinition = -1;
+}
+
+//-----------------------------------------------------------------------------
+// Returns 1 or 0 for a known condition, -1 if it depends on dynamic combos. The
+// residual expression is left in m_Condition
+//-----------------------------------------------------------------------------
+int CPreprocessorContext::EvaluateCondition( const PPLine_t &line )
+{
+	const PPToken_t *pTokens = &m_pp.m_Tokens[line.m_nFirstToken];
+	m_Condition.RemoveAll();
+
+	if ( line.m_nDirective == PPDIR_IFDEF || line.m_nDirective == PPDIR_IFNDEF )
+	{
+		int nState = m_Macros[pTokens[0].m_nSymbol].m_nState;
+		if ( nState == MACRO_UNKNOWN )
+		{
+			if ( line.m_nDirective == PPDIR_IFNDEF )
+			{
+				PPToken_t negate = { PPTOKEN_PUNCT, 0, -1, '!' };
+				m_Condition.AddToTail( negate );
+			}
+			PPToken_t defined = { PPTOKEN_DEFINED_UNKNOWN, 0, -1, pTokens[0].m_nSymbol };
+			m_Condition.AddToTail( defined );
+			return -1;
+		}
+		bool bDefined = ( nState != MACRO_UNDEFINED );
+		return ( bDefined == ( line.m_nDirective == PPDIR_IFDEF ) ) ? 1 : 0;
+	}
+
+	// Resolve defined() before expanding anything
+	m_Scratch.RemoveAll();
+	for ( int i = 0; i < line.m_nTokenCount; ++i )
+	{
+		if ( pTokens[i].m_nType != PPTOKEN_IDENTIFIER || pTokens[i].m_nSymbol != m_pp.m_nDefinedSymbol )
+		{
+			m_Scratch.AddToTail( pTokens[i] );
+			continue;
+		}
+
+		bool bParen = ( i + 1 < line.m_nTokenCount && pTokens[i + 1].m_nType == PPTOKEN_PUNCT && pTokens[i + 1].m_nSymbol == '(' );
+		int nName = i + ( bParen ? 2 : 1 );
+		if ( nName >= line.m_nTokenCount || pTokens[nName].m_nType != PPTOKEN_IDENTIFIER ||
+			( bParen && ( nName + 1 >= line.m_nTokenCount || pTokens[nName + 1].m_nSymbol != ')' ) ) )
+		{
+			ReportError( "malformed defined()" );
+			return 0;
+		}
+
+		int nState = m_Macros[pTokens[nName].m_nSymbol].m_nState;
+		PPToken_t result = { PPTOKEN_VALUE, 0, -1, nState != MACRO_UNDEFINED };
+		if ( nState == MACRO_UNKNOWN )
+		{
+			result.m_nType = PPTOKEN_DEFINED_UNKNOWN;
+			result.m_nSymbol = pTokens[nName].m_nSymbol;
+		}
+		m_Scratch.AddToTail( result );
+		i = nName + ( bParen ? 1 : 0 );
+	}
+
+	ExpandTokens( m_Scratch.Base(), m_Scratch.Count(), m_Condition );
+
+	m_nConditionPos = 0;
+	m_bConditionError = false;
+	ValueResult_t result = ParseTernary();
+	if ( m_bConditionError || m_nConditionPos != m_Condition.Count() )
+	{
+		ReportError( "malformed conditional expression" );
+		return 0;
+	}
+	if ( result.m_bUnknown )
+		return -1;
+	return result.m_nValue ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Macro expansion
+//-----------------------------------------------------------------------------
+bool CPreprocessorContext::IsExpanding( int nSymbol ) const
+{
+	for ( int i = 0; i < m_Expanding.Count(); ++i )
+	{
+		if ( m_Expanding[i] == nSymbol )
+			return true;
+	}
+	return false;
+}
+
+void CPreprocessorContext::ExpandTokens( const PPToken_t *pTokens, int nCount, CUtlVector< PPToken_t > &out )
+{
+	for ( int i = 0; i < nCount; ++i )
+	{
+		const PPToken_t &token = pTokens[i];
+		if ( token.m_nType != PPTOKEN_IDENTIFIER )
+		{
+			out.AddToTail( token );
+			continue;
+		}
+
+		const MacroState_t &macro = m_Macros[token.m_nSymbol];
+		if ( macro.m_nState != MACRO_DEFINED || IsExpanding( token.m_nSymbol ) )
+		{
+			out.AddToTail( token );
+			continue;
+		}
+
+		if ( macro.m_nDefinition < 0 )
+		{
+			PPToken_t value = { PPTOKEN_VALUE, 0, -1, macro.m_nValue };
+			out.AddToTail( value );
+			continue;
+		}
+
+		const PPMacroDef_t &def = m_pp.m_MacroDefs[macro.m_nDefinition];
+		const PPToken_t *pBody = &m_pp.m_Tokens[def.m_nFirstBodyToken];
+		if ( def.m_nParamCount < 0 )
+		{
+			m_Expanding.AddToTail( token.m_nSymbol );
+			ExpandTokens( pBody, def.m_nBodyTokenCount, out );
+			m_Expanding.RemoveMultipleFromTail( 1 );
+			continue;
+		}
+
+		if ( i + 1 >= nCount || pTokens[i + 1].m_nType != PPTOKEN_PUNCT || pTokens[i + 1].m_nSymbol != '(' )
+		{
+			// Not an invocation on this line. Tag the name with the definition, the
+			// compiler may still expand it if the arguments follow on the next line
+			out.AddToTail( token );
+			PPToken_t tag = { PPTOKEN_VALUE, 0, -1, -1 - macro.m_nDefinition };
+			out.AddToTail( tag );
+			continue;
+		}
+
+		// Split the arguments at top level commas
+		CUtlVectorFixedGrowable< int, 16 > argStart;
+		int nDepth = 0;
+		int nClose = -1;
+		argStart.AddToTail( i + 2 );
+		for ( int j = i + 2; j < nCount; ++j )
+		{
+			if ( pTokens[j].m_nType != PPTOKEN_PUNCT )
+				continue;
+			if ( pTokens[j].m_nSymbol == '(' )
+			{
+				++nDepth;
+			}
+			else if ( pTokens[j].m_nSymbol == ')' )
+			{
+				if ( nDepth-- == 0 )
+				{
+					nClose = j;
+					break;
+				}
+			}
+			else if ( pTokens[j].m_nSymbol == ',' && nDepth == 0 )
+			{
+				argStart.AddToTail( j + 1 );
+			}
+		}
+
+		int nArgs = argStart.Count();
+		if ( nArgs == 1 && nClose == i + 2 )
+		{
+			nArgs = 0;
+		}
+		if ( nClose < 0 || nArgs != def.m_nParamCount )
+		{
+			ReportError( "bad invocation of macro %s", m_pp.GetSymbolName( token.m_nSymbol ) );
+			out.AddToTail( token );
+			continue;
+		}
+		argStart.AddToTail( nClose + 1 );
+
+		if ( m_nSubstitutionDepth >= MAX_EXPANSION_DEPTH )
+		{
+			ReportError( "macro %s nested too deeply", m_pp.GetSymbolName( token.m_nSymbol ) );
+			return;
+		}
+
+		// Substitute fully expanded arguments, then rescan
+		CUtlVector< PPToken_t > &substituted = m_Substitutions[m_nSubstitutionDepth++];
+		substituted.RemoveAll();
+		for ( int j = 0; j < def.m_nBodyTokenCount; ++j )
+		{
+			int nParam = -1;
+			if ( pBody[j].m_nType == PPTOKEN_IDENTIFIER )
+			{
+				for ( int k = 0; k < def.m_nParamCount; ++k )
+				{
+					if ( m_pp.m_ParamPool[def.m_nFirstParam + k] == pBody[j].m_nSymbol )
+					{
+						nParam = k;
+						break;
+					}
+				}
+			}
+
+			if ( nParam < 0 )
+			{
+				substituted.AddToTail( pBody[j] );
+				continue;
+			}
+
+			int nArgFirst = argStart[nParam];
+			int nArgCount = argStart[nParam + 1] - 1 - nArgFirst;
+			ExpandTokens( pTokens + nArgFirst, nArgCount, substituted );
+		}
+
+		m_Expanding.AddToTail( token.m_nSymbol );
+		ExpandTokens( substituted.Base(), substituted.Count(), out );
+		m_Expanding.RemoveMultipleFromTail( 1 );
+		--m_nSubstitutionDepth;
+		i = nClose;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Output
+//-----------------------------------------------------------------------------
+void CPreprocessorContext::EmitText( const char *pText, int nLength )
+{
+	m_Output.AddMultipleToTail( nLength, pText );
+}
+
+void CPreprocessorContext::EmitTokens( const PPToken_t *pTokens, int nCount )
+{
+	for ( int i = 0; i < nCount; ++i )
+	{
+		const PPToken_t &token = pTokens[i];
+		if ( i > 0 )
+		{
+			m_Output.AddToTail( ' ' );
+		}
+
+		if ( token.m_nOffset >= 0 )
+		{
+			EmitText( &m_pp.m_TextPool[token.m_nOffset], token.m_nLength );
+		}
+		else if ( token.m_nType == PPTOKEN_VALUE )
+		{
+			char szValue[16];
+			int nLength = V_snprintf( szValue, sizeof( szValue ), "%d", token.m_nSymbol );
+			EmitText( szValue, nLength );
+		}
+		else if ( token.m_nType == PPTOKEN_DEFINED_UNKNOWN )
+		{
+			const char *pName = m_pp.GetSymbolName( token.m_nSymbol );
+			EmitText( "defined(", 8 );
+			EmitText( pName, V_strlen( pName ) );
+			EmitText( ")", 1 );
+		}
+		else
+		{
+			m_Output.AddToTail( (char)token.m_nSymbol );
+		}
+	}
+	m_Output.AddToTail( '\n' );
+}
+
+void CPreprocessorContext::EmitDirective( const char *pName, const PPToken_t *pTokens, int nCount )
+{
+	EmitText( pName, V_strlen( pName ) );
+	m_Output.AddToTail( ' ' );
+	EmitTokens( pTokens, nCount );
+}
+
+//-----------------------------------------------------------------------------
+// Conditional expressions. Unknown operands make the result unknown unless the
+// other operand decides it on its own
+//-----------------------------------------------------------------------------
+bool CPreprocessorContext::AcceptOperator( int nOperator )
+{
+	if ( m_nConditionPos < m_Condition.Count() )
+	{
+		const PPToken_t &token = m_Condition[m_nConditionPos];
+		if ( token.m_nType == PPTOKEN_PUNCT && token.m_nSymbol == nOperator )
+		{
+			++m_nConditionPos;
+			return true;
+		}
+	}
+	return false;
+}
+
+int CPreprocessorContext::PeekBinaryOperator( int &nPrecedence ) const
+{
+	if ( m_nConditionPos >= m_Condition.Count() || m_Condition[m_nConditionPos].m_nType != PPTOKEN_PUNCT )
+		return 0;
+
+	int nOperator = m_Condition[m_nConditionPos].m_nSymbol;
+	switch ( nOperator )
+	{
+	case '*': case '/': case '%':			nPrecedence = 10; break;
+	case '+': case '-':						nPrecedence = 9; break;
+	case PPOP_SHL: case PPOP_SHR:			nPrecedence = 8; break;
+	case '<': case '>':
+	case PPOP_LE: case PPOP_GE:				nPrecedence = 7; break;
+	case PPOP_EQ: case PPOP_NE:				nPrecedence = 6; break;
+	case '&':								nPrecedence = 5; break;
+	case '^':								nPrecedence = 4; break;
+	case '|':								nPrecedence = 3; break;
+	case PPOP_AND:							nPrecedence = 2; break;
+	case PPOP_OR:							nPrecedence = 1; break;
+	default:								return 0;
+	}
+	return nOperator;
+}
+
+CPreprocessorContext::ValueResult_t CPreprocessorContext::ParseTernary()
+{
+	ValueResult_t cond = ParseBinary( 1 );
+	if ( !AcceptOperator( '?' ) )
+		return cond;
+
+	ValueResult_t a = ParseTernary();
+	if ( !AcceptOperator( ':' ) )
+	{
+		m_bConditionError = true;
+		return cond;
+	}
+	ValueResult_t b = ParseTernary();
+
+	if ( !cond.m_bUnknown )
+		return cond.m_nValue ? a : b;
+
+	ValueResult_t result = a;
+	result.m_bUnknown = a.m_bUnknown || b.m_bUnknown || a.m_nValue != b.m_nValue;
+	return result;
+}
+
+CPreprocessorContext::ValueResult_t CPreprocessorContext::ParseBinary( int nMinPrecedence )
+{
+	ValueResult_t lhs = ParseUnary();
+	for ( ;; )
+	{
+		int nPrecedence;
+		int nOperator = PeekBinaryOperator( nPrecedence );
+		if ( !nOperator || nPrecedence < nMinPrecedence )
+			return lhs;
+
+		++m_nConditionPos;
+		ValueResult_t rhs = ParseBinary( nPrecedence + 1 );
+
+		ValueResult_t result = { 0, lhs.m_bUnknown || rhs.m_bUnknown };
+		if ( nOperator == PPOP_AND )
+		{
+			// A known false side decides it
+			if ( ( !lhs.m_bUnknown && !lhs.m_nValue ) || ( !rhs.m_bUnknown && !rhs.m_nValue ) )
+			{
+				result.m_bUnknown = false;
+			}
+			else if ( !result.m_bUnknown )
+			{
+				result.m_nValue = 1;
+			}
+			lhs = result;
+			continue;
+		}
+
+		if ( nOperator == PPOP_OR )
+		{
+			if ( ( !lhs.m_bUnknown && lhs.m_nValue ) || ( !rhs.m_bUnknown && rhs.m_nValue ) )
+			{
+				result.m_bUnknown = false;
+				result.m_nValue = 1;
+			}
+			else if ( !result.m_bUnknown )
+			{
+				result.m_nValue = 0;
+			}
+			lhs = result;
+			continue;
+		}
+
+		int64 a = lhs.m_nValue;
+		int64 b = rhs.m_nValue;
+		switch ( nOperator )
+		{
+		case '*':		result.m_nValue = a * b; break;
+		case '/':		result.m_nValue = b ? a / b : 0; break;
+		case '%':		result.m_nValue = b ? a % b : 0; break;
+		case '+':		result.m_nValue = a + b; break;
+		case '-':		result.m_nValue = a - b; break;
+		case PPOP_SHL:	result.m_nValue = a << ( b & 63 ); break;
+		case PPOP_SHR:	result.m_nValue = a >> ( b & 63 ); break;
+		case '<':		result.m_nValue = a < b; break;
+		case '>':		result.m_nValue = a > b; break;
+		case PPOP_LE:	result.m_nValue = a <= b; break;
+		case PPOP_GE:	result.m_nValue = a >= b; break;
+		case PPOP_EQ:	result.m_nValue = a == b; break;
+		case PPOP_NE:	result.m_nValue = a != b; break;
+		case '&':		result.m_nValue = a & b; break;
+		case '^':		result.m_nValue = a ^ b; break;
+		case '|':		result.m_nValue = a | b; break;
+		}
+		lhs = result;
+	}
+}
+
+CPreprocessorContext::ValueResult_t CPreprocessorContext::ParseUnary()
+{
+	ValueResult_t result = { 0, false };
+	if ( m_nConditionPos >= m_Condition.Count() )
+	{
+		m_bConditionError = true;
+		return result;
+	}
+
+	const PPToken_t &token = m_Condition[m_nConditionPos++];
+	switch ( token.m_nType )
+	{
+	case PPTOKEN_PUNCT:
+		switch ( token.m_nSymbol )
+		{
+		case '(':
+			result = ParseTernary();
+			if ( !AcceptOperator( ')' ) )
+			{
+				m_bConditionError = true;
+			}
+			return result;
+		case '!':
+			result = ParseUnary();
+			result.m_nValue = !result.m_nValue;
+			return result;
+		case '~':
+			result = ParseUnary();
+			result.m_nValue = ~result.m_nValue;
+			return result;
+		case '-':
+			result = ParseUnary();
+			result.m_nValue = -result.m_nValue;
+			return result;
+		case '+':
+			return ParseUnary();
+		}
+		m_bConditionError = true;
+		return result;
+
+	case PPTOKEN_NUMBER:
+	{
+		char szNumber[64];
+		V_strncpy( szNumber, &m_pp.m_TextPool[token.m_nOffset], MIN( (int)sizeof( szNumber ), token.m_nLength + 1 ) );
+		result.m_nValue = strtoll( szNumber, NULL, 0 );
+		return result;
+	}
+
+	case PPTOKEN_VALUE:
+		result.m_nValue = token.m_nSymbol;
+		return result;
+
+	case PPTOKEN_DEFINED_UNKNOWN:
+		result.m_bUnknown = true;
+		return result;
+
+	case PPTOKEN_IDENTIFIER:
+	{
+		// Whatever is left was not expanded: undefined names are 0
+		int nState = m_Macros[token.m_nSymbol].m_nState;
+		result.m_bUnknown = ( nState == MACRO_UNKNOWN || nState == MACRO_UNKNOWN_VALUE );
+		if ( result.m_bUnknown && AcceptOperator( '(' ) )
+		{
+			// Invocation of an undecided function-like macro
+			for ( int nDepth = 1; nDepth > 0 && m_nConditionPos < m_Condition.Count(); ++m_nConditionPos )
+			{
+				const PPToken_t &arg = m_Condition[m_nConditionPos];
+				if ( arg.m_nType == PPTOKEN_PUNCT )
+				{
+					nDepth += ( arg.m_nSymbol == '(' ) - ( arg.m_nSymbol == ')' );
+				}
+			}
+		}
+		return result;
+	}
+	}
+
+	m_bConditionError = true;
+	return result;
+}
@@ -0,0 +1,257 @@
+//==================================================================================================
+//
+// Partial preprocessor for the FXC subset used by stdshaders
+//
+// Source files are tokenized once. Each static combo is then preprocessed with its static combo
+// values known and its dynamic combos defined to unknown values: conditionals that can be decided
+// are resolved, the rest are kept in the output with the known macros expanded. Two static combos
+// that produce the same output compile to the same code, whatever the dynamic combo values are.
+//
+//==================================================================================================
+
+#ifndef HLSLPREPROCESSOR_H
+#define HLSLPREPROCESSOR_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+#include "tier1/utlvector.h"
+
+enum PPTokenType_t
+{
+	PPTOKEN_IDENTIFIER = 0,
+	PPTOKEN_NUMBER,
+	PPTOKEN_STRING,
+	PPTOKEN_PUNCT,
+	PPTOKEN_VALUE,				// Synthesized integer, m_nSymbol is the value
+	PPTOKEN_DEFINED_UNKNOWN,	// "defined X" that can't be decided, m_nSymbol is X
+};
+
+// Multi-character punctuators, single characters use their own code
+enum PPOperator_t
+{
+	PPOP_AND = 256,		// &&
+	PPOP_OR,			// ||
+	PPOP_EQ,			// ==
+	PPOP_NE,			// !=
+	PPOP_LE,			// <=
+	PPOP_GE,			// >=
+	PPOP_SHL,			// <<
+	PPOP_SHR,			// >>
+	PPOP_OTHER,			// Any other multi-character punctuator
+};
+
+struct PPToken_t
+{
+	uint16	m_nType;
+	uint16	m_nLength;
+	int		m_nOffset;	// Into the text pool
+	int		m_nSymbol;	// Identifier symbol, operator code or value
+};
+
+enum PPDirective_t
+{
+	PPDIR_TEXT = 0,
+	PPDIR_INCLUDE,
+	PPDIR_DEFINE,
+	PPDIR_UNDEF,
+	PPDIR_IF,
+	PPDIR_IFDEF,
+	PPDIR_IFNDEF,
+	PPDIR_ELIF,
+	PPDIR_ELSE,
+	PPDIR_ENDIF,
+	PPDIR_PRAGMA,
+	PPDIR_ERROR,
+	PPDIR_IGNORED,		// #line and unknown directives
+};
+
+struct PPLine_t
+{
+	uint8	m_nDirective;
+	bool	m_bVerbatim;		// No token can be a macro, output the text as is
+	int		m_nSourceLine;
+	int		m_nFirstToken;		// Tokens after the directive name
+	int		m_nTokenCount;
+	int		m_nTextOffset;		// Normalized line text, valid for verbatim lines
+	int		m_nTextLength;
+	int		m_nArg;				// #include: file index, #define: macro index, #if..#else: next branch line
+};
+
+struct PPMacroDef_t
+{
+	int		m_nSymbol;
+	int		m_nParamCount;		// -1 for object-like macros
+	int		m_nFirstParam;		// Into the parameter pool
+	int		m_nFirstBodyToken;
+	int		m_nBodyTokenCount;
+};
+
+struct PPFile_t
+{
+	char	m_szPath[MAX_PATH];
+	int		m_nFirstLine;
+	int		m_nLineCount;
+};
+
+//-----------------------------------------------------------------------------
+// Tokenized sources, shared read-only by all preprocessor contexts
+//-----------------------------------------------------------------------------
+class CHLSLPreprocessor
+{
+public:
+	CHLSLPreprocessor();
+	~CHLSLPreprocessor();
+
+	void AddIncludePath( const char *pPath );
+
+	// Returns the index of the file, loading every file it can include. -1 on failure
+	int LoadFile( const char *pFileName );
+
+	int FindSymbol( const char *pName ) const;
+	int AddSymbol( const char *pName, int nLength );
+	int GetSymbolCount() const { return m_SymbolOffsets.Count(); }
+	const char *GetSymbolName( int nSymbol ) const { return &m_SymbolNames[ m_SymbolOffsets[nSymbol] ]; }
+
+	int GetFileCount() const { return m_Files.Count(); }
+	const PPFile_t &GetFile( int nFile ) const { return m_Files[nFile]; }
+
+	// Macros defined before the first line of every combo
+	void AddPredefinedMacro( const char *pName, int nValue );
+
+	// Macros the contexts define per combo, returns the symbol
+	int AddComboMacro( const char *pName );
+
+	// Flags lines that can be output without expansion, call once all files are loaded
+	void FinalizeLines();
+
+	bool HasErrors() const { return m_nErrors > 0; }
+
+private:
+	friend class CPreprocessorContext;
+
+	struct PredefinedMacro_t
+	{
+		int m_nSymbol;
+		int m_nValue;
+	};
+
+	bool ResolveInclude( const char *pIncluder, const char *pName, char *pOut, int nOutSize ) const;
+	bool TokenizeFile( int nFile, const char *pSource, int nSize );
+	void TokenizeLine( const char *pLine, int nLength, int nSourceLine, const char *pPath );
+	bool MatchConditionals( int nFile );
+	void ParseDefine( PPLine_t &line, bool bFunctionLike, const char *pPath );
+	void Error( const char *pPath, int nLine, const char *pFormat, ... );
+
+	CUtlVector< char >				m_TextPool;
+	CUtlVector< PPToken_t >			m_Tokens;
+	CUtlVector< PPLine_t >			m_Lines;
+	CUtlVector< PPFile_t >			m_Files;
+	CUtlVector< PPMacroDef_t >		m_MacroDefs;
+	CUtlVector< int >				m_ParamPool;
+	CUtlVector< PredefinedMacro_t >	m_Predefined;
+	CUtlVector< int >				m_ComboMacros;
+	CUtlVector< char * >			m_IncludePaths;
+
+	// Open addressed symbol table
+	CUtlVector< char >				m_SymbolNames;
+	CUtlVector< int >				m_SymbolOffsets;
+	CUtlVector< int >				m_SymbolHash;
+
+	int								m_nDefinedSymbol;
+	int								m_nErrors;
+	mutable CInterlockedInt			m_nReportedErrors;	// From preprocessor contexts
+};
+
+//-----------------------------------------------------------------------------
+// Preprocesses one combo at a time. Not thread safe, use one context per thread
+//-----------------------------------------------------------------------------
+class CPreprocessorContext
+{
+public:
+	explicit CPreprocessorContext( const CHLSLPreprocessor &pp );
+
+	// Starts a new combo, all macros but the predefined ones are undefined
+	void Reset();
+	void DefineValue( int nSymbol, int nValue );
+	void DefineUnknown( int nSymbol );
+
+	// Returns false if the combo hit an #error or malformed source
+	bool Run( int nRootFile );
+
+	const CUtlVector< char > &GetOutput() const { return m_Output; }
+	bool IsFileUsed( int nFile ) const { return m_FilesUsed[nFile] != 0; }
+
+private:
+	enum MacroStateType_t
+	{
+		MACRO_UNDEFINED = 0,
+		MACRO_DEFINED,				// Known definition
+		MACRO_UNKNOWN_VALUE,		// Defined, value unknown until compile time
+		MACRO_UNKNOWN,				// Changed in a branch that can't be decided
+	};
+
+	struct MacroState_t
+	{
+		int m_nState;
+		int m_nDefinition;			// Macro definition index, -1 for a plain value
+		int m_nValue;
+	};
+
+	struct ValueResult_t
+	{
+		int64 m_nValue;
+		bool m_bUnknown;
+	};
+
+	struct Conditional_t
+	{
+		bool m_bTaken;				// A branch was known true, the rest are dead
+		bool m_bEmitted;			// An undecided branch was output, the chain ends with #endif
+		bool m_bLive;				// Current branch is output
+	};
+
+	bool RunFile( int nFile, int nDepth );
+	void HandleDefine( const PPLine_t &line );
+	void HandleUndef( const PPLine_t &line );
+	int EvaluateCondition( const PPLine_t &line );
+	void ReportError( const char *pFormat, ... );
+
+	void ExpandTokens( const PPToken_t *pTokens, int nCount, CUtlVector< PPToken_t > &out );
+	bool IsExpanding( int nSymbol ) const;
+	void EmitTokens( const PPToken_t *pTokens, int nCount );
+	void EmitText( const char *pText, int nLength );
+	void EmitDirective( const char *pName, const PPToken_t *pTokens, int nCount );
+
+	// Three valued expression parser over m_Condition
+	ValueResult_t ParseTernary();
+	ValueResult_t ParseBinary( int nPrecedence );
+	ValueResult_t ParseUnary();
+	bool AcceptOperator( int nOperator );
+	int PeekBinaryOperator( int &nPrecedence ) const;
+
+	const CHLSLPreprocessor		&m_pp;
+
+	CUtlVector< MacroState_t >	m_Macros;
+	CUtlVector< MacroState_t >	m_InitialMacros;
+	CUtlVector< int >			m_Expanding;
+	CUtlVector< Conditional_t >	m_Conditionals;
+	CUtlVector< uint8 >			m_FilesUsed;
+	CUtlVector< char >			m_Output;
+
+	CUtlVector< PPToken_t >		m_Scratch;
+	CUtlVector< CUtlVector< PPToken_t > > m_Substitutions;	// One per nested function-like macro
+	int							m_nSubstitutionDepth;
+	CUtlVector< PPToken_t >		m_Condition;
+	int							m_nConditionPos;
+	bool						m_bConditionError;
+
+	int							m_nLine;			// Current line, for errors
+	int							m_nUnknownDepth;	// Undecided conditionals around the current line
+	bool						m_bError;
+};
+
+#endif // HLSLPREPROCESSOR_H
@@ -0,0 +1,525 @@
+//==================================================================================================
+//
+// STATIC, DYNAMIC and SKIP declarations of an fxc shader
+//
+//==================================================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "shadercombos.h"
+#include "tier1/strtools.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define MAX_SKIP_STACK	64
+
+enum SkipOperator_t
+{
+	SKIPOPERATOR_OR = 0,
+	SKIPOPERATOR_AND,
+	SKIPOPERATOR_BITOR,
+	SKIPOPERATOR_BITAND,
+	SKIPOPERATOR_EQ,
+	SKIPOPERATOR_NE,
+	SKIPOPERATOR_LT,
+	SKIPOPERATOR_GT,
+	SKIPOPERATOR_LE,
+	SKIPOPERATOR_GE,
+	SKIPOPERATOR_ADD,
+	SKIPOPERATOR_SUB,
+	SKIPOPERATOR_MUL,
+	SKIPOPERATOR_DIV,
+};
+
+static const struct
+{
+	const char *m_pText;
+	int m_nOperator;
+	int m_nPrecedence;
+} s_SkipOperators[] =
+{
+	// Two character operators first so they win over their prefixes
+	{ "||", SKIPOPERATOR_OR, 1 },
+	{ "&&", SKIPOPERATOR_AND, 2 },
+	{ "==", SKIPOPERATOR_EQ, 5 },
+	{ "!=", SKIPOPERATOR_NE, 5 },
+	{ "<=", SKIPOPERATOR_LE, 6 },
+	{ ">=", SKIPOPERATOR_GE, 6 },
+	{ "|", SKIPOPERATOR_BITOR, 3 },
+	{ "&", SKIPOPERATOR_BITAND, 4 },
+	{ "<", SKIPOPERATOR_LT, 6 },
+	{ ">", SKIPOPERATOR_GT, 6 },
+	{ "+", SKIPOPERATOR_ADD, 7 },
+	{ "-", SKIPOPERATOR_SUB, 7 },
+	{ "*", SKIPOPERATOR_MUL, 8 },
+	{ "/", SKIPOPERATOR_DIV, 8 },
+};
+
+static const char *SkipWhitespace( const char *p )
+{
+	while ( *p == ' ' || *p == '\t' )
+	{
+		++p;
+	}
+	return p;
+}
+
+static void StripTrailingWhitespace( char *pString )
+{
+	int nLength = V_strlen( pString );
+	while ( nLength > 0 && ( pString[nLength - 1] == ' ' || pString[nLength - 1] == '\t' ||
+		pString[nLength - 1] == '\r' || pString[nLength - 1] == '\n' ) )
+	{
+		pString[--nLength] = '\0';
+	}
+}
+
+static inline bool IsNameChar( char c )
+{
+	return ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) || ( c >= '0' && c <= '9' ) || c == '_';
+}
+
+CShaderCombos::CShaderCombos()
+{
+	m_szTarget[0] = '\0';
+	m_nStaticCombos = 1;
+	m_nDynamicCombos = 1;
+}
+
+CShaderCombos::~CShaderCombos()
+{
+	for ( int i = 0; i < m_SkipSources.Count(); ++i )
+	{
+		delete[] m_SkipSources[i];
+	}
+}
+
+void CShaderCombos::SetTarget( const char *pTarget )
+{
+	V_strncpy( m_szTarget, pTarget, sizeof( m_szTarget ) );
+}
+
+//-----------------------------------------------------------------------------
+// Tags are [ps30], [vs20b] style targets and [PC]/[XBOX]/[CONSOLE] platforms
+//-----------------------------------------------------------------------------
+bool CShaderCombos::MatchesTarget( const char *pTags ) const
+{
+	bool bHasTarget = false;
+	bool bTargetMatch = false;
+	bool bHasPlatform = false;
+	bool bPlatformMatch = false;
+
+	for ( const char *p = V_strstr( pTags, "[" ); p; p = V_strstr( p + 1, "[" ) )
+	{
+		const char *pEnd = V_strstr( p, "]" );
+		if ( !pEnd )
+			break;
+
+		char szTag[32];
+		V_strncpy( szTag, p + 1, MIN( (int)sizeof( szTag ), (int)( pEnd - p ) ) );
+		if ( szTag[0] == '=' )
+			continue;	// Initializer
+
+		if ( ( szTag[0] == 'p' || szTag[0] == 'v' || szTag[0] == 'P' || szTag[0] == 'V' ) &&
+			( szTag[1] == 's' || szTag[1] == 'S' ) && szTag[2] >= '0' && szTag[2] <= '9' )
+		{
+			bHasTarget = true;
+			bTargetMatch |= !V_stricmp( szTag, m_szTarget );
+		}
+		else
+		{
+			bHasPlatform = true;
+			bPlatformMatch |= !V_stricmp( szTag, "PC" );
+		}
+	}
+
+	return ( !bHasTarget || bTargetMatch ) && ( !bHasPlatform || bPlatformMatch );
+}
+
+bool CShaderCombos::ParseDeclaration( const char *pLine, bool bStatic, const char *pPath, int nLine )
+{
+	// "NAME" "min..max" [tags]
+	const char *p = SkipWhitespace( pLine );
+	const char *pName = ( *p == '"' ) ? p + 1 : NULL;
+	const char *pNameEnd = pName ? V_strstr( pName, "\"" ) : NULL;
+	if ( !pNameEnd || pNameEnd - pName >= MAX_COMBO_NAME_LENGTH )
+	{
+		fprintf( stderr, "%s(%d): error: malformed combo declaration\n", pPath, nLine );
+		return false;
+	}
+
+	p = SkipWhitespace( pNameEnd + 1 );
+	int nMin, nMax;
+	if ( sscanf( p, "\"%d..%d\"", &nMin, &nMax ) != 2 || nMax < nMin )
+	{
+		fprintf( stderr, "%s(%d): error: malformed combo range\n", pPath, nLine );
+		return false;
+	}
+
+	const char *pTags = V_strstr( p + 1, "\"" );
+	if ( pTags && !MatchesTarget( pTags + 1 ) )
+		return true;
+
+	ShaderCombo_t combo;
+	V_strncpy( combo.m_szName, pName, pNameEnd - pName + 1 );
+	combo.m_nMin = nMin;
+	combo.m_nMax = nMax;
+	combo.m_bStatic = bStatic;
+
+	if ( FindCombo( combo.m_szName, V_strlen( combo.m_szName ) ) >= 0 )
+	{
+		fprintf( stderr, "%s(%d): error: combo %s declared twice\n", pPath, nLine, combo.m_szName );
+		return false;
+	}
+
+	int nCount = nMax - nMin + 1;
+	int &nTotal = bStatic ? m_nStaticCombos : m_nDynamicCombos;
+	if ( nTotal > INT_MAX / nCount )
+	{
+		fprintf( stderr, "%s(%d): error: too many combos\n", pPath, nLine );
+		return false;
+	}
+	nTotal *= nCount;
+
+	m_Combos.AddToTail( combo );
+	return true;
+}
+
+bool CShaderCombos::ParseFile( const char *pPath )
+{
+	FILE *fp = fopen( pPath, "rt" );
+	if ( !fp )
+	{
+		fprintf( stderr, "error: can't open %s\n", pPath );
+		return false;
+	}
+
+	bool bSuccess = true;
+	char szLine[2048];
+	for ( int nLine = 1; fgets( szLine, sizeof( szLine ), fp ); ++nLine )
+	{
+		const char *p = SkipWhitespace( szLine );
+		if ( p[0] != '/' || p[1] != '/' )
+			continue;
+		p = SkipWhitespace( p + 2 );
+
+		int nKeyword = -1;
+		static const char *s_pKeywords[] = { "STATIC", "DYNAMIC", "SKIP" };
+		for ( int i = 0; i < ARRAYSIZE( s_pKeywords ); ++i )
+		{
+			int nLength = V_strlen( s_pKeywords[i] );
+			if ( !V_strncmp( p, s_pKeywords[i], nLength ) && *SkipWhitespace( p + nLength ) == ':' )
+			{
+				nKeyword = i;
+				p = SkipWhitespace( p + nLength ) + 1;
+				break;
+			}
+		}
+		if ( nKeyword < 0 )
+			continue;
+
+		StripTrailingWhitespace( szLine );
+
+		if ( nKeyword < 2 )
+		{
+			bSuccess &= ParseDeclaration( p, nKeyword == 0, pPath, nLine );
+			continue;
+		}
+
+		// Trailing tags apply to the whole skip
+		char szSkip[2048];
+		V_strncpy( szSkip, SkipWhitespace( p ), sizeof( szSkip ) );
+		char *pTags = V_strstr( szSkip, "[" );
+		if ( pTags )
+		{
+			if ( !MatchesTarget( pTags ) )
+				continue;
+			*pTags = '\0';
+			StripTrailingWhitespace( szSkip );
+		}
+
+		// Common headers are included several times, keep each skip once
+		bool bDuplicate = false;
+		for ( int i = 0; i < m_SkipSources.Count() && !bDuplicate; ++i )
+		{
+			bDuplicate = !V_strcmp( m_SkipSources[i], szSkip );
+		}
+		if ( !bDuplicate )
+		{
+			int nLength = V_strlen( szSkip ) + 1;
+			char *pCopy = new char[nLength];
+			V_strncpy( pCopy, szSkip, nLength );
+			m_SkipSources.AddToTail( pCopy );
+		}
+	}
+
+	fclose( fp );
+	return bSuccess;
+}
+
+int CShaderCombos::FindCombo( const char *pName ) const
+{
+	return FindCombo( pName, V_strlen( pName ) );
+}
+
+int CShaderCombos::FindCombo( const char *pName, int nLength ) const
+{
+	for ( int i = 0; i < m_Combos.Count(); ++i )
+	{
+		if ( !V_strncmp( m_Combos[i].m_szName, pName, nLength ) && m_Combos[i].m_szName[nLength] == '\0' )
+			return i;
+	}
+	return -1;
+}
+
+//-----------------------------------------------------------------------------
+// SKIP expressions compile to postfix instructions over the combo values
+//-----------------------------------------------------------------------------
+bool CShaderCombos::Finalize()
+{
+	bool bSuccess = true;
+	for ( int i = 0; i < m_SkipSources.Count(); ++i )
+	{
+		if ( !CompileSkip( m_SkipSources[i] ) )
+		{
+			fprintf( stderr, "error: malformed skip: %s\n", m_SkipSources[i] );
+			bSuccess = false;
+		}
+	}
+	return bSuccess;
+}
+
+bool CShaderCombos::CompileSkip( const char *pExpression )
+{
+	Skip_t skip;
+	skip.m_nFirstInstruction = m_Instructions.Count();
+	skip.m_bDynamic = false;
+
+	const char *p = pExpression;
+	if ( !CompileBinary( p, 1, skip.m_bDynamic ) || *SkipWhitespace( p ) != '\0' )
+	{
+		m_Instructions.RemoveMultipleFromTail( m_Instructions.Count() - skip.m_nFirstInstruction );
+		return false;
+	}
+
+	skip.m_nInstructionCount = m_Instructions.Count() - skip.m_nFirstInstruction;
+	m_Skips.AddToTail( skip );
+	return true;
+}
+
+bool CShaderCombos::CompileBinary( const char *&p, int nMinPrecedence, bool &bDynamic )
+{
+	if ( !CompileUnary( p, bDynamic ) )
+		return false;
+
+	for ( ;; )
+	{
+		p = SkipWhitespace( p );
+
+		int nOperator = -1;
+		for ( int i = 0; i < ARRAYSIZE( s_SkipOperators ); ++i )
+		{
+			int nLength = V_strlen( s_SkipOperators[i].m_pText );
+			if ( !V_strncmp( p, s_SkipOperators[i].m_pText, nLength ) )
+			{
+				nOperator = i;
+				break;
+			}
+		}
+
+		if ( nOperator < 0 || s_SkipOperators[nOperator].m_nPrecedence < nMinPrecedence )
+			return true;
+
+		p += V_strlen( s_SkipOperators[nOperator].m_pText );
+		if ( !CompileBinary( p, s_SkipOperators[nOperator].m_nPrecedence + 1, bDynamic ) )
+			return false;
+
+		SkipInstruction_t instruction = { SKIPOP_BINARY, s_SkipOperators[nOperator].m_nOperator };
+		m_Instructions.AddToTail( instruction );
+	}
+}
+
+bool CShaderCombos::CompileUnary( const char *&p, bool &bDynamic )
+{
+	p = SkipWhitespace( p );
+
+	if ( *p == '(' )
+	{
+		++p;
+		if ( !CompileBinary( p, 1, bDynamic ) )
+			return false;
+		p = SkipWhitespace( p );
+		if ( *p != ')' )
+			return false;
+		++p;
+		return true;
+	}
+
+	if ( *p == '!' || *p == '-' )
+	{
+		SkipInstruction_t instruction = { (uint8)( *p == '!' ? SKIPOP_NOT : SKIPOP_NEGATE ), 0 };
+		++p;
+		if ( !CompileUnary( p, bDynamic ) )
+			return false;
+		m_Instructions.AddToTail( instruction );
+		return true;
+	}
+
+	if ( *p >= '0' && *p <= '9' )
+	{
+		char *pEnd;
+		SkipInstruction_t instruction = { SKIPOP_CONST, (int)strtol( p, &pEnd, 0 ) };
+		p = pEnd;
+		m_Instructions.AddToTail( instruction );
+		return true;
+	}
+
+	bool bDefined = false;
+	if ( !V_strncmp( p, "defined", 7 ) && !IsNameChar( p[7] ) )
+	{
+		bDefined = true;
+		p = SkipWhitespace( p + 7 );
+	}
+
+	if ( *p != '$' )
+		return false;
+
+	const char *pName = ++p;
+	while ( IsNameChar( *p ) )
+	{
+		++p;
+	}
+
+	// Combos of other shaders are undefined here and evaluate to 0
+	int nCombo = FindCombo( pName, p - pName );
+	SkipInstruction_t instruction = { SKIPOP_CONST, 0 };
+	if ( bDefined )
+	{
+		instruction.m_nArg = ( nCombo >= 0 );
+	}
+	else if ( nCombo >= 0 )
+	{
+		instruction.m_nOp = SKIPOP_VAR;
+		instruction.m_nArg = nCombo;
+		bDynamic |= !m_Combos[nCombo].m_bStatic;
+	}
+	m_Instructions.AddToTail( instruction );
+	return true;
+}
+
+bool CShaderCombos::EvaluateSkip( const Skip_t &skip, const int *pValues ) const
+{
+	int stack[MAX_SKIP_STACK];
+	int nTop = 0;
+
+	const SkipInstruction_t *pInstruction = &m_Instructions[skip.m_nFirstInstruction];
+	for ( int i = 0; i < skip.m_nInstructionCount; ++i, ++pInstruction )
+	{
+		switch ( pInstruction->m_nOp )
+		{
+		case SKIPOP_CONST:
+			stack[nTop++] = pInstruction->m_nArg;
+			break;
+		case SKIPOP_VAR:
+			stack[nTop++] = pValues[pInstruction->m_nArg];
+			break;
+		case SKIPOP_NOT:
+			stack[nTop - 1] = !stack[nTop - 1];
+			break;
+		case SKIPOP_NEGATE:
+			stack[nTop - 1] = -stack[nTop - 1];
+			break;
+		case SKIPOP_BINARY:
+		{
+			int b = stack[--nTop];
+			int &a = stack[nTop - 1];
+			switch ( pInstruction->m_nArg )
+			{
+			case SKIPOPERATOR_OR:		a = a || b; break;
+			case SKIPOPERATOR_AND:		a = a && b; break;
+			case SKIPOPERATOR_BITOR:	a = a | b; break;
+			case SKIPOPERATOR_BITAND:	a = a & b; break;
+			case SKIPOPERATOR_EQ:		a = a == b; break;
+			case SKIPOPERATOR_NE:		a = a != b; break;
+			case SKIPOPERATOR_LT:		a = a < b; break;
+			case SKIPOPERATOR_GT:		a = a > b; break;
+			case SKIPOPERATOR_LE:		a = a <= b; break;
+			case SKIPOPERATOR_GE:		a = a >= b; break;
+			case SKIPOPERATOR_ADD:		a = a + b; break;
+			case SKIPOPERATOR_SUB:		a = a - b; break;
+			case SKIPOPERATOR_MUL:		a = a * b; break;
+			case SKIPOPERATOR_DIV:		a = b ? a / b : 0; break;
+			}
+			break;
+		}
+		}
+
+		if ( nTop >= MAX_SKIP_STACK )
+			return false;
+	}
+
+	return nTop == 1 && stack[0] != 0;
+}
+
+bool CShaderCombos::IsStaticSkipped( const int *pValues ) const
+{
+	for ( int i = 0; i < m_Skips.Count(); ++i )
+	{
+		if ( !m_Skips[i].m_bDynamic && EvaluateSkip( m_Skips[i], pValues ) )
+			return true;
+	}
+	return false;
+}
+
+bool CShaderCombos::IsDynamicSkipped( const int *pValues ) const
+{
+	for ( int i = 0; i < m_Skips.Count(); ++i )
+	{
+		if ( m_Skips[i].m_bDynamic && EvaluateSkip( m_Skips[i], pValues ) )
+			return true;
+	}
+	return false;
+}
+
+void CShaderCombos::DecodeStatic( int nStatic, int *pValues ) const
+{
+	for ( int i = 0; i < m_Combos.Count(); ++i )
+	{
+		const ShaderCombo_t &combo = m_Combos[i];
+		if ( !combo.m_bStatic )
+			continue;
+		int nCount = combo.m_nMax - combo.m_nMin + 1;
+		pValues[i] = combo.m_nMin + nStatic % nCount;
+		nStatic /= nCount;
+	}
+}
+
+int CShaderCombos::EncodeStatic( const int *pValues ) const
+{
+	int nStatic = 0;
+	for ( int i = m_Combos.Count() - 1; i >= 0; --i )
+	{
+		const ShaderCombo_t &combo = m_Combos[i];
+		if ( !combo.m_bStatic )
+			continue;
+		int nCount = combo.m_nMax - combo.m_nMin + 1;
+		nStatic = nStatic * nCount + clamp( pValues[i], combo.m_nMin, combo.m_nMax ) - combo.m_nMin;
+	}
+	return nStatic;
+}
+
+void CShaderCombos::DecodeDynamic( int nDynamic, int *pValues ) const
+{
+	for ( int i = 0; i < m_Combos.Count(); ++i )
+	{
+		const ShaderCombo_t &combo = m_Combos[i];
+		if ( combo.m_bStatic )
+			continue;
+		int nCount = combo.m_nMax - combo.m_nMin + 1;
+		pValues[i] = combo.m_nMin + nDynamic % nCount;
+		nDynamic /= nCount;
+	}
+}
@@ -0,0 +1,110 @@
+//==================================================================================================
+//
+// STATIC, DYNAMIC and SKIP declarations of an fxc shader
+//
+// Combo indices follow ShaderCompile: dynamic combos come first in declaration order, the static
+// index counts the static combos in declaration order and is multiplied by the dynamic combo
+// count to form the full combo index.
+//
+//==================================================================================================
+
+#ifndef SHADERCOMBOS_H
+#define SHADERCOMBOS_H
+
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier0/platform.h"
+#include "tier1/utlvector.h"
+
+#define MAX_COMBO_NAME_LENGTH	64
+
+struct ShaderCombo_t
+{
+	char	m_szName[MAX_COMBO_NAME_LENGTH];
+	int		m_nMin;
+	int		m_nMax;
+	bool	m_bStatic;
+};
+
+class CShaderCombos
+{
+public:
+	CShaderCombos();
+	~CShaderCombos();
+
+	// Target such as "ps30" or "vs20b", used to filter [ps30]-style tags
+	void SetTarget( const char *pTarget );
+
+	// Collects declarations from one source file, the shader and every file it includes
+	bool ParseFile( const char *pPath );
+
+	// Compiles the SKIP expressions, call once all files are parsed
+	bool Finalize();
+
+	int GetComboCount() const { return m_Combos.Count(); }
+	const ShaderCombo_t &GetCombo( int nCombo ) const { return m_Combos[nCombo]; }
+
+	int GetStaticComboCount() const { return m_nStaticCombos; }
+	int GetDynamicComboCount() const { return m_nDynamicCombos; }
+
+	// Index of the combo with this name, -1 if the shader doesn't declare it
+	int FindCombo( const char *pName ) const;
+
+	// Fill the values of the static or dynamic combos, indexed like GetCombo()
+	void DecodeStatic( int nStatic, int *pValues ) const;
+	void DecodeDynamic( int nDynamic, int *pValues ) const;
+
+	// Static index of the values of the static combos, the inverse of DecodeStatic()
+	int EncodeStatic( const int *pValues ) const;
+
+	// Skips that only look at static combos
+	bool IsStaticSkipped( const int *pValues ) const;
+
+	// Skips that look at dynamic combos, pValues must hold both
+	bool IsDynamicSkipped( const int *pValues ) const;
+
+private:
+	enum SkipOp_t
+	{
+		SKIPOP_CONST = 0,
+		SKIPOP_VAR,
+		SKIPOP_NOT,
+		SKIPOP_NEGATE,
+		SKIPOP_BINARY,
+	};
+
+	struct SkipInstruction_t
+	{
+		uint8	m_nOp;
+		int		m_nArg;		// Constant, combo index or operator
+	};
+
+	struct Skip_t
+	{
+		int		m_nFirstInstruction;
+		int		m_nInstructionCount;
+		bool	m_bDynamic;
+	};
+
+	bool ParseDeclaration( const char *pLine, bool bStatic, const char *pPath, int nLine );
+	bool MatchesTarget( const char *pTags ) const;
+	bool CompileSkip( const char *pExpression );
+	bool EvaluateSkip( const Skip_t &skip, const int *pValues ) const;
+	int FindCombo( const char *pName, int nLength ) const;
+
+	// Recursive descent compiler for one skip expression
+	bool CompileBinary( const char *&p, int nMinPrecedence, bool &bDynamic );
+	bool CompileUnary( const char *&p, bool &bDynamic );
+
+	char							m_szTarget[16];
+	CUtlVector< ShaderCombo_t >		m_Combos;
+	CUtlVector< char * >			m_SkipSources;
+	CUtlVector< Skip_t >			m_Skips;
+	CUtlVector< SkipInstruction_t >	m_Instructions;
+	int								m_nStaticCombos;
+	int								m_nDynamicCombos;
+};
+
+#endif // SHADERCOMBOS_H
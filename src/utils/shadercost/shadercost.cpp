@@ -0,0 +1,855 @@
+//==================================================================================================
+//
+// shadercost: ranks PBR materials by the pixel shader they will run
+//
+// Each VMT is loaded the way the material system does, patch materials included, and its
+// parameters go through the checks SHADER_INIT_PARAMS and SHADER_DRAW make in pbr_dx9.cpp to pick
+// the static combo of the pixel shader. The compiled shaders of that combo are read from the vcs
+// file: ALU instructions and texture fetches are counted in the bytecode of every dynamic combo,
+// samplers in their declarations. Counts are static, a loop counts once. Files repacked by
+// vcsrepack work too, their blocks are found through the alias table.
+//
+// The cost is the mean ALU count plus -texweight times the mean fetch count over the dynamic
+// combos, for the normal pass and the flashlight pass. Materials stacking three or more of
+// wrinkle, SSS, emission and parallax are flagged, and so is parallax on brushes, which cover the
+// largest areas of the screen.
+//
+// Materials without $model count as models when they are under models/, like studiomdl materials.
+//
+// Usage: shadercost -fxc pbr_ps30.fxc -vcs pbr_ps30.vcs [-sort cost|flashlight|alu|tex|samplers|name]
+//                   [-texweight n] [-shadowfilter n] [-noparallax] [-top n] [-csv] materials_folder
+//
+//==================================================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "tier0/platform.h"
+#include "tier1/KeyValues.h"
+#include "tier1/lzmaDecoder.h"
+#include "tier1/strtools.h"
+#include "tier1/utlstring.h"
+#include "tier1/utlvector.h"
+#include "materialsystem/shader_vcs_version.h"
+#include "../fxcprep/shadercombos.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define SENTINEL_STATIC_COMBO_ID	0xffffffff
+#define MAX_PATCH_DEPTH				8
+
+// Framing of the chunks of a static combo block
+#define VCS_BLOCK_END				0xffffffff
+#define VCS_BLOCK_UNCOMPRESSED		0x80000000
+#define VCS_BLOCK_LZMA				0x40000000
+#define VCS_BLOCK_SIZE_MASK			0x3fffffff
+
+// D3D9 shader bytecode
+#define SHADER_OPCODE_MASK			0x0000ffff
+#define SHADER_OPCODE_DCL			31
+#define SHADER_OPCODE_DEFB			47
+#define SHADER_OPCODE_DEFI			48
+#define SHADER_OPCODE_TEXLD			66
+#define SHADER_OPCODE_DEF			81
+#define SHADER_OPCODE_TEXLDD		93
+#define SHADER_OPCODE_TEXLDL		95
+#define SHADER_OPCODE_PHASE			0xfffd
+#define SHADER_OPCODE_COMMENT		0xfffe
+#define SHADER_OPCODE_END			0xffff
+#define SHADER_REGISTER_SAMPLER		10
+
+enum MaterialFeature_t
+{
+	FEATURE_LIGHTMAPPED		= ( 1 << 0 ),
+	FEATURE_ENVAMBIENT		= ( 1 << 1 ),
+	FEATURE_EMISSIVE		= ( 1 << 2 ),
+	FEATURE_SPECULAR		= ( 1 << 3 ),
+	FEATURE_PARALLAX		= ( 1 << 4 ),
+	FEATURE_LIGHTWARP		= ( 1 << 5 ),
+	FEATURE_WRINKLE			= ( 1 << 6 ),
+	FEATURE_SSS				= ( 1 << 7 ),
+
+	FEATURE_COUNT			= 8
+};
+
+static const char *s_pFeatureNames[FEATURE_COUNT] = { "lightmapped", "envambient", "emissive", "specular", "parallax", "lightwarp", "wrinkle", "sss" };
+
+// Any three of these in one material
+#define FEATURES_HEAVY		( FEATURE_EMISSIVE | FEATURE_PARALLAX | FEATURE_WRINKLE | FEATURE_SSS )
+
+struct ComboCost_t
+{
+	bool	m_bLoaded;
+	bool	m_bCompiled;		// False for static combos ShaderCompile skipped
+	int		m_nDynamicCombos;
+	float	m_flALU;			// Means over the dynamic combos
+	float	m_flTexture;
+	int		m_nMaxALU;
+	int		m_nMaxTexture;
+	int		m_nSamplers;
+};
+
+struct MaterialCost_t
+{
+	char	m_szName[MAX_PATH];
+	int		m_nFeatures;
+	int		m_nStatic;			// Static combos of the normal and the flashlight pass
+	int		m_nFlashlightStatic;
+	const ComboCost_t *m_pCost;
+	const ComboCost_t *m_pFlashlightCost;
+	float	m_flCost;
+	float	m_flFlashlightCost;
+};
+
+//-----------------------------------------------------------------------------
+// Files
+//-----------------------------------------------------------------------------
+static bool ReadFile( const char *pPath, CUtlVector< uint8 > &data )
+{
+	FILE *fp = fopen( pPath, "rb" );
+	if ( !fp )
+		return false;
+
+	fseek( fp, 0, SEEK_END );
+	long nSize = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+	data.SetCount( nSize );
+	bool bSuccess = nSize >= 0 && fread( data.Base(), 1, nSize, fp ) == (size_t)nSize;
+	fclose( fp );
+	return bSuccess;
+}
+
+static bool IsVMTFile( const char *pFileName )
+{
+	int nLength = V_strlen( pFileName );
+	return nLength > 4 && !V_stricmp( pFileName + nLength - 4, ".vmt" );
+}
+
+static void AddFolder( const char *pFolder, CUtlVector< CUtlString > &files )
+{
+	char szPath[MAX_PATH];
+#ifdef _WIN32
+	WIN32_FIND_DATA findData;
+	V_snprintf( szPath, sizeof( szPath ), "%s\\*", pFolder );
+	HANDLE hFind = FindFirstFile( szPath, &findData );
+	if ( hFind == INVALID_HANDLE_VALUE )
+		return;
+
+	do
+	{
+		if ( findData.cFileName[0] == '.' )
+			continue;
+		V_snprintf( szPath, sizeof( szPath ), "%s\\%s", pFolder, findData.cFileName );
+		if ( findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+		{
+			AddFolder( szPath, files );
+		}
+		else if ( IsVMTFile( szPath ) )
+		{
+			files.AddToTail( szPath );
+		}
+	}
+	while ( FindNextFile( hFind, &findData ) );
+	FindClose( hFind );
+#else
+	DIR *pDir = opendir( pFolder );
+	if ( !pDir )
+		return;
+
+	while ( dirent *pEntry = readdir( pDir ) )
+	{
+		if ( pEntry->d_name[0] == '.' )
+			continue;
+		V_snprintf( szPath, sizeof( szPath ), "%s/%s", pFolder, pEntry->d_name );
+		struct stat info;
+		if ( stat( szPath, &info ) )
+			continue;
+		if ( S_ISDIR( info.st_mode ) )
+		{
+			AddFolder( szPath, files );
+		}
+		else if ( IsVMTFile( szPath ) )
+		{
+			files.AddToTail( szPath );
+		}
+	}
+	closedir( pDir );
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Loads a VMT. A patch material is its include with the insert keys added
+// where missing and the replace keys overwritten
+//-----------------------------------------------------------------------------
+static void ApplyPatch( KeyValues *pMaterial, KeyValues *pSection, bool bReplace )
+{
+	if ( !pSection )
+		return;
+
+	for ( KeyValues *pKey = pSection->GetFirstSubKey(); pKey; pKey = pKey->GetNextKey() )
+	{
+		if ( pKey->GetFirstSubKey() )
+			continue;
+		if ( bReplace || !pMaterial->FindKey( pKey->GetName() ) )
+		{
+			pMaterial->SetString( pKey->GetName(), pKey->GetString() );
+		}
+	}
+}
+
+static KeyValues *LoadMaterial( const char *pRoot, const char *pPath, int nDepth = 0 )
+{
+	CUtlVector< uint8 > text;
+	if ( nDepth > MAX_PATCH_DEPTH || !ReadFile( pPath, text ) )
+		return NULL;
+	text.AddToTail( 0 );
+
+	KeyValues *pMaterial = new KeyValues( "vmt" );
+	if ( !pMaterial->LoadFromBuffer( pPath, (const char *)text.Base() ) )
+	{
+		pMaterial->deleteThis();
+		return NULL;
+	}
+	if ( V_stricmp( pMaterial->GetName(), "patch" ) )
+		return pMaterial;
+
+	// Includes are relative to the game folder and start with materials/
+	const char *pInclude = pMaterial->GetString( "include" );
+	if ( !V_strnicmp( pInclude, "materials", 9 ) && ( pInclude[9] == '/' || pInclude[9] == '\\' ) )
+	{
+		pInclude += 10;
+	}
+	char szInclude[MAX_PATH];
+	V_snprintf( szInclude, sizeof( szInclude ), "%s/%s", pRoot, pInclude );
+	V_FixSlashes( szInclude );
+
+	KeyValues *pBase = LoadMaterial( pRoot, szInclude, nDepth + 1 );
+	if ( pBase )
+	{
+		ApplyPatch( pBase, pMaterial->FindKey( "insert" ), false );
+		ApplyPatch( pBase, pMaterial->FindKey( "replace" ), true );
+	}
+	pMaterial->deleteThis();
+	return pBase;
+}
+
+static bool IsDefined( KeyValues *pMaterial, const char *pKey )
+{
+	return pMaterial->GetString( pKey )[0] != '\0';
+}
+
+//-----------------------------------------------------------------------------
+// The checks pbr_dx9.cpp makes. SHADER_INIT_PARAMS fills in $compress from
+// $basetexture when any other wrinkle map is set, SHADER_DRAW then only looks
+// at $compress
+//-----------------------------------------------------------------------------
+static void InitMaterialParams( KeyValues *pMaterial )
+{
+	if ( !IsDefined( pMaterial, "$compress" ) && ( IsDefined( pMaterial, "$bumpcompress" ) ||
+		IsDefined( pMaterial, "$stretch" ) || IsDefined( pMaterial, "$bumpstretch" ) ) )
+	{
+		pMaterial->SetString( "$compress", pMaterial->GetString( "$basetexture" ) );
+	}
+}
+
+static int GetMaterialFeatures( KeyValues *pMaterial, const char *pName, bool bParallax )
+{
+	InitMaterialParams( pMaterial );
+
+	bool bModel = pMaterial->GetInt( "$model", !V_strnicmp( pName, "models/", 7 ) ) != 0;
+	bool bThickness = bModel && IsDefined( pMaterial, "$thicknesstexture" );
+	bool bLightwarp = !bThickness && IsDefined( pMaterial, "$lightwarptexture" );
+	bool bWrinkle = bModel && IsDefined( pMaterial, "$compress" );
+	bool bUseParallax = bParallax && !bWrinkle && pMaterial->GetInt( "$parallax" ) != 0;
+
+	int nFeatures = 0;
+	nFeatures |= bModel ? 0 : FEATURE_LIGHTMAPPED;
+	nFeatures |= ( pMaterial->GetInt( "$useenvambient" ) == 1 ) ? FEATURE_ENVAMBIENT : 0;
+	nFeatures |= IsDefined( pMaterial, "$emissiontexture" ) ? FEATURE_EMISSIVE : 0;
+	nFeatures |= IsDefined( pMaterial, "$speculartexture" ) ? FEATURE_SPECULAR : 0;
+	nFeatures |= bUseParallax ? FEATURE_PARALLAX : 0;
+	nFeatures |= bLightwarp ? FEATURE_LIGHTWARP : 0;
+	nFeatures |= bWrinkle ? FEATURE_WRINKLE : 0;
+	nFeatures |= bThickness ? FEATURE_SSS : 0;
+	return nFeatures;
+}
+
+static void SetCombo( const CShaderCombos &combos, int *pValues, const char *pName, int nValue )
+{
+	int nCombo = combos.FindCombo( pName );
+	if ( nCombo >= 0 )
+	{
+		pValues[nCombo] = nValue;
+	}
+}
+
+// Static index of the features, -1 when a SKIP removes it
+static int GetStaticCombo( const CShaderCombos &combos, int nFeatures, bool bFlashlight, int nShadowFilterMode )
+{
+	CUtlVector< int > values;
+	values.SetCount( combos.GetComboCount() );
+	for ( int i = 0; i < values.Count(); ++i )
+	{
+		values[i] = combos.GetCombo( i ).m_nMin;
+	}
+
+	// Both g-buffer flags are set in SHADER_INIT, so WORLD_NORMAL is always on
+	SetCombo( combos, values.Base(), "FLASHLIGHT", bFlashlight );
+	SetCombo( combos, values.Base(), "FLASHLIGHTDEPTHFILTERMODE", bFlashlight ? nShadowFilterMode : 0 );
+	SetCombo( combos, values.Base(), "LIGHTMAPPED", ( nFeatures & FEATURE_LIGHTMAPPED ) != 0 );
+	SetCombo( combos, values.Base(), "USEENVAMBIENT", ( nFeatures & FEATURE_ENVAMBIENT ) != 0 );
+	SetCombo( combos, values.Base(), "EMISSIVE", ( nFeatures & FEATURE_EMISSIVE ) != 0 );
+	SetCombo( combos, values.Base(), "SPECULAR", ( nFeatures & FEATURE_SPECULAR ) != 0 );
+	SetCombo( combos, values.Base(), "PARALLAXOCCLUSION", ( nFeatures & FEATURE_PARALLAX ) != 0 );
+	SetCombo( combos, values.Base(), "WORLD_NORMAL", 1 );
+	SetCombo( combos, values.Base(), "LIGHTWARPTEXTURE", ( nFeatures & FEATURE_LIGHTWARP ) != 0 );
+	SetCombo( combos, values.Base(), "WRINKLEMAP", ( nFeatures & FEATURE_WRINKLE ) != 0 );
+	SetCombo( combos, values.Base(), "SUBSURFACESCATTERING", ( nFeatures & FEATURE_SSS ) != 0 );
+
+	if ( combos.IsStaticSkipped( values.Base() ) )
+		return -1;
+	return combos.EncodeStatic( values.Base() );
+}
+
+//-----------------------------------------------------------------------------
+// Compiled shaders of a vcs file
+//-----------------------------------------------------------------------------
+class CVCSFile
+{
+public:
+	bool Load( const char *pPath );
+
+	// Counts are loaded the first time a static combo is asked for
+	const ComboCost_t *GetComboCost( int nStatic );
+
+private:
+	bool IsValidRecord( uint32 nRecord ) const;
+	int FindRecord( uint32 nStaticComboID ) const;
+	bool UnpackBlock( uint32 nOffset, uint32 nEnd, CUtlVector< uint8 > &unpacked ) const;
+	static void CountInstructions( const uint32 *pTokens, int nTokens, int *pALU, int *pTexture, int *pSamplers );
+
+	CUtlVector< uint8 > m_File;
+	CUtlVector< int > m_ComboRecords;	// Record of each static combo, aliases resolved, -1 if not compiled
+	CUtlVector< StaticComboRecord_t > m_Records;
+	CUtlVector< ComboCost_t > m_Costs;
+};
+
+bool CVCSFile::Load( const char *pPath )
+{
+	if ( !ReadFile( pPath, m_File ) || m_File.Count() < (int)sizeof( ShaderHeader_t ) )
+	{
+		fprintf( stderr, "error: can't read %s\n", pPath );
+		return false;
+	}
+
+	ShaderHeader_t header;
+	V_memcpy( &header, m_File.Base(), sizeof( header ) );
+	if ( header.m_nVersion != SHADER_VCS_VERSION_NUMBER )
+	{
+		fprintf( stderr, "error: %s is version %d, only version %d is supported\n", pPath, header.m_nVersion, SHADER_VCS_VERSION_NUMBER );
+		return false;
+	}
+
+	uint32 nFileSize = m_File.Count();
+	uint32 nRecords = header.m_nNumStaticCombos;
+	uint64 nAliasCountOffset = sizeof( ShaderHeader_t ) + (uint64)nRecords * sizeof( StaticComboRecord_t );
+	if ( nRecords < 1 || nAliasCountOffset + sizeof( uint32 ) > nFileSize )
+	{
+		fprintf( stderr, "error: %s has a truncated static combo dictionary\n", pPath );
+		return false;
+	}
+	m_Records.SetCount( nRecords );
+	V_memcpy( m_Records.Base(), m_File.Base() + sizeof( ShaderHeader_t ), nRecords * sizeof( StaticComboRecord_t ) );
+
+	uint32 nAliases;
+	V_memcpy( &nAliases, m_File.Base() + nAliasCountOffset, sizeof( nAliases ) );
+	if ( nAliasCountOffset + sizeof( uint32 ) + (uint64)nAliases * sizeof( StaticComboAliasRecord_t ) > nFileSize )
+	{
+		fprintf( stderr, "error: %s has a truncated alias table\n", pPath );
+		return false;
+	}
+	CUtlVector< StaticComboAliasRecord_t > aliases;
+	aliases.SetCount( nAliases );
+	V_memcpy( aliases.Base(), m_File.Base() + nAliasCountOffset + sizeof( uint32 ), nAliases * sizeof( StaticComboAliasRecord_t ) );
+
+	int nStaticCombos = header.m_nTotalCombos / MAX( 1, header.m_nDynamicCombos );
+	m_ComboRecords.SetCount( nStaticCombos );
+	m_Costs.SetCount( nStaticCombos );
+	for ( int i = 0; i < nStaticCombos; ++i )
+	{
+		m_ComboRecords[i] = -1;
+		m_Costs[i].m_bLoaded = false;
+	}
+	for ( uint32 i = 0; i + 1 < nRecords; ++i )
+	{
+		if ( m_Records[i].m_nStaticComboID < (uint32)nStaticCombos && IsValidRecord( i ) )
+		{
+			m_ComboRecords[m_Records[i].m_nStaticComboID] = i;
+		}
+	}
+
+	// Sources can be carrier ids past the last static combo, which vcsrepack stores its blocks under
+	for ( uint32 i = 0; i < nAliases; ++i )
+	{
+		uint32 nCombo = aliases[i].m_nStaticComboID;
+		if ( nCombo < (uint32)nStaticCombos )
+		{
+			m_ComboRecords[nCombo] = FindRecord( aliases[i].m_nSourceStaticCombo );
+		}
+	}
+	return true;
+}
+
+// A record's block ends where the next one starts, the last record is the sentinel
+bool CVCSFile::IsValidRecord( uint32 nRecord ) const
+{
+	return nRecord + 1 < (uint32)m_Records.Count() && m_Records[nRecord + 1].m_nFileOffset <= (uint32)m_File.Count() &&
+		m_Records[nRecord].m_nFileOffset <= m_Records[nRecord + 1].m_nFileOffset;
+}
+
+// Binary search by id like the engine's, records are sorted by id and the sentinel has the largest
+int CVCSFile::FindRecord( uint32 nStaticComboID ) const
+{
+	int nLow = 0;
+	int nHigh = m_Records.Count() - 2;
+	while ( nLow <= nHigh )
+	{
+		int nMid = ( nLow + nHigh ) / 2;
+		uint32 nID = m_Records[nMid].m_nStaticComboID;
+		if ( nID == nStaticComboID )
+			return IsValidRecord( nMid ) ? nMid : -1;
+		if ( nID < nStaticComboID )
+		{
+			nLow = nMid + 1;
+		}
+		else
+		{
+			nHigh = nMid - 1;
+		}
+	}
+	return -1;
+}
+
+// A block is a run of chunks, each unpacking to (dynamic combo, size, bytecode) records
+bool CVCSFile::UnpackBlock( uint32 nOffset, uint32 nEnd, CUtlVector< uint8 > &unpacked ) const
+{
+	unpacked.RemoveAll();
+	CUtlVector< uint8 > chunk;
+	while ( nOffset + sizeof( uint32 ) <= nEnd )
+	{
+		uint32 nChunk;
+		V_memcpy( &nChunk, m_File.Base() + nOffset, sizeof( nChunk ) );
+		nOffset += sizeof( uint32 );
+		if ( nChunk == VCS_BLOCK_END )
+			return true;
+
+		uint32 nSize = nChunk & VCS_BLOCK_SIZE_MASK;
+		if ( nOffset + nSize > nEnd )
+			return false;
+
+		uint8 *pChunk = const_cast< uint8 * >( m_File.Base() ) + nOffset;
+		if ( nChunk & VCS_BLOCK_UNCOMPRESSED )
+		{
+			unpacked.AddMultipleToTail( nSize, pChunk );
+		}
+		else if ( nChunk & VCS_BLOCK_LZMA )
+		{
+			CLZMA lzma;
+			if ( nSize < sizeof( lzma_header_t ) || !lzma.IsCompressed( pChunk ) || lzma.GetActualSize( pChunk ) > MAX_SHADER_UNPACKED_BLOCK_SIZE )
+				return false;
+			chunk.SetCount( lzma.GetActualSize( pChunk ) );
+			if ( lzma.Uncompress( pChunk, chunk.Base() ) != (unsigned int)chunk.Count() )
+				return false;
+			unpacked.AddMultipleToTail( chunk.Count(), chunk.Base() );
+		}
+		else
+		{
+			// bzip2 chunks come from ShaderCompile versions older than version 6 files
+			return false;
+		}
+		nOffset += nSize;
+	}
+	return false;
+}
+
+void CVCSFile::CountInstructions( const uint32 *pTokens, int nTokens, int *pALU, int *pTexture, int *pSamplers )
+{
+	*pALU = 0;
+	*pTexture = 0;
+	*pSamplers = 0;
+
+	// The first token is the version, lengths are only encoded from shader model 2 on
+	if ( nTokens < 1 || ( ( pTokens[0] >> 8 ) & 0xff ) < 2 )
+		return;
+
+	int i = 1;
+	while ( i < nTokens )
+	{
+		uint32 nToken = pTokens[i];
+		uint32 nOpcode = nToken & SHADER_OPCODE_MASK;
+		if ( nOpcode == SHADER_OPCODE_END )
+			break;
+
+		if ( nOpcode == SHADER_OPCODE_COMMENT )
+		{
+			i += 1 + ( ( nToken >> 16 ) & 0x7fff );
+			continue;
+		}
+
+		int nLength = ( nToken >> 24 ) & 0xf;
+		switch ( nOpcode )
+		{
+		case SHADER_OPCODE_DCL:
+			if ( i + 2 < nTokens )
+			{
+				uint32 nRegister = pTokens[i + 2];
+				uint32 nType = ( ( nRegister >> 28 ) & 0x7 ) | ( ( nRegister >> 8 ) & 0x18 );
+				*pSamplers += ( nType == SHADER_REGISTER_SAMPLER );
+			}
+			break;
+
+		case SHADER_OPCODE_DEF:
+		case SHADER_OPCODE_DEFB:
+		case SHADER_OPCODE_DEFI:
+		case SHADER_OPCODE_PHASE:
+			break;
+
+		case SHADER_OPCODE_TEXLD:
+		case SHADER_OPCODE_TEXLDD:
+		case SHADER_OPCODE_TEXLDL:
+			++*pTexture;
+			break;
+
+		default:
+			++*pALU;
+			break;
+		}
+		i += 1 + nLength;
+	}
+}
+
+const ComboCost_t *CVCSFile::GetComboCost( int nStatic )
+{
+	if ( nStatic < 0 || nStatic >= m_Costs.Count() )
+		return NULL;
+
+	ComboCost_t &cost = m_Costs[nStatic];
+	if ( cost.m_bLoaded )
+		return &cost;
+
+	V_memset( &cost, 0, sizeof( cost ) );
+	cost.m_bLoaded = true;
+	int nRecord = m_ComboRecords[nStatic];
+	CUtlVector< uint8 > unpacked;
+	if ( nRecord < 0 || !UnpackBlock( m_Records[nRecord].m_nFileOffset, m_Records[nRecord + 1].m_nFileOffset, unpacked ) )
+		return &cost;
+
+	int nTotalALU = 0;
+	int nTotalTexture = 0;
+	int nOffset = 0;
+	while ( nOffset + 2 * (int)sizeof( uint32 ) <= unpacked.Count() )
+	{
+		uint32 nSize;
+		V_memcpy( &nSize, unpacked.Base() + nOffset + sizeof( uint32 ), sizeof( nSize ) );
+		nOffset += 2 * sizeof( uint32 );
+		if ( nSize > (uint32)( unpacked.Count() - nOffset ) )
+			break;
+
+		CUtlVector< uint32 > tokens;
+		tokens.SetCount( nSize / sizeof( uint32 ) );
+		V_memcpy( tokens.Base(), unpacked.Base() + nOffset, tokens.Count() * sizeof( uint32 ) );
+		nOffset += nSize;
+
+		int nALU, nTexture, nSamplers;
+		CountInstructions( tokens.Base(), tokens.Count(), &nALU, &nTexture, &nSamplers );
+		nTotalALU += nALU;
+		nTotalTexture += nTexture;
+		cost.m_nMaxALU = MAX( cost.m_nMaxALU, nALU );
+		cost.m_nMaxTexture = MAX( cost.m_nMaxTexture, nTexture );
+		cost.m_nSamplers = MAX( cost.m_nSamplers, nSamplers );
+		++cost.m_nDynamicCombos;
+	}
+
+	if ( cost.m_nDynamicCombos )
+	{
+		cost.m_bCompiled = true;
+		cost.m_flALU = (float)nTotalALU / cost.m_nDynamicCombos;
+		cost.m_flTexture = (float)nTotalTexture / cost.m_nDynamicCombos;
+	}
+	return &cost;
+}
+
+//-----------------------------------------------------------------------------
+// Report
+//-----------------------------------------------------------------------------
+enum SortKey_t
+{
+	SORT_COST = 0,
+	SORT_FLASHLIGHT,
+	SORT_ALU,
+	SORT_TEXTURE,
+	SORT_SAMPLERS,
+	SORT_NAME,
+
+	SORT_COUNT
+};
+
+static const char *s_pSortNames[SORT_COUNT] = { "cost", "flashlight", "alu", "tex", "samplers", "name" };
+static SortKey_t s_SortKey = SORT_COST;
+
+static float SortValue( const MaterialCost_t &material )
+{
+	const ComboCost_t *pCost = material.m_pCost;
+	switch ( s_SortKey )
+	{
+	case SORT_FLASHLIGHT:	return material.m_flFlashlightCost;
+	case SORT_ALU:			return pCost ? pCost->m_flALU : 0.0f;
+	case SORT_TEXTURE:		return pCost ? pCost->m_flTexture : 0.0f;
+	case SORT_SAMPLERS:		return pCost ? (float)pCost->m_nSamplers : 0.0f;
+	default:				return material.m_flCost;
+	}
+}
+
+// Most expensive first, then by name
+static int __cdecl CompareMaterials( const MaterialCost_t *pA, const MaterialCost_t *pB )
+{
+	if ( s_SortKey != SORT_NAME )
+	{
+		float flA = SortValue( *pA );
+		float flB = SortValue( *pB );
+		if ( flA != flB )
+			return ( flA > flB ) ? -1 : 1;
+	}
+	return V_stricmp( pA->m_szName, pB->m_szName );
+}
+
+static void GetFeatureString( int nFeatures, char *pOut, int nOutSize )
+{
+	pOut[0] = '\0';
+	for ( int i = 0; i < FEATURE_COUNT; ++i )
+	{
+		if ( nFeatures & ( 1 << i ) )
+		{
+			if ( pOut[0] )
+			{
+				V_strncat( pOut, "+", nOutSize );
+			}
+			V_strncat( pOut, s_pFeatureNames[i], nOutSize );
+		}
+	}
+}
+
+static void GetWarningString( const MaterialCost_t &material, char *pOut, int nOutSize )
+{
+	pOut[0] = '\0';
+	int nHeavy = 0;
+	for ( int i = 0; i < FEATURE_COUNT; ++i )
+	{
+		nHeavy += ( material.m_nFeatures & FEATURES_HEAVY & ( 1 << i ) ) != 0;
+	}
+	if ( !material.m_pCost || !material.m_pCost->m_bCompiled )
+	{
+		V_strncat( pOut, "notcompiled ", nOutSize );
+	}
+	if ( nHeavy >= 3 )
+	{
+		V_strncat( pOut, "stack ", nOutSize );
+	}
+	if ( ( material.m_nFeatures & FEATURE_PARALLAX ) && ( material.m_nFeatures & FEATURE_LIGHTMAPPED ) )
+	{
+		V_strncat( pOut, "parallax-brush ", nOutSize );
+	}
+	int nLength = V_strlen( pOut );
+	if ( nLength )
+	{
+		pOut[nLength - 1] = '\0';
+	}
+}
+
+static void PrintUsage()
+{
+	printf( "usage: shadercost -fxc pbr_ps30.fxc -vcs pbr_ps30.vcs [-sort cost|flashlight|alu|tex|samplers|name]\n" );
+	printf( "                  [-texweight n] [-shadowfilter n] [-noparallax] [-top n] [-csv] materials_folder\n" );
+}
+
+int main( int argc, char **argv )
+{
+	const char *pFXC = NULL;
+	const char *pVCS = NULL;
+	const char *pRoot = NULL;
+	float flTextureWeight = 4.0f;
+	int nShadowFilterMode = 0;
+	int nTop = 0;
+	bool bParallax = true;
+	bool bCSV = false;
+	for ( int i = 1; i < argc; ++i )
+	{
+		const char *pArg = argv[i];
+		bool bHasValue = ( i + 1 < argc );
+		bool bValid = true;
+		if ( !V_stricmp( pArg, "-fxc" ) && bHasValue )
+		{
+			pFXC = argv[++i];
+		}
+		else if ( !V_stricmp( pArg, "-vcs" ) && bHasValue )
+		{
+			pVCS = argv[++i];
+		}
+		else if ( !V_stricmp( pArg, "-sort" ) && bHasValue )
+		{
+			const char *pValue = argv[++i];
+			bValid = false;
+			for ( int j = 0; j < SORT_COUNT; ++j )
+			{
+				if ( !V_stricmp( pValue, s_pSortNames[j] ) )
+				{
+					s_SortKey = (SortKey_t)j;
+					bValid = true;
+				}
+			}
+		}
+		else if ( !V_stricmp( pArg, "-texweight" ) && bHasValue )
+		{
+			flTextureWeight = (float)atof( argv[++i] );
+		}
+		else if ( !V_stricmp( pArg, "-shadowfilter" ) && bHasValue )
+		{
+			nShadowFilterMode = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( pArg, "-top" ) && bHasValue )
+		{
+			nTop = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( pArg, "-noparallax" ) )
+		{
+			bParallax = false;
+		}
+		else if ( !V_stricmp( pArg, "-csv" ) )
+		{
+			bCSV = true;
+		}
+		else if ( pArg[0] != '-' && !pRoot )
+		{
+			pRoot = pArg;
+		}
+		else
+		{
+			bValid = false;
+		}
+
+		if ( !bValid )
+		{
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	if ( !pFXC || !pVCS || !pRoot )
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	CShaderCombos combos;
+	combos.SetTarget( "ps30" );
+	if ( !combos.ParseFile( pFXC ) || !combos.Finalize() )
+		return 1;
+
+	CVCSFile vcs;
+	if ( !vcs.Load( pVCS ) )
+		return 1;
+
+	char szRoot[MAX_PATH];
+	V_strncpy( szRoot, pRoot, sizeof( szRoot ) );
+	V_StripTrailingSlash( szRoot );
+	int nRootLength = V_strlen( szRoot );
+
+	CUtlVector< CUtlString > files;
+	AddFolder( szRoot, files );
+
+	CUtlVector< MaterialCost_t > materials;
+	int nErrors = 0;
+	for ( int i = 0; i < files.Count(); ++i )
+	{
+		const char *pPath = files[i].Get();
+		KeyValues *pMaterial = LoadMaterial( szRoot, pPath );
+		if ( !pMaterial )
+		{
+			fprintf( stderr, "error: can't load %s\n", pPath );
+			++nErrors;
+			continue;
+		}
+
+		if ( !V_stricmp( pMaterial->GetName(), "pbr" ) )
+		{
+			MaterialCost_t &material = materials[materials.AddToTail()];
+			V_strncpy( material.m_szName, pPath + nRootLength + 1, sizeof( material.m_szName ) );
+			V_StripExtension( material.m_szName, material.m_szName, sizeof( material.m_szName ) );
+			V_FixSlashes( material.m_szName, '/' );
+
+			material.m_nFeatures = GetMaterialFeatures( pMaterial, material.m_szName, bParallax );
+			material.m_nStatic = GetStaticCombo( combos, material.m_nFeatures, false, nShadowFilterMode );
+			material.m_nFlashlightStatic = GetStaticCombo( combos, material.m_nFeatures, true, nShadowFilterMode );
+			material.m_pCost = vcs.GetComboCost( material.m_nStatic );
+			material.m_pFlashlightCost = vcs.GetComboCost( material.m_nFlashlightStatic );
+			material.m_flCost = material.m_pCost ? material.m_pCost->m_flALU + flTextureWeight * material.m_pCost->m_flTexture : 0.0f;
+			material.m_flFlashlightCost = material.m_pFlashlightCost ? material.m_pFlashlightCost->m_flALU + flTextureWeight * material.m_pFlashlightCost->m_flTexture : 0.0f;
+		}
+		pMaterial->deleteThis();
+	}
+
+	materials.Sort( CompareMaterials );
+
+	if ( bCSV )
+	{
+		printf( "material,static,cost,alu,maxalu,tex,maxtex,samplers,flashlightstatic,flashlightcost,features,warnings\n" );
+	}
+	else
+	{
+		printf( "%8s %7s %7s %5s %8s %10s  %-40s %s\n", "cost", "alu", "tex", "smp", "flash", "static", "features", "material" );
+	}
+
+	int nCount = ( nTop > 0 ) ? MIN( nTop, materials.Count() ) : materials.Count();
+	int nFlagged = 0;
+	for ( int i = 0; i < materials.Count(); ++i )
+	{
+		const MaterialCost_t &material = materials[i];
+		static const ComboCost_t s_NoCost = { true, false, 0, 0.0f, 0.0f, 0, 0, 0 };
+		const ComboCost_t &cost = material.m_pCost ? *material.m_pCost : s_NoCost;
+
+		char szFeatures[256];
+		char szWarnings[256];
+		GetFeatureString( material.m_nFeatures, szFeatures, sizeof( szFeatures ) );
+		GetWarningString( material, szWarnings, sizeof( szWarnings ) );
+		nFlagged += ( szWarnings[0] != '\0' );
+		if ( i >= nCount )
+			continue;
+
+		if ( bCSV )
+		{
+			printf( "%s,%d,%.1f,%.1f,%d,%.1f,%d,%d,%d,%.1f,%s,%s\n", material.m_szName, material.m_nStatic, material.m_flCost,
+				cost.m_flALU, cost.m_nMaxALU, cost.m_flTexture, cost.m_nMaxTexture, cost.m_nSamplers,
+				material.m_nFlashlightStatic, material.m_flFlashlightCost, szFeatures, szWarnings );
+		}
+		else
+		{
+			printf( "%8.1f %7.1f %7.1f %5d %8.1f %10d  %-40s %s%s%s%s\n", material.m_flCost, cost.m_flALU, cost.m_flTexture,
+				cost.m_nSamplers, material.m_flFlashlightCost, material.m_nStatic, szFeatures, material.m_szName,
+				szWarnings[0] ? " [" : "", szWarnings, szWarnings[0] ? "]" : "" );
+		}
+	}
+
+	if ( !bCSV )
+	{
+		printf( "%d materials, %d PBR, %d flagged, %d unreadable\n", files.Count(), materials.Count(), nFlagged, nErrors );
+	}
+	return nErrors ? 1 : 0;
+}
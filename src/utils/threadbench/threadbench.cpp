@@ -0,0 +1,1503 @@
+//==================================================================================================
+//
+// threadbench: checks and times the lock free threading code of tier0, tier1 and vstdlib
+//
+// vproftrace: enters VPROF trace scopes across capture starts and stops and checks the trace that
+// gets written: every begin has its end, and the end is written when its own scope ends rather
+// than when a scope entered after the stop does. Then times a scope with the capture off and on
+// for 1, 2, 4... up to -threads threads.
+//
+// mempool: allocates and frees blocks of a CMemoryPoolMT and of a CThreadCachedMemoryPool on 1, 2,
+// 4... up to -threads threads, checking no block is handed to two threads at once, and destroys the
+// cached pool while threads that have exited still hold magazines.
+//
+// ringqueue: fills a CTSRingQueue and a CRingCallQueue past their capacity on one thread, which
+// must neither wait nor reorder, and drains the ring call queues while other threads queue calls.
+// Then pushes from 1, 2, 4... up to -threads producers to -consumers consumers, through a small
+// ring and through a CTSQueue, checking every producer's items come out in the order it pushed them.
+//
+// callqueue: queues calls from 1, 2, 4... up to -threads threads and runs them, on a CCallQueue, whose
+// functors come from the heap, and on a CArenaCallQueue, whose functors live in blocks it reuses.
+//
+// threadpool: checks that SuspendExecution() on a CWorkStealingThreadPool returns only once no job is
+// running and that none starts until ResumeExecution(), and that ExecuteToPriority() leaves serial
+// jobs below the priority queued. Then times a fork-join tree of jobs that add jobs and wait for
+// them, and the same leaves all queued from the main thread, on 1, 2, 4... up to -threads workers.
+//
+// datacache: checks a CShardedDataManager keeps to its budget and its locks, that handles of
+// destroyed resources touch nothing in the slot that was reused, and that queued evictions count as
+// used until they're destroyed, then uses it from several threads at once. Then times it against
+// a CDataManager on a workload where most uses go to a fifth of the handles, on 1, 2, 4... up to
+// -threads threads.
+//
+// Usage: threadbench vproftrace [-threads n] [-scopes n]
+//        threadbench mempool [-threads n] [-blocks n] [-rounds n]
+//        threadbench ringqueue [-threads n] [-consumers n] [-items n]
+//        threadbench callqueue [-threads n] [-calls n] [-rounds n]
+//        threadbench threadpool [-threads n] [-depth n] [-work n] [-distribute]
+//        threadbench datacache [-threads n] [-handles n] [-ops n]
+//
+//==================================================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+#include "tier0/tsctimer.h"
+#include "tier0/tslist.h"
+#include "tier0/vproftrace.h"
+#include "tier1/callqueue.h"
+#include "tier1/datamanager.h"
+#include "tier1/mempool.h"
+#include "tier1/shardeddatamanager.h"
+#include "tier1/strtools.h"
+#include "tier1/utlvector.h"
+#include "vstdlib/jobthread.h"
+#include "vstdlib/workstealingpool.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define THREADBENCH_MAX_THREADS		64
+
+static void Spin( double flSeconds )
+{
+	double flEnd = Plat_FloatTime() + flSeconds;
+	while ( Plat_FloatTime() < flEnd )
+	{
+	}
+}
+
+static bool ReadFile( const char *pFileName, CUtlVector< char > &data )
+{
+	FILE *fp = fopen( pFileName, "rb" );
+	if ( !fp )
+		return false;
+
+	fseek( fp, 0, SEEK_END );
+	long nSize = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+	data.SetCount( nSize + 1 );
+	bool bRead = ( nSize == 0 ) || ( fread( data.Base(), 1, nSize, fp ) == (size_t)nSize );
+	data[nSize] = '\0';
+	fclose( fp );
+	return bRead;
+}
+
+// Runs a function on nThreads threads at once, the calling thread being one of them
+struct ThreadRun_t
+{
+	void ( *m_pFunc )( int nThread, void *pContext );
+	void *m_pContext;
+	int m_nThread;
+};
+
+static uintp ThreadRunFunc( void *pParam )
+{
+	ThreadRun_t *pRun = (ThreadRun_t *)pParam;
+	pRun->m_pFunc( pRun->m_nThread, pRun->m_pContext );
+	return 0;
+}
+
+static void RunOnThreads( int nThreads, void ( *pFunc )( int nThread, void *pContext ), void *pContext )
+{
+	ThreadRun_t runs[THREADBENCH_MAX_THREADS];
+	ThreadHandle_t hThreads[THREADBENCH_MAX_THREADS];
+	for ( int i = 1; i < nThreads; ++i )
+	{
+		runs[i].m_pFunc = pFunc;
+		runs[i].m_pContext = pContext;
+		runs[i].m_nThread = i;
+		hThreads[i] = CreateSimpleThread( ThreadRunFunc, &runs[i] );
+	}
+	pFunc( 0, pContext );
+	for ( int i = 1; i < nThreads; ++i )
+	{
+		ThreadJoin( hThreads[i] );
+		ReleaseThreadHandle( hThreads[i] );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// VPROF trace
+//-----------------------------------------------------------------------------
+
+// Pairs the B and E events of a written trace per thread. Fills in the length of each scope in
+// the order the scopes ended, false when an end has no begin or a begin no end
+static bool ReadTraceScopes( const char *pFileName, CUtlVector< double > &lengths )
+{
+	lengths.RemoveAll();
+	CUtlVector< char > text;
+	if ( !ReadFile( pFileName, text ) )
+		return false;
+
+	CUtlVector< uint64 > threads;
+	CUtlVector< CUtlVector< double > > open;
+	for ( const char *pEvent = strstr( text.Base(), "{\"ph\":\"" ); pEvent; pEvent = strstr( pEvent + 1, "{\"ph\":\"" ) )
+	{
+		char chType = pEvent[7];
+		if ( chType != 'B' && chType != 'E' )
+			continue;
+
+		const char *pTid = strstr( pEvent, "\"tid\":" );
+		const char *pTs = strstr( pEvent, "\"ts\":" );
+		if ( !pTid || !pTs )
+			return false;
+
+		uint64 nThreadId = strtoull( pTid + 6, NULL, 10 );
+		double flTime = atof( pTs + 5 );
+		int nThread = threads.Find( nThreadId );
+		if ( nThread < 0 )
+		{
+			nThread = threads.AddToTail( nThreadId );
+			open.AddToTail();
+		}
+
+		if ( chType == 'B' )
+		{
+			open[nThread].AddToTail( flTime );
+		}
+		else
+		{
+			if ( !open[nThread].Count() )
+				return false;
+			lengths.AddToTail( flTime - open[nThread].Tail() );
+			open[nThread].RemoveMultipleFromTail( 1 );
+		}
+	}
+
+	for ( int i = 0; i < open.Count(); ++i )
+	{
+		if ( open[i].Count() )
+			return false;
+	}
+	return true;
+}
+
+#define VPROFTRACE_CHECK_FILE		"threadbench_vproftrace.json"
+#define VPROFTRACE_CHECK_HOLD		0.005		// Seconds an outer scope stays open after the inner ones end
+
+static void BeginScope( const char *pName )
+{
+	VProfTrace().BeginScope( pName, "threadbench" );
+}
+
+static void EndScope()
+{
+	VProfTrace().EndScope();
+}
+
+static void StopInsideScope()
+{
+	VProfTrace().Start();
+	BeginScope( "outer" );
+	VProfTrace().Stop();
+	BeginScope( "after stop" );
+	EndScope();
+	Spin( VPROFTRACE_CHECK_HOLD );
+	EndScope();
+}
+
+static void StopInsideNestedScopes()
+{
+	VProfTrace().Start();
+	BeginScope( "outer" );
+	BeginScope( "inner" );
+	VProfTrace().Stop();
+	BeginScope( "after stop" );
+	BeginScope( "after stop, nested" );
+	EndScope();
+	EndScope();
+	EndScope();
+	Spin( VPROFTRACE_CHECK_HOLD );
+	EndScope();
+}
+
+static void StartInsideScope()
+{
+	BeginScope( "before start" );
+	VProfTrace().Start();
+	BeginScope( "inner" );
+	EndScope();
+	Spin( VPROFTRACE_CHECK_HOLD );
+	EndScope();
+	VProfTrace().Stop();
+}
+
+static void RestartInsideScope()
+{
+	VProfTrace().Start();
+	BeginScope( "previous capture" );
+	VProfTrace().Stop();
+	VProfTrace().Start();
+	BeginScope( "inner" );
+	EndScope();
+	Spin( VPROFTRACE_CHECK_HOLD );
+	EndScope();
+	VProfTrace().Stop();
+}
+
+struct VProfTraceCheck_t
+{
+	const char *m_pName;
+	void ( *m_pFunc )();
+	int m_nScopes;				// Scopes the trace should have
+	bool m_bLastHeld;			// The last one to end stayed open for VPROFTRACE_CHECK_HOLD
+};
+
+static const VProfTraceCheck_t s_VProfTraceChecks[] =
+{
+	{ "stop inside a scope", StopInsideScope, 1, true },
+	{ "stop inside nested scopes", StopInsideNestedScopes, 2, true },
+	{ "start inside a scope", StartInsideScope, 1, false },
+	{ "restart inside a scope", RestartInsideScope, 1, false },
+};
+
+static bool RunVProfTraceChecks()
+{
+	bool bPassed = true;
+	for ( int i = 0; i < ARRAYSIZE( s_VProfTraceChecks ); ++i )
+	{
+		const VProfTraceCheck_t &check = s_VProfTraceChecks[i];
+		check.m_pFunc();
+
+		CUtlVector< double > lengths;
+		bool bWritten = VProfTrace().WriteChromeTrace( VPROFTRACE_CHECK_FILE );
+		bool bBalanced = bWritten && ReadTraceScopes( VPROFTRACE_CHECK_FILE, lengths );
+		remove( VPROFTRACE_CHECK_FILE );
+
+		// Microseconds in the trace
+		double flHeld = 1e6 * VPROFTRACE_CHECK_HOLD;
+		bool bCount = lengths.Count() == check.m_nScopes;
+		bool bHeld = lengths.Count() && ( lengths.Tail() >= 0.8 * flHeld ) == check.m_bLastHeld;
+		bool bOk = bBalanced && bCount && bHeld;
+		printf( "%-28s %s", check.m_pName, bOk ? "ok" : "FAILED" );
+		if ( !bOk )
+		{
+			printf( ": %s, %d scopes, expected %d, last %.0f us", !bWritten ? "can't write " VPROFTRACE_CHECK_FILE : ( bBalanced ? "balanced" : "unbalanced" ),
+				lengths.Count(), check.m_nScopes, lengths.Count() ? lengths.Tail() : 0.0 );
+		}
+		printf( "\n" );
+		bPassed &= bOk;
+	}
+	return bPassed;
+}
+
+static void EnterScopes( int nThread, void *pContext )
+{
+	int nScopes = *(int *)pContext;
+	for ( int i = 0; i < nScopes; ++i )
+	{
+		BeginScope( "bench" );
+		EndScope();
+	}
+}
+
+static int BenchVProfTrace( int argc, char **argv )
+{
+	int nThreads = 1;
+	int nScopes = 200000;
+	for ( int i = 0; i < argc; ++i )
+	{
+		bool bHasValue = i + 1 < argc;
+		if ( !V_stricmp( argv[i], "-threads" ) && bHasValue )
+		{
+			nThreads = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-scopes" ) && bHasValue )
+		{
+			nScopes = atoi( argv[++i] );
+		}
+		else
+		{
+			return -1;
+		}
+	}
+	nThreads = clamp( nThreads, 1, THREADBENCH_MAX_THREADS );
+	nScopes = MAX( nScopes, 1 );
+
+	bool bPassed = RunVProfTraceChecks();
+
+	printf( "\n%d scopes per thread\n", nScopes );
+	printf( "%7s %14s %14s %10s\n", "threads", "off ns/scope", "on ns/scope", "dropped" );
+	for ( int nRun = 1; nRun <= nThreads; nRun = ( nRun == nThreads ) ? nThreads + 1 : MIN( nRun * 2, nThreads ) )
+	{
+		CPreciseTimer timer;
+		timer.Start();
+		RunOnThreads( nRun, EnterScopes, &nScopes );
+		timer.End();
+		double flOff = timer.GetSeconds();
+
+		VProfTrace().Start();
+		timer.Start();
+		RunOnThreads( nRun, EnterScopes, &nScopes );
+		timer.End();
+		double flOn = timer.GetSeconds();
+		VProfTrace().Stop();
+
+		// Wall time over the scopes of one thread, what each thread sees
+		printf( "%7d %14.1f %14.1f %10d\n", nRun, 1e9 * flOff / nScopes, 1e9 * flOn / nScopes, VProfTrace().GetDroppedEventCount() );
+	}
+	return bPassed ? 0 : 1;
+}
+
+//-----------------------------------------------------------------------------
+// Memory pools
+//-----------------------------------------------------------------------------
+#define MEMPOOL_BENCH_BLOCK_SIZE	64
+
+template< class POOL >
+struct MemPoolRun_t
+{
+	POOL *m_pPool;
+	int m_nBlocks;				// Held at once by each thread
+	int m_nRounds;
+	CInterlockedInt m_nErrors;
+};
+
+// Each thread allocates its blocks, stamps them, and checks the stamps before freeing them
+template< class POOL >
+static void AllocBlocks( int nThread, void *pContext )
+{
+	MemPoolRun_t< POOL > *pRun = (MemPoolRun_t< POOL > *)pContext;
+	CUtlVector< int * > blocks;
+	blocks.EnsureCapacity( pRun->m_nBlocks );
+	for ( int nRound = 0; nRound < pRun->m_nRounds; ++nRound )
+	{
+		blocks.RemoveAll();
+		for ( int i = 0; i < pRun->m_nBlocks; ++i )
+		{
+			int *pBlock = (int *)pRun->m_pPool->Alloc();
+			pBlock[0] = nThread;
+			pBlock[1] = i;
+			blocks.AddToTail( pBlock );
+		}
+		for ( int i = 0; i < blocks.Count(); ++i )
+		{
+			if ( blocks[i][0] != nThread || blocks[i][1] != i )
+			{
+				++pRun->m_nErrors;
+			}
+			pRun->m_pPool->Free( blocks[i] );
+		}
+	}
+}
+
+template< class POOL >
+static double TimeMemPool( int nThreads, int nBlocks, int nRounds, int &nErrors )
+{
+	POOL pool( MEMPOOL_BENCH_BLOCK_SIZE, 1024, CUtlMemoryPool::GROW_FAST, "threadbench" );
+	MemPoolRun_t< POOL > run;
+	run.m_pPool = &pool;
+	run.m_nBlocks = nBlocks;
+	run.m_nRounds = nRounds;
+	run.m_nErrors = 0;
+
+	CPreciseTimer timer;
+	timer.Start();
+	RunOnThreads( nThreads, AllocBlocks< POOL >, &run );
+	timer.End();
+	double flTime = timer.GetSeconds();
+	nErrors += run.m_nErrors;
+	return flTime;
+}
+
+static int BenchMemPool( int argc, char **argv )
+{
+	int nThreads = 64;
+	int nBlocks = 100;
+	int nRounds = 2000;
+	for ( int i = 0; i < argc; ++i )
+	{
+		bool bHasValue = i + 1 < argc;
+		if ( !V_stricmp( argv[i], "-threads" ) && bHasValue )
+		{
+			nThreads = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-blocks" ) && bHasValue )
+		{
+			nBlocks = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-rounds" ) && bHasValue )
+		{
+			nRounds = atoi( argv[++i] );
+		}
+		else
+		{
+			return -1;
+		}
+	}
+	nThreads = clamp( nThreads, 1, THREADBENCH_MAX_THREADS );
+	nBlocks = MAX( nBlocks, 2 );
+	nRounds = MAX( nRounds, 1 );
+
+	printf( "%d byte blocks, %d held per thread, %d rounds, %d cpus\n", MEMPOOL_BENCH_BLOCK_SIZE, nBlocks, nRounds, (int)GetCPUInformation().m_nLogicalProcessors );
+	printf( "%7s %14s %14s %8s\n", "threads", "mt ns/block", "cached ns/block", "speedup" );
+	int nErrors = 0;
+	for ( int nRun = 1; nRun <= nThreads; nRun = ( nRun == nThreads ) ? nThreads + 1 : MIN( nRun * 2, nThreads ) )
+	{
+		// An alloc and a free per block, over the blocks of one thread
+		double flBlocks = (double)nBlocks * nRounds;
+		double flLocked = TimeMemPool< CMemoryPoolMT >( nRun, nBlocks, nRounds, nErrors );
+		double flCached = TimeMemPool< CThreadCachedMemoryPool >( nRun, nBlocks, nRounds, nErrors );
+		printf( "%7d %14.1f %14.1f %7.2fx\n", nRun, 1e9 * flLocked / flBlocks, 1e9 * flCached / flBlocks, flLocked / flCached );
+	}
+	// Each TimeMemPool< CThreadCachedMemoryPool > above also destroyed its pool while the exited
+	// threads still held magazines, which is what a leak checker run of this would look at
+	printf( "%s: %d blocks handed out twice\n", nErrors ? "FAILED" : "ok", nErrors );
+	return nErrors ? 1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Ring queue
+//-----------------------------------------------------------------------------
+#define RINGQUEUE_CHECK_CAPACITY	16
+#define RINGQUEUE_CHECK_ITEMS		( 5 * RINGQUEUE_CHECK_CAPACITY )
+
+static CUtlVector< int > s_RingCalls;
+
+static void RingCall( int nCall )
+{
+	s_RingCalls.AddToTail( nCall );
+}
+
+// One thread pushing past the ring used to wait forever for a pop that only it could do
+static bool RunRingQueueChecks()
+{
+	CTSRingQueue< intp, RINGQUEUE_CHECK_CAPACITY > queue;
+	for ( int i = 0; i < RINGQUEUE_CHECK_ITEMS; ++i )
+	{
+		queue.PushItem( i );
+	}
+	bool bOverflowed = queue.Count() == RINGQUEUE_CHECK_ITEMS && queue.OverflowCount() == RINGQUEUE_CHECK_ITEMS - RINGQUEUE_CHECK_CAPACITY;
+
+	// Room in the ring again, but the overflow is older
+	intp nItem = -1;
+	queue.PopItem( &nItem );
+	bool bBounded = ( nItem == 0 ) && !queue.TryPushItem( RINGQUEUE_CHECK_ITEMS );
+	queue.PushItem( RINGQUEUE_CHECK_ITEMS );
+
+	bool bOrdered = true;
+	intp items[7];
+	int nNext = 1;
+	for ( int nPopped; ( nPopped = queue.PopItems( items, ARRAYSIZE( items ) ) ) != 0; )
+	{
+		for ( int i = 0; i < nPopped; ++i )
+		{
+			bOrdered &= ( items[i] == nNext++ );
+		}
+	}
+	bOrdered &= ( nNext == RINGQUEUE_CHECK_ITEMS + 1 ) && queue.Count() == 0 && queue.OverflowCount() == 0;
+	bool bOk = bOverflowed && bBounded && bOrdered;
+	printf( "%-28s %s\n", "ring queue past capacity", bOk ? "ok" : "FAILED" );
+
+	CRingCallQueue< RINGQUEUE_CHECK_CAPACITY > callQueue;
+	s_RingCalls.RemoveAll();
+	for ( int i = 0; i < RINGQUEUE_CHECK_ITEMS; ++i )
+	{
+		callQueue.QueueCall( RingCall, i );
+	}
+	callQueue.CallQueued();
+	bool bCalled = s_RingCalls.Count() == RINGQUEUE_CHECK_ITEMS && callQueue.Count() == 0;
+	for ( int i = 0; bCalled && i < RINGQUEUE_CHECK_ITEMS; ++i )
+	{
+		bCalled = ( s_RingCalls[i] == i );
+	}
+	printf( "%-28s %s\n", "call queue past capacity", bCalled ? "ok" : "FAILED" );
+	return bOk && bCalled;
+}
+
+#define RINGQUEUE_DRAIN_PRODUCERS	3
+#define RINGQUEUE_DRAIN_CALLS		20000		// Per producer
+
+static CInterlockedInt s_nRingDrainCalls;
+
+static void RingDrainCall( int nCall )
+{
+	++s_nRingDrainCalls;
+}
+
+template< class QUEUE >
+struct RingDrainRun_t
+{
+	QUEUE m_Queue;
+	CInterlockedInt m_nProducing;
+};
+
+// Thread 0 drains for as long as the others queue
+template< class QUEUE >
+static void RingDrainThread( int nThread, void *pContext )
+{
+	RingDrainRun_t< QUEUE > *pRun = (RingDrainRun_t< QUEUE > *)pContext;
+	if ( !nThread )
+	{
+		while ( pRun->m_nProducing )
+		{
+			pRun->m_Queue.CallQueued();
+		}
+		return;
+	}
+
+	for ( int i = 0; i < RINGQUEUE_DRAIN_CALLS; ++i )
+	{
+		pRun->m_Queue.QueueCall( RingDrainCall, i );
+	}
+	--pRun->m_nProducing;
+}
+
+// A drain that saw a cell claimed and not yet written used to stop there and leave its end marker
+// behind, so every later drain ended at a stale one and ran the calls before it one drain late
+template< class QUEUE >
+static bool RunRingDrainCheck( const char *pName )
+{
+	RingDrainRun_t< QUEUE > *pRun = new RingDrainRun_t< QUEUE >;
+	pRun->m_nProducing = RINGQUEUE_DRAIN_PRODUCERS;
+	s_nRingDrainCalls = 0;
+	RunOnThreads( RINGQUEUE_DRAIN_PRODUCERS + 1, RingDrainThread< QUEUE >, pRun );
+
+	// Nothing queuing now, one drain runs the rest
+	pRun->m_Queue.CallQueued();
+	int nCalled = s_nRingDrainCalls;
+	int nLeft = pRun->m_Queue.Count();
+	delete pRun;
+
+	bool bOk = ( nCalled == RINGQUEUE_DRAIN_PRODUCERS * RINGQUEUE_DRAIN_CALLS ) && !nLeft;
+	printf( "%-28s %s", pName, bOk ? "ok" : "FAILED" );
+	if ( !bOk )
+	{
+		printf( ": %d of %d run, %d left queued", nCalled, RINGQUEUE_DRAIN_PRODUCERS * RINGQUEUE_DRAIN_CALLS, nLeft );
+	}
+	printf( "\n" );
+	return bOk;
+}
+
+#define RINGQUEUE_BENCH_CAPACITY	64
+
+typedef CTSRingQueue< intp, RINGQUEUE_BENCH_CAPACITY > BenchRingQueue_t;
+typedef CTSQueue< intp > BenchListQueue_t;
+
+// Each the way it's meant to be drained, the ring a run of cells at a time
+static int PopBenchItems( BenchRingQueue_t &queue, intp *pItems, int nMaxItems )
+{
+	return queue.PopItems( pItems, nMaxItems );
+}
+
+static int PopBenchItems( BenchListQueue_t &queue, intp *pItems, int nMaxItems )
+{
+	int nPopped = 0;
+	while ( nPopped < nMaxItems && queue.PopItem( &pItems[nPopped] ) )
+	{
+		nPopped++;
+	}
+	return nPopped;
+}
+
+template< class QUEUE >
+struct RingQueueRun_t
+{
+	QUEUE m_Queue;
+	int m_nConsumers;
+	int m_nItems;				// Per producer
+	CInterlockedInt m_nLeft;
+	CInterlockedInt m_nErrors;
+};
+
+// The first m_nConsumers threads consume, the rest produce items numbered by producer in the high
+// bits. Each consumer has to see any one producer's items in the order they were pushed
+template< class QUEUE >
+static void RingQueueThread( int nThread, void *pContext )
+{
+	RingQueueRun_t< QUEUE > *pRun = (RingQueueRun_t< QUEUE > *)pContext;
+	if ( nThread >= pRun->m_nConsumers )
+	{
+		for ( int i = 0; i < pRun->m_nItems; ++i )
+		{
+			pRun->m_Queue.PushItem( ( (intp)nThread << 24 ) | i );
+		}
+		return;
+	}
+
+	int nLast[THREADBENCH_MAX_THREADS];
+	for ( int i = 0; i < THREADBENCH_MAX_THREADS; ++i )
+	{
+		nLast[i] = -1;
+	}
+	int nErrors = 0;
+	intp items[16];
+	while ( pRun->m_nLeft > 0 )
+	{
+		int nPopped = PopBenchItems( pRun->m_Queue, items, ARRAYSIZE( items ) );
+		if ( !nPopped )
+		{
+			ThreadPause();
+			continue;
+		}
+		for ( int i = 0; i < nPopped; ++i )
+		{
+			int nProducer = (int)( items[i] >> 24 );
+			int nItem = (int)( items[i] & 0xffffff );
+			if ( nItem <= nLast[nProducer] )
+			{
+				nErrors++;
+			}
+			nLast[nProducer] = nItem;
+		}
+		pRun->m_nLeft -= nPopped;
+	}
+	pRun->m_nErrors += nErrors;
+}
+
+// Nanoseconds per item, over every producer's items
+template< class QUEUE >
+static double TimeRingQueue( int nProducers, int nConsumers, int nItems, int &nLeft, int &nErrors )
+{
+	RingQueueRun_t< QUEUE > *pRun = new RingQueueRun_t< QUEUE >;
+	pRun->m_nConsumers = nConsumers;
+	pRun->m_nItems = nItems;
+	pRun->m_nLeft = nProducers * nItems;
+	pRun->m_nErrors = 0;
+
+	CPreciseTimer timer;
+	timer.Start();
+	RunOnThreads( nConsumers + nProducers, RingQueueThread< QUEUE >, pRun );
+	timer.End();
+	double flTime = timer.GetSeconds();
+
+	nLeft += pRun->m_Queue.Count();
+	nErrors += pRun->m_nErrors;
+	delete pRun;
+	return 1e9 * flTime / ( (double)nProducers * nItems );
+}
+
+static int BenchRingQueue( int argc, char **argv )
+{
+	int nThreads = 8;
+	int nConsumers = 1;
+	int nItems = 200000;
+	for ( int i = 0; i < argc; ++i )
+	{
+		bool bHasValue = i + 1 < argc;
+		if ( !V_stricmp( argv[i], "-threads" ) && bHasValue )
+		{
+			nThreads = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-consumers" ) && bHasValue )
+		{
+			nConsumers = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-items" ) && bHasValue )
+		{
+			nItems = atoi( argv[++i] );
+		}
+		else
+		{
+			return -1;
+		}
+	}
+	// Producers, the consumers are more threads
+	nConsumers = clamp( nConsumers, 1, THREADBENCH_MAX_THREADS - 1 );
+	nThreads = clamp( nThreads, 1, THREADBENCH_MAX_THREADS - nConsumers );
+	nItems = clamp( nItems, 1, 0xffffff );
+
+	bool bPassed = RunRingQueueChecks();
+	bPassed &= RunRingDrainCheck< CRingCallQueue< RINGQUEUE_CHECK_CAPACITY > >( "call queue drained queuing" );
+	bPassed &= RunRingDrainCheck< CArenaCallQueueT< CTSRingQueue< CFunctor *, RINGQUEUE_CHECK_CAPACITY > > >( "arena queue drained queuing" );
+
+	printf( "\n%d items per producer, ring of %d, %d consumer%s, ns per item\n", nItems, RINGQUEUE_BENCH_CAPACITY, nConsumers, ( nConsumers == 1 ) ? "" : "s" );
+	printf( "%9s %10s %10s %8s %10s %10s\n", "producers", "ring", "CTSQueue", "speedup", "left", "reordered" );
+	for ( int nRun = 1; nRun <= nThreads; nRun = ( nRun == nThreads ) ? nThreads + 1 : MIN( nRun * 2, nThreads ) )
+	{
+		int nLeft = 0;
+		int nErrors = 0;
+		double flRing = TimeRingQueue< BenchRingQueue_t >( nRun, nConsumers, nItems, nLeft, nErrors );
+		double flList = TimeRingQueue< BenchListQueue_t >( nRun, nConsumers, nItems, nLeft, nErrors );
+		printf( "%9d %10.1f %10.1f %7.2fx %10d %10d\n", nRun, flRing, flList, flList / flRing, nLeft, nErrors );
+		bPassed &= ( nErrors == 0 && nLeft == 0 );
+	}
+	return bPassed ? 0 : 1;
+}
+
+//-----------------------------------------------------------------------------
+// Call queues
+//-----------------------------------------------------------------------------
+static CInterlockedInt s_nQueuedCalls;
+
+// A few arguments, about what a render call queues
+static void QueuedCall( int nThread, int nCall, float flValue, const char *pName )
+{
+	++s_nQueuedCalls;
+}
+
+template< class QUEUE >
+struct CallQueueRun_t
+{
+	QUEUE *m_pQueue;
+	int m_nCalls;				// Per thread
+};
+
+template< class QUEUE >
+static void QueueCalls( int nThread, void *pContext )
+{
+	CallQueueRun_t< QUEUE > *pRun = (CallQueueRun_t< QUEUE > *)pContext;
+	for ( int i = 0; i < pRun->m_nCalls; ++i )
+	{
+		pRun->m_pQueue->QueueCall( QueuedCall, nThread, i, 1.0f, (const char *)"threadbench" );
+	}
+}
+
+// Seconds to queue and seconds to run, over all rounds
+template< class QUEUE >
+static void TimeCallQueue( int nThreads, int nCalls, int nRounds, double &flQueue, double &flRun, bool &bCalled )
+{
+	QUEUE *pQueue = new QUEUE;
+	CallQueueRun_t< QUEUE > run;
+	run.m_pQueue = pQueue;
+	run.m_nCalls = nCalls;
+
+	flQueue = flRun = 0;
+	for ( int nRound = 0; nRound < nRounds; ++nRound )
+	{
+		s_nQueuedCalls = 0;
+		CPreciseTimer queueTimer, runTimer;
+		queueTimer.Start();
+		RunOnThreads( nThreads, QueueCalls< QUEUE >, &run );
+		queueTimer.End();
+		runTimer.Start();
+		pQueue->CallQueued();
+		runTimer.End();
+		flQueue += queueTimer.GetSeconds();
+		flRun += runTimer.GetSeconds();
+		bCalled &= ( s_nQueuedCalls == nThreads * nCalls );
+	}
+	delete pQueue;
+}
+
+static int BenchCallQueue( int argc, char **argv )
+{
+	int nThreads = 8;
+	int nCalls = 2000;
+	int nRounds = 200;
+	for ( int i = 0; i < argc; ++i )
+	{
+		bool bHasValue = i + 1 < argc;
+		if ( !V_stricmp( argv[i], "-threads" ) && bHasValue )
+		{
+			nThreads = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-calls" ) && bHasValue )
+		{
+			nCalls = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-rounds" ) && bHasValue )
+		{
+			nRounds = atoi( argv[++i] );
+		}
+		else
+		{
+			return -1;
+		}
+	}
+	nThreads = clamp( nThreads, 1, THREADBENCH_MAX_THREADS );
+	nCalls = MAX( nCalls, 1 );
+	nRounds = MAX( nRounds, 1 );
+
+	printf( "%d calls per thread, %d rounds, ns per call to queue / to run\n", nCalls, nRounds );
+	printf( "%7s %18s %18s %8s\n", "threads", "heap", "arena", "speedup" );
+	bool bCalled = true;
+	for ( int nRun = 1; nRun <= nThreads; nRun = ( nRun == nThreads ) ? nThreads + 1 : MIN( nRun * 2, nThreads ) )
+	{
+		double flHeapQueue, flHeapRun, flArenaQueue, flArenaRun;
+		TimeCallQueue< CCallQueue >( nRun, nCalls, nRounds, flHeapQueue, flHeapRun, bCalled );
+		TimeCallQueue< CArenaCallQueue >( nRun, nCalls, nRounds, flArenaQueue, flArenaRun, bCalled );
+
+		// Queuing is timed across the threads, running on the one that calls CallQueued()
+		double flCalls = (double)nRun * nCalls * nRounds;
+		printf( "%7d %8.1f / %7.1f %8.1f / %7.1f %7.2fx\n", nRun, 1e9 * flHeapQueue / flCalls, 1e9 * flHeapRun / flCalls,
+			1e9 * flArenaQueue / flCalls, 1e9 * flArenaRun / flCalls, ( flHeapQueue + flHeapRun ) / ( flArenaQueue + flArenaRun ) );
+	}
+	printf( "%s\n", bCalled ? "ok: every call queued ran" : "FAILED: calls lost" );
+	return bCalled ? 0 : 1;
+}
+
+//-----------------------------------------------------------------------------
+// Work stealing thread pool
+//-----------------------------------------------------------------------------
+#define THREADPOOL_CHECK_WORKERS	4
+#define THREADPOOL_CHECK_JOBS		200
+#define THREADPOOL_CHECK_JOB_TIME	0.0005
+#define THREADPOOL_CHECK_HOLD		0.02		// Seconds the pool stays suspended
+
+static IThreadPool *s_pBenchPool;
+static CInterlockedInt s_nJobsRunning;
+static CInterlockedInt s_nJobsRun;
+
+static void TimedJob()
+{
+	++s_nJobsRunning;
+	Spin( THREADPOOL_CHECK_JOB_TIME );
+	--s_nJobsRunning;
+	++s_nJobsRun;
+}
+
+static bool RunThreadPoolChecks()
+{
+	IThreadPool *pPool = CreateWorkStealingThreadPool();
+	ThreadPoolStartParams_t params;
+	params.nThreads = THREADPOOL_CHECK_WORKERS;
+	pPool->Start( params );
+
+	s_nJobsRunning = 0;
+	s_nJobsRun = 0;
+	CUtlVector< CJob * > jobs;
+	for ( int i = 0; i < THREADPOOL_CHECK_JOBS; ++i )
+	{
+		jobs.AddToTail( pPool->QueueCall( TimedJob ) );
+	}
+
+	// Suspended with jobs still queued, the ones running finish first
+	Spin( 10 * THREADPOOL_CHECK_JOB_TIME );
+	pPool->SuspendExecution();
+	int nRunning = s_nJobsRunning;
+	int nRun = s_nJobsRun;
+	Spin( THREADPOOL_CHECK_HOLD );
+	int nRunSuspended = s_nJobsRun - nRun;
+	bool bPending = false;
+	for ( int i = 0; i < jobs.Count(); ++i )
+	{
+		bPending |= ( jobs[i]->GetStatus() == JOB_STATUS_PENDING );
+	}
+	pPool->ResumeExecution();
+
+	pPool->YieldWait( jobs.Base(), jobs.Count() );
+	bool bAllRun = ( s_nJobsRun == THREADPOOL_CHECK_JOBS );
+	for ( int i = 0; i < jobs.Count(); ++i )
+	{
+		jobs[i]->Release();
+	}
+	DestroyWorkStealingThreadPool( pPool );
+
+	bool bOk = ( nRunning == 0 ) && ( nRunSuspended == 0 ) && bPending && bAllRun;
+	printf( "%-28s %s", "suspend and resume", bOk ? "ok" : "FAILED" );
+	if ( !bOk )
+	{
+		printf( ": %d running once suspended, %d run while suspended, %s pending, %d of %d run", nRunning, nRunSuspended,
+			bPending ? "some" : "none", (int)s_nJobsRun, THREADPOOL_CHECK_JOBS );
+	}
+	printf( "\n" );
+	return bOk;
+}
+
+static void PriorityJob()
+{
+	++s_nJobsRun;
+}
+
+static CJob *AddSerialJob( IThreadPool *pPool, JobPriority_t priority )
+{
+	CJob *pJob = new CFunctorJob( CreateFunctor( PriorityJob ) );
+	pJob->SetFlags( JF_SERIAL );
+	pJob->SetPriority( priority );
+	pPool->AddJob( pJob );
+	return pJob;
+}
+
+// Serial jobs used to be taken ahead of the priority loop, so this ran the low one too
+static bool RunThreadPoolPriorityCheck()
+{
+	IThreadPool *pPool = CreateWorkStealingThreadPool();
+	ThreadPoolStartParams_t params;
+	params.nThreads = 1;
+	pPool->Start( params );
+
+	// Held so only ExecuteToPriority() below runs anything
+	pPool->SuspendExecution();
+	s_nJobsRun = 0;
+	CJob *pLow = AddSerialJob( pPool, JP_LOW );
+	CJob *pHigh = AddSerialJob( pPool, JP_HIGH );
+	int nExecuted = pPool->ExecuteToPriority( JP_HIGH );
+	bool bOk = ( nExecuted == 1 ) && pHigh->IsFinished() && !pLow->IsFinished();
+	pPool->ResumeExecution();
+
+	CJob *jobs[] = { pLow, pHigh };
+	pPool->YieldWait( jobs, ARRAYSIZE( jobs ) );
+	bOk &= ( s_nJobsRun == 2 );
+	pLow->Release();
+	pHigh->Release();
+	DestroyWorkStealingThreadPool( pPool );
+
+	printf( "%-28s %s\n", "serial jobs by priority", bOk ? "ok" : "FAILED" );
+	return bOk;
+}
+
+static void LeafWork( int nWork )
+{
+	volatile int nSum = 0;
+	for ( int i = 0; i < nWork; ++i )
+	{
+		nSum += i;
+	}
+	++s_nJobsRun;
+}
+
+// Two jobs per level that each add two more and wait for them
+static void ForkJob( int nDepth, int nWork )
+{
+	if ( !nDepth )
+	{
+		LeafWork( nWork );
+		return;
+	}
+
+	CJob *pJobs[2];
+	pJobs[0] = s_pBenchPool->QueueCall( ForkJob, nDepth - 1, nWork );
+	pJobs[1] = s_pBenchPool->QueueCall( ForkJob, nDepth - 1, nWork );
+	s_pBenchPool->YieldWait( pJobs, 2 );
+	pJobs[0]->Release();
+	pJobs[1]->Release();
+}
+
+static int BenchThreadPool( int argc, char **argv )
+{
+	int nThreads = 8;
+	int nDepth = 14;
+	int nWork = 2000;
+	bool bDistribute = false;
+	for ( int i = 0; i < argc; ++i )
+	{
+		bool bHasValue = i + 1 < argc;
+		if ( !V_stricmp( argv[i], "-threads" ) && bHasValue )
+		{
+			nThreads = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-depth" ) && bHasValue )
+		{
+			nDepth = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-work" ) && bHasValue )
+		{
+			nWork = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-distribute" ) )
+		{
+			bDistribute = true;
+		}
+		else
+		{
+			return -1;
+		}
+	}
+	nThreads = clamp( nThreads, 1, TP_MAX_POOL_THREADS );
+	nDepth = clamp( nDepth, 1, 20 );
+	nWork = MAX( nWork, 1 );
+
+	bool bPassed = RunThreadPoolChecks();
+	bPassed &= RunThreadPoolPriorityCheck();
+
+	// Workers don't count the thread that waits, which helps with the jobs
+	int nLeaves = 1 << nDepth;
+	CUtlVector< CJob * > jobs;
+	jobs.SetCount( nLeaves );
+
+	printf( "\n%d leaves of %d adds, %d cpus\n", nLeaves, nWork, (int)GetCPUInformation().m_nLogicalProcessors );
+	printf( "%7s %10s %8s %10s %8s\n", "workers", "fork ms", "speedup", "flat ms", "speedup" );
+	double flForkOne = 0, flFlatOne = 0;
+	for ( int nRun = 1; nRun <= nThreads; nRun = ( nRun == nThreads ) ? nThreads + 1 : MIN( nRun * 2, nThreads ) )
+	{
+		s_pBenchPool = CreateWorkStealingThreadPool();
+		ThreadPoolStartParams_t params;
+		params.nThreads = nRun;
+		params.fDistribute = bDistribute ? TRS_TRUE : TRS_FALSE;
+		s_pBenchPool->Start( params );
+
+		s_nJobsRun = 0;
+		CPreciseTimer timer;
+		timer.Start();
+		ForkJob( nDepth, nWork );
+		timer.End();
+		double flFork = timer.GetSeconds();
+		bPassed &= ( s_nJobsRun == nLeaves );
+
+		s_nJobsRun = 0;
+		timer.Start();
+		for ( int i = 0; i < nLeaves; ++i )
+		{
+			jobs[i] = s_pBenchPool->QueueCall( LeafWork, nWork );
+		}
+		s_pBenchPool->YieldWait( jobs.Base(), nLeaves );
+		timer.End();
+		double flFlat = timer.GetSeconds();
+		bPassed &= ( s_nJobsRun == nLeaves );
+		for ( int i = 0; i < nLeaves; ++i )
+		{
+			jobs[i]->Release();
+		}
+
+		DestroyWorkStealingThreadPool( s_pBenchPool );
+		s_pBenchPool = NULL;
+
+		if ( nRun == 1 )
+		{
+			flForkOne = flFork;
+			flFlatOne = flFlat;
+		}
+		printf( "%7d %10.1f %7.2fx %10.1f %7.2fx\n", nRun, 1e3 * flFork, flForkOne / flFork, 1e3 * flFlat, flFlatOne / flFlat );
+	}
+	return bPassed ? 0 : 1;
+}
+
+//-----------------------------------------------------------------------------
+// Data caches
+//-----------------------------------------------------------------------------
+#define DATACACHE_CHECK_SIZE		100			// Bytes per resource in the checks
+#define DATACACHE_CHECK_BUDGET		( 16 * 10 * DATACACHE_CHECK_SIZE )		// 10 resources per shard
+#define DATACACHE_CHECK_THREADS		4
+#define DATACACHE_CHECK_OPS			100000
+#define DATACACHE_BENCH_SIZE		1024
+#define DATACACHE_BENCH_BUDGET		( 4 * 1024 * 1024 )
+
+static CInterlockedInt s_nCacheBlobs;
+
+// A resource of some bytes, the first one set while it's alive
+class CCacheBlob
+{
+public:
+	static CCacheBlob *CreateResource( const int &nSize )
+	{
+		CCacheBlob *pBlob = new CCacheBlob;
+		pBlob->m_nSize = nSize;
+		pBlob->m_pData = new char[nSize];
+		pBlob->m_pData[0] = 1;
+		++s_nCacheBlobs;
+		return pBlob;
+	}
+	static unsigned int EstimatedSize( const int &nSize )	{ return nSize; }
+
+	void DestroyResource()
+	{
+		--s_nCacheBlobs;
+		delete [] m_pData;
+		delete this;
+	}
+	unsigned int Size()										{ return m_nSize; }
+	CCacheBlob *GetData()									{ return this; }
+
+	unsigned int m_nSize;
+	char *m_pData;
+};
+
+typedef CDataManager< CCacheBlob, int, CCacheBlob *, CThreadFastMutex > DataCache_t;
+typedef CShardedDataManager< CCacheBlob, int > ShardedDataCache_t;
+
+class CEvictionCounter : public ShardedDataCache_t::IEvictionListener
+{
+public:
+	CEvictionCounter() : m_nEvicted( 0 ), m_nDestroyed( 0 ) {}
+
+	virtual void OnResourceEvicted( memhandle_t hMem, CCacheBlob *pBlob )
+	{
+		++m_nEvicted;
+		if ( pBlob->m_pData[0] != 1 )
+		{
+			++m_nDestroyed;
+		}
+	}
+
+	CInterlockedInt m_nEvicted;
+	CInterlockedInt m_nDestroyed;		// Heard of after they were destroyed
+};
+
+static void PrintDataCacheCheck( const char *pName, bool bOk )
+{
+	printf( "%-28s %s\n", pName, bOk ? "ok" : "FAILED" );
+}
+
+// Handles after the first of a list are in the order given
+static bool IsLRUOrder( ShardedDataCache_t &cache, memhandle_t hFirst, memhandle_t hSecond )
+{
+	CUtlVector< memhandle_t > list;
+	cache.GetLRUHandleList( list );
+	return list.Count() == 2 && list[0] == hFirst && list[1] == hSecond;
+}
+
+static bool RunDataCacheSingleThreadChecks()
+{
+	bool bPassed = true;
+
+	// Creating past the budget evicts, the oldest first
+	{
+		ShardedDataCache_t cache( DATACACHE_CHECK_BUDGET );
+		CUtlVector< memhandle_t > handles;
+		for ( int i = 0; i < 1000; ++i )
+		{
+			handles.AddToTail( cache.CreateResource( DATACACHE_CHECK_SIZE ) );
+		}
+		bool bOk = cache.UsedSize() <= cache.TargetSize() && s_nCacheBlobs == (int)( cache.UsedSize() / DATACACHE_CHECK_SIZE );
+		bOk &= !cache.LockResource( handles[0] ) && cache.LockResource( handles[999] ) && !cache.UnlockResource( handles[999] );
+		bOk &= !cache.LockResource( INVALID_MEMHANDLE ) && !cache.LockResource( (memhandle_t)0 );
+		PrintDataCacheCheck( "budget", bOk );
+		bPassed &= bOk;
+	}
+
+	// Locked ones aren't evicted, destroyed ones stop resolving
+	{
+		ShardedDataCache_t cache( DATACACHE_CHECK_BUDGET );
+		memhandle_t hLocked = cache.CreateResource( DATACACHE_CHECK_SIZE, true );
+		for ( int i = 0; i < 1000; ++i )
+		{
+			cache.CreateResource( DATACACHE_CHECK_SIZE );
+		}
+		int nCount = 0;
+		cache.LockResourceReturnCount( &nCount, hLocked );
+		bool bOk = cache.GetResource_NoLockNoLRUTouch( hLocked ) && nCount == 2 && cache.UnlockResource( hLocked ) == 1;
+		CUtlVector< memhandle_t > locked;
+		cache.GetLockHandleList( locked );
+		bOk &= locked.Count() == 1 && locked[0] == hLocked && cache.UnlockResource( hLocked ) == 0;
+		cache.DestroyResource( hLocked );
+		bOk &= !cache.LockResource( hLocked );
+		cache.FlushAllUnlocked();
+		bOk &= cache.UsedSize() == 0;
+		PrintDataCacheCheck( "locks and destroy", bOk );
+		bPassed &= bOk;
+	}
+
+	// A handle to a slot that was reused touches nothing
+	{
+		ShardedDataCache_t cache( DATACACHE_CHECK_BUDGET );
+		memhandle_t hStale = cache.CreateResourceInShard( DATACACHE_CHECK_SIZE, 0 );
+		cache.DestroyResource( hStale );
+		memhandle_t hReused = cache.CreateResourceInShard( DATACACHE_CHECK_SIZE, 0 );
+		memhandle_t hOther = cache.CreateResourceInShard( DATACACHE_CHECK_SIZE, 0 );
+		bool bOk = hReused != hStale && ( (uintp)hReused & 0xffff ) == ( (uintp)hStale & 0xffff );
+		cache.MarkAsStale( hOther );
+		cache.MarkAsStale( hStale );
+		bOk &= IsLRUOrder( cache, hOther, hReused );
+		cache.MarkAsStale( hReused );
+		cache.TouchResource( hOther );
+		cache.TouchResource( hStale );
+		bOk &= !cache.GetResource_NoLock( hStale ) && IsLRUOrder( cache, hReused, hOther );
+		PrintDataCacheCheck( "stale handles", bOk );
+		bPassed &= bOk;
+	}
+
+	// What's touched between evictions stays
+	{
+		ShardedDataCache_t cache( 16 * 64 * DATACACHE_CHECK_SIZE );
+		CUtlVector< memhandle_t > hot;
+		for ( int i = 0; i < 256; ++i )
+		{
+			hot.AddToTail( cache.CreateResource( DATACACHE_CHECK_SIZE ) );
+		}
+		for ( int nRound = 0; nRound < 20; ++nRound )
+		{
+			for ( int i = 0; i < hot.Count(); ++i )
+			{
+				cache.TouchResource( hot[i] );
+			}
+			for ( int i = 0; i < 200; ++i )
+			{
+				cache.CreateResource( DATACACHE_CHECK_SIZE );
+			}
+		}
+		int nHot = 0;
+		for ( int i = 0; i < hot.Count(); ++i )
+		{
+			nHot += cache.GetResource_NoLockNoLRUTouch( hot[i] ) ? 1 : 0;
+		}
+		bool bOk = nHot > 200;
+		printf( "%-28s %s: %d of %d kept\n", "touched kept", bOk ? "ok" : "FAILED", nHot, hot.Count() );
+		bPassed &= bOk;
+	}
+
+	// Evictions queued until ProcessEvictions() still count as used
+	{
+		CEvictionCounter counter;
+		ShardedDataCache_t cache( DATACACHE_CHECK_BUDGET );
+		cache.SetEvictionListener( &counter );
+		cache.SetAsyncEviction( true );
+		for ( int i = 0; i < 1000; ++i )
+		{
+			cache.CreateResource( DATACACHE_CHECK_SIZE );
+		}
+		bool bOk = cache.PendingEvictionSize() > 0 && counter.m_nEvicted == 0;
+		bOk &= cache.UsedSize() == (unsigned)s_nCacheBlobs * DATACACHE_CHECK_SIZE && cache.UsedSize() > cache.TargetSize();
+		int nProcessed = cache.ProcessEvictions();
+		bOk &= nProcessed == counter.m_nEvicted && counter.m_nDestroyed == 0 && cache.PendingEvictionSize() == 0;
+		bOk &= cache.UsedSize() == (unsigned)s_nCacheBlobs * DATACACHE_CHECK_SIZE && cache.UsedSize() <= cache.TargetSize();
+		printf( "%-28s %s: %d evicted\n", "async eviction", bOk ? "ok" : "FAILED", nProcessed );
+		bPassed &= bOk;
+	}
+
+	bool bFreed = ( s_nCacheBlobs == 0 );
+	PrintDataCacheCheck( "all destroyed", bFreed );
+	return bPassed && bFreed;
+}
+
+struct DataCacheCheckRun_t
+{
+	ShardedDataCache_t *m_pCache;
+	CInterlockedInt m_nWorking;
+};
+
+// Thread 0 destroys the queued evictions, the others create, lock, touch and destroy their own
+// resources, and touch and mark stale the handles of ones they destroyed
+static void DataCacheCheckThread( int nThread, void *pContext )
+{
+	DataCacheCheckRun_t *pRun = (DataCacheCheckRun_t *)pContext;
+	ShardedDataCache_t &cache = *pRun->m_pCache;
+	if ( !nThread )
+	{
+		while ( pRun->m_nWorking )
+		{
+			cache.ProcessEvictions();
+			ThreadSleep( 0 );
+		}
+		return;
+	}
+
+	CUtlVector< memhandle_t > handles;
+	unsigned int nRandom = nThread * 31 + 7;
+	for ( int i = 0; i < DATACACHE_CHECK_OPS; ++i )
+	{
+		nRandom = nRandom * 1103515245 + 12345;
+		int nOp = ( nRandom >> 16 ) % 6;
+		if ( !nOp || !handles.Count() )
+		{
+			handles.AddToTail( cache.CreateResource( DATACACHE_CHECK_SIZE, ( nRandom & 1 ) != 0 ) );
+			continue;
+		}
+
+		memhandle_t hMem = handles[( nRandom >> 8 ) % handles.Count()];
+		if ( nOp == 1 )
+		{
+			if ( cache.LockResource( hMem ) )
+			{
+				cache.UnlockResource( hMem );
+			}
+		}
+		else if ( nOp == 2 )
+		{
+			if ( cache.LockCount( hMem ) )
+			{
+				cache.UnlockResource( hMem );
+			}
+		}
+		else if ( nOp == 3 )
+		{
+			if ( !cache.LockCount( hMem ) )
+			{
+				cache.DestroyResource( hMem );
+			}
+		}
+		else if ( nOp == 4 )
+		{
+			cache.MarkAsStale( hMem );
+		}
+		else
+		{
+			cache.TouchResource( hMem );
+		}
+	}
+	for ( int i = 0; i < handles.Count(); ++i )
+	{
+		while ( cache.LockCount( handles[i] ) )
+		{
+			cache.UnlockResource( handles[i] );
+		}
+	}
+	--pRun->m_nWorking;
+}
+
+static bool RunDataCacheThreadChecks()
+{
+	CEvictionCounter counter;
+	ShardedDataCache_t *pCache = new ShardedDataCache_t( 16 * 64 * DATACACHE_CHECK_SIZE );
+	pCache->SetEvictionListener( &counter );
+	pCache->SetAsyncEviction( true );
+
+	DataCacheCheckRun_t run;
+	run.m_pCache = pCache;
+	run.m_nWorking = DATACACHE_CHECK_THREADS;
+	RunOnThreads( DATACACHE_CHECK_THREADS + 1, DataCacheCheckThread, &run );
+
+	pCache->FlushToTargetSize();
+	pCache->ProcessEvictions();
+	CUtlVector< memhandle_t > locked;
+	pCache->GetLockHandleList( locked );
+	bool bOk = pCache->UsedSize() <= pCache->TargetSize() && pCache->UsedSize() == (unsigned)s_nCacheBlobs * DATACACHE_CHECK_SIZE;
+	bOk &= !locked.Count() && !counter.m_nDestroyed;
+	delete pCache;
+	bOk &= ( s_nCacheBlobs == 0 );
+	printf( "%-28s %s: %d threads, %d evicted\n", "threads", bOk ? "ok" : "FAILED", DATACACHE_CHECK_THREADS, (int)counter.m_nEvicted );
+	return bOk;
+}
+
+template< class CACHE >
+struct DataCacheRun_t
+{
+	CACHE *m_pCache;
+	memhandle_t *m_pHandles;	// Shared, a miss puts the recreated resource's handle back
+	int m_nHandles;
+	int m_nOps;					// Per thread
+	CInterlockedInt m_nMisses;
+};
+
+// Most uses go to a fifth of the handles, half of them lock and unlock, half only touch
+template< class CACHE >
+static void UseDataCache( int nThread, void *pContext )
+{
+	DataCacheRun_t< CACHE > *pRun = (DataCacheRun_t< CACHE > *)pContext;
+	CACHE &cache = *pRun->m_pCache;
+	int nMisses = 0;
+	unsigned int nRandom = 12345 + nThread * 7919;
+	for ( int i = 0; i < pRun->m_nOps; ++i )
+	{
+		nRandom = nRandom * 1103515245 + 12345;
+		unsigned int nPick = nRandom >> 8;
+		int iHandle = ( nPick % 10 < 8 ) ? ( nPick / 10 ) % ( pRun->m_nHandles / 5 ) : ( nPick / 10 ) % pRun->m_nHandles;
+		memhandle_t hMem = pRun->m_pHandles[iHandle];
+		if ( i & 1 )
+		{
+			nMisses += cache.GetResource_NoLock( hMem ) ? 0 : 1;
+			continue;
+		}
+
+		CCacheBlob *pBlob = cache.LockResource( hMem );
+		if ( !pBlob )
+		{
+			++nMisses;
+			hMem = cache.CreateResource( DATACACHE_BENCH_SIZE, true );
+			pRun->m_pHandles[iHandle] = hMem;
+			pBlob = cache.GetResource_NoLockNoLRUTouch( hMem );
+		}
+		if ( pBlob )
+		{
+			pBlob->m_pData[0] = 1;
+		}
+		cache.UnlockResource( hMem );
+	}
+	pRun->m_nMisses += nMisses;
+}
+
+// Nanoseconds per use
+template< class CACHE >
+static double TimeDataCache( int nThreads, int nHandles, int nOps, double &flMissRate )
+{
+	CACHE *pCache = new CACHE( DATACACHE_BENCH_BUDGET );
+	CUtlVector< memhandle_t > handles;
+	for ( int i = 0; i < nHandles; ++i )
+	{
+		handles.AddToTail( pCache->CreateResource( DATACACHE_BENCH_SIZE ) );
+	}
+
+	DataCacheRun_t< CACHE > run;
+	run.m_pCache = pCache;
+	run.m_pHandles = handles.Base();
+	run.m_nHandles = nHandles;
+	run.m_nOps = nOps;
+	run.m_nMisses = 0;
+
+	CPreciseTimer timer;
+	timer.Start();
+	RunOnThreads( nThreads, UseDataCache< CACHE >, &run );
+	timer.End();
+	double flTime = timer.GetSeconds();
+	delete pCache;
+
+	double flOps = (double)nThreads * nOps;
+	flMissRate = run.m_nMisses / flOps;
+	return 1e9 * flTime / flOps;
+}
+
+static int BenchDataCache( int argc, char **argv )
+{
+	int nThreads = 8;
+	int nHandles = 8192;
+	int nOps = 200000;
+	for ( int i = 0; i < argc; ++i )
+	{
+		bool bHasValue = i + 1 < argc;
+		if ( !V_stricmp( argv[i], "-threads" ) && bHasValue )
+		{
+			nThreads = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-handles" ) && bHasValue )
+		{
+			nHandles = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-ops" ) && bHasValue )
+		{
+			nOps = atoi( argv[++i] );
+		}
+		else
+		{
+			return -1;
+		}
+	}
+	nThreads = clamp( nThreads, 1, THREADBENCH_MAX_THREADS );
+	nHandles = MAX( nHandles, 5 );
+	nOps = MAX( nOps, 1 );
+
+	bool bPassed = RunDataCacheSingleThreadChecks();
+	bPassed &= RunDataCacheThreadChecks();
+
+	printf( "\n%d handles of %d bytes, %d byte budget, %d uses per thread, %d cpus\n", nHandles, DATACACHE_BENCH_SIZE, DATACACHE_BENCH_BUDGET, nOps, (int)GetCPUInformation().m_nLogicalProcessors );
+	printf( "%7s %12s %8s %12s %8s %8s\n", "threads", "single ns", "miss", "sharded ns", "miss", "speedup" );
+	for ( int nRun = 1; nRun <= nThreads; nRun = ( nRun == nThreads ) ? nThreads + 1 : MIN( nRun * 2, nThreads ) )
+	{
+		double flSingleMiss, flShardedMiss;
+		double flSingle = TimeDataCache< DataCache_t >( nRun, nHandles, nOps, flSingleMiss );
+		double flSharded = TimeDataCache< ShardedDataCache_t >( nRun, nHandles, nOps, flShardedMiss );
+		printf( "%7d %12.1f %7.1f%% %12.1f %7.1f%% %7.2fx\n", nRun, flSingle, 100 * flSingleMiss, flSharded, 100 * flShardedMiss, flSingle / flSharded );
+	}
+	return bPassed ? 0 : 1;
+}
+
+//-----------------------------------------------------------------------------
+// Main
+//-----------------------------------------------------------------------------
+struct Benchmark_t
+{
+	const char *m_pName;
+	int ( *m_pFunc )( int argc, char **argv );	// -1 for bad arguments, 1 for a failed check
+	const char *m_pUsage;
+};
+
+static const Benchmark_t s_Benchmarks[] =
+{
+	{ "vproftrace", BenchVProfTrace, "[-threads n] [-scopes n]" },
+	{ "mempool", BenchMemPool, "[-threads n] [-blocks n] [-rounds n]" },
+	{ "ringqueue", BenchRingQueue, "[-threads n] [-consumers n] [-items n]" },
+	{ "callqueue", BenchCallQueue, "[-threads n] [-calls n] [-rounds n]" },
+	{ "threadpool", BenchThreadPool, "[-threads n] [-depth n] [-work n] [-distribute]" },
+	{ "datacache", BenchDataCache, "[-threads n] [-handles n] [-ops n]" },
+};
+
+static void PrintUsage()
+{
+	for ( int i = 0; i < ARRAYSIZE( s_Benchmarks ); ++i )
+	{
+		printf( "%s threadbench %s %s\n", i ? "      " : "usage:", s_Benchmarks[i].m_pName, s_Benchmarks[i].m_pUsage );
+	}
+}
+
+int main( int argc, char **argv )
+{
+	CTSCClock::Init();
+
+	for ( int i = 0; argc > 1 && i < ARRAYSIZE( s_Benchmarks ); ++i )
+	{
+		if ( V_stricmp( argv[1], s_Benchmarks[i].m_pName ) )
+			continue;
+
+		int nResult = s_Benchmarks[i].m_pFunc( argc - 2, argv + 2 );
+		if ( nResult < 0 )
+		{
+			PrintUsage();
+			return 1;
+		}
+		return nResult;
+	}
+	PrintUsage();
+	return 1;
+}
@@ -0,0 +1,651 @@
+//==================================================================================================
+//
+// vcsrepack: reorders the static combo blocks of a version 6 vcs file by runtime usage
+//
+// ShaderCompile writes the blocks in static combo order, so the combos one scene uses are spread
+// over the whole file. The repacker puts the used blocks first, each one next to the block used
+// with it in the most sessions, then the unused blocks in their original order. Blocks with
+// identical contents are stored once.
+//
+// The engine finds a static combo by a binary search of the records, then of the aliases, and
+// reads a block up to the offset of the next record, so the records have to stay sorted by both
+// id and offset. The repacked blocks are therefore stored under carrier ids, static combos that
+// ShaderCompile skipped, in file order, and every live static combo becomes an alias of its
+// carrier. Run it on the file ShaderCompile wrote, not on a repacked one.
+//
+// Usage file, one session per "session" line, "shader staticindex [count]" per used combo:
+//
+//     session
+//     pbr_ps30 17 120
+//     pbr_vs30 1 212
+//
+// Usage: vcsrepack -usage file [-cold count] [-o out.vcs] shader.vcs
+//
+//==================================================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+#include "tier0/platform.h"
+#include "tier1/strtools.h"
+#include "tier1/generichash.h"
+#include "tier1/utlvector.h"
+#include "materialsystem/shader_vcs_version.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define SENTINEL_STATIC_COMBO_ID	0xffffffff
+
+// Above this many used blocks the co-usage matrix gets too big, used blocks are ordered by use count
+#define MAX_CHAINED_BLOCKS			4096
+
+struct ComboBlock_t
+{
+	uint32	m_nOffset;			// In the input file
+	uint32	m_nSize;
+	uint32	m_nFirstCombo;		// Lowest static combo that uses the block
+	uint64	m_nHash;
+	int		m_nUnique;			// Block with the same contents that is kept
+	int		m_nSessions;		// Sessions that used the block
+	uint64	m_nUseCount;
+};
+
+static bool ReadFile( const char *pPath, CUtlVector< uint8 > &data )
+{
+	FILE *fp = fopen( pPath, "rb" );
+	if ( !fp )
+	{
+		fprintf( stderr, "error: can't open %s\n", pPath );
+		return false;
+	}
+	fseek( fp, 0, SEEK_END );
+	long nSize = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+	data.SetCount( nSize );
+	bool bSuccess = nSize >= 0 && fread( data.Base(), 1, nSize, fp ) == (size_t)nSize;
+	fclose( fp );
+	if ( !bSuccess )
+	{
+		fprintf( stderr, "error: can't read %s\n", pPath );
+	}
+	return bSuccess;
+}
+
+// Writes a temporary next to the file and renames that over it, so a failed or interrupted write
+// leaves the original intact; the output is often the input itself
+static bool WriteFileReplacing( const char *pPath, const void *pData, int nSize )
+{
+	char szTempPath[MAX_PATH];
+	V_snprintf( szTempPath, sizeof( szTempPath ), "%s.tmp", pPath );
+
+	FILE *fp = fopen( szTempPath, "wb" );
+	bool bWritten = fp && fwrite( pData, 1, nSize, fp ) == (size_t)nSize;
+	if ( fp )
+	{
+		bWritten &= ( fclose( fp ) == 0 );
+	}
+
+#ifdef _WIN32
+	bool bReplaced = bWritten && MoveFileEx( szTempPath, pPath, MOVEFILE_REPLACE_EXISTING ) != 0;
+#else
+	bool bReplaced = bWritten && rename( szTempPath, pPath ) == 0;
+#endif
+	if ( !bReplaced )
+	{
+		remove( szTempPath );
+		fprintf( stderr, "error: can't write %s\n", pPath );
+	}
+	return bReplaced;
+}
+
+static int __cdecl CompareAliases( const StaticComboAliasRecord_t *a, const StaticComboAliasRecord_t *b )
+{
+	if ( a->m_nStaticComboID != b->m_nStaticComboID )
+		return a->m_nStaticComboID < b->m_nStaticComboID ? -1 : 1;
+	return 0;
+}
+
+// Sort by contents, equal blocks end up next to each other
+static const ComboBlock_t *s_pSortBlocks;
+static int __cdecl CompareBlockContents( const int *a, const int *b )
+{
+	const ComboBlock_t &blockA = s_pSortBlocks[*a];
+	const ComboBlock_t &blockB = s_pSortBlocks[*b];
+	if ( blockA.m_nHash != blockB.m_nHash )
+		return blockA.m_nHash < blockB.m_nHash ? -1 : 1;
+	if ( blockA.m_nSize != blockB.m_nSize )
+		return blockA.m_nSize < blockB.m_nSize ? -1 : 1;
+	return *a - *b;
+}
+
+static int __cdecl CompareBlockUse( const int *a, const int *b )
+{
+	const ComboBlock_t &blockA = s_pSortBlocks[*a];
+	const ComboBlock_t &blockB = s_pSortBlocks[*b];
+	if ( blockA.m_nSessions != blockB.m_nSessions )
+		return blockB.m_nSessions - blockA.m_nSessions;
+	if ( blockA.m_nUseCount != blockB.m_nUseCount )
+		return blockA.m_nUseCount > blockB.m_nUseCount ? -1 : 1;
+	return blockA.m_nFirstCombo < blockB.m_nFirstCombo ? -1 : 1;
+}
+
+static int __cdecl CompareBlockFirstCombo( const int *a, const int *b )
+{
+	const ComboBlock_t &blockA = s_pSortBlocks[*a];
+	const ComboBlock_t &blockB = s_pSortBlocks[*b];
+	if ( blockA.m_nFirstCombo != blockB.m_nFirstCombo )
+		return blockA.m_nFirstCombo < blockB.m_nFirstCombo ? -1 : 1;
+	return *a - *b;
+}
+
+//-----------------------------------------------------------------------------
+// Reads the sessions of the usage file that belong to the shader. Each session is a list of
+// (static combo, count) pairs
+//-----------------------------------------------------------------------------
+static bool ReadUsage( const char *pPath, const char *pShader, CUtlVector< CUtlVector< uint32 > > &sessions )
+{
+	CUtlVector< uint8 > text;
+	if ( !ReadFile( pPath, text ) )
+		return false;
+	text.AddToTail( 0 );
+
+	bool bNewSession = true;
+	int nLine = 0;
+	char *pNext = (char *)text.Base();
+	while ( *pNext )
+	{
+		char *pLine = pNext;
+		while ( *pNext && *pNext != '\n' )
+		{
+			++pNext;
+		}
+		if ( *pNext )
+		{
+			*pNext++ = 0;
+		}
+		++nLine;
+
+		char szShader[MAX_PATH];
+		unsigned int nCombo;
+		unsigned int nCount = 1;
+		int nFields = sscanf( pLine, "%259s %u %u", szShader, &nCombo, &nCount );
+		if ( nFields <= 0 || !V_strncmp( szShader, "//", 2 ) )
+			continue;
+
+		if ( !V_stricmp( szShader, "session" ) )
+		{
+			bNewSession = true;
+			continue;
+		}
+		if ( nFields < 2 )
+		{
+			fprintf( stderr, "%s(%d): error: expected \"shader staticindex [count]\"\n", pPath, nLine );
+			return false;
+		}
+		if ( V_stricmp( szShader, pShader ) )
+			continue;
+
+		if ( bNewSession )
+		{
+			sessions.AddToTail();
+			bNewSession = false;
+		}
+		CUtlVector< uint32 > &session = sessions.Tail();
+		session.AddToTail( nCombo );
+		session.AddToTail( nCount );
+	}
+	return true;
+}
+
+static void PrintUsage()
+{
+	printf( "usage: vcsrepack -usage file [-cold count] [-o out.vcs] shader.vcs\n" );
+}
+
+int main( int argc, char **argv )
+{
+	const char *pInput = NULL;
+	const char *pOutput = NULL;
+	const char *pUsageFile = NULL;
+	uint64 nColdCount = 0;
+
+	for ( int i = 1; i < argc; ++i )
+	{
+		const char *pArg = argv[i];
+		bool bHasValue = ( i + 1 < argc );
+		if ( !V_stricmp( pArg, "-usage" ) && bHasValue )
+		{
+			pUsageFile = argv[++i];
+		}
+		else if ( !V_stricmp( pArg, "-cold" ) && bHasValue )
+		{
+			nColdCount = strtoull( argv[++i], NULL, 10 );
+		}
+		else if ( !V_stricmp( pArg, "-o" ) && bHasValue )
+		{
+			pOutput = argv[++i];
+		}
+		else if ( pArg[0] != '-' && !pInput )
+		{
+			pInput = pArg;
+		}
+		else
+		{
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	if ( !pInput || !pUsageFile )
+	{
+		PrintUsage();
+		return 1;
+	}
+	if ( !pOutput )
+	{
+		pOutput = pInput;
+	}
+
+	CUtlVector< uint8 > file;
+	if ( !ReadFile( pInput, file ) )
+		return 1;
+
+	//
+	// Parse and validate the dictionary
+	//
+	uint32 nFileSize = file.Count();
+	if ( nFileSize < sizeof( ShaderHeader_t ) )
+	{
+		fprintf( stderr, "error: %s is too small to be a vcs file\n", pInput );
+		return 1;
+	}
+
+	ShaderHeader_t header;
+	V_memcpy( &header, file.Base(), sizeof( header ) );
+	if ( header.m_nVersion != SHADER_VCS_VERSION_NUMBER )
+	{
+		fprintf( stderr, "error: %s is version %d, only version %d can be repacked\n", pInput, header.m_nVersion, SHADER_VCS_VERSION_NUMBER );
+		return 1;
+	}
+
+	uint32 nRecords = header.m_nNumStaticCombos;
+	uint64 nAliasCountOffset = sizeof( ShaderHeader_t ) + (uint64)nRecords * sizeof( StaticComboRecord_t );
+	if ( nRecords < 1 || nAliasCountOffset + sizeof( uint32 ) > nFileSize )
+	{
+		fprintf( stderr, "error: %s has a truncated static combo dictionary\n", pInput );
+		return 1;
+	}
+
+	CUtlVector< StaticComboRecord_t > records;
+	records.SetCount( nRecords );
+	V_memcpy( records.Base(), file.Base() + sizeof( ShaderHeader_t ), nRecords * sizeof( StaticComboRecord_t ) );
+
+	uint32 nAliases;
+	V_memcpy( &nAliases, file.Base() + nAliasCountOffset, sizeof( nAliases ) );
+	uint64 nDataStart = nAliasCountOffset + sizeof( uint32 ) + (uint64)nAliases * sizeof( StaticComboAliasRecord_t );
+	if ( nDataStart > nFileSize )
+	{
+		fprintf( stderr, "error: %s has a truncated alias table\n", pInput );
+		return 1;
+	}
+
+	CUtlVector< StaticComboAliasRecord_t > aliases;
+	aliases.SetCount( nAliases );
+	V_memcpy( aliases.Base(), file.Base() + nAliasCountOffset + sizeof( uint32 ), nAliases * sizeof( StaticComboAliasRecord_t ) );
+
+	if ( records.Tail().m_nStaticComboID != SENTINEL_STATIC_COMBO_ID )
+	{
+		fprintf( stderr, "error: %s has no sentinel static combo record\n", pInput );
+		return 1;
+	}
+	for ( uint32 i = 0; i + 1 < nRecords; ++i )
+	{
+		if ( records[i].m_nStaticComboID >= records[i + 1].m_nStaticComboID ||
+			records[i].m_nFileOffset < nDataStart || records[i].m_nFileOffset > records[i + 1].m_nFileOffset ||
+			records[i + 1].m_nFileOffset > nFileSize )
+		{
+			fprintf( stderr, "error: %s has an invalid static combo record for combo %u\n", pInput, records[i].m_nStaticComboID );
+			return 1;
+		}
+	}
+
+	// Every static combo the engine can ask for, and the block it gets
+	uint32 nStaticCombos = header.m_nTotalCombos / MAX( 1, header.m_nDynamicCombos );
+	uint32 nComboSpace = nStaticCombos;
+	for ( uint32 i = 0; i + 1 < nRecords; ++i )
+	{
+		nComboSpace = MAX( nComboSpace, records[i].m_nStaticComboID + 1 );
+	}
+	for ( uint32 i = 0; i < nAliases; ++i )
+	{
+		nComboSpace = MAX( nComboSpace, aliases[i].m_nStaticComboID + 1 );
+	}
+	if ( nComboSpace > 64 * 1024 * 1024 )
+	{
+		fprintf( stderr, "error: %s uses static combo ids up to %u\n", pInput, nComboSpace );
+		return 1;
+	}
+
+	CUtlVector< ComboBlock_t > blocks;
+	CUtlVector< int > comboBlocks;
+	comboBlocks.SetCount( nComboSpace );
+	for ( uint32 i = 0; i < nComboSpace; ++i )
+	{
+		comboBlocks[i] = -1;
+	}
+	for ( uint32 i = 0; i + 1 < nRecords; ++i )
+	{
+		ComboBlock_t &block = blocks[ blocks.AddToTail() ];
+		block.m_nOffset = records[i].m_nFileOffset;
+		block.m_nSize = records[i + 1].m_nFileOffset - records[i].m_nFileOffset;
+		block.m_nFirstCombo = records[i].m_nStaticComboID;
+		block.m_nHash = MurmurHash64( file.Base() + block.m_nOffset, block.m_nSize, 0 );
+		block.m_nUnique = i;
+		block.m_nSessions = 0;
+		block.m_nUseCount = 0;
+		comboBlocks[ records[i].m_nStaticComboID ] = i;
+	}
+	for ( uint32 i = 0; i < nAliases; ++i )
+	{
+		const StaticComboAliasRecord_t &alias = aliases[i];
+		int nBlock = alias.m_nSourceStaticCombo < nComboSpace ? comboBlocks[ alias.m_nSourceStaticCombo ] : -1;
+		if ( nBlock < 0 || comboBlocks[ alias.m_nStaticComboID ] >= 0 )
+		{
+			fprintf( stderr, "error: %s has an invalid alias for static combo %u\n", pInput, alias.m_nStaticComboID );
+			return 1;
+		}
+		comboBlocks[ alias.m_nStaticComboID ] = nBlock;
+	}
+
+	//
+	// Store identical blocks once
+	//
+	s_pSortBlocks = blocks.Base();
+	CUtlVector< int > order;
+	order.SetCount( blocks.Count() );
+	for ( int i = 0; i < blocks.Count(); ++i )
+	{
+		order[i] = i;
+	}
+	order.Sort( CompareBlockContents );
+	for ( int i = 1; i < order.Count(); ++i )
+	{
+		ComboBlock_t &block = blocks[ order[i] ];
+		for ( int j = i - 1; j >= 0; --j )
+		{
+			const ComboBlock_t &other = blocks[ order[j] ];
+			if ( other.m_nHash != block.m_nHash || other.m_nSize != block.m_nSize )
+				break;
+			if ( other.m_nUnique == order[j] && !V_memcmp( file.Base() + other.m_nOffset, file.Base() + block.m_nOffset, block.m_nSize ) )
+			{
+				block.m_nUnique = order[j];
+				break;
+			}
+		}
+	}
+	for ( uint32 i = 0; i < nComboSpace; ++i )
+	{
+		if ( comboBlocks[i] >= 0 )
+		{
+			comboBlocks[i] = blocks[ comboBlocks[i] ].m_nUnique;
+			ComboBlock_t &block = blocks[ comboBlocks[i] ];
+			block.m_nFirstCombo = MIN( block.m_nFirstCombo, i );
+		}
+	}
+
+	CUtlVector< int > unique;
+	for ( int i = 0; i < blocks.Count(); ++i )
+	{
+		if ( blocks[i].m_nUnique == i )
+		{
+			unique.AddToTail( i );
+		}
+	}
+
+	//
+	// Apply the usage
+	//
+	char szShader[MAX_PATH];
+	V_FileBase( pInput, szShader, sizeof( szShader ) );
+	CUtlVector< CUtlVector< uint32 > > sessions;
+	if ( !ReadUsage( pUsageFile, szShader, sessions ) )
+		return 1;
+
+	CUtlVector< CUtlVector< int > > sessionBlocks;
+	CUtlVector< int > lastSession;
+	lastSession.SetCount( blocks.Count() );
+	for ( int i = 0; i < blocks.Count(); ++i )
+	{
+		lastSession[i] = -1;
+	}
+	int nUnknownCombos = 0;
+	for ( int s = 0; s < sessions.Count(); ++s )
+	{
+		const CUtlVector< uint32 > &session = sessions[s];
+		CUtlVector< int > &used = sessionBlocks[ sessionBlocks.AddToTail() ];
+		for ( int i = 0; i < session.Count(); i += 2 )
+		{
+			uint32 nCombo = session[i];
+			int nBlock = nCombo < nComboSpace ? comboBlocks[nCombo] : -1;
+			if ( nBlock < 0 )
+			{
+				++nUnknownCombos;
+				continue;
+			}
+			ComboBlock_t &block = blocks[nBlock];
+			block.m_nUseCount += session[i + 1];
+			if ( lastSession[nBlock] != s )
+			{
+				lastSession[nBlock] = s;
+				++block.m_nSessions;
+				used.AddToTail( nBlock );
+			}
+		}
+	}
+	if ( nUnknownCombos )
+	{
+		fprintf( stderr, "warning: %d combos in the usage of %s aren't in %s\n", nUnknownCombos, szShader, pInput );
+	}
+
+	CUtlVector< int > hot;
+	CUtlVector< int > cold;
+	for ( int i = 0; i < unique.Count(); ++i )
+	{
+		const ComboBlock_t &block = blocks[ unique[i] ];
+		if ( block.m_nSessions && block.m_nUseCount > nColdCount )
+		{
+			hot.AddToTail( unique[i] );
+		}
+		else
+		{
+			cold.AddToTail( unique[i] );
+		}
+	}
+	hot.Sort( CompareBlockUse );
+	cold.Sort( CompareBlockFirstCombo );
+
+	// Chain the hot blocks: start with the most used one, then always take the block that shares
+	// the most sessions with the last one taken. Ties go to the most used block
+	if ( hot.Count() > 2 && hot.Count() <= MAX_CHAINED_BLOCKS )
+	{
+		int nHot = hot.Count();
+		CUtlVector< int > hotIndex;
+		hotIndex.SetCount( blocks.Count() );
+		for ( int i = 0; i < blocks.Count(); ++i )
+		{
+			hotIndex[i] = -1;
+		}
+		for ( int i = 0; i < nHot; ++i )
+		{
+			hotIndex[ hot[i] ] = i;
+		}
+
+		CUtlVector< uint16 > shared;
+		shared.SetCount( nHot * nHot );
+		V_memset( shared.Base(), 0, shared.Count() * sizeof( uint16 ) );
+		CUtlVector< int > sessionHot;
+		for ( int s = 0; s < sessionBlocks.Count(); ++s )
+		{
+			sessionHot.RemoveAll();
+			for ( int i = 0; i < sessionBlocks[s].Count(); ++i )
+			{
+				int nIndex = hotIndex[ sessionBlocks[s][i] ];
+				if ( nIndex >= 0 )
+				{
+					sessionHot.AddToTail( nIndex );
+				}
+			}
+			for ( int i = 0; i < sessionHot.Count(); ++i )
+			{
+				uint16 *pRow = &shared[ sessionHot[i] * nHot ];
+				for ( int j = 0; j < sessionHot.Count(); ++j )
+				{
+					if ( pRow[ sessionHot[j] ] < 0xffff )
+					{
+						++pRow[ sessionHot[j] ];
+					}
+				}
+			}
+		}
+
+		CUtlVector< int > chain;
+		CUtlVector< uint8 > placed;
+		placed.SetCount( nHot );
+		V_memset( placed.Base(), 0, nHot );
+		int nLast = 0;
+		for ( ;; )
+		{
+			chain.AddToTail( hot[nLast] );
+			placed[nLast] = 1;
+			if ( chain.Count() == nHot )
+				break;
+
+			// hot is sorted by use, the first unplaced block with the most shared sessions wins ties
+			const uint16 *pRow = &shared[ nLast * nHot ];
+			int nBest = -1;
+			for ( int i = 0; i < nHot; ++i )
+			{
+				if ( !placed[i] && ( nBest < 0 || pRow[i] > pRow[nBest] ) )
+				{
+					nBest = i;
+				}
+			}
+			nLast = nBest;
+		}
+		hot.Swap( chain );
+	}
+
+	//
+	// Carriers: static combos ShaderCompile skipped, or ids past the last static combo
+	//
+	int nOutBlocks = hot.Count() + cold.Count();
+	CUtlVector< uint32 > carriers;
+	for ( uint32 i = 0; i < nStaticCombos && carriers.Count() < nOutBlocks; ++i )
+	{
+		if ( comboBlocks[i] < 0 )
+		{
+			carriers.AddToTail( i );
+		}
+	}
+	for ( uint32 i = nComboSpace; carriers.Count() < nOutBlocks; ++i )
+	{
+		if ( i == SENTINEL_STATIC_COMBO_ID )
+		{
+			fprintf( stderr, "error: %s has no static combo ids left for the repacked blocks\n", pInput );
+			return 1;
+		}
+		carriers.AddToTail( i );
+	}
+
+	CUtlVector< int > outOrder;
+	outOrder.AddVectorToTail( hot );
+	outOrder.AddVectorToTail( cold );
+
+	CUtlVector< uint32 > blockCarrier;
+	blockCarrier.SetCount( blocks.Count() );
+	CUtlVector< StaticComboAliasRecord_t > outAliases;
+	for ( int i = 0; i < nOutBlocks; ++i )
+	{
+		blockCarrier[ outOrder[i] ] = carriers[i];
+	}
+	for ( uint32 i = 0; i < nComboSpace; ++i )
+	{
+		if ( comboBlocks[i] < 0 )
+			continue;
+		StaticComboAliasRecord_t alias;
+		alias.m_nStaticComboID = i;
+		alias.m_nSourceStaticCombo = blockCarrier[ comboBlocks[i] ];
+		outAliases.AddToTail( alias );
+	}
+	outAliases.Sort( CompareAliases );
+
+	//
+	// Write the repacked file
+	//
+	ShaderHeader_t outHeader = header;
+	outHeader.m_nNumStaticCombos = nOutBlocks + 1;
+	uint64 nOutDataStart = sizeof( ShaderHeader_t ) + (uint64)( nOutBlocks + 1 ) * sizeof( StaticComboRecord_t ) +
+		sizeof( uint32 ) + (uint64)outAliases.Count() * sizeof( StaticComboAliasRecord_t );
+
+	CUtlVector< StaticComboRecord_t > outRecords;
+	uint64 nOffset = nOutDataStart;
+	uint64 nHotSize = 0;
+	for ( int i = 0; i < nOutBlocks; ++i )
+	{
+		StaticComboRecord_t record;
+		record.m_nStaticComboID = carriers[i];
+		record.m_nFileOffset = (uint32)nOffset;
+		outRecords.AddToTail( record );
+		nOffset += blocks[ outOrder[i] ].m_nSize;
+		if ( i < hot.Count() )
+		{
+			nHotSize = nOffset - nOutDataStart;
+		}
+	}
+	if ( nOffset > 0xffffffffu )
+	{
+		fprintf( stderr, "error: repacked %s is too large\n", pInput );
+		return 1;
+	}
+	StaticComboRecord_t sentinel;
+	sentinel.m_nStaticComboID = SENTINEL_STATIC_COMBO_ID;
+	sentinel.m_nFileOffset = (uint32)nOffset;
+	outRecords.AddToTail( sentinel );
+
+	CUtlVector< uint8 > out;
+	out.EnsureCapacity( (int)nOffset );
+	uint32 nOutAliases = outAliases.Count();
+	out.AddMultipleToTail( sizeof( outHeader ), (uint8 *)&outHeader );
+	out.AddMultipleToTail( outRecords.Count() * sizeof( StaticComboRecord_t ), (uint8 *)outRecords.Base() );
+	out.AddMultipleToTail( sizeof( nOutAliases ), (uint8 *)&nOutAliases );
+	out.AddMultipleToTail( outAliases.Count() * sizeof( StaticComboAliasRecord_t ), (uint8 *)outAliases.Base() );
+	for ( int i = 0; i < nOutBlocks; ++i )
+	{
+		const ComboBlock_t &block = blocks[ outOrder[i] ];
+		out.AddMultipleToTail( block.m_nSize, file.Base() + block.m_nOffset );
+	}
+
+	// Span of the hot blocks in the input, for comparison
+	uint64 nHotStart = nFileSize;
+	uint64 nHotEnd = 0;
+	for ( int i = 0; i < hot.Count(); ++i )
+	{
+		const ComboBlock_t &block = blocks[ hot[i] ];
+		nHotStart = MIN( nHotStart, block.m_nOffset );
+		nHotEnd = MAX( nHotEnd, (uint64)block.m_nOffset + block.m_nSize );
+	}
+
+	if ( !WriteFileReplacing( pOutput, out.Base(), out.Count() ) )
+		return 1;
+
+	printf( "%s: %d sessions, %d blocks, %d unique, %d hot in %lluk (was spread over %lluk), %uk -> %dk\n",
+		pInput, sessions.Count(), blocks.Count(), unique.Count(), hot.Count(),
+		(unsigned long long)( nHotSize + 1023 ) / 1024, (unsigned long long)( nHotEnd > nHotStart ? nHotEnd - nHotStart + 1023 : 0 ) / 1024,
+		( nFileSize + 1023 ) / 1024, ( out.Count() + 1023 ) / 1024 );
+	return 0;
+}
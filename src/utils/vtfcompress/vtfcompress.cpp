@@ -0,0 +1,475 @@
+//==================================================================================================
+//
+// vtfcompress: block compresses uncompressed VTF files in place
+//
+// Every mip, frame, face and slice is encoded with BCEncodeImage. Folders are searched for .vtf
+// files recursively. Files are spread over the threads, a batch with fewer files than threads
+// encodes rows of blocks in parallel instead. Files that are already compressed are skipped.
+//
+// The format defaults to DXT1, DXT1 with one bit alpha or DXT5 from the alpha flags of the file,
+// the error metric to normal for normal maps, sRGB for sRGB textures and linear otherwise.
+//
+// -arenas reports the use of the threads' scratch arenas. On Linux -counters adds instructions per
+// cycle and cache and branch misses to the timing, where perf_event_open allows it; the other
+// platforms have no counters to read and don't take the flag.
+//
+// Usage: vtfcompress [-format dxt1|dxt1a|dxt5|ati1n|ati2n] [-quality fast|normal|exhaustive]
+//                    [-metric linear|srgb|normal] [-threads n] [-arenas] [-counters] [-n] file.vtf|folder ...
+//
+//==================================================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "tier0/platform.h"
+#include "tier0/tsctimer.h"
+#include "tier0/perfcounters.h"
+#include "tier1/memarena.h"
+#include "tier1/strtools.h"
+#include "tier1/utlvector.h"
+#include "vstdlib/jobthread.h"
+#include "vstdlib/workstealingpool.h"
+#include "vtf/vtf.h"
+#include "vtf/vtfreader.h"
+#include "bitmap/bcencoder.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define VTF_OFFSET_FORMAT		52
+#define VTF_OFFSET_RESOURCES	80
+
+struct CompressFile_t
+{
+	char	m_szFileName[MAX_PATH];
+	int64	m_nPixels;
+	bool	m_bCompressed;
+	bool	m_bError;
+};
+
+//-----------------------------------------------------------------------------
+// Finds the files to compress
+//-----------------------------------------------------------------------------
+static void AddFile( const char *pFileName, CUtlVector< CompressFile_t > &files )
+{
+	CompressFile_t &file = files[files.AddToTail()];
+	V_strncpy( file.m_szFileName, pFileName, sizeof( file.m_szFileName ) );
+	file.m_nPixels = 0;
+	file.m_bCompressed = false;
+	file.m_bError = false;
+}
+
+static bool IsVTFFile( const char *pFileName )
+{
+	int nLength = V_strlen( pFileName );
+	return nLength > 4 && !V_stricmp( pFileName + nLength - 4, ".vtf" );
+}
+
+static void AddFolder( const char *pFolder, CUtlVector< CompressFile_t > &files )
+{
+	char szPath[MAX_PATH];
+#ifdef _WIN32
+	WIN32_FIND_DATA findData;
+	V_snprintf( szPath, sizeof( szPath ), "%s\\*", pFolder );
+	HANDLE hFind = FindFirstFile( szPath, &findData );
+	if ( hFind == INVALID_HANDLE_VALUE )
+		return;
+
+	do
+	{
+		if ( findData.cFileName[0] == '.' )
+			continue;
+		V_snprintf( szPath, sizeof( szPath ), "%s\\%s", pFolder, findData.cFileName );
+		if ( findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+		{
+			AddFolder( szPath, files );
+		}
+		else if ( IsVTFFile( szPath ) )
+		{
+			AddFile( szPath, files );
+		}
+	}
+	while ( FindNextFile( hFind, &findData ) );
+	FindClose( hFind );
+#else
+	DIR *pDir = opendir( pFolder );
+	if ( !pDir )
+		return;
+
+	while ( dirent *pEntry = readdir( pDir ) )
+	{
+		if ( pEntry->d_name[0] == '.' )
+			continue;
+		V_snprintf( szPath, sizeof( szPath ), "%s/%s", pFolder, pEntry->d_name );
+		struct stat info;
+		if ( stat( szPath, &info ) )
+			continue;
+		if ( S_ISDIR( info.st_mode ) )
+		{
+			AddFolder( szPath, files );
+		}
+		else if ( IsVTFFile( szPath ) )
+		{
+			AddFile( szPath, files );
+		}
+	}
+	closedir( pDir );
+#endif
+}
+
+static bool IsFolder( const char *pPath )
+{
+#ifdef _WIN32
+	DWORD nAttributes = GetFileAttributes( pPath );
+	return nAttributes != INVALID_FILE_ATTRIBUTES && ( nAttributes & FILE_ATTRIBUTE_DIRECTORY );
+#else
+	struct stat info;
+	return !stat( pPath, &info ) && S_ISDIR( info.st_mode );
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Replaces a file by writing a temporary next to it and renaming that over it,
+// so a failed or interrupted write leaves the original intact
+//-----------------------------------------------------------------------------
+static bool WriteFileReplacing( const char *pFileName, const void *pData, int nSize )
+{
+	char szTempName[MAX_PATH];
+	V_snprintf( szTempName, sizeof( szTempName ), "%s.tmp", pFileName );
+
+	FILE *fp = fopen( szTempName, "wb" );
+	if ( !fp )
+		return false;
+	bool bWritten = fwrite( pData, 1, nSize, fp ) == (size_t)nSize;
+	bWritten &= ( fclose( fp ) == 0 );
+
+#ifdef _WIN32
+	bool bReplaced = bWritten && MoveFileEx( szTempName, pFileName, MOVEFILE_REPLACE_EXISTING ) != 0;
+#else
+	bool bReplaced = bWritten && rename( szTempName, pFileName ) == 0;
+#endif
+	if ( !bReplaced )
+	{
+		remove( szTempName );
+	}
+	return bReplaced;
+}
+
+//-----------------------------------------------------------------------------
+// Compresses one file
+//-----------------------------------------------------------------------------
+class CVTFCompressor
+{
+public:
+	CVTFCompressor()
+	{
+		m_Format = IMAGE_FORMAT_UNKNOWN;
+		m_Metric = BC_METRIC_COUNT;
+		m_bWrite = true;
+	}
+
+	void CompressFile( CompressFile_t &file );
+
+	ImageFormat			m_Format;		// IMAGE_FORMAT_UNKNOWN to pick one from the flags
+	BCErrorMetric_t		m_Metric;		// BC_METRIC_COUNT to pick one from the flags
+	BCEncodeParams_t	m_Params;
+	bool				m_bWrite;
+};
+
+void CVTFCompressor::CompressFile( CompressFile_t &file )
+{
+	CVTFReader vtf;
+	if ( !vtf.Open( file.m_szFileName ) || !vtf.HasImageData() )
+	{
+		fprintf( stderr, "error: can't read %s\n", file.m_szFileName );
+		file.m_bError = true;
+		return;
+	}
+	// Block compressed files are done already
+	if ( !CanDecodeToRGBA8888( vtf.Format() ) || BCCanEncode( vtf.Format() ) || vtf.Format() == IMAGE_FORMAT_DXT3 )
+		return;
+
+	ImageFormat dstFormat = m_Format;
+	if ( dstFormat == IMAGE_FORMAT_UNKNOWN )
+	{
+		dstFormat = ( vtf.Flags() & TEXTUREFLAGS_EIGHTBITALPHA ) ? IMAGE_FORMAT_DXT5 :
+			( vtf.Flags() & TEXTUREFLAGS_ONEBITALPHA ) ? IMAGE_FORMAT_DXT1_ONEBITALPHA : IMAGE_FORMAT_DXT1;
+	}
+
+	BCEncodeParams_t params = m_Params;
+	params.m_Metric = m_Metric;
+	if ( params.m_Metric == BC_METRIC_COUNT )
+	{
+		params.m_Metric = ( vtf.Flags() & TEXTUREFLAGS_NORMAL ) ? BC_METRIC_NORMAL :
+			( vtf.Flags() & TEXTUREFLAGS_SRGB ) ? BC_METRIC_SRGB : BC_METRIC_LINEAR;
+	}
+
+	// Everything before the image data is kept, the image data is re-encoded in file order:
+	// smallest mip first, then frames, faces and slices
+	int nImageStart, nSize;
+	vtf.ImageFileInfo( 0, 0, vtf.MipCount() - 1, &nImageStart, &nSize );
+	int nImageEnd = nImageStart;
+	int nNewImageSize = 0;
+	for ( int nMip = 0; nMip < vtf.MipCount(); ++nMip )
+	{
+		int nWidth, nHeight, nDepth;
+		vtf.ComputeMipLevelDimensions( nMip, &nWidth, &nHeight, &nDepth );
+		nImageEnd += vtf.ComputeMipSize( nMip ) * vtf.FrameCount() * vtf.FaceCount();
+		nNewImageSize += CVTFReader::ImageSize( dstFormat, nWidth, nHeight, nDepth ) * vtf.FrameCount() * vtf.FaceCount();
+	}
+
+	// The output and the decoded mips only live for this file, the worker thread's arena gets
+	// them back in one go when the scope ends
+	CMemoryArenaScope arenaScope;
+	int nOutputSize = (int)vtf.FileSize() - ( nImageEnd - nImageStart ) + nNewImageSize;
+	uint8 *pOutput = arenaScope.GetArena().AllocArray< uint8 >( nOutputSize );
+	uint8 *pOut = pOutput;
+	V_memcpy( pOut, vtf.FileData(), nImageStart );
+	*(int *)( pOut + VTF_OFFSET_FORMAT ) = dstFormat;
+	pOut += nImageStart;
+
+	// Sized for the largest mip, the smaller ones reuse it
+	int nMaxWidth, nMaxHeight, nMaxDepth;
+	vtf.ComputeMipLevelDimensions( 0, &nMaxWidth, &nMaxHeight, &nMaxDepth );
+	uint8 *pRGBA = arenaScope.GetArena().AllocArray< uint8 >( nMaxWidth * nMaxHeight * 4 );
+	for ( int nMip = vtf.MipCount() - 1; nMip >= 0; --nMip )
+	{
+		int nWidth, nHeight, nDepth;
+		vtf.ComputeMipLevelDimensions( nMip, &nWidth, &nHeight, &nDepth );
+		int nSliceSize = CVTFReader::ImageSize( dstFormat, nWidth, nHeight, 1 );
+		for ( int nFrame = 0; nFrame < vtf.FrameCount(); ++nFrame )
+		{
+			for ( int nFace = 0; nFace < vtf.FaceCount(); ++nFace )
+			{
+				for ( int nSlice = 0; nSlice < nDepth; ++nSlice, pOut += nSliceSize )
+				{
+					DecodeToRGBA8888( vtf.ImageData( nFrame, nFace, nMip, nSlice ), vtf.Format(), nWidth, nHeight, pRGBA );
+					BCEncodeImage( pRGBA, nWidth, nHeight, nWidth * 4, dstFormat, pOut, params );
+					file.m_nPixels += nWidth * nHeight;
+				}
+			}
+		}
+	}
+
+	// Resources after the image data move with its new size
+	V_memcpy( pOut, vtf.FileData() + nImageEnd, vtf.FileSize() - nImageEnd );
+	for ( int i = 0; i < vtf.ResourceCount(); ++i )
+	{
+		ResourceEntryInfo *pEntry = (ResourceEntryInfo *)( pOutput + VTF_OFFSET_RESOURCES ) + i;
+		if ( !( pEntry->eType & RSRCF_HAS_NO_DATA_CHUNK ) && pEntry->resData >= (uint32)nImageEnd )
+		{
+			pEntry->resData += nNewImageSize - ( nImageEnd - nImageStart );
+		}
+	}
+
+	file.m_bCompressed = true;
+	vtf.Close();
+	if ( !m_bWrite )
+		return;
+
+	if ( !WriteFileReplacing( file.m_szFileName, pOutput, nOutputSize ) )
+	{
+		fprintf( stderr, "error: can't write %s\n", file.m_szFileName );
+		file.m_bError = true;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Main
+//-----------------------------------------------------------------------------
+static void PrintUsage()
+{
+	printf( "usage: vtfcompress [-format dxt1|dxt1a|dxt5|ati1n|ati2n] [-quality fast|normal|exhaustive]\n" );
+#ifdef _LINUX
+	printf( "                   [-metric linear|srgb|normal] [-threads n] [-arenas] [-counters] [-n] file.vtf|folder ...\n" );
+#else
+	printf( "                   [-metric linear|srgb|normal] [-threads n] [-arenas] [-n] file.vtf|folder ...\n" );
+#endif
+}
+
+int main( int argc, char **argv )
+{
+	static const char *s_pFormatNames[] = { "dxt1", "dxt1a", "dxt5", "ati1n", "ati2n" };
+	static const ImageFormat s_Formats[] = { IMAGE_FORMAT_DXT1, IMAGE_FORMAT_DXT1_ONEBITALPHA, IMAGE_FORMAT_DXT5, IMAGE_FORMAT_ATI1N, IMAGE_FORMAT_ATI2N };
+	static const char *s_pQualityNames[BC_QUALITY_COUNT] = { "fast", "normal", "exhaustive" };
+	static const char *s_pMetricNames[BC_METRIC_COUNT] = { "linear", "srgb", "normal" };
+
+	CTSCClock::Init();
+
+	CVTFCompressor compressor;
+	CUtlVector< CompressFile_t > files;
+	int nThreads = GetCPUInformation().m_nLogicalProcessors;
+	bool bArenas = false;
+	bool bCounters = false;
+	for ( int i = 1; i < argc; ++i )
+	{
+		const char *pArg = argv[i];
+		bool bHasValue = ( i + 1 < argc );
+		bool bValid = true;
+		if ( !V_stricmp( pArg, "-format" ) && bHasValue )
+		{
+			const char *pValue = argv[++i];
+			compressor.m_Format = IMAGE_FORMAT_UNKNOWN;
+			for ( int j = 0; j < ARRAYSIZE( s_pFormatNames ); ++j )
+			{
+				if ( !V_stricmp( pValue, s_pFormatNames[j] ) )
+				{
+					compressor.m_Format = s_Formats[j];
+				}
+			}
+			bValid = compressor.m_Format != IMAGE_FORMAT_UNKNOWN;
+		}
+		else if ( !V_stricmp( pArg, "-quality" ) && bHasValue )
+		{
+			const char *pValue = argv[++i];
+			bValid = false;
+			for ( int j = 0; j < BC_QUALITY_COUNT; ++j )
+			{
+				if ( !V_stricmp( pValue, s_pQualityNames[j] ) )
+				{
+					compressor.m_Params.m_Quality = (BCQuality_t)j;
+					bValid = true;
+				}
+			}
+		}
+		else if ( !V_stricmp( pArg, "-metric" ) && bHasValue )
+		{
+			const char *pValue = argv[++i];
+			bValid = false;
+			for ( int j = 0; j < BC_METRIC_COUNT; ++j )
+			{
+				if ( !V_stricmp( pValue, s_pMetricNames[j] ) )
+				{
+					compressor.m_Metric = (BCErrorMetric_t)j;
+					bValid = true;
+				}
+			}
+		}
+		else if ( !V_stricmp( pArg, "-threads" ) && bHasValue )
+		{
+			nThreads = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( pArg, "-arenas" ) )
+		{
+			bArenas = true;
+		}
+#ifdef _LINUX
+		else if ( !V_stricmp( pArg, "-counters" ) )
+		{
+			bCounters = true;
+		}
+#endif
+		else if ( !V_stricmp( pArg, "-n" ) )
+		{
+			compressor.m_bWrite = false;
+		}
+		else if ( pArg[0] != '-' )
+		{
+			if ( IsFolder( pArg ) )
+			{
+				AddFolder( pArg, files );
+			}
+			else
+			{
+				AddFile( pArg, files );
+			}
+		}
+		else
+		{
+			bValid = false;
+		}
+
+		if ( !bValid )
+		{
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	if ( !files.Count() )
+	{
+		PrintUsage();
+		return 1;
+	}
+	nThreads = clamp( nThreads, 1, TP_MAX_POOL_THREADS );
+
+	// Opened before the pool so its threads are counted too
+	CPerfCounters counters;
+	if ( bCounters && !counters.Init( true ) )
+	{
+		fprintf( stderr, "warning: hardware counters are not available\n" );
+	}
+	PerfCounterValues_t startCounts;
+	counters.Read( startCounts );
+
+	// The calling thread works too
+	IThreadPool *pThreadPool = NULL;
+	if ( nThreads > 1 )
+	{
+		pThreadPool = CreateWorkStealingThreadPool();
+		ThreadPoolStartParams_t startParams;
+		startParams.nThreads = nThreads - 1;
+		pThreadPool->Start( startParams );
+	}
+
+	CPreciseTimer timer;
+	timer.Start();
+	if ( pThreadPool && files.Count() >= nThreads )
+	{
+		ParallelProcess( pThreadPool, files.Base(), files.Count(), &compressor, &CVTFCompressor::CompressFile );
+	}
+	else
+	{
+		compressor.m_Params.m_pThreadPool = pThreadPool;
+		for ( int i = 0; i < files.Count(); ++i )
+		{
+			compressor.CompressFile( files[i] );
+		}
+	}
+	timer.End();
+	double flTime = MAX( timer.GetSeconds(), 1e-6 );
+
+	if ( pThreadPool )
+	{
+		pThreadPool->Stop();
+		DestroyWorkStealingThreadPool( pThreadPool );
+	}
+
+	// The counts of the pool threads are added in as they exit
+	PerfCounterValues_t endCounts, counts;
+	counters.Read( endCounts );
+	PerfCounterValues_t::Sub( endCounts, startCounts, counts );
+
+	int nCompressed = 0;
+	int nErrors = 0;
+	int64 nPixels = 0;
+	for ( int i = 0; i < files.Count(); ++i )
+	{
+		nCompressed += files[i].m_bCompressed;
+		nErrors += files[i].m_bError;
+		nPixels += files[i].m_nPixels;
+	}
+
+	double flMegaPixels = nPixels / 1000000.0;
+	printf( "%d files, %d compressed, %.1f Mpixels in %.3fs: %.2f Mpixels/s, %.2f Mpixels/s per thread (%d threads, %s)\n",
+		files.Count(), nCompressed, flMegaPixels, flTime, flMegaPixels / flTime, flMegaPixels / flTime / nThreads,
+		nThreads, s_pQualityNames[compressor.m_Params.m_Quality] );
+	if ( counts.m_nValidMask )
+	{
+		printf( "%.2f IPC, per 1000 instructions: %.2f L1D misses, %.3f LLC misses, %.2f branch misses\n", counts.GetIPC(),
+			counts.GetPerKiloInstruction( PERF_COUNTER_L1D_MISSES ), counts.GetPerKiloInstruction( PERF_COUNTER_LLC_MISSES ),
+			counts.GetPerKiloInstruction( PERF_COUNTER_BRANCH_MISSES ) );
+	}
+	if ( bArenas )
+	{
+		CMemoryArena::DumpAllStats();
+	}
+	return nErrors ? 1 : 0;
+}
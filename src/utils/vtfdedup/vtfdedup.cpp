@@ -0,0 +1,873 @@
+//==================================================================================================
+//
+// vtfdedup: points materials that use identical textures at a single copy
+//
+// Every .vtf under the materials folder is decoded to RGBA8888 and hashed mip by mip. Textures with
+// the same size, frames, faces, mips and sampling flags whose pixels match, or differ by at most
+// -threshold per channel, are merged into one: the VMTs are rewritten to use the texture the engine
+// ships as a default when it is in the group, the smallest one otherwise.
+//
+// Constant textures get more in PBR materials: a solid $mraotexture becomes dev/pbr_mraotexture with
+// the color folded into $metalnessfactor, $roughnessfactor and $aofactor, a black $emissiontexture
+// is dropped. The VTF files themselves are left alone, the report lists what is no longer used.
+//
+// Usage: vtfdedup [-threshold n] [-threads n] [-n] materials_folder
+//
+//==================================================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "tier0/platform.h"
+#include "tier1/generichash.h"
+#include "tier1/strtools.h"
+#include "tier1/utldict.h"
+#include "tier1/utlstring.h"
+#include "tier1/utlvector.h"
+#include "vstdlib/jobthread.h"
+#include "vstdlib/workstealingpool.h"
+#include "vtf/vtf.h"
+#include "vtf/vtfreader.h"
+#include "bitmap/bcencoder.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define DEDUP_THUMBNAIL_SIZE	4
+#define DEDUP_MRAO_DEFAULT		"dev/pbr_mraotexture"
+#define DEDUP_NORMAL_DEFAULT	"dev/flat_normal"
+
+// Flags that follow from the contents rather than how the texture is sampled
+#define DEDUP_IGNORED_FLAGS		( TEXTUREFLAGS_ONEBITALPHA | TEXTUREFLAGS_EIGHTBITALPHA )
+
+struct DedupTexture_t
+{
+	char	m_szFileName[MAX_PATH];
+	char	m_szName[MAX_PATH];			// Relative to the materials folder, lower case, no extension
+	int		m_nWidth;
+	int		m_nHeight;
+	int		m_nDepth;
+	int		m_nFrames;
+	int		m_nFaces;
+	int		m_nMips;
+	int		m_nFlags;
+	int		m_nImageSize;				// Bytes of image data, what the texture costs once loaded
+	uint64	m_nHash;					// Of the decoded mips, chained from the smallest one
+	uint8	m_Thumbnail[DEDUP_THUMBNAIL_SIZE * DEDUP_THUMBNAIL_SIZE][4];	// Box filtered first image
+	uint8	m_Min[4];					// Over the largest mip of every image
+	uint8	m_Max[4];
+	bool	m_bReadable;
+	bool	m_bDefault;					// One of the textures shaders fall back to
+	int		m_nReplacement;				// Texture to use instead, -1 to keep this one
+	int		m_nReferences;				// By the VMTs, before and after they are rewritten
+	int		m_nNewReferences;
+};
+
+//-----------------------------------------------------------------------------
+// Finds the files
+//-----------------------------------------------------------------------------
+static bool HasExtension( const char *pFileName, const char *pExtension )
+{
+	const char *pFileExtension = V_GetFileExtension( pFileName );
+	return pFileExtension && !V_stricmp( pFileExtension, pExtension );
+}
+
+static void AddFolder( const char *pFolder, const char *pExtension, CUtlVector< CUtlString > &files )
+{
+	char szPath[MAX_PATH];
+#ifdef _WIN32
+	WIN32_FIND_DATA findData;
+	V_snprintf( szPath, sizeof( szPath ), "%s\\*", pFolder );
+	HANDLE hFind = FindFirstFile( szPath, &findData );
+	if ( hFind == INVALID_HANDLE_VALUE )
+		return;
+
+	do
+	{
+		if ( findData.cFileName[0] == '.' )
+			continue;
+		V_snprintf( szPath, sizeof( szPath ), "%s\\%s", pFolder, findData.cFileName );
+		if ( findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+		{
+			AddFolder( szPath, pExtension, files );
+		}
+		else if ( HasExtension( szPath, pExtension ) )
+		{
+			files.AddToTail( szPath );
+		}
+	}
+	while ( FindNextFile( hFind, &findData ) );
+	FindClose( hFind );
+#else
+	DIR *pDir = opendir( pFolder );
+	if ( !pDir )
+		return;
+
+	while ( dirent *pEntry = readdir( pDir ) )
+	{
+		if ( pEntry->d_name[0] == '.' )
+			continue;
+		V_snprintf( szPath, sizeof( szPath ), "%s/%s", pFolder, pEntry->d_name );
+		struct stat info;
+		if ( stat( szPath, &info ) )
+			continue;
+		if ( S_ISDIR( info.st_mode ) )
+		{
+			AddFolder( szPath, pExtension, files );
+		}
+		else if ( HasExtension( szPath, pExtension ) )
+		{
+			files.AddToTail( szPath );
+		}
+	}
+	closedir( pDir );
+#endif
+}
+
+// Texture names as VMTs use them: forward slashes, lower case and no extension
+static void NormalizeTextureName( const char *pName, char *pOut, int nOutSize )
+{
+	V_strncpy( pOut, pName, nOutSize );
+	V_FixSlashes( pOut, '/' );
+	V_strlower( pOut );
+	if ( HasExtension( pOut, "vtf" ) )
+	{
+		V_StripExtension( pOut, pOut, nOutSize );
+	}
+}
+
+static bool ReadFile( const char *pFileName, CUtlVector< char > &data )
+{
+	FILE *fp = fopen( pFileName, "rb" );
+	if ( !fp )
+		return false;
+
+	fseek( fp, 0, SEEK_END );
+	long nSize = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+	data.SetCount( nSize );
+	bool bRead = ( nSize == 0 ) || ( fread( data.Base(), 1, nSize, fp ) == (size_t)nSize );
+	fclose( fp );
+	return bRead;
+}
+
+//-----------------------------------------------------------------------------
+// Replaces a file by writing a temporary next to it and renaming that over it,
+// so a failed or interrupted write leaves the original intact
+//-----------------------------------------------------------------------------
+static bool WriteFileReplacing( const char *pFileName, const void *pData, int nSize )
+{
+	char szTempName[MAX_PATH];
+	V_snprintf( szTempName, sizeof( szTempName ), "%s.tmp", pFileName );
+
+	FILE *fp = fopen( szTempName, "wb" );
+	if ( !fp )
+		return false;
+	bool bWritten = fwrite( pData, 1, nSize, fp ) == (size_t)nSize;
+	bWritten &= ( fclose( fp ) == 0 );
+
+#ifdef _WIN32
+	bool bReplaced = bWritten && MoveFileEx( szTempName, pFileName, MOVEFILE_REPLACE_EXISTING ) != 0;
+#else
+	bool bReplaced = bWritten && rename( szTempName, pFileName ) == 0;
+#endif
+	if ( !bReplaced )
+	{
+		remove( szTempName );
+	}
+	return bReplaced;
+}
+
+//-----------------------------------------------------------------------------
+// Decodes every image of a mip, frames first, then faces and slices
+//-----------------------------------------------------------------------------
+static void DecodeMip( const CVTFReader &vtf, int nMip, CUtlVector< uint8 > &rgba )
+{
+	int nWidth, nHeight, nDepth;
+	vtf.ComputeMipLevelDimensions( nMip, &nWidth, &nHeight, &nDepth );
+	int nImageSize = nWidth * nHeight * 4;
+	rgba.SetCount( nImageSize * nDepth * vtf.FaceCount() * vtf.FrameCount() );
+
+	uint8 *pDst = rgba.Base();
+	for ( int nFrame = 0; nFrame < vtf.FrameCount(); ++nFrame )
+	{
+		for ( int nFace = 0; nFace < vtf.FaceCount(); ++nFace )
+		{
+			for ( int nSlice = 0; nSlice < nDepth; ++nSlice, pDst += nImageSize )
+			{
+				DecodeToRGBA8888( vtf.ImageData( nFrame, nFace, nMip, nSlice ), vtf.Format(), nWidth, nHeight, pDst );
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Decodes, hashes and measures one texture
+//-----------------------------------------------------------------------------
+class CTextureAnalyzer
+{
+public:
+	void AnalyzeTexture( DedupTexture_t &texture );
+};
+
+void CTextureAnalyzer::AnalyzeTexture( DedupTexture_t &texture )
+{
+	CVTFReader vtf;
+	if ( !vtf.Open( texture.m_szFileName ) || !vtf.HasImageData() || !CanDecodeToRGBA8888( vtf.Format() ) )
+		return;
+
+	texture.m_nWidth = vtf.Width();
+	texture.m_nHeight = vtf.Height();
+	texture.m_nDepth = vtf.Depth();
+	texture.m_nFrames = vtf.FrameCount();
+	texture.m_nFaces = vtf.FaceCount();
+	texture.m_nMips = vtf.MipCount();
+	texture.m_nFlags = vtf.Flags() & ~DEDUP_IGNORED_FLAGS;
+	texture.m_nImageSize = 0;
+
+	// Hashing from the smallest mip matches the file order
+	CUtlVector< uint8 > rgba;
+	uint64 nHash = 0;
+	for ( int nMip = vtf.MipCount() - 1; nMip >= 0; --nMip )
+	{
+		DecodeMip( vtf, nMip, rgba );
+		nHash = MurmurHash64( rgba.Base(), rgba.Count(), (uint32)nHash ^ (uint32)( nHash >> 32 ) );
+		texture.m_nImageSize += vtf.ComputeMipSize( nMip ) * vtf.FrameCount() * vtf.FaceCount();
+	}
+	texture.m_nHash = nHash;
+
+	// rgba holds the largest mip now
+	for ( int c = 0; c < 4; ++c )
+	{
+		texture.m_Min[c] = 255;
+		texture.m_Max[c] = 0;
+	}
+	for ( int i = 0; i < rgba.Count(); i += 4 )
+	{
+		for ( int c = 0; c < 4; ++c )
+		{
+			texture.m_Min[c] = MIN( texture.m_Min[c], rgba[i + c] );
+			texture.m_Max[c] = MAX( texture.m_Max[c], rgba[i + c] );
+		}
+	}
+
+	// Any two textures within the threshold of each other have thumbnails within it too
+	for ( int nY = 0; nY < DEDUP_THUMBNAIL_SIZE; ++nY )
+	{
+		int nY0 = nY * texture.m_nHeight / DEDUP_THUMBNAIL_SIZE;
+		int nY1 = MAX( ( nY + 1 ) * texture.m_nHeight / DEDUP_THUMBNAIL_SIZE, nY0 + 1 );
+		for ( int nX = 0; nX < DEDUP_THUMBNAIL_SIZE; ++nX )
+		{
+			int nX0 = nX * texture.m_nWidth / DEDUP_THUMBNAIL_SIZE;
+			int nX1 = MAX( ( nX + 1 ) * texture.m_nWidth / DEDUP_THUMBNAIL_SIZE, nX0 + 1 );
+			int nSum[4] = { 0, 0, 0, 0 };
+			for ( int y = nY0; y < nY1; ++y )
+			{
+				const uint8 *pRow = rgba.Base() + ( y * texture.m_nWidth ) * 4;
+				for ( int x = nX0; x < nX1; ++x )
+				{
+					for ( int c = 0; c < 4; ++c )
+					{
+						nSum[c] += pRow[x * 4 + c];
+					}
+				}
+			}
+
+			int nCount = ( nY1 - nY0 ) * ( nX1 - nX0 );
+			for ( int c = 0; c < 4; ++c )
+			{
+				texture.m_Thumbnail[nY * DEDUP_THUMBNAIL_SIZE + nX][c] = (uint8)( ( nSum[c] + nCount / 2 ) / nCount );
+			}
+		}
+	}
+
+	texture.m_bReadable = true;
+}
+
+//-----------------------------------------------------------------------------
+// Grouping
+//-----------------------------------------------------------------------------
+static bool SameLayout( const DedupTexture_t &a, const DedupTexture_t &b )
+{
+	return a.m_nWidth == b.m_nWidth && a.m_nHeight == b.m_nHeight && a.m_nDepth == b.m_nDepth &&
+		a.m_nFrames == b.m_nFrames && a.m_nFaces == b.m_nFaces && a.m_nMips == b.m_nMips &&
+		a.m_nFlags == b.m_nFlags;
+}
+
+static bool IsConstant( const DedupTexture_t &texture, int nThreshold )
+{
+	for ( int c = 0; c < 4; ++c )
+	{
+		if ( texture.m_Max[c] - texture.m_Min[c] > nThreshold )
+			return false;
+	}
+	return true;
+}
+
+static int ConstantColor( const DedupTexture_t &texture, int nChannel )
+{
+	return ( texture.m_Min[nChannel] + texture.m_Max[nChannel] + 1 ) / 2;
+}
+
+static bool ThumbnailsMatch( const DedupTexture_t &a, const DedupTexture_t &b, int nThreshold )
+{
+	for ( int i = 0; i < DEDUP_THUMBNAIL_SIZE * DEDUP_THUMBNAIL_SIZE; ++i )
+	{
+		for ( int c = 0; c < 4; ++c )
+		{
+			if ( abs( a.m_Thumbnail[i][c] - b.m_Thumbnail[i][c] ) > nThreshold )
+				return false;
+		}
+	}
+	return true;
+}
+
+// Compares every mip of two textures with the same layout
+static bool ImagesMatch( const DedupTexture_t &a, const DedupTexture_t &b, int nThreshold )
+{
+	CVTFReader vtfA, vtfB;
+	if ( !vtfA.Open( a.m_szFileName ) || !vtfB.Open( b.m_szFileName ) )
+		return false;
+
+	CUtlVector< uint8 > rgbaA, rgbaB;
+	for ( int nMip = 0; nMip < a.m_nMips; ++nMip )
+	{
+		DecodeMip( vtfA, nMip, rgbaA );
+		DecodeMip( vtfB, nMip, rgbaB );
+		for ( int i = 0; i < rgbaA.Count(); ++i )
+		{
+			if ( abs( rgbaA[i] - rgbaB[i] ) > nThreshold )
+				return false;
+		}
+	}
+	return true;
+}
+
+// Defaults first so they stay in use, then the smallest, then by name so runs are repeatable
+static int __cdecl ComparePreference( DedupTexture_t * const *ppA, DedupTexture_t * const *ppB )
+{
+	const DedupTexture_t &a = **ppA;
+	const DedupTexture_t &b = **ppB;
+	if ( a.m_bDefault != b.m_bDefault )
+		return a.m_bDefault ? -1 : 1;
+	if ( a.m_nImageSize != b.m_nImageSize )
+		return ( a.m_nImageSize < b.m_nImageSize ) ? -1 : 1;
+	return V_strcmp( a.m_szName, b.m_szName );
+}
+
+static void FindDuplicates( CUtlVector< DedupTexture_t > &textures, int nThreshold, int *pExact, int *pNear )
+{
+	CUtlVector< DedupTexture_t * > order;
+	for ( int i = 0; i < textures.Count(); ++i )
+	{
+		if ( textures[i].m_bReadable )
+		{
+			order.AddToTail( &textures[i] );
+		}
+	}
+	order.Sort( ComparePreference );
+
+	// Each texture is checked against the ones kept so far, in order of preference, so a group
+	// never drifts further than the threshold from the texture it keeps
+	CUtlVector< int > kept;
+	for ( int i = 0; i < order.Count(); ++i )
+	{
+		DedupTexture_t &texture = *order[i];
+		for ( int j = 0; j < kept.Count(); ++j )
+		{
+			DedupTexture_t &other = textures[kept[j]];
+			if ( !SameLayout( texture, other ) )
+				continue;
+
+			if ( texture.m_nHash == other.m_nHash )
+			{
+				texture.m_nReplacement = kept[j];
+				++*pExact;
+				break;
+			}
+
+			if ( nThreshold > 0 && ThumbnailsMatch( texture, other, nThreshold ) && ImagesMatch( texture, other, nThreshold ) )
+			{
+				texture.m_nReplacement = kept[j];
+				++*pNear;
+				break;
+			}
+		}
+
+		if ( texture.m_nReplacement < 0 )
+		{
+			kept.AddToTail( &texture - textures.Base() );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// VMT rewriting. Lines are kept as they are except for the values replaced,
+// so comments and formatting survive
+//-----------------------------------------------------------------------------
+struct VMTLine_t
+{
+	int		m_nStart;					// Span of the line without its end of line
+	int		m_nEnd;
+	int		m_nDepth;					// Of braces before the first token
+	int		m_nTokens;
+	int		m_nTokenStart[2];			// First two tokens without their quotes
+	int		m_nTokenEnd[2];
+	bool	m_bRemove;
+	CUtlString	m_Value;				// Replaces the second token when not empty
+	CUtlString	m_Append;				// Lines added after this one
+};
+
+class CVMTRewriter
+{
+public:
+	CVMTRewriter( CUtlVector< DedupTexture_t > &textures, CUtlDict< int, int > &names, int nThreshold );
+
+	// Returns true when the file changed, or would have without bWrite
+	bool RewriteFile( const char *pFileName, bool bWrite );
+
+	int		m_nReferences;				// Texture references rewritten
+	int		m_nConstants;				// Constant textures replaced by factors or dropped
+
+private:
+	void Parse();
+	void Token( int nLine, int i, char *pOut, int nOutSize ) const;
+	int FindKey( const char *pKey, int nDepth ) const;
+	void SetFactor( int nMRAOLine, const char *pKey, float flScale );
+
+	CUtlVector< DedupTexture_t > &m_Textures;
+	CUtlDict< int, int > &m_Names;
+	int m_nThreshold;
+	int m_nMRAODefault;
+
+	CUtlVector< char > m_File;
+	CUtlVector< VMTLine_t > m_Lines;
+	bool m_bCRLF;
+};
+
+CVMTRewriter::CVMTRewriter( CUtlVector< DedupTexture_t > &textures, CUtlDict< int, int > &names, int nThreshold ) :
+	m_Textures( textures ), m_Names( names )
+{
+	m_nThreshold = nThreshold;
+	m_nReferences = 0;
+	m_nConstants = 0;
+
+	// Constant MRAO textures can only become factors on the default when it is constant itself
+	m_nMRAODefault = -1;
+	int nName = m_Names.Find( DEDUP_MRAO_DEFAULT );
+	if ( nName != m_Names.InvalidIndex() )
+	{
+		const DedupTexture_t &mrao = m_Textures[m_Names[nName]];
+		if ( mrao.m_bReadable && IsConstant( mrao, 0 ) &&
+			ConstantColor( mrao, 0 ) && ConstantColor( mrao, 1 ) && ConstantColor( mrao, 2 ) )
+		{
+			m_nMRAODefault = m_Names[nName];
+		}
+	}
+}
+
+void CVMTRewriter::Parse()
+{
+	m_Lines.RemoveAll();
+	m_bCRLF = false;
+
+	const char *pData = m_File.Base();
+	int nSize = m_File.Count();
+	int nDepth = 0;
+	int nStart = 0;
+	while ( nStart < nSize || ( nStart == nSize && !m_Lines.Count() ) )
+	{
+		int nEnd = nStart;
+		while ( nEnd < nSize && pData[nEnd] != '\n' )
+		{
+			++nEnd;
+		}
+
+		VMTLine_t &line = m_Lines[m_Lines.AddToTail()];
+		line.m_nStart = nStart;
+		line.m_nEnd = ( nEnd > nStart && pData[nEnd - 1] == '\r' ) ? nEnd - 1 : nEnd;
+		line.m_nDepth = nDepth;
+		line.m_nTokens = 0;
+		line.m_bRemove = false;
+		m_bCRLF |= ( line.m_nEnd != nEnd );
+
+		int i = nStart;
+		while ( i < line.m_nEnd )
+		{
+			char c = pData[i];
+			if ( c == ' ' || c == '\t' )
+			{
+				++i;
+			}
+			else if ( c == '/' && i + 1 < line.m_nEnd && pData[i + 1] == '/' )
+			{
+				break;
+			}
+			else if ( c == '{' || c == '}' )
+			{
+				nDepth += ( c == '{' ) ? 1 : -1;
+				++i;
+			}
+			else
+			{
+				bool bQuoted = ( c == '"' );
+				int nTokenStart = bQuoted ? i + 1 : i;
+				int nTokenEnd = nTokenStart;
+				while ( nTokenEnd < line.m_nEnd )
+				{
+					char t = pData[nTokenEnd];
+					if ( bQuoted ? ( t == '"' ) : ( t == ' ' || t == '\t' || t == '"' || t == '{' || t == '}' ) )
+						break;
+					++nTokenEnd;
+				}
+
+				if ( line.m_nTokens == 0 )
+				{
+					line.m_nDepth = nDepth;
+				}
+				if ( line.m_nTokens < 2 )
+				{
+					line.m_nTokenStart[line.m_nTokens] = nTokenStart;
+					line.m_nTokenEnd[line.m_nTokens] = nTokenEnd;
+				}
+				++line.m_nTokens;
+				i = ( bQuoted && nTokenEnd < line.m_nEnd ) ? nTokenEnd + 1 : nTokenEnd;
+			}
+		}
+
+		nStart = nEnd + 1;
+	}
+}
+
+void CVMTRewriter::Token( int nLine, int i, char *pOut, int nOutSize ) const
+{
+	const VMTLine_t &line = m_Lines[nLine];
+	int nLength = MIN( line.m_nTokenEnd[i] - line.m_nTokenStart[i], nOutSize - 1 );
+	V_memcpy( pOut, m_File.Base() + line.m_nTokenStart[i], nLength );
+	pOut[nLength] = 0;
+}
+
+int CVMTRewriter::FindKey( const char *pKey, int nDepth ) const
+{
+	char szKey[MAX_PATH];
+	for ( int i = 0; i < m_Lines.Count(); ++i )
+	{
+		if ( m_Lines[i].m_nTokens < 2 || m_Lines[i].m_nDepth != nDepth )
+			continue;
+
+		Token( i, 0, szKey, sizeof( szKey ) );
+		if ( !V_stricmp( szKey, pKey ) )
+			return i;
+	}
+	return -1;
+}
+
+// Scales a factor of the material, adding it after the $mraotexture line when it isn't there
+void CVMTRewriter::SetFactor( int nMRAOLine, const char *pKey, float flScale )
+{
+	const VMTLine_t &mraoLine = m_Lines[nMRAOLine];
+	int nLine = FindKey( pKey, mraoLine.m_nDepth );
+	float flFactor = 1.0f;
+	if ( nLine >= 0 )
+	{
+		char szValue[MAX_PATH];
+		Token( nLine, 1, szValue, sizeof( szValue ) );
+		flFactor = (float)atof( szValue );
+	}
+	else if ( flScale == 1.0f )
+	{
+		return;
+	}
+
+	char szValue[32];
+	V_snprintf( szValue, sizeof( szValue ), "%g", flFactor * flScale );
+	if ( nLine >= 0 )
+	{
+		m_Lines[nLine].m_Value = szValue;
+		return;
+	}
+
+	// Same indentation and spacing as the $mraotexture line
+	const char *pData = m_File.Base();
+	CUtlString indent, gap;
+	int nIndentEnd = mraoLine.m_nTokenStart[0];
+	if ( nIndentEnd > mraoLine.m_nStart && pData[nIndentEnd - 1] == '"' )
+	{
+		--nIndentEnd;
+	}
+	indent.SetDirect( pData + mraoLine.m_nStart, nIndentEnd - mraoLine.m_nStart );
+	int nGapStart = mraoLine.m_nTokenEnd[0] + ( pData[mraoLine.m_nTokenEnd[0]] == '"' ? 1 : 0 );
+	int nGapEnd = mraoLine.m_nTokenStart[1] - ( pData[mraoLine.m_nTokenStart[1] - 1] == '"' ? 1 : 0 );
+	gap.SetDirect( pData + nGapStart, MAX( nGapEnd - nGapStart, 0 ) );
+	if ( !gap.Length() )
+	{
+		gap = " ";
+	}
+
+	CUtlString &append = m_Lines[nMRAOLine].m_Append;
+	append += m_bCRLF ? "\r\n" : "\n";
+	append += indent;
+	append += "\"";
+	append += pKey;
+	append += "\"";
+	append += gap;
+	append += "\"";
+	append += szValue;
+	append += "\"";
+}
+
+bool CVMTRewriter::RewriteFile( const char *pFileName, bool bWrite )
+{
+	if ( !ReadFile( pFileName, m_File ) )
+	{
+		fprintf( stderr, "error: can't read %s\n", pFileName );
+		return false;
+	}
+	Parse();
+
+	char szShader[MAX_PATH] = "";
+	char szKey[MAX_PATH];
+	char szName[MAX_PATH];
+	bool bChanged = false;
+	for ( int i = 0; i < m_Lines.Count(); ++i )
+	{
+		VMTLine_t &line = m_Lines[i];
+		if ( line.m_nTokens == 1 && !szShader[0] )
+		{
+			Token( i, 0, szShader, sizeof( szShader ) );
+		}
+		if ( line.m_nTokens < 2 )
+			continue;
+
+		Token( i, 1, szKey, sizeof( szKey ) );
+		NormalizeTextureName( szKey, szName, sizeof( szName ) );
+		int nName = m_Names.Find( szName );
+		if ( nName == m_Names.InvalidIndex() )
+			continue;
+
+		int nTexture = m_Names[nName];
+		DedupTexture_t &texture = m_Textures[nTexture];
+		++texture.m_nReferences;
+
+		Token( i, 0, szKey, sizeof( szKey ) );
+		bool bPBR = !V_stricmp( szShader, "pbr" ) && line.m_nDepth == 1;
+		if ( bPBR && !V_stricmp( szKey, "$emissiontexture" ) && texture.m_bReadable && IsConstant( texture, m_nThreshold ) &&
+			ConstantColor( texture, 0 ) <= m_nThreshold && ConstantColor( texture, 1 ) <= m_nThreshold && ConstantColor( texture, 2 ) <= m_nThreshold )
+		{
+			// Black adds nothing, without the texture the shader skips emission altogether
+			line.m_bRemove = true;
+			++m_nConstants;
+			bChanged = true;
+			continue;
+		}
+
+		if ( bPBR && !V_stricmp( szKey, "$mraotexture" ) && m_nMRAODefault >= 0 && nTexture != m_nMRAODefault &&
+			texture.m_bReadable && IsConstant( texture, m_nThreshold ) )
+		{
+			// The shader multiplies the texture by the factors
+			const DedupTexture_t &mrao = m_Textures[m_nMRAODefault];
+			SetFactor( i, "$metalnessfactor", (float)ConstantColor( texture, 0 ) / ConstantColor( mrao, 0 ) );
+			SetFactor( i, "$roughnessfactor", (float)ConstantColor( texture, 1 ) / ConstantColor( mrao, 1 ) );
+			SetFactor( i, "$aofactor", (float)ConstantColor( texture, 2 ) / ConstantColor( mrao, 2 ) );
+			line.m_Value = DEDUP_MRAO_DEFAULT;
+			++m_Textures[m_nMRAODefault].m_nNewReferences;
+			++m_nConstants;
+			bChanged = true;
+			continue;
+		}
+
+		if ( texture.m_nReplacement >= 0 )
+		{
+			line.m_Value = m_Textures[texture.m_nReplacement].m_szName;
+			++m_Textures[texture.m_nReplacement].m_nNewReferences;
+			++m_nReferences;
+			bChanged = true;
+			continue;
+		}
+
+		++texture.m_nNewReferences;
+	}
+
+	if ( !bChanged || !bWrite )
+		return bChanged;
+
+	CUtlVector< char > output;
+	const char *pData = m_File.Base();
+	for ( int i = 0; i < m_Lines.Count(); ++i )
+	{
+		const VMTLine_t &line = m_Lines[i];
+		int nNext = ( i + 1 < m_Lines.Count() ) ? m_Lines[i + 1].m_nStart : m_File.Count();
+		if ( line.m_bRemove )
+			continue;
+
+		if ( line.m_Value.Length() )
+		{
+			output.AddMultipleToTail( line.m_nTokenStart[1] - line.m_nStart, pData + line.m_nStart );
+			output.AddMultipleToTail( line.m_Value.Length(), line.m_Value.Get() );
+			output.AddMultipleToTail( line.m_nEnd - line.m_nTokenEnd[1], pData + line.m_nTokenEnd[1] );
+		}
+		else
+		{
+			output.AddMultipleToTail( line.m_nEnd - line.m_nStart, pData + line.m_nStart );
+		}
+		output.AddMultipleToTail( line.m_Append.Length(), line.m_Append.Get() );
+		output.AddMultipleToTail( nNext - line.m_nEnd, pData + line.m_nEnd );
+	}
+
+	if ( !WriteFileReplacing( pFileName, output.Base(), output.Count() ) )
+	{
+		fprintf( stderr, "error: can't write %s, left unchanged\n", pFileName );
+		return false;
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Main
+//-----------------------------------------------------------------------------
+static void PrintUsage()
+{
+	printf( "usage: vtfdedup [-threshold n] [-threads n] [-n] materials_folder\n" );
+}
+
+int main( int argc, char **argv )
+{
+	const char *pRoot = NULL;
+	int nThreshold = 0;
+	bool bWrite = true;
+	int nThreads = GetCPUInformation().m_nLogicalProcessors;
+	for ( int i = 1; i < argc; ++i )
+	{
+		const char *pArg = argv[i];
+		bool bHasValue = ( i + 1 < argc );
+		if ( !V_stricmp( pArg, "-threshold" ) && bHasValue )
+		{
+			nThreshold = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( pArg, "-threads" ) && bHasValue )
+		{
+			nThreads = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( pArg, "-n" ) )
+		{
+			bWrite = false;
+		}
+		else if ( pArg[0] != '-' && !pRoot )
+		{
+			pRoot = pArg;
+		}
+		else
+		{
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	if ( !pRoot )
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	char szRoot[MAX_PATH];
+	V_strncpy( szRoot, pRoot, sizeof( szRoot ) );
+	V_StripTrailingSlash( szRoot );
+	pRoot = szRoot;
+	nThreshold = clamp( nThreshold, 0, 255 );
+	nThreads = clamp( nThreads, 1, TP_MAX_POOL_THREADS );
+
+	CUtlVector< CUtlString > textureFiles, materialFiles;
+	AddFolder( pRoot, "vtf", textureFiles );
+	AddFolder( pRoot, "vmt", materialFiles );
+
+	CUtlVector< DedupTexture_t > textures;
+	CUtlDict< int, int > names;
+	int nRootLength = V_strlen( pRoot );
+	textures.SetCount( textureFiles.Count() );
+	for ( int i = 0; i < textureFiles.Count(); ++i )
+	{
+		DedupTexture_t &texture = textures[i];
+		V_memset( &texture, 0, sizeof( texture ) );
+		V_strncpy( texture.m_szFileName, textureFiles[i].Get(), sizeof( texture.m_szFileName ) );
+		NormalizeTextureName( texture.m_szFileName + nRootLength + 1, texture.m_szName, sizeof( texture.m_szName ) );
+		texture.m_bDefault = !V_strcmp( texture.m_szName, DEDUP_MRAO_DEFAULT ) || !V_strcmp( texture.m_szName, DEDUP_NORMAL_DEFAULT );
+		texture.m_nReplacement = -1;
+		names.Insert( texture.m_szName, i );
+	}
+
+	// The calling thread works too
+	double flStartTime = Plat_FloatTime();
+	CTextureAnalyzer analyzer;
+	if ( nThreads > 1 && textures.Count() > 1 )
+	{
+		IThreadPool *pThreadPool = CreateWorkStealingThreadPool();
+		ThreadPoolStartParams_t startParams;
+		startParams.nThreads = nThreads - 1;
+		pThreadPool->Start( startParams );
+		ParallelProcess( pThreadPool, textures.Base(), textures.Count(), &analyzer, &CTextureAnalyzer::AnalyzeTexture );
+		pThreadPool->Stop();
+		DestroyWorkStealingThreadPool( pThreadPool );
+	}
+	else
+	{
+		for ( int i = 0; i < textures.Count(); ++i )
+		{
+			analyzer.AnalyzeTexture( textures[i] );
+		}
+	}
+
+	int nExact = 0;
+	int nNear = 0;
+	FindDuplicates( textures, nThreshold, &nExact, &nNear );
+
+	CVMTRewriter rewriter( textures, names, nThreshold );
+	int nChangedMaterials = 0;
+	for ( int i = 0; i < materialFiles.Count(); ++i )
+	{
+		if ( rewriter.RewriteFile( materialFiles[i].Get(), bWrite ) )
+		{
+			printf( "%s %s\n", bWrite ? "rewrote" : "would rewrite", materialFiles[i].Get() );
+			++nChangedMaterials;
+		}
+	}
+	double flTime = Plat_FloatTime() - flStartTime;
+
+	// Textures the materials used before and no longer do won't be loaded
+	int nUnreadable = 0;
+	int nConstant = 0;
+	int nDropped = 0;
+	int64 nDroppedSize = 0;
+	int64 nUsedSize = 0;
+	for ( int i = 0; i < textures.Count(); ++i )
+	{
+		const DedupTexture_t &texture = textures[i];
+		nUnreadable += !texture.m_bReadable;
+		nConstant += texture.m_bReadable && IsConstant( texture, nThreshold );
+		if ( texture.m_nReferences )
+		{
+			nUsedSize += texture.m_nImageSize;
+		}
+		if ( texture.m_nReferences && !texture.m_nNewReferences )
+		{
+			printf( "unused: %s\n", texture.m_szName );
+			++nDropped;
+			nDroppedSize += texture.m_nImageSize;
+		}
+	}
+
+	printf( "%d textures (%d unreadable), %d exact and %d near duplicates, %d constant\n",
+		textures.Count(), nUnreadable, nExact, nNear, nConstant );
+	printf( "%d materials, %d %s: %d references shared, %d constant textures replaced\n",
+		materialFiles.Count(), nChangedMaterials, bWrite ? "rewritten" : "to rewrite", rewriter.m_nReferences, rewriter.m_nConstants );
+	printf( "%d textures no longer used, %.1f of %.1f MB of texture data (%.1f%%) in %.3fs\n",
+		nDropped, nDroppedSize / ( 1024.0 * 1024.0 ), nUsedSize / ( 1024.0 * 1024.0 ),
+		nUsedSize ? 100.0 * nDroppedSize / nUsedSize : 0.0, flTime );
+	return 0;
+}
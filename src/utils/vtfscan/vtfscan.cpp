@@ -0,0 +1,372 @@
+//==================================================================================================
+//
+// vtfscan: times a metadata scan of a texture tree with CVTFReader, and fuzzes the reader
+//
+// The scan reads the first -header bytes of every VTF under the folder and parses them with
+// CVTFReader::OpenHeader, the way a metadata tool would. Time spent opening and reading the files
+// is reported apart from time spent parsing, which should be the smaller of the two by far.
+//
+// -fuzz n then feeds the reader each file truncated at every length up to the end of the resource
+// dictionary and at a spread of lengths past it, followed by n copies with random bytes of the
+// header and dictionary changed. Every copy lives in a buffer of its exact size, so a build with
+// /fsanitize=address also catches reads the range checks below don't see. Whenever a copy opens,
+// every pointer the reader hands out is checked against the buffer.
+//
+// Usage: vtfscan [-header bytes] [-fuzz n] [-seed n] materials_folder
+//
+//==================================================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "tier0/platform.h"
+#include "tier1/strtools.h"
+#include "tier1/utlstring.h"
+#include "tier1/utlvector.h"
+#include "vtf/vtf.h"
+#include "vtf/vtfreader.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define DEFAULT_HEADER_BYTES	4096
+
+// Evenly spaced truncations past the dictionary
+#define FUZZ_TRUNCATION_STEPS	64
+
+//-----------------------------------------------------------------------------
+// Finds the files
+//-----------------------------------------------------------------------------
+static bool HasExtension( const char *pFileName, const char *pExtension )
+{
+	const char *pFileExtension = V_GetFileExtension( pFileName );
+	return pFileExtension && !V_stricmp( pFileExtension, pExtension );
+}
+
+static void AddFolder( const char *pFolder, const char *pExtension, CUtlVector< CUtlString > &files )
+{
+	char szPath[MAX_PATH];
+#ifdef _WIN32
+	WIN32_FIND_DATA findData;
+	V_snprintf( szPath, sizeof( szPath ), "%s\\*", pFolder );
+	HANDLE hFind = FindFirstFile( szPath, &findData );
+	if ( hFind == INVALID_HANDLE_VALUE )
+		return;
+
+	do
+	{
+		if ( findData.cFileName[0] == '.' )
+			continue;
+		V_snprintf( szPath, sizeof( szPath ), "%s\\%s", pFolder, findData.cFileName );
+		if ( findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+		{
+			AddFolder( szPath, pExtension, files );
+		}
+		else if ( HasExtension( szPath, pExtension ) )
+		{
+			files.AddToTail( szPath );
+		}
+	}
+	while ( FindNextFile( hFind, &findData ) );
+	FindClose( hFind );
+#else
+	DIR *pDir = opendir( pFolder );
+	if ( !pDir )
+		return;
+
+	while ( dirent *pEntry = readdir( pDir ) )
+	{
+		if ( pEntry->d_name[0] == '.' )
+			continue;
+		V_snprintf( szPath, sizeof( szPath ), "%s/%s", pFolder, pEntry->d_name );
+		struct stat info;
+		if ( stat( szPath, &info ) )
+			continue;
+		if ( S_ISDIR( info.st_mode ) )
+		{
+			AddFolder( szPath, pExtension, files );
+		}
+		else if ( HasExtension( szPath, pExtension ) )
+		{
+			files.AddToTail( szPath );
+		}
+	}
+	closedir( pDir );
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Metadata scan
+//-----------------------------------------------------------------------------
+struct ScanStats_t
+{
+	int		m_nFiles;
+	int		m_nParsed;
+	uint64	m_nBytesRead;
+	double	m_flReadTime;
+	double	m_flParseTime;
+};
+
+static void ScanFile( const char *pFileName, CUtlVector< uint8 > &buffer, ScanStats_t &stats )
+{
+	double flStart = Plat_FloatTime();
+	FILE *fp = fopen( pFileName, "rb" );
+	if ( !fp )
+		return;
+	fseek( fp, 0, SEEK_END );
+	long nFileSize = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+	size_t nRead = fread( buffer.Base(), 1, MIN( (size_t)buffer.Count(), (size_t)MAX( nFileSize, 0L ) ), fp );
+	fclose( fp );
+	double flRead = Plat_FloatTime();
+
+	CVTFReader reader;
+	bool bParsed = nFileSize > 0 && reader.OpenHeader( buffer.Base(), nRead, nFileSize );
+	double flParsed = Plat_FloatTime();
+
+	++stats.m_nFiles;
+	stats.m_nParsed += bParsed;
+	stats.m_nBytesRead += nRead;
+	stats.m_flReadTime += flRead - flStart;
+	stats.m_flParseTime += flParsed - flRead;
+}
+
+//-----------------------------------------------------------------------------
+// Fuzzing
+//-----------------------------------------------------------------------------
+static uint32 s_nRandomState = 0x9e3779b9;
+
+static uint32 RandomUint32()
+{
+	// xorshift32
+	s_nRandomState ^= s_nRandomState << 13;
+	s_nRandomState ^= s_nRandomState >> 17;
+	s_nRandomState ^= s_nRandomState << 5;
+	return s_nRandomState;
+}
+
+static bool IsInBuffer( const void *pData, size_t nSize, const uint8 *pBuffer, size_t nBufferSize )
+{
+	const uint8 *p = (const uint8 *)pData;
+	return p >= pBuffer && p <= pBuffer + nBufferSize && nSize <= (size_t)( pBuffer + nBufferSize - p );
+}
+
+// Touches everything the reader can return and checks it lies in the buffer. Walks the first
+// and last frame, face and slice of every mip, the counts can be anything up to 65535
+static bool CheckReader( const CVTFReader &reader, const uint8 *pBuffer, size_t nBufferSize, const char **ppWhat )
+{
+	int nLowResSize;
+	const uint8 *pLowRes = reader.LowResImageData( &nLowResSize );
+	if ( pLowRes && !IsInBuffer( pLowRes, nLowResSize, pBuffer, nBufferSize ) )
+	{
+		*ppWhat = "low-res image";
+		return false;
+	}
+
+	for ( int i = 0; i < reader.ResourceCount(); ++i )
+	{
+		size_t nSize;
+		const void *pData = reader.GetResourceData( reader.ResourceType( i ), &nSize );
+		if ( pData && !IsInBuffer( pData, nSize, pBuffer, nBufferSize ) )
+		{
+			*ppWhat = "resource";
+			return false;
+		}
+	}
+
+	int nFrames[2] = { 0, reader.FrameCount() - 1 };
+	int nFaces[2] = { 0, reader.FaceCount() - 1 };
+	for ( int iMip = 0; iMip < reader.MipCount(); ++iMip )
+	{
+		int nMipWidth, nMipHeight, nMipDepth;
+		reader.ComputeMipLevelDimensions( iMip, &nMipWidth, &nMipHeight, &nMipDepth );
+		int nSlices[2] = { 0, nMipDepth - 1 };
+		for ( int i = 0; i < 8; ++i )
+		{
+			int nSize;
+			const uint8 *pData = reader.ImageData( nFrames[i & 1], nFaces[( i >> 1 ) & 1], iMip, nSlices[i >> 2], &nSize );
+			if ( pData && !IsInBuffer( pData, nSize, pBuffer, nBufferSize ) )
+			{
+				*ppWhat = "image";
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+struct FuzzStats_t
+{
+	int		m_nInputs;
+	int		m_nOpened;
+	int		m_nFailures;
+};
+
+// Opens a copy of the first nSize bytes of pData, in a buffer of exactly that size
+static void FuzzOne( const char *pFileName, const uint8 *pData, size_t nSize, const char *pKind, FuzzStats_t &stats )
+{
+	uint8 *pCopy = (uint8 *)malloc( MAX( nSize, (size_t)1 ) );
+	memcpy( pCopy, pData, nSize );
+
+	CVTFReader reader;
+	++stats.m_nInputs;
+	if ( reader.OpenMemory( pCopy, nSize ) )
+	{
+		++stats.m_nOpened;
+		const char *pWhat;
+		if ( !CheckReader( reader, pCopy, nSize, &pWhat ) )
+		{
+			++stats.m_nFailures;
+			fprintf( stderr, "error: %s, %s input of %u bytes: %s data out of range\n", pFileName, pKind, (uint32)nSize, pWhat );
+		}
+	}
+	reader.Close();
+	free( pCopy );
+}
+
+static void FuzzFile( const char *pFileName, int nMutations, FuzzStats_t &stats )
+{
+	CUtlVector< uint8 > file;
+	FILE *fp = fopen( pFileName, "rb" );
+	if ( !fp )
+		return;
+	fseek( fp, 0, SEEK_END );
+	long nFileSize = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+	file.SetCount( MAX( nFileSize, 0L ) );
+	bool bRead = fread( file.Base(), 1, file.Count(), fp ) == (size_t)file.Count();
+	fclose( fp );
+	if ( !bRead || file.Count() == 0 )
+		return;
+
+	// Header and dictionary, where the parser does its work
+	size_t nHeaderSize = file.Count();
+	CVTFReader reader;
+	if ( reader.OpenMemory( file.Base(), file.Count() ) )
+	{
+		nHeaderSize = 0x50 + reader.ResourceCount() * sizeof( ResourceEntryInfo );
+	}
+	reader.Close();
+	nHeaderSize = MIN( MAX( nHeaderSize, (size_t)sizeof( VTFFileBaseHeader_t ) ), (size_t)file.Count() );
+
+	for ( size_t i = 0; i <= nHeaderSize; ++i )
+	{
+		FuzzOne( pFileName, file.Base(), i, "truncated", stats );
+	}
+	for ( int i = 1; i <= FUZZ_TRUNCATION_STEPS; ++i )
+	{
+		size_t nSize = nHeaderSize + ( file.Count() - nHeaderSize ) * i / FUZZ_TRUNCATION_STEPS;
+		FuzzOne( pFileName, file.Base(), nSize, "truncated", stats );
+	}
+
+	CUtlVector< uint8 > mutated;
+	for ( int i = 0; i < nMutations; ++i )
+	{
+		mutated.CopyArray( file.Base(), file.Count() );
+		int nChanges = 1 + RandomUint32() % 8;
+		for ( int j = 0; j < nChanges; ++j )
+		{
+			uint32 nOffset = RandomUint32() % nHeaderSize;
+			switch ( RandomUint32() % 3 )
+			{
+			case 0:		mutated[nOffset] ^= 1 << ( RandomUint32() % 8 ); break;
+			case 1:		mutated[nOffset] = (uint8)RandomUint32(); break;
+			default:	mutated[nOffset] = ( RandomUint32() & 1 ) ? 0xff : 0x00; break;
+			}
+		}
+
+		// Some of them truncated as well
+		size_t nSize = mutated.Count();
+		if ( RandomUint32() % 4 == 0 )
+		{
+			nSize = RandomUint32() % ( nSize + 1 );
+		}
+		FuzzOne( pFileName, mutated.Base(), nSize, "mutated", stats );
+	}
+}
+
+static void PrintUsage()
+{
+	printf( "usage: vtfscan [-header bytes] [-fuzz n] [-seed n] materials_folder\n" );
+}
+
+int main( int argc, char **argv )
+{
+	int nHeaderBytes = DEFAULT_HEADER_BYTES;
+	int nMutations = -1;
+	const char *pFolder = NULL;
+
+	for ( int i = 1; i < argc; ++i )
+	{
+		const char *pArg = argv[i];
+		bool bHasValue = i + 1 < argc;
+		if ( !V_stricmp( pArg, "-header" ) && bHasValue )
+		{
+			nHeaderBytes = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( pArg, "-fuzz" ) && bHasValue )
+		{
+			nMutations = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( pArg, "-seed" ) && bHasValue )
+		{
+			s_nRandomState = (uint32)atoi( argv[++i] ) | 1;
+		}
+		else if ( pArg[0] == '-' || pFolder )
+		{
+			PrintUsage();
+			return 1;
+		}
+		else
+		{
+			pFolder = pArg;
+		}
+	}
+	if ( !pFolder )
+	{
+		PrintUsage();
+		return 1;
+	}
+	nHeaderBytes = MAX( nHeaderBytes, (int)sizeof( VTFFileBaseHeader_t ) );
+
+	CUtlVector< CUtlString > files;
+	double flStart = Plat_FloatTime();
+	AddFolder( pFolder, "vtf", files );
+	double flListTime = Plat_FloatTime() - flStart;
+
+	ScanStats_t scan;
+	V_memset( &scan, 0, sizeof( scan ) );
+	CUtlVector< uint8 > buffer;
+	buffer.SetCount( nHeaderBytes );
+	for ( int i = 0; i < files.Count(); ++i )
+	{
+		ScanFile( files[i].Get(), buffer, scan );
+	}
+
+	printf( "%d files listed in %.3fs\n", files.Count(), flListTime );
+	printf( "%d parsed, %d rejected, %.1f MB read\n", scan.m_nParsed, scan.m_nFiles - scan.m_nParsed, scan.m_nBytesRead / ( 1024.0 * 1024.0 ) );
+	printf( "open+read %.3fs (%.1f us/file), parse %.3fs (%.2f us/file)\n",
+		scan.m_flReadTime, 1e6 * scan.m_flReadTime / MAX( scan.m_nFiles, 1 ),
+		scan.m_flParseTime, 1e6 * scan.m_flParseTime / MAX( scan.m_nFiles, 1 ) );
+
+	if ( nMutations < 0 )
+		return 0;
+
+	FuzzStats_t fuzz;
+	V_memset( &fuzz, 0, sizeof( fuzz ) );
+	flStart = Plat_FloatTime();
+	for ( int i = 0; i < files.Count(); ++i )
+	{
+		FuzzFile( files[i].Get(), nMutations, fuzz );
+	}
+	printf( "fuzz: %d inputs, %d opened, %d out of range (%.1fs)\n", fuzz.m_nInputs, fuzz.m_nOpened, fuzz.m_nFailures,
+		Plat_FloatTime() - flStart );
+	return fuzz.m_nFailures ? 1 : 0;
+}
@@ -0,0 +1,629 @@
+//==================================================================================================
+//
+// Memory mapped VTF reader
+//
+// The header is read field by field at the offsets PC builds of vtex write, not through the
+// VTFFileHeader_t structures: their size depends on the compiler padding the VectorAligned
+// reflectivity, which is the quirk vtf.h warns about.
+//
+//==================================================================================================
+
+#if defined( _WIN32 )
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <limits.h>
+
+#include "vtf/vtfreader.h"
+#include "vtf/vtf.h"
+#include "tier1/strtools.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// Field offsets of the PC header
+#define VTF_OFFSET_VERSION			4
+#define VTF_OFFSET_HEADER_SIZE		12
+#define VTF_OFFSET_WIDTH			16
+#define VTF_OFFSET_HEIGHT			18
+#define VTF_OFFSET_FLAGS			20
+#define VTF_OFFSET_FRAMES			24
+#define VTF_OFFSET_START_FRAME		26
+#define VTF_OFFSET_REFLECTIVITY		32		// 4 bytes of padding before the VectorAligned
+#define VTF_OFFSET_BUMP_SCALE		48
+#define VTF_OFFSET_FORMAT			52
+#define VTF_OFFSET_MIP_COUNT		56
+#define VTF_OFFSET_LOW_RES_FORMAT	57
+#define VTF_OFFSET_LOW_RES_WIDTH	61
+#define VTF_OFFSET_LOW_RES_HEIGHT	62
+#define VTF_OFFSET_DEPTH			63		// 7.2 and later
+#define VTF_OFFSET_RESOURCE_COUNT	68		// 7.3 and later, after 3 bytes of padding
+#define VTF_OFFSET_RESOURCES		80		// The structure is padded to 16 bytes
+
+// Smallest headerSize each version can have
+#define VTF_HEADER_SIZE_7_0			63
+#define VTF_HEADER_SIZE_7_2			65
+#define VTF_HEADER_SIZE_7_3			72
+
+#define VTF_RSRC_TYPE_MASK			( ~(uint32)RSRCF_MASK )
+
+static inline uint16 ReadUint16( const uint8 *p )
+{
+	return (uint16)( p[0] | ( p[1] << 8 ) );
+}
+
+static inline uint32 ReadUint32( const uint8 *p )
+{
+	return (uint32)p[0] | ( (uint32)p[1] << 8 ) | ( (uint32)p[2] << 16 ) | ( (uint32)p[3] << 24 );
+}
+
+static inline float ReadFloat( const uint8 *p )
+{
+	uint32 nBits = ReadUint32( p );
+	float flValue;
+	V_memcpy( &flValue, &nBits, sizeof( flValue ) );
+	return flValue;
+}
+
+//-----------------------------------------------------------------------------
+// Bytes per texel, or per 4x4 block for the compressed formats
+//-----------------------------------------------------------------------------
+struct VTFFormatSize_t
+{
+	uint8	m_nBytes;
+	bool	m_bCompressed;
+};
+
+static const VTFFormatSize_t s_FormatSizes[] =
+{
+	{ 4, false },	// IMAGE_FORMAT_RGBA8888
+	{ 4, false },	// IMAGE_FORMAT_ABGR8888
+	{ 3, false },	// IMAGE_FORMAT_RGB888
+	{ 3, false },	// IMAGE_FORMAT_BGR888
+	{ 2, false },	// IMAGE_FORMAT_RGB565
+	{ 1, false },	// IMAGE_FORMAT_I8
+	{ 2, false },	// IMAGE_FORMAT_IA88
+	{ 1, false },	// IMAGE_FORMAT_P8
+	{ 1, false },	// IMAGE_FORMAT_A8
+	{ 3, false },	// IMAGE_FORMAT_RGB888_BLUESCREEN
+	{ 3, false },	// IMAGE_FORMAT_BGR888_BLUESCREEN
+	{ 4, false },	// IMAGE_FORMAT_ARGB8888
+	{ 4, false },	// IMAGE_FORMAT_BGRA8888
+	{ 8, true },	// IMAGE_FORMAT_DXT1
+	{ 16, true },	// IMAGE_FORMAT_DXT3
+	{ 16, true },	// IMAGE_FORMAT_DXT5
+	{ 4, false },	// IMAGE_FORMAT_BGRX8888
+	{ 2, false },	// IMAGE_FORMAT_BGR565
+	{ 2, false },	// IMAGE_FORMAT_BGRX5551
+	{ 2, false },	// IMAGE_FORMAT_BGRA4444
+	{ 8, true },	// IMAGE_FORMAT_DXT1_ONEBITALPHA
+	{ 2, false },	// IMAGE_FORMAT_BGRA5551
+	{ 2, false },	// IMAGE_FORMAT_UV88
+	{ 4, false },	// IMAGE_FORMAT_UVWQ8888
+	{ 8, false },	// IMAGE_FORMAT_RGBA16161616F
+	{ 8, false },	// IMAGE_FORMAT_RGBA16161616
+	{ 4, false },	// IMAGE_FORMAT_UVLX8888
+	{ 4, false },	// IMAGE_FORMAT_R32F
+	{ 12, false },	// IMAGE_FORMAT_RGB323232F
+	{ 16, false },	// IMAGE_FORMAT_RGBA32323232F
+	{ 4, false },	// IMAGE_FORMAT_RG1616F
+	{ 8, false },	// IMAGE_FORMAT_RG3232F
+	{ 4, false },	// IMAGE_FORMAT_RGBX8888
+	{ 0, false },	// IMAGE_FORMAT_NULL
+	{ 16, true },	// IMAGE_FORMAT_ATI2N
+	{ 8, true },	// IMAGE_FORMAT_ATI1N
+	{ 4, false },	// IMAGE_FORMAT_RGBA1010102
+	{ 4, false },	// IMAGE_FORMAT_BGRA1010102
+	{ 2, false },	// IMAGE_FORMAT_R16F
+	{ 2, false },	// IMAGE_FORMAT_D16
+	{ 2, false },	// IMAGE_FORMAT_D15S1
+	{ 4, false },	// IMAGE_FORMAT_D32
+	{ 4, false },	// IMAGE_FORMAT_D24S8
+	{ 4, false },	// IMAGE_FORMAT_LINEAR_D24S8
+	{ 4, false },	// IMAGE_FORMAT_D24X8
+	{ 4, false },	// IMAGE_FORMAT_D24X4S4
+	{ 4, false },	// IMAGE_FORMAT_D24FS8
+	{ 2, false },	// IMAGE_FORMAT_D16_SHADOW
+	{ 4, false },	// IMAGE_FORMAT_D24X8_SHADOW
+	{ 4, false },	// IMAGE_FORMAT_LINEAR_BGRX8888
+	{ 4, false },	// IMAGE_FORMAT_LINEAR_RGBA8888
+	{ 4, false },	// IMAGE_FORMAT_LINEAR_ABGR8888
+	{ 4, false },	// IMAGE_FORMAT_LINEAR_ARGB8888
+	{ 4, false },	// IMAGE_FORMAT_LINEAR_BGRA8888
+	{ 3, false },	// IMAGE_FORMAT_LINEAR_RGB888
+	{ 3, false },	// IMAGE_FORMAT_LINEAR_BGR888
+	{ 2, false },	// IMAGE_FORMAT_LINEAR_BGRX5551
+	{ 1, false },	// IMAGE_FORMAT_LINEAR_I8
+	{ 8, false },	// IMAGE_FORMAT_LINEAR_RGBA16161616
+	{ 4, false },	// IMAGE_FORMAT_LE_BGRX8888
+	{ 4, false },	// IMAGE_FORMAT_LE_BGRA8888
+};
+
+COMPILE_TIME_ASSERT( ARRAYSIZE( s_FormatSizes ) == NUM_IMAGE_FORMATS );
+
+int CVTFReader::ImageSize( ImageFormat fmt, int nWidth, int nHeight, int nDepth )
+{
+	if ( fmt < 0 || fmt >= NUM_IMAGE_FORMATS )
+		return 0;
+
+	const VTFFormatSize_t &size = s_FormatSizes[fmt];
+	int64 nTexels;
+	if ( size.m_bCompressed )
+	{
+		nTexels = (int64)( ( nWidth + 3 ) >> 2 ) * ( ( nHeight + 3 ) >> 2 ) * nDepth;
+	}
+	else
+	{
+		nTexels = (int64)nWidth * nHeight * nDepth;
+	}
+	int64 nSize = nTexels * size.m_nBytes;
+	return nSize <= INT_MAX ? (int)nSize : 0;
+}
+
+//-----------------------------------------------------------------------------
+// Constructor, destructor
+//-----------------------------------------------------------------------------
+CVTFReader::CVTFReader()
+{
+	m_pMapping = NULL;
+	m_nMappingSize = 0;
+#ifdef _WIN32
+	m_hFile = INVALID_HANDLE_VALUE;
+	m_hFileMapping = NULL;
+#endif
+	m_pFile = NULL;
+	Close();
+}
+
+CVTFReader::~CVTFReader()
+{
+	Close();
+}
+
+//-----------------------------------------------------------------------------
+// Opening and closing
+//-----------------------------------------------------------------------------
+bool CVTFReader::Open( const char *pFileName )
+{
+	Close();
+
+#ifdef _WIN32
+	m_hFile = CreateFile( pFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL );
+	if ( m_hFile == INVALID_HANDLE_VALUE )
+		return false;
+
+	LARGE_INTEGER nSize;
+	if ( !GetFileSizeEx( (HANDLE)m_hFile, &nSize ) || nSize.QuadPart <= 0 || nSize.QuadPart > INT_MAX )
+	{
+		Close();
+		return false;
+	}
+
+	m_hFileMapping = CreateFileMapping( (HANDLE)m_hFile, NULL, PAGE_READONLY, 0, 0, NULL );
+	if ( !m_hFileMapping )
+	{
+		Close();
+		return false;
+	}
+
+	m_pMapping = MapViewOfFile( (HANDLE)m_hFileMapping, FILE_MAP_READ, 0, 0, 0 );
+	m_nMappingSize = (size_t)nSize.QuadPart;
+#else
+	int fd = open( pFileName, O_RDONLY );
+	if ( fd < 0 )
+		return false;
+
+	struct stat fileStat;
+	if ( fstat( fd, &fileStat ) != 0 || fileStat.st_size <= 0 || fileStat.st_size > INT_MAX )
+	{
+		close( fd );
+		return false;
+	}
+
+	void *pMapping = mmap( NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	m_pMapping = ( pMapping != MAP_FAILED ) ? pMapping : NULL;
+	m_nMappingSize = fileStat.st_size;
+#endif
+
+	if ( !m_pMapping )
+	{
+		Close();
+		return false;
+	}
+
+	m_pFile = (const uint8 *)m_pMapping;
+	m_nFileSize = m_nMappingSize;
+	m_nDataSize = m_nMappingSize;
+	if ( !Parse() )
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+bool CVTFReader::OpenMemory( const void *pData, size_t nSize )
+{
+	Close();
+	if ( !pData || nSize > INT_MAX )
+		return false;
+
+	m_pFile = (const uint8 *)pData;
+	m_nFileSize = nSize;
+	m_nDataSize = nSize;
+	if ( !Parse() )
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+bool CVTFReader::OpenHeader( const void *pData, size_t nDataSize, size_t nFileSize )
+{
+	Close();
+	if ( !pData || nDataSize > nFileSize || nFileSize > INT_MAX )
+		return false;
+
+	m_pFile = (const uint8 *)pData;
+	m_nFileSize = nFileSize;
+	m_nDataSize = nDataSize;
+	if ( !Parse() )
+	{
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void CVTFReader::Close()
+{
+	if ( m_pMapping )
+	{
+#ifdef _WIN32
+		UnmapViewOfFile( m_pMapping );
+#else
+		munmap( m_pMapping, m_nMappingSize );
+#endif
+		m_pMapping = NULL;
+		m_nMappingSize = 0;
+	}
+#ifdef _WIN32
+	if ( m_hFileMapping )
+	{
+		CloseHandle( (HANDLE)m_hFileMapping );
+		m_hFileMapping = NULL;
+	}
+	if ( m_hFile != INVALID_HANDLE_VALUE )
+	{
+		CloseHandle( (HANDLE)m_hFile );
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+#endif
+
+	m_pFile = NULL;
+	m_nFileSize = 0;
+	m_nDataSize = 0;
+	m_nMajorVersion = m_nMinorVersion = 0;
+	m_nWidth = m_nHeight = m_nDepth = 0;
+	m_nMipCount = m_nFrameCount = m_nStartFrame = m_nFaceCount = 0;
+	m_nFlags = 0;
+	m_Format = IMAGE_FORMAT_UNKNOWN;
+	m_flBumpScale = 1.0f;
+	m_vecReflectivity.Init();
+	m_nLowResWidth = m_nLowResHeight = 0;
+	m_LowResFormat = IMAGE_FORMAT_UNKNOWN;
+	m_nLowResOffset = 0;
+	m_nLowResSize = 0;
+	m_pResources = NULL;
+	m_nResourceCount = 0;
+	m_nImageOffset = 0;
+	V_memset( m_nMipOffset, 0, sizeof( m_nMipOffset ) );
+	V_memset( m_nMipSize, 0, sizeof( m_nMipSize ) );
+}
+
+//-----------------------------------------------------------------------------
+// Header parsing
+//-----------------------------------------------------------------------------
+bool CVTFReader::Parse()
+{
+	const uint8 *p = m_pFile;
+	if ( m_nDataSize < VTF_OFFSET_RESOURCE_COUNT || V_memcmp( p, "VTF", 4 ) )
+		return false;
+
+	m_nMajorVersion = (int)ReadUint32( p + VTF_OFFSET_VERSION );
+	m_nMinorVersion = (int)ReadUint32( p + VTF_OFFSET_VERSION + 4 );
+	if ( m_nMajorVersion != VTF_MAJOR_VERSION || m_nMinorVersion < 0 || m_nMinorVersion > VTF_MINOR_VERSION )
+		return false;
+
+	uint32 nHeaderSize = ReadUint32( p + VTF_OFFSET_HEADER_SIZE );
+	uint32 nMinHeaderSize = ( m_nMinorVersion >= 3 ) ? VTF_HEADER_SIZE_7_3 : ( m_nMinorVersion >= 2 ) ? VTF_HEADER_SIZE_7_2 : VTF_HEADER_SIZE_7_0;
+	if ( nHeaderSize < nMinHeaderSize || nHeaderSize > m_nDataSize )
+		return false;
+
+	m_nWidth = ReadUint16( p + VTF_OFFSET_WIDTH );
+	m_nHeight = ReadUint16( p + VTF_OFFSET_HEIGHT );
+	m_nFlags = (int)ReadUint32( p + VTF_OFFSET_FLAGS );
+	m_nFrameCount = ReadUint16( p + VTF_OFFSET_FRAMES );
+	m_nStartFrame = ReadUint16( p + VTF_OFFSET_START_FRAME );
+	m_vecReflectivity.Init( ReadFloat( p + VTF_OFFSET_REFLECTIVITY ), ReadFloat( p + VTF_OFFSET_REFLECTIVITY + 4 ), ReadFloat( p + VTF_OFFSET_REFLECTIVITY + 8 ) );
+	m_flBumpScale = ReadFloat( p + VTF_OFFSET_BUMP_SCALE );
+	int nFormat = (int)ReadUint32( p + VTF_OFFSET_FORMAT );
+	m_nMipCount = p[VTF_OFFSET_MIP_COUNT];
+	int nLowResFormat = (int)ReadUint32( p + VTF_OFFSET_LOW_RES_FORMAT );
+	m_nLowResWidth = p[VTF_OFFSET_LOW_RES_WIDTH];
+	m_nLowResHeight = p[VTF_OFFSET_LOW_RES_HEIGHT];
+	m_nDepth = ( m_nMinorVersion >= 2 ) ? ReadUint16( p + VTF_OFFSET_DEPTH ) : 1;
+
+	// Some older tools wrote a depth of 0 for 2D textures
+	m_nDepth = MAX( m_nDepth, 1 );
+	if ( m_nWidth == 0 || m_nHeight == 0 || m_nFrameCount == 0 )
+		return false;
+	if ( nFormat < 0 || nFormat >= NUM_IMAGE_FORMATS )
+		return false;
+	m_Format = (ImageFormat)nFormat;
+
+	// A mip chain stops at 1x1x1
+	int nMaxMips = 1;
+	while ( ( m_nWidth >> nMaxMips ) || ( m_nHeight >> nMaxMips ) || ( m_nDepth >> nMaxMips ) )
+	{
+		++nMaxMips;
+	}
+	if ( m_nMipCount < 1 || m_nMipCount > nMaxMips )
+		return false;
+
+	// Envmaps before 7.5 carry a spheremap after the cube faces, unless the start frame says otherwise
+	m_nFaceCount = 1;
+	if ( m_nFlags & TEXTUREFLAGS_ENVMAP )
+	{
+		m_nFaceCount = ( m_nMinorVersion < 5 && m_nStartFrame != 0xffff ) ? CUBEMAP_FACE_COUNT + 1 : CUBEMAP_FACE_COUNT;
+	}
+
+	if ( m_nLowResWidth && m_nLowResHeight )
+	{
+		if ( nLowResFormat < 0 || nLowResFormat >= NUM_IMAGE_FORMATS )
+			return false;
+		m_LowResFormat = (ImageFormat)nLowResFormat;
+		m_nLowResSize = ImageSize( m_LowResFormat, m_nLowResWidth, m_nLowResHeight, 1 );
+	}
+	else
+	{
+		m_nLowResWidth = m_nLowResHeight = 0;
+		m_nLowResSize = 0;
+	}
+
+	uint32 nLowResOffset = 0;
+	uint32 nImageOffset = 0;
+	if ( m_nMinorVersion >= 3 )
+	{
+		if ( !ParseResources( &nLowResOffset, &nImageOffset ) )
+			return false;
+	}
+	else
+	{
+		// The low-res image, then the image data, right after the header
+		nLowResOffset = nHeaderSize;
+		nImageOffset = nHeaderSize + m_nLowResSize;
+	}
+
+	if ( !nLowResOffset )
+	{
+		// 7.3 files can describe a low-res image without having the resource
+		m_nLowResSize = 0;
+	}
+	else if ( m_nLowResSize )
+	{
+		if ( (uint64)nLowResOffset + m_nLowResSize > m_nFileSize )
+			return false;
+		m_nLowResOffset = nLowResOffset;
+	}
+
+	// Mips are stored smallest first, each with every frame and face
+	uint64 nOffset = nImageOffset;
+	for ( int i = m_nMipCount - 1; i >= 0; --i )
+	{
+		int nMipWidth, nMipHeight, nMipDepth;
+		ComputeMipLevelDimensions( i, &nMipWidth, &nMipHeight, &nMipDepth );
+		m_nMipSize[i] = ImageSize( m_Format, nMipWidth, nMipHeight, nMipDepth );
+		if ( !m_nMipSize[i] && m_Format != IMAGE_FORMAT_NULL )
+			return false;
+		m_nMipOffset[i] = (uint32)MIN( nOffset, (uint64)UINT_MAX );
+		nOffset += (uint64)m_nMipSize[i] * m_nFrameCount * m_nFaceCount;
+	}
+
+	if ( nImageOffset )
+	{
+		if ( nOffset > m_nFileSize )
+			return false;
+		m_nImageOffset = nImageOffset;
+	}
+	return true;
+}
+
+bool CVTFReader::ParseResources( uint32 *pLowResOffset, uint32 *pImageOffset )
+{
+	uint32 nCount = ReadUint32( m_pFile + VTF_OFFSET_RESOURCE_COUNT );
+	if ( nCount > MAX_RSRC_DICTIONARY_ENTRIES || VTF_OFFSET_RESOURCES + (uint64)nCount * sizeof( ResourceEntryInfo ) > m_nDataSize )
+		return false;
+
+	m_pResources = m_pFile + VTF_OFFSET_RESOURCES;
+	m_nResourceCount = nCount;
+
+	for ( uint32 i = 0; i < nCount; ++i )
+	{
+		const uint8 *pEntry = m_pResources + i * sizeof( ResourceEntryInfo );
+		uint32 eType = ReadUint32( pEntry );
+		uint32 nData = ReadUint32( pEntry + 4 );
+		if ( eType & RSRCF_HAS_NO_DATA_CHUNK )
+			continue;
+
+		switch ( eType & VTF_RSRC_TYPE_MASK )
+		{
+		case VTF_LEGACY_RSRC_LOW_RES_IMAGE:
+			*pLowResOffset = nData;
+			break;
+
+		case VTF_LEGACY_RSRC_IMAGE:
+			if ( nData >= m_nFileSize )
+				return false;
+			*pImageOffset = nData;
+			break;
+
+		default:
+			// Other resources start with the size of their data. Past the end of the data in
+			// memory only the offset can be checked, GetResourceData doesn't return those
+			if ( (uint64)nData + sizeof( uint32 ) > m_nFileSize )
+				return false;
+			if ( (uint64)nData + sizeof( uint32 ) <= m_nDataSize && (uint64)nData + sizeof( uint32 ) + ReadUint32( m_pFile + nData ) > m_nFileSize )
+				return false;
+			break;
+		}
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Resources
+//-----------------------------------------------------------------------------
+const uint8 *CVTFReader::FindResource( uint32 eType ) const
+{
+	eType &= VTF_RSRC_TYPE_MASK;
+	for ( int i = 0; i < m_nResourceCount; ++i )
+	{
+		const uint8 *pEntry = m_pResources + i * sizeof( ResourceEntryInfo );
+		if ( ( ReadUint32( pEntry ) & VTF_RSRC_TYPE_MASK ) == eType )
+			return pEntry;
+	}
+	return NULL;
+}
+
+uint32 CVTFReader::ResourceType( int nResource ) const
+{
+	Assert( nResource >= 0 && nResource < m_nResourceCount );
+	return ReadUint32( m_pResources + nResource * sizeof( ResourceEntryInfo ) ) & VTF_RSRC_TYPE_MASK;
+}
+
+bool CVTFReader::HasResourceEntry( uint32 eType ) const
+{
+	return FindResource( eType ) != NULL;
+}
+
+const void *CVTFReader::GetResourceData( uint32 eType, size_t *pDataSize ) const
+{
+	const uint8 *pEntry = FindResource( eType );
+	if ( !pEntry )
+	{
+		if ( pDataSize )
+		{
+			*pDataSize = 0;
+		}
+		return NULL;
+	}
+
+	size_t nSize;
+	const uint8 *pData;
+	uint32 nData = ReadUint32( pEntry + 4 );
+	switch ( eType & VTF_RSRC_TYPE_MASK )
+	{
+	case VTF_LEGACY_RSRC_LOW_RES_IMAGE:
+		pData = LowResImageData();
+		nSize = m_nLowResSize;
+		break;
+
+	case VTF_LEGACY_RSRC_IMAGE:
+		pData = ( m_nImageOffset && m_nImageOffset < m_nDataSize ) ? m_pFile + m_nImageOffset : NULL;
+		nSize = pData ? m_nDataSize - m_nImageOffset : 0;
+		break;
+
+	default:
+		if ( ReadUint32( pEntry ) & RSRCF_HAS_NO_DATA_CHUNK )
+		{
+			pData = pEntry + 4;
+			nSize = sizeof( uint32 );
+		}
+		else
+		{
+			// Validated by ParseResources
+			pData = NULL;
+			nSize = 0;
+			if ( (uint64)nData + sizeof( uint32 ) <= m_nDataSize && (uint64)nData + sizeof( uint32 ) + ReadUint32( m_pFile + nData ) <= m_nDataSize )
+			{
+				pData = m_pFile + nData + sizeof( uint32 );
+				nSize = ReadUint32( m_pFile + nData );
+			}
+		}
+		break;
+	}
+
+	if ( pDataSize )
+	{
+		*pDataSize = nSize;
+	}
+	return pData;
+}
+
+//-----------------------------------------------------------------------------
+// Image data
+//-----------------------------------------------------------------------------
+const uint8 *CVTFReader::LowResImageData( int *pSizeInBytes ) const
+{
+	bool bPresent = m_nLowResSize && (uint64)m_nLowResOffset + m_nLowResSize <= m_nDataSize;
+	if ( pSizeInBytes )
+	{
+		*pSizeInBytes = bPresent ? m_nLowResSize : 0;
+	}
+	return bPresent ? m_pFile + m_nLowResOffset : NULL;
+}
+
+void CVTFReader::ComputeMipLevelDimensions( int iMipLevel, int *pMipWidth, int *pMipHeight, int *pMipDepth ) const
+{
+	*pMipWidth = MAX( m_nWidth >> iMipLevel, 1 );
+	*pMipHeight = MAX( m_nHeight >> iMipLevel, 1 );
+	*pMipDepth = MAX( m_nDepth >> iMipLevel, 1 );
+}
+
+int CVTFReader::ComputeMipSize( int iMipLevel ) const
+{
+	Assert( iMipLevel >= 0 && iMipLevel < m_nMipCount );
+	return m_nMipSize[iMipLevel];
+}
+
+void CVTFReader::ImageFileInfo( int nFrame, int nFace, int nMip, int *pStartLocation, int *pSizeInBytes ) const
+{
+	Assert( nFrame >= 0 && nFrame < m_nFrameCount && nFace >= 0 && nFace < m_nFaceCount && nMip >= 0 && nMip < m_nMipCount );
+	int64 nStart = m_nMipOffset[nMip] + (int64)( nFrame * m_nFaceCount + nFace ) * m_nMipSize[nMip];
+	*pStartLocation = (int)MIN( nStart, (int64)INT_MAX );
+	*pSizeInBytes = m_nMipSize[nMip];
+}
+
+const uint8 *CVTFReader::ImageData( int iFrame, int iFace, int iMipLevel, int iSlice, int *pSizeInBytes ) const
+{
+	if ( pSizeInBytes )
+	{
+		*pSizeInBytes = 0;
+	}
+	if ( !m_nImageOffset || iFrame < 0 || iFrame >= m_nFrameCount || iFace < 0 || iFace >= m_nFaceCount || iMipLevel < 0 || iMipLevel >= m_nMipCount )
+		return NULL;
+
+	int nMipWidth, nMipHeight, nMipDepth;
+	ComputeMipLevelDimensions( iMipLevel, &nMipWidth, &nMipHeight, &nMipDepth );
+	if ( iSlice < 0 || iSlice >= nMipDepth )
+		return NULL;
+
+	int nStart, nSize;
+	ImageFileInfo( iFrame, iFace, iMipLevel, &nStart, &nSize );
+	int nSliceSize = nSize / nMipDepth;
+	if ( (uint64)nStart + (uint64)( iSlice + 1 ) * nSliceSize > m_nDataSize )
+		return NULL;
+	if ( pSizeInBytes )
+	{
+		*pSizeInBytes = nSliceSize;
+	}
+	return m_pFile + nStart + iSlice * nSliceSize;
+}
@@ -0,0 +1,468 @@
+//==================================================================================================
+//
+// Mip-tail-first VTF loading
+//
+// Each texture keeps its header and tail in memory for as long as it is open. Larger mips are
+// loaded one level at a time, so a texture asked for at full size still gets every intermediate
+// mip before the top one, and the queue can move on to more urgent textures in between.
+//
+//==================================================================================================
+
+#include <stdio.h>
+#include <math.h>
+
+#include "vtf/vtfstreamer.h"
+#include "vtf/vtf.h"
+#include "tier1/strtools.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+// First read of a file, enough for the header, the dictionary and the resources before the image
+// data. Small textures are read whole
+#define VTF_STREAM_HEADER_READ_SIZE		( 64 * 1024 )
+
+//-----------------------------------------------------------------------------
+// Constructor, destructor
+//-----------------------------------------------------------------------------
+CVTFStreamer::CVTFStreamer() : m_Requests( 0, 0, RequestLessFunc )
+{
+	m_hLoaderThread = NULL;
+	m_bExit = false;
+	m_bLoading = false;
+	m_nResidentMemory = 0;
+}
+
+CVTFStreamer::~CVTFStreamer()
+{
+	Shutdown();
+}
+
+//-----------------------------------------------------------------------------
+// Init, shutdown
+//-----------------------------------------------------------------------------
+bool CVTFStreamer::Init()
+{
+	Assert( !m_hLoaderThread );
+	m_bExit = false;
+	m_hLoaderThread = CreateSimpleThread( LoaderThreadFunc, this );
+	return m_hLoaderThread != NULL;
+}
+
+void CVTFStreamer::Shutdown()
+{
+	if ( m_hLoaderThread )
+	{
+		m_Mutex.Lock();
+		m_bExit = true;
+		m_Mutex.Unlock();
+		m_RequestEvent.Set();
+		ThreadJoin( m_hLoaderThread );
+		ReleaseThreadHandle( m_hLoaderThread );
+		m_hLoaderThread = NULL;
+	}
+
+	for ( int i = 0; i < m_Textures.Count(); ++i )
+	{
+		if ( m_Textures[i]->m_bInUse )
+		{
+			Close( i );
+		}
+		delete m_Textures[i];
+	}
+	m_Textures.Purge();
+	m_FreeTextures.Purge();
+	m_Requests.RemoveAll();
+}
+
+//-----------------------------------------------------------------------------
+// Queue order: the texture the most magnified relative to its resident mip first
+//-----------------------------------------------------------------------------
+bool CVTFStreamer::RequestLessFunc( const MipRequest_t &a, const MipRequest_t &b )
+{
+	return a.m_flPriority < b.m_flPriority;
+}
+
+CVTFStreamer::StreamingTexture_t *CVTFStreamer::GetTexture( VTFStreamHandle_t hTexture ) const
+{
+	if ( hTexture < 0 || hTexture >= m_Textures.Count() || !m_Textures[hTexture]->m_bInUse )
+	{
+		Assert( 0 );
+		return NULL;
+	}
+	return m_Textures[hTexture];
+}
+
+//-----------------------------------------------------------------------------
+// Bytes of one mip level, every frame and face, and where they start in the file
+//-----------------------------------------------------------------------------
+int CVTFStreamer::MipFileRange( const StreamingTexture_t *pTexture, int nMip, int *pStart ) const
+{
+	const CVTFReader &header = pTexture->m_Header;
+	int nSize;
+	header.ImageFileInfo( 0, 0, nMip, pStart, &nSize );
+	return nSize * header.FrameCount() * header.FaceCount();
+}
+
+bool CVTFStreamer::ReadFileRange( const char *pFileName, int nStart, int nSize, uint8 *pDest ) const
+{
+	FILE *fp = fopen( pFileName, "rb" );
+	if ( !fp )
+		return false;
+	bool bSuccess = fseek( fp, nStart, SEEK_SET ) == 0 && fread( pDest, 1, nSize, fp ) == (size_t)nSize;
+	fclose( fp );
+	return bSuccess;
+}
+
+//-----------------------------------------------------------------------------
+// Opening and closing
+//-----------------------------------------------------------------------------
+VTFStreamHandle_t CVTFStreamer::Open( const char *pFileName, int nTailSize, int nPicMip )
+{
+	FILE *fp = fopen( pFileName, "rb" );
+	if ( !fp )
+		return VTF_STREAM_INVALID_HANDLE;
+
+	fseek( fp, 0, SEEK_END );
+	long nFileSize = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+	if ( nFileSize <= 0 )
+	{
+		fclose( fp );
+		return VTF_STREAM_INVALID_HANDLE;
+	}
+
+	int nFirstRead = MIN( nFileSize, VTF_STREAM_HEADER_READ_SIZE );
+	CUtlVector< uint8 > firstRead;
+	firstRead.SetCount( nFirstRead );
+	bool bRead = fread( firstRead.Base(), 1, nFirstRead, fp ) == (size_t)nFirstRead;
+	fclose( fp );
+
+	CVTFReader header;
+	if ( !bRead || !header.OpenHeader( firstRead.Base(), nFirstRead, nFileSize ) || !header.HasImageData() )
+		return VTF_STREAM_INVALID_HANDLE;
+
+	// Keep what comes before the image data, the tail starts with the smallest mip
+	int nLastMip = header.MipCount() - 1;
+	int nTailStart, nSize;
+	header.ImageFileInfo( 0, 0, nLastMip, &nTailStart, &nSize );
+	int nHeaderSize = MIN( nFirstRead, nTailStart );
+
+	StreamingTexture_t *pTexture = new StreamingTexture_t;
+	V_strncpy( pTexture->m_szFileName, pFileName, sizeof( pTexture->m_szFileName ) );
+	V_memset( pTexture->m_pMipData, 0, sizeof( pTexture->m_pMipData ) );
+	pTexture->m_pHeaderData = new uint8[nHeaderSize];
+	V_memcpy( pTexture->m_pHeaderData, firstRead.Base(), nHeaderSize );
+	if ( !pTexture->m_Header.OpenHeader( pTexture->m_pHeaderData, nHeaderSize, nFileSize ) )
+	{
+		// The header or its resources run past the start of the image data
+		delete[] pTexture->m_pHeaderData;
+		delete pTexture;
+		return VTF_STREAM_INVALID_HANDLE;
+	}
+	const CVTFReader &info = pTexture->m_Header;
+
+	// Largest mip the LOD settings allow at picmip 0
+	int nTopMip = 0;
+	const TextureLODControlSettings_t *pLOD = (const TextureLODControlSettings_t *)info.GetResourceData( VTF_RSRC_TEXTURE_LOD_SETTINGS, NULL );
+	if ( pLOD && pLOD->m_ResolutionClampX && pLOD->m_ResolutionClampY )
+	{
+		while ( nTopMip < nLastMip && ( ( info.Width() >> nTopMip ) > ( 1 << pLOD->m_ResolutionClampX ) || ( info.Height() >> nTopMip ) > ( 1 << pLOD->m_ResolutionClampY ) ) )
+		{
+			++nTopMip;
+		}
+	}
+	nTopMip = clamp( nTopMip + nPicMip, 0, nLastMip );
+
+	int nTailMip = nTopMip;
+	while ( nTailMip < nLastMip && MAX( info.Width() >> nTailMip, info.Height() >> nTailMip ) > nTailSize )
+	{
+		++nTailMip;
+	}
+
+	// The tail is contiguous
+	int nTailTopStart;
+	int nTailBytes = MipFileRange( pTexture, nTailMip, &nTailTopStart ) + nTailTopStart - nTailStart;
+	pTexture->m_pTailData = new uint8[nTailBytes];
+	if ( nTailStart + nTailBytes <= nFirstRead )
+	{
+		V_memcpy( pTexture->m_pTailData, firstRead.Base() + nTailStart, nTailBytes );
+	}
+	else if ( !ReadFileRange( pFileName, nTailStart, nTailBytes, pTexture->m_pTailData ) )
+	{
+		delete[] pTexture->m_pTailData;
+		delete[] pTexture->m_pHeaderData;
+		delete pTexture;
+		return VTF_STREAM_INVALID_HANDLE;
+	}
+
+	for ( int i = nTailMip; i <= nLastMip; ++i )
+	{
+		int nStart;
+		MipFileRange( pTexture, i, &nStart );
+		pTexture->m_pMipData[i] = pTexture->m_pTailData + nStart - nTailStart;
+	}
+
+	pTexture->m_nTailSize = nTailBytes;
+	pTexture->m_nTopMip = nTopMip;
+	pTexture->m_nTailMip = nTailMip;
+	pTexture->m_nResidentMip = nTailMip;
+	pTexture->m_nWantedMip = nTailMip;
+	pTexture->m_flScreenSize = 0.0f;
+	pTexture->m_nRequestSerial = 0;
+	pTexture->m_bInUse = true;
+
+	AUTO_LOCK( m_Mutex );
+	VTFStreamHandle_t hTexture;
+	if ( m_FreeTextures.Count() )
+	{
+		hTexture = m_FreeTextures.Tail();
+		m_FreeTextures.RemoveMultipleFromTail( 1 );
+		pTexture->m_nSerial = m_Textures[hTexture]->m_nSerial + 1;
+		delete m_Textures[hTexture];
+		m_Textures[hTexture] = pTexture;
+	}
+	else
+	{
+		pTexture->m_nSerial = 0;
+		hTexture = m_Textures.AddToTail( pTexture );
+	}
+	m_nResidentMemory += nTailBytes;
+	return hTexture;
+}
+
+void CVTFStreamer::Close( VTFStreamHandle_t hTexture )
+{
+	AUTO_LOCK( m_Mutex );
+	StreamingTexture_t *pTexture = GetTexture( hTexture );
+	if ( !pTexture )
+		return;
+
+	// The loader drops a mip that finishes after the texture is gone
+	FreeMips( pTexture, pTexture->m_nTailMip );
+	m_nResidentMemory -= pTexture->m_nTailSize;
+
+	pTexture->m_Header.Close();
+	delete[] pTexture->m_pTailData;
+	delete[] pTexture->m_pHeaderData;
+	pTexture->m_pTailData = NULL;
+	pTexture->m_pHeaderData = NULL;
+	V_memset( pTexture->m_pMipData, 0, sizeof( pTexture->m_pMipData ) );
+	pTexture->m_bInUse = false;
+	m_FreeTextures.AddToTail( hTexture );
+}
+
+//-----------------------------------------------------------------------------
+// Frees the streamed mips larger than nFirstKeptMip. Call with the mutex held
+//-----------------------------------------------------------------------------
+void CVTFStreamer::FreeMips( StreamingTexture_t *pTexture, int nFirstKeptMip )
+{
+	nFirstKeptMip = MIN( nFirstKeptMip, pTexture->m_nTailMip );
+	for ( int i = pTexture->m_nResidentMip; i < nFirstKeptMip; ++i )
+	{
+		int nStart;
+		m_nResidentMemory -= MipFileRange( pTexture, i, &nStart );
+		delete[] pTexture->m_pMipData[i];
+		pTexture->m_pMipData[i] = NULL;
+	}
+	pTexture->m_nResidentMip = MAX( pTexture->m_nResidentMip, nFirstKeptMip );
+}
+
+//-----------------------------------------------------------------------------
+// Requests
+//-----------------------------------------------------------------------------
+void CVTFStreamer::QueueRequest( VTFStreamHandle_t hTexture, StreamingTexture_t *pTexture )
+{
+	// Screen pixels per texel of the resident mip
+	const CVTFReader &info = pTexture->m_Header;
+	int nResidentSize = MAX( MAX( info.Width(), info.Height() ) >> pTexture->m_nResidentMip, 1 );
+
+	MipRequest_t request;
+	request.m_hTexture = hTexture;
+	request.m_nSerial = pTexture->m_nSerial;
+	request.m_nRequestSerial = pTexture->m_nRequestSerial;
+	request.m_flPriority = pTexture->m_flScreenSize / nResidentSize;
+	m_Requests.Insert( request );
+	m_RequestEvent.Set();
+}
+
+void CVTFStreamer::RequestScreenSize( VTFStreamHandle_t hTexture, float flScreenSize )
+{
+	AUTO_LOCK( m_Mutex );
+	StreamingTexture_t *pTexture = GetTexture( hTexture );
+	if ( !pTexture )
+		return;
+
+	// The mip whose larger side is at least the screen size
+	const CVTFReader &info = pTexture->m_Header;
+	int nMaxSize = MAX( info.Width(), info.Height() );
+	int nWantedMip = pTexture->m_nTailMip;
+	while ( nWantedMip > pTexture->m_nTopMip && ( nMaxSize >> nWantedMip ) < flScreenSize )
+	{
+		--nWantedMip;
+	}
+
+	pTexture->m_flScreenSize = flScreenSize;
+	pTexture->m_nWantedMip = nWantedMip;
+	++pTexture->m_nRequestSerial;
+
+	// Keep one mip above the request so small changes in size don't reload it
+	if ( nWantedMip > pTexture->m_nResidentMip + 1 )
+	{
+		FreeMips( pTexture, nWantedMip - 1 );
+	}
+
+	if ( nWantedMip < pTexture->m_nResidentMip )
+	{
+		QueueRequest( hTexture, pTexture );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Loader thread: reads the next larger mip of the most urgent texture
+//-----------------------------------------------------------------------------
+uintp CVTFStreamer::LoaderThreadFunc( void *pParam )
+{
+	( (CVTFStreamer *)pParam )->LoaderThread();
+	return 0;
+}
+
+void CVTFStreamer::LoaderThread()
+{
+	char szFileName[MAX_PATH];
+	for ( ;; )
+	{
+		m_Mutex.Lock();
+		if ( m_bExit )
+		{
+			m_Mutex.Unlock();
+			break;
+		}
+
+		// Skip requests for closed textures or that a later request replaced
+		bool bFound = false;
+		MipRequest_t request;
+		while ( m_Requests.Count() && !bFound )
+		{
+			request = m_Requests.ElementAtHead();
+			m_Requests.RemoveAtHead();
+			const StreamingTexture_t *pTexture = m_Textures[request.m_hTexture];
+			bFound = pTexture->m_bInUse && pTexture->m_nSerial == request.m_nSerial &&
+				pTexture->m_nRequestSerial == request.m_nRequestSerial && pTexture->m_nWantedMip < pTexture->m_nResidentMip;
+		}
+		if ( !bFound )
+		{
+			m_bLoading = false;
+			m_Mutex.Unlock();
+			m_RequestEvent.Wait();
+			continue;
+		}
+
+		StreamingTexture_t *pTexture = m_Textures[request.m_hTexture];
+		int nMip = pTexture->m_nResidentMip - 1;
+		int nStart;
+		int nSize = MipFileRange( pTexture, nMip, &nStart );
+		V_strncpy( szFileName, pTexture->m_szFileName, sizeof( szFileName ) );
+		m_bLoading = true;
+		m_Mutex.Unlock();
+
+		uint8 *pData = new uint8[nSize];
+		bool bSuccess = ReadFileRange( szFileName, nStart, nSize, pData );
+
+		AUTO_LOCK( m_Mutex );
+		pTexture = m_Textures[request.m_hTexture];
+		if ( !bSuccess || !pTexture->m_bInUse || pTexture->m_nSerial != request.m_nSerial || pTexture->m_nResidentMip != nMip + 1 || pTexture->m_nWantedMip > nMip )
+		{
+			delete[] pData;
+			continue;
+		}
+
+		pTexture->m_pMipData[nMip] = pData;
+		pTexture->m_nResidentMip = nMip;
+		m_nResidentMemory += nSize;
+		if ( pTexture->m_nWantedMip < nMip )
+		{
+			QueueRequest( request.m_hTexture, pTexture );
+		}
+	}
+}
+
+void CVTFStreamer::Flush()
+{
+	for ( ;; )
+	{
+		m_Mutex.Lock();
+		bool bIdle = !m_bLoading && !m_Requests.Count();
+		m_Mutex.Unlock();
+		if ( bIdle || !m_hLoaderThread )
+			break;
+		ThreadSleep( 1 );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Accessors
+//-----------------------------------------------------------------------------
+const CVTFReader &CVTFStreamer::GetHeader( VTFStreamHandle_t hTexture ) const
+{
+	// Open of another texture can grow m_Textures, the texture itself stays where it is
+	AUTO_LOCK( m_Mutex );
+	const StreamingTexture_t *pTexture = GetTexture( hTexture );
+	if ( !pTexture )
+	{
+		static CVTFReader s_ClosedHeader;
+		return s_ClosedHeader;
+	}
+	return pTexture->m_Header;
+}
+
+int CVTFStreamer::GetTopMip( VTFStreamHandle_t hTexture ) const
+{
+	AUTO_LOCK( m_Mutex );
+	const StreamingTexture_t *pTexture = GetTexture( hTexture );
+	return pTexture ? pTexture->m_nTopMip : -1;
+}
+
+int CVTFStreamer::GetTailMip( VTFStreamHandle_t hTexture ) const
+{
+	AUTO_LOCK( m_Mutex );
+	const StreamingTexture_t *pTexture = GetTexture( hTexture );
+	return pTexture ? pTexture->m_nTailMip : -1;
+}
+
+int CVTFStreamer::GetResidentMip( VTFStreamHandle_t hTexture ) const
+{
+	AUTO_LOCK( m_Mutex );
+	const StreamingTexture_t *pTexture = GetTexture( hTexture );
+	return pTexture ? pTexture->m_nResidentMip : -1;
+}
+
+const uint8 *CVTFStreamer::GetImageData( VTFStreamHandle_t hTexture, int iFrame, int iFace, int iMipLevel, int *pSizeInBytes ) const
+{
+	if ( pSizeInBytes )
+	{
+		*pSizeInBytes = 0;
+	}
+
+	AUTO_LOCK( m_Mutex );
+	const StreamingTexture_t *pTexture = GetTexture( hTexture );
+	if ( !pTexture || iMipLevel < 0 || iMipLevel >= pTexture->m_Header.MipCount() || !pTexture->m_pMipData[iMipLevel] )
+		return NULL;
+
+	const CVTFReader &info = pTexture->m_Header;
+	if ( iFrame < 0 || iFrame >= info.FrameCount() || iFace < 0 || iFace >= info.FaceCount() )
+		return NULL;
+
+	int nSize = info.ComputeMipSize( iMipLevel );
+	if ( pSizeInBytes )
+	{
+		*pSizeInBytes = nSize;
+	}
+	return pTexture->m_pMipData[iMipLevel] + ( iFrame * info.FaceCount() + iFace ) * nSize;
+}
+
+size_t CVTFStreamer::GetResidentMemory() const
+{
+	AUTO_LOCK( m_Mutex );
+	return m_nResidentMemory;
+}